@@ -0,0 +1,609 @@
+/*
+ * =============================================================================
+ *
+ *       Filename:  ngx_http_custom_counters_array.c
+ *
+ *    Description:  counter arrays
+ *
+ *        Version:  4.0
+ *        Created:  18.10.2026 21:41:17
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Alexey Radkov (), 
+ *        Company:  
+ *
+ * =============================================================================
+ */
+
+#include "ngx_http_custom_counters_module.h"
+#include "ngx_http_custom_counters_array.h"
+
+
+static const ngx_int_t  ngx_http_cnt_array_max_elts = 1024;
+
+
+static ngx_int_t ngx_http_cnt_get_array_value(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t  data);
+static char *ngx_http_cnt_array_impl(ngx_conf_t *cf, void *conf,
+    ngx_uint_t matrix);
+static ngx_int_t ngx_http_cnt_array_index_var(ngx_conf_t *cf,
+    ngx_str_t *name);
+static ngx_int_t ngx_http_cnt_array_index(ngx_http_request_t *r,
+    ngx_int_t idx);
+static char *ngx_http_cnt_array_reset(ngx_conf_t *cf, void *conf,
+    ngx_http_cnt_set_t *cnt_set, ngx_http_cnt_set_array_data_t *array);
+static ngx_int_t ngx_http_cnt_array_cmp_keys(const void *one,
+    const void *two);
+
+
+char *
+ngx_http_cnt_counter_array(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    return ngx_http_cnt_array_impl(cf, conf, 0);
+}
+
+
+char *
+ngx_http_cnt_histogram2d(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    return ngx_http_cnt_array_impl(cf, conf, 1);
+}
+
+
+static char *
+ngx_http_cnt_array_impl(ngx_conf_t *cf, void *conf, ngx_uint_t matrix)
+{
+    ngx_uint_t                            i, first, nkeys, ncols = 0;
+    ngx_http_cnt_main_conf_t             *mcf;
+    ngx_http_cnt_srv_conf_t              *scf;
+    ngx_str_t                            *value, name;
+    ngx_http_variable_t                  *v;
+    ngx_http_cnt_set_t                   *cnt_sets, *cnt_set;
+    ngx_http_cnt_set_array_data_t        *arrays, *array;
+    ngx_http_cnt_set_var_data_t          *vars;
+    ngx_int_t                             idx = NGX_ERROR;
+    ngx_int_t                             v_idx, e_idx, val, slot;
+    ngx_uint_t                            point = 0;
+    u_char                               *p;
+
+    value = cf->args->elts;
+
+    if (value[1].len < 2 || value[1].data[0] != '$') {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid variable name \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+    value[1].len--;
+    value[1].data++;
+
+    mcf = ngx_http_conf_get_module_main_conf(cf,
+                                             ngx_http_custom_counters_module);
+    scf = ngx_http_conf_get_module_srv_conf(cf,
+                                            ngx_http_custom_counters_module);
+
+    if (ngx_http_cnt_counter_set_init(cf, mcf, scf) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    v = ngx_http_add_variable(cf, &value[1], NGX_HTTP_VAR_CHANGEABLE);
+    if (v == NULL) {
+        return NGX_CONF_ERROR;
+    }
+    v_idx = ngx_http_get_variable_index(cf, &value[1]);
+    if (v_idx == NGX_ERROR) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (v->get_handler != NULL
+        && v->get_handler != ngx_http_cnt_get_array_value)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "counter array variable has a different setter");
+        return NGX_CONF_ERROR;
+    }
+
+    cnt_sets = mcf->cnt_sets.elts;
+    cnt_set = &cnt_sets[scf->cnt_set];
+
+    if (cnt_set->arrays.nalloc == 0
+        && ngx_array_init(&cnt_set->arrays, cf->pool, 1,
+                          sizeof(ngx_http_cnt_set_array_data_t))
+            != NGX_OK)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "failed to allocate memory for counter array data");
+        return NGX_CONF_ERROR;
+    }
+
+    arrays = cnt_set->arrays.elts;
+    for (i = 0; i < cnt_set->arrays.nelts; i++) {
+        if (arrays[i].self == v_idx) {
+            idx = i;
+            break;
+        }
+    }
+
+    if (cf->args->nelts == 3) {
+        if (idx == NGX_ERROR) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "counter array \"%V\" "
+                               "was not declared in this counter set",
+                               &value[1]);
+            return NGX_CONF_ERROR;
+        }
+
+        if ((value[2].len == 4 && ngx_strncmp(value[2].data, "undo", 4) == 0)
+            || (value[2].len == 5
+                && ngx_strncmp(value[2].data, "reuse", 5) == 0))
+        {
+            return ngx_http_cnt_observe_impl(cf, conf, v_idx, idx,
+                                             ngx_http_cnt_observe_array,
+                                             value[2].data[0] == 'u');
+        }
+
+        if (value[2].len == 5 && ngx_strncmp(value[2].data, "reset", 5) == 0)
+        {
+            return ngx_http_cnt_array_reset(cf, conf, cnt_set, &arrays[idx]);
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "unknown counter array operation \"%V\"",
+                           &value[2]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (idx != NGX_ERROR) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "counter array \"%V\" was "
+                           "already declared in this counter set, use "
+                           "\"reuse\" to update it here", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    /* dense arrays are declared as "$name size $index", sparse arrays as
+     * "$name $index key ...", two-dimensional histograms as
+     * "$name $row $column rows columns" */
+
+    if (matrix) {
+        if (cf->args->nelts != 6) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "two-dimensional histogram must be declared "
+                               "as \"$name $row $column rows columns\"");
+            return NGX_CONF_ERROR;
+        }
+        val = ngx_atoi(value[4].data, value[4].len);
+        ncols = ngx_atoi(value[5].data, value[5].len);
+        if (val == NGX_ERROR || val == 0 || (ngx_int_t) ncols == NGX_ERROR
+            || ncols == 0)
+        {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid dimensions of two-dimensional "
+                               "histogram \"%V x %V\"", &value[4], &value[5]);
+            return NGX_CONF_ERROR;
+        }
+        if (val > ngx_http_cnt_array_max_elts
+            || ncols > (ngx_uint_t) ngx_http_cnt_array_max_elts
+            || val * ncols > (ngx_uint_t) ngx_http_cnt_array_max_elts)
+        {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "number of bins of two-dimensional histogram "
+                               "must not exceed %i",
+                               ngx_http_cnt_array_max_elts);
+            return NGX_CONF_ERROR;
+        }
+        first = 0;
+        nkeys = val * ncols;
+    } else if (value[2].len > 0 && value[2].data[0] == '$') {
+        first = 3;
+        nkeys = cf->args->nelts - 3;
+    } else {
+        if (cf->args->nelts != 4) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "dense counter array must be declared as "
+                               "\"$name size $index\"");
+            return NGX_CONF_ERROR;
+        }
+        val = ngx_atoi(value[2].data, value[2].len);
+        if (val == NGX_ERROR || val == 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid size of counter array \"%V\"",
+                               &value[2]);
+            return NGX_CONF_ERROR;
+        }
+        first = 0;
+        nkeys = val;
+    }
+
+    if (nkeys > (ngx_uint_t) ngx_http_cnt_array_max_elts) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "number of elements of counter array must not "
+                           "exceed %i", ngx_http_cnt_array_max_elts);
+        return NGX_CONF_ERROR;
+    }
+
+    array = ngx_array_push(&cnt_set->arrays);
+    if (array == NULL) {
+        return NGX_CONF_ERROR;
+    }
+    idx = cnt_set->arrays.nelts - 1;
+
+    array->self = v_idx;
+    array->name = value[1];
+    array->nelts = nkeys;
+    array->ncols = ncols;
+    array->keys = NULL;
+
+    array->index_idx = ngx_http_cnt_array_index_var(cf,
+                                    &value[first > 0 || matrix ? 2 : 3]);
+    if (array->index_idx == NGX_ERROR) {
+        return NGX_CONF_ERROR;
+    }
+
+    array->col_index_idx = NGX_ERROR;
+    if (matrix) {
+        array->col_index_idx = ngx_http_cnt_array_index_var(cf, &value[3]);
+        if (array->col_index_idx == NGX_ERROR) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    array->slots = ngx_palloc(cf->pool, nkeys * sizeof(ngx_int_t));
+    if (array->slots == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (first > 0) {
+        array->keys = ngx_palloc(cf->pool, nkeys * sizeof(ngx_int_t));
+        if (array->keys == NULL) {
+            return NGX_CONF_ERROR;
+        }
+        for (i = 0; i < nkeys; i++) {
+            array->keys[i] = ngx_atoi(value[first + i].data,
+                                      value[first + i].len);
+            if (array->keys[i] == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid index \"%V\"", &value[first + i]);
+                return NGX_CONF_ERROR;
+            }
+        }
+        ngx_sort(array->keys, nkeys, sizeof(ngx_int_t),
+                 ngx_http_cnt_array_cmp_keys);
+        for (i = 1; i < nkeys; i++) {
+            if (array->keys[i] == array->keys[i - 1]) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "duplicate index \"%i\"", array->keys[i]);
+                return NGX_CONF_ERROR;
+            }
+        }
+    }
+
+    for (i = 0; i < nkeys; i++) {
+        val = array->keys == NULL ? (ngx_int_t) i : array->keys[i];
+        name.len = value[1].len + 2 * (1 + NGX_INT_T_LEN);
+        name.data = ngx_pnalloc(cf->pool, name.len);
+        if (name.data == NULL) {
+            return NGX_CONF_ERROR;
+        }
+        if (matrix) {
+            p = ngx_sprintf(name.data, "%V_%ui_%ui", &value[1], i / ncols,
+                            i % ncols);
+        } else {
+            p = ngx_sprintf(name.data, "%V_%i", &value[1], val);
+        }
+        name.len = p - name.data;
+
+        slot = ngx_http_cnt_counter_var_init(cf, mcf, scf, &name, &point, 1,
+                                             &e_idx);
+        if (slot == NGX_ERROR) {
+            return NGX_CONF_ERROR;
+        }
+
+        vars = cnt_set->vars.elts;
+        if (vars[slot].array != NGX_ERROR && vars[slot].array != idx) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "counter \"%V\" is "
+                               "already an element of another counter array",
+                               &name);
+            return NGX_CONF_ERROR;
+        }
+        vars[slot].array = idx;
+        array->slots[i] = slot;
+    }
+
+    array->err_name.len = value[1].len + 4;
+    array->err_name.data = ngx_pnalloc(cf->pool, array->err_name.len);
+    if (array->err_name.data == NULL) {
+        return NGX_CONF_ERROR;
+    }
+    (void) ngx_sprintf(array->err_name.data, "%V_err", &value[1]);
+
+    array->err = ngx_http_cnt_counter_var_init(cf, mcf, scf, &array->err_name,
+                                               &point, 1, &e_idx);
+    if (array->err == NGX_ERROR) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (ngx_http_cnt_var_data_init(cf, scf, v, idx,
+                                   ngx_http_cnt_get_array_value, NGX_ERROR)
+        != NGX_OK)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    return ngx_http_cnt_observe_impl(cf, conf, v_idx, idx,
+                                     ngx_http_cnt_observe_array, 0);
+}
+
+
+ngx_int_t
+ngx_http_cnt_array_slot(ngx_http_request_t *r, ngx_http_cnt_set_t *cnt_set,
+                        ngx_int_t array)
+{
+    ngx_http_cnt_set_array_data_t        *data;
+    ngx_int_t                             val, col;
+    ngx_uint_t                            lo, hi, mid;
+
+    data = &((ngx_http_cnt_set_array_data_t *) cnt_set->arrays.elts)[array];
+
+    val = ngx_http_cnt_array_index(r, data->index_idx);
+    if (val == NGX_ERROR) {
+        return data->err;
+    }
+
+    /* the bin of a two-dimensional histogram is at offset
+     * row * ncols + column, the row gets bounded before the multiplication
+     * so that a huge index cannot overflow into a valid offset */
+
+    if (data->ncols > 0) {
+        if ((ngx_uint_t) val >= data->nelts / data->ncols) {
+            return data->err;
+        }
+        col = ngx_http_cnt_array_index(r, data->col_index_idx);
+        if (col == NGX_ERROR || (ngx_uint_t) col >= data->ncols) {
+            return data->err;
+        }
+        return data->slots[val * data->ncols + col];
+    }
+
+    if (data->keys == NULL) {
+        return (ngx_uint_t) val < data->nelts ? data->slots[val] : data->err;
+    }
+
+    lo = 0;
+    hi = data->nelts;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (data->keys[mid] == val) {
+            return data->slots[mid];
+        }
+        if (data->keys[mid] < val) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return data->err;
+}
+
+
+u_char *
+ngx_http_cnt_render_array(ngx_http_cnt_set_t *cnt_set, ngx_int_t array,
+                          u_char *buf)
+{
+    ngx_uint_t                            i;
+    ngx_http_cnt_set_array_data_t        *data;
+    volatile ngx_atomic_int_t            *shm_data;
+    u_char                               *last;
+
+    data = &((ngx_http_cnt_set_array_data_t *) cnt_set->arrays.elts)[array];
+    shm_data = ngx_http_cnt_shm_values(cnt_set->zone->data);
+
+    /* two-dimensional histograms get rendered as arrays of rows */
+
+    if (data->ncols > 0) {
+        last = ngx_sprintf(buf, "[");
+        for (i = 0; i < data->nelts; i++) {
+            last = ngx_sprintf(last, "%s%s%A%s",
+                               i > 0 && i % data->ncols == 0 ? "," : "",
+                               i % data->ncols == 0 ? "[" : ",",
+                               shm_data[data->slots[i]],
+                               (i + 1) % data->ncols == 0 ? "]" : "");
+        }
+        return ngx_sprintf(last, "]");
+    }
+
+    last = ngx_sprintf(buf, "{");
+
+    for (i = 0; i < data->nelts; i++) {
+        last = ngx_sprintf(last, "%s\"%i\":%A", i == 0 ? "" : ",",
+                           data->keys == NULL ? (ngx_int_t) i : data->keys[i],
+                           shm_data[data->slots[i]]);
+    }
+
+    return ngx_sprintf(last, "}");
+}
+
+
+/* the length of elements is already counted in the length of the counter
+ * set as their names are longer than their keys */
+
+size_t
+ngx_http_cnt_arrays_buf_len(ngx_http_cnt_set_t *cnt_set)
+{
+    ngx_uint_t                            i;
+    ngx_http_cnt_set_array_data_t        *arrays;
+    size_t                                len = 0;
+
+    arrays = cnt_set->arrays.elts;
+    for (i = 0; i < cnt_set->arrays.nelts; i++) {
+        len += 2 + 1 + 2 + 1 + arrays[i].name.len;
+        if (arrays[i].ncols > 0) {
+            len += 2 + 1 + arrays[i].nelts / arrays[i].ncols * 3;
+        }
+    }
+
+    return len;
+}
+
+
+static ngx_int_t
+ngx_http_cnt_get_array_value(ngx_http_request_t *r,
+                             ngx_http_variable_value_t *v, uintptr_t  data)
+{
+    ngx_array_t                          *v_data = (ngx_array_t *) data;
+
+    ngx_uint_t                            i;
+    ngx_http_cnt_main_conf_t             *mcf;
+    ngx_http_cnt_srv_conf_t              *scf;
+    ngx_http_cnt_var_data_t              *var_data;
+    ngx_http_cnt_set_t                   *cnt_sets, *cnt_set;
+    ngx_http_cnt_set_array_data_t        *arrays;
+    u_char                               *buf;
+    ngx_int_t                             idx = NGX_ERROR;
+
+    if (v_data == NULL) {
+        return NGX_ERROR;
+    }
+    var_data = v_data->elts;
+
+    scf = ngx_http_get_module_srv_conf(r, ngx_http_custom_counters_module);
+    if (scf->cnt_set == NGX_CONF_UNSET_UINT) {
+        goto unreachable_array;
+    }
+
+    mcf = ngx_http_get_module_main_conf(r, ngx_http_custom_counters_module);
+    cnt_sets = mcf->cnt_sets.elts;
+    cnt_set = &cnt_sets[scf->cnt_set];
+
+    for (i = 0; i < v_data->nelts; i++) {
+        if (var_data[i].cnt_set != scf->cnt_set) {
+            continue;
+        }
+
+        idx = var_data[i].self;
+        break;
+    }
+    if (idx == NGX_ERROR) {
+        goto unreachable_array;
+    }
+
+    arrays = cnt_set->arrays.elts;
+
+    buf = ngx_pnalloc(r->pool, 2 + arrays[idx].nelts
+                      * (2 + 1 + 1 + NGX_INT_T_LEN + NGX_ATOMIC_T_LEN));
+    if (buf == NULL) {
+        return NGX_ERROR;
+    }
+
+    v->len          = ngx_http_cnt_render_array(cnt_set, idx, buf) - buf;
+    v->data         = buf;
+    v->valid        = 1;
+    v->no_cacheable = 0;
+    v->not_found    = 0;
+
+    return NGX_OK;
+
+unreachable_array:
+
+    v->len          = 0;
+    v->data         = NULL;
+    v->valid        = 1;
+    v->no_cacheable = 0;
+    v->not_found    = 0;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_cnt_array_index_var(ngx_conf_t *cf, ngx_str_t *name)
+{
+    ngx_str_t                             var;
+
+    if (name->len < 2 || name->data[0] != '$') {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid variable name \"%V\"", name);
+        return NGX_ERROR;
+    }
+
+    var.len = name->len - 1;
+    var.data = name->data + 1;
+
+    return ngx_http_get_variable_index(cf, &var);
+}
+
+
+static ngx_int_t
+ngx_http_cnt_array_index(ngx_http_request_t *r, ngx_int_t idx)
+{
+    ngx_http_variable_value_t            *var;
+
+    var = ngx_http_get_indexed_variable(r, idx);
+    if (var == NULL || !var->valid || var->not_found) {
+        return NGX_ERROR;
+    }
+
+    return ngx_atoi(var->data, var->len);
+}
+
+
+static char *
+ngx_http_cnt_array_reset(ngx_conf_t *cf, void *conf,
+                         ngx_http_cnt_set_t *cnt_set,
+                         ngx_http_cnt_set_array_data_t *array)
+{
+    ngx_uint_t                            i;
+    ngx_http_cnt_set_var_data_t          *vars;
+    ngx_str_t                            *arg, *name;
+    ngx_conf_t                            cf_cnt;
+    ngx_array_t                           cf_cnt_args;
+
+    if (ngx_array_init(&cf_cnt_args, cf->temp_pool, 4, sizeof(ngx_str_t))
+        != NGX_OK)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    arg = ngx_array_push_n(&cf_cnt_args, 4);
+    if (arg == NULL) {
+        return NGX_CONF_ERROR;
+    }
+    ngx_str_set(&arg[0], "counter");
+    ngx_str_set(&arg[2], "set");
+    ngx_str_set(&arg[3], "0");
+
+    cf_cnt = *cf;
+    cf_cnt.args = &cf_cnt_args;
+
+    vars = cnt_set->vars.elts;
+
+    for (i = 0; i <= array->nelts; i++) {
+        name = i < array->nelts ? &vars[array->slots[i]].name
+                                : &array->err_name;
+
+        /* the counter implementation strips the leading dollar */
+
+        arg[1].len = name->len + 1;
+        arg[1].data = ngx_pnalloc(cf->temp_pool, arg[1].len);
+        if (arg[1].data == NULL) {
+            return NGX_CONF_ERROR;
+        }
+        (void) ngx_sprintf(arg[1].data, "$%V", name);
+
+        if (ngx_http_cnt_counter_impl(&cf_cnt, NULL, conf, 0)) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static ngx_int_t
+ngx_http_cnt_array_cmp_keys(const void *one, const void *two)
+{
+    ngx_int_t  first = *(ngx_int_t *) one;
+    ngx_int_t  second = *(ngx_int_t *) two;
+
+    return first < second ? -1 : first > second;
+}
@@ -0,0 +1,61 @@
+/*
+ * =============================================================================
+ *
+ *       Filename:  ngx_http_custom_counters_array.h
+ *
+ *    Description:  counter arrays
+ *
+ *        Version:  4.0
+ *        Created:  18.10.2026 21:41:17
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Alexey Radkov (), 
+ *        Company:  
+ *
+ * =============================================================================
+ */
+
+#ifndef NGX_HTTP_CUSTOM_COUNTERS_ARRAY_H
+#define NGX_HTTP_CUSTOM_COUNTERS_ARRAY_H
+
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+#include "ngx_http_custom_counters_module.h"
+
+
+/* elements of an array are counters named after the array with the index as
+ * a suffix, they get selected by the value of the index variable directly:
+ * dense arrays map index i to slots[i], sparse arrays look up the index in
+ * their sorted keys; values which are not numbers or not indexes of the
+ * array get counted in the error counter; two-dimensional histograms are
+ * dense arrays with ncols columns stored row by row, their column gets
+ * selected by the second index variable */
+
+typedef struct {
+    ngx_int_t                             self;
+    ngx_int_t                             index_idx;
+    ngx_int_t                             col_index_idx;
+    ngx_str_t                             name;
+    ngx_uint_t                            nelts;
+    ngx_uint_t                            ncols;
+    ngx_int_t                            *keys;
+    ngx_int_t                            *slots;
+    ngx_int_t                             err;
+    ngx_str_t                             err_name;
+} ngx_http_cnt_set_array_data_t;
+
+
+char *ngx_http_cnt_counter_array(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+char *ngx_http_cnt_histogram2d(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+ngx_int_t ngx_http_cnt_array_slot(ngx_http_request_t *r,
+    ngx_http_cnt_set_t *cnt_set, ngx_int_t array);
+u_char *ngx_http_cnt_render_array(ngx_http_cnt_set_t *cnt_set,
+    ngx_int_t array, u_char *buf);
+size_t ngx_http_cnt_arrays_buf_len(ngx_http_cnt_set_t *cnt_set);
+
+#endif /* NGX_HTTP_CUSTOM_COUNTERS_ARRAY_H */
+
@@ -1,29 +0,0 @@
-/*
- * =============================================================================
- *
- *       Filename:  ngx_http_custom_counters_forward_jsmntok.h
- *
- *    Description:  forward declaration of jsmntok_t from JSMN library
- *
- *        Version:  4.0
- *        Created:  26.06.2020 15:12:54
- *       Revision:  none
- *       Compiler:  gcc
- *
- *         Author:  Alexey Radkov (), 
- *        Company:  
- *
- * =============================================================================
- */
-
-#ifndef NGX_HTTP_CUSTOM_COUNTERS_FORWARD_JSMNTOK_H
-#define NGX_HTTP_CUSTOM_COUNTERS_FORWARD_JSMNTOK_H
-
-#ifdef NGX_HTTP_CUSTOM_COUNTERS_PERSISTENCY
-
-typedef struct jsmntok jsmntok_t;
-
-#endif
-
-#endif /* NGX_HTTP_CUSTOM_COUNTERS_FORWARD_JSMNTOK_H */
-
@@ -16,6 +16,9 @@
  * =============================================================================
  */
 
+#include <ngx_config.h>
+#include <math.h>
+
 #include "ngx_http_custom_counters_module.h"
 #include "ngx_http_custom_counters_histogram.h"
 
@@ -29,36 +32,6 @@ typedef enum {
 } ngx_http_cnt_histogram_special_var_e;
 
 
-typedef struct {
-    ngx_int_t                             idx;
-    ngx_str_t                             name;
-    ngx_str_t                             inc_var_name;
-    ngx_str_t                             tag;
-} ngx_http_cnt_histogram_var_handle_t;
-
-
-typedef struct {
-    ngx_int_t                             self;
-    ngx_int_t                             bound_idx;
-    ngx_str_t                             name;
-    ngx_array_t                           cnt_data;
-    ngx_http_cnt_histogram_var_handle_t   cnt_cnt;
-    ngx_http_cnt_histogram_var_handle_t   cnt_err;
-} ngx_http_cnt_set_histogram_data_t;
-
-
-typedef struct {
-    ngx_int_t                             idx;
-    ngx_array_t                          *range;
-} ngx_http_cnt_map_to_range_index_data_t;
-
-
-typedef struct {
-    double                                value;
-    ngx_str_t                             s_value;
-} ngx_http_cnt_range_boundary_data_t;
-
-
 static ngx_int_t ngx_http_cnt_get_histogram_value(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t  data);
 static ngx_int_t ngx_http_cnt_get_histogram_inc_value(ngx_http_request_t *r,
@@ -68,6 +41,13 @@ static ngx_int_t ngx_http_cnt_histogram_special_var(ngx_conf_t *cf, void *conf,
     ngx_str_t *counter_op_value, ngx_str_t base_name, ngx_int_t idx,
     ngx_http_cnt_set_histogram_data_t *data,
     ngx_http_cnt_histogram_special_var_e type);
+static ngx_http_cnt_set_histogram_data_t *ngx_http_cnt_histogram_push(
+    ngx_conf_t *cf, ngx_http_cnt_set_t *cnt_set, ngx_uint_t nbins,
+    ngx_uint_t nbuckets);
+static ngx_int_t ngx_http_cnt_histogram_observe_counter(ngx_conf_t *cf,
+    ngx_http_cnt_declare_pt declare, ngx_str_t *base_name, ngx_str_t *suffix,
+    ngx_str_t *tag, ngx_uint_t point, ngx_uint_t scaled,
+    ngx_http_cnt_histogram_var_handle_t *handle);
 static ngx_int_t ngx_http_cnt_get_range_index(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t  data);
 
@@ -179,6 +159,17 @@ ngx_http_cnt_histogram(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 
         cnt_data = vars[idx].cnt_data.elts;
 
+        if (vars[idx].observe_idx != NGX_ERROR
+            && ((value[2].len == 4
+                 && ngx_strncmp(value[2].data, "undo", 4) == 0)
+                || (value[2].len == 5
+                    && ngx_strncmp(value[2].data, "reuse", 5) == 0)))
+        {
+            return ngx_http_cnt_observe_impl(cf, conf, vars[idx].self, idx,
+                                             ngx_http_cnt_observe_histogram,
+                                             value[2].data[0] == 'u');
+        }
+
         if (value[2].len == 4 && ngx_strncmp(value[2].data, "undo", 4) == 0) {
             counter_op = ngx_array_push(&cf_cnt_args);
             if (counter_op == NULL) {
@@ -226,6 +217,12 @@ ngx_http_cnt_histogram(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             if (ngx_http_cnt_counter_impl(&cf_cnt, NULL, conf, 0)) {
                 return NGX_CONF_ERROR;
             }
+            if (vars[idx].cnt_sum.name.len > 0) {
+                *counter_name = vars[idx].cnt_sum.name;
+                if (ngx_http_cnt_counter_impl(&cf_cnt, NULL, conf, 0)) {
+                    return NGX_CONF_ERROR;
+                }
+            }
         } else if (value[2].len == 5
                    && ngx_strncmp(value[2].data, "reuse", 5) == 0)
         {
@@ -264,6 +261,42 @@ ngx_http_cnt_histogram(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         return NGX_CONF_OK;
     }
 
+    if (value[2].len == 7 && ngx_strncmp(value[2].data, "observe", 7) == 0) {
+        if (idx != NGX_ERROR) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "histogram \"%V\" "
+                               "was already declared in this counter set",
+                               &value[1]);
+            return NGX_CONF_ERROR;
+        }
+
+        idx = ngx_http_cnt_histogram_observe_declare(cf, cnt_set,
+                                                ngx_http_cnt_declare_counter,
+                                                ngx_http_get_variable_index);
+        if (idx == NGX_ERROR) {
+            return NGX_CONF_ERROR;
+        }
+
+        vars = cnt_set->histograms.elts;
+        vars[idx].self = v_idx;
+        if (ngx_http_cnt_var_data_init(cf, scf, v, idx,
+                                       ngx_http_cnt_get_histogram_value,
+                                       NGX_ERROR)
+            != NGX_OK)
+        {
+            return NGX_CONF_ERROR;
+        }
+
+        return ngx_http_cnt_observe_impl(cf, conf, v_idx, idx,
+                                         ngx_http_cnt_observe_histogram, 0);
+    }
+
+    if (cf->args->nelts != 4) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid number of arguments in \"histogram\" "
+                           "directive");
+        return NGX_CONF_ERROR;
+    }
+
     val = ngx_atoi(value[2].data, value[2].len);
     if (val == NGX_ERROR) {
         ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "not a number \"%V\"",
@@ -309,7 +342,9 @@ ngx_http_cnt_histogram(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     if (var->bound_idx == NGX_ERROR) {
         return NGX_CONF_ERROR;
     }
+    var->observe_idx = NGX_ERROR;
     var->name = value[1];
+    ngx_str_null(&var->cnt_sum.name);
 
     counter_op = ngx_array_push(&cf_cnt_args);
     if (counter_op == NULL) {
@@ -424,8 +459,6 @@ ngx_http_cnt_init_histograms(ngx_cycle_t *cycle)
     ngx_http_cnt_set_histogram_data_t       *histograms;
     ngx_http_cnt_set_t                      *cnt_sets;
     ngx_http_cnt_histogram_var_handle_t     *vars;
-    ngx_http_cnt_map_to_range_index_data_t  *v_data;
-    ngx_http_cnt_range_boundary_data_t      *boundary = NULL;
     ngx_str_t                                name;
     u_char                                  *buf, *last;
     ngx_uint_t                               len = 2;
@@ -441,26 +474,15 @@ ngx_http_cnt_init_histograms(ngx_cycle_t *cycle)
     for (i = 0; i < mcf->cnt_sets.nelts; i++) {
         histograms = cnt_sets[i].histograms.elts;
         for (j = 0; j < cnt_sets[i].histograms.nelts; j++) {
-            if (cmvars[histograms[j].bound_idx].get_handler
-                != ngx_http_cnt_get_range_index)
+            if (histograms[j].observe_idx != NGX_ERROR
+                || cmvars[histograms[j].bound_idx].get_handler
+                   != ngx_http_cnt_get_range_index)
             {
                 continue;
             }
-            v_data = (ngx_http_cnt_map_to_range_index_data_t *)
-                    cmvars[histograms[j].bound_idx].data;
-            if (v_data->range != NULL) {
-                boundary = v_data->range->elts;
-            }
-            vars = histograms[j].cnt_data.elts;
-            for (k = 0; k < histograms[j].cnt_data.nelts; k++) {
-                if (boundary == NULL || v_data->range == NULL
-                    || k == v_data->range->nelts)
-                {
-                    ngx_str_set(&vars[k].tag, "+Inf");
-                    break;
-                }
-                vars[k].tag = boundary[k].s_value;
-            }
+            ngx_http_cnt_histogram_range_tags(&histograms[j],
+                        (ngx_http_cnt_map_to_range_index_data_t *)
+                        cmvars[histograms[j].bound_idx].data);
         }
     }
 
@@ -473,6 +495,10 @@ ngx_http_cnt_init_histograms(ngx_cycle_t *cycle)
                      + 14 + histograms[j].cnt_err.name.len - 1 /* skip dollar */
                           + histograms[j].cnt_err.tag.len
                      + 11 + histograms[j].name.len;
+            if (histograms[j].cnt_sum.name.len > 0) {
+                len += 14 + histograms[j].cnt_sum.name.len - 1 /* skip dollar */
+                          + histograms[j].cnt_sum.tag.len;
+            }
             vars = histograms[j].cnt_data.elts;
             for (k = 0; k < histograms[j].cnt_data.nelts; k++) {
                 len += 6 + vars[k].name.len - 1 /* skip dollar */
@@ -519,8 +545,15 @@ ngx_http_cnt_init_histograms(ngx_cycle_t *cycle)
                                &name, &histograms[j].cnt_cnt.tag);
             name.data = histograms[j].cnt_err.name.data + 1;
             name.len = histograms[j].cnt_err.name.len - 1;
-            last = ngx_sprintf(last, "\"err\":[\"%V\",\"%V\"]},",
+            last = ngx_sprintf(last, "\"err\":[\"%V\",\"%V\"]",
                                &name, &histograms[j].cnt_err.tag);
+            if (histograms[j].cnt_sum.name.len > 0) {
+                name.data = histograms[j].cnt_sum.name.data + 1;
+                name.len = histograms[j].cnt_sum.name.len - 1;
+                last = ngx_sprintf(last, ",\"sum\":[\"%V\",\"%V\"]",
+                                   &name, &histograms[j].cnt_sum.tag);
+            }
+            last = ngx_sprintf(last, "},");
         }
         if (j > 0) {
             last--;
@@ -562,17 +595,9 @@ ngx_http_cnt_histograms(ngx_http_request_t *r, ngx_http_variable_value_t *v,
 char *
 ngx_http_cnt_map_to_range_index(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
-    ngx_uint_t                               i;
     ngx_str_t                               *value;
     ngx_http_variable_t                     *v;
-    ngx_int_t                                v_idx;
     ngx_http_cnt_map_to_range_index_data_t  *v_data;
-    ngx_array_t                             *v_range;
-    static const size_t                      buf_size = 32;
-    u_char                                   buf[buf_size], *p;
-    ngx_int_t                                len;
-    ngx_http_cnt_range_boundary_data_t      *pcur;
-    double                                   cur, prev = 0.0;
 
     value = cf->args->elts;
 
@@ -597,11 +622,34 @@ ngx_http_cnt_map_to_range_index(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     }
     v->data = (uintptr_t) v_data;
 
-    v_idx = ngx_http_get_variable_index(cf, &value[2]);
-    if (v_idx == NGX_ERROR) {
+    v_data->self = ngx_http_get_variable_index(cf, &value[2]);
+    if (v_data->self == NGX_ERROR) {
         return NGX_CONF_ERROR;
     }
 
+    return ngx_http_cnt_parse_range(cf, ngx_http_get_variable_index, v_data);
+}
+
+
+/* parses the source variable and the range of directive map_to_range_index,
+ * the variable with the range index is declared by the module */
+
+char *
+ngx_http_cnt_parse_range(ngx_conf_t *cf, ngx_http_cnt_var_index_pt var_index,
+                         ngx_http_cnt_map_to_range_index_data_t *v_data)
+{
+    ngx_uint_t                               i, nbounds;
+    ngx_str_t                               *value;
+    ngx_int_t                                rc;
+    ngx_array_t                             *v_range;
+    static const size_t                      buf_size = 32;
+    u_char                                   buf[buf_size], *p;
+    ngx_int_t                                len;
+    ngx_http_cnt_range_boundary_data_t      *pcur;
+    double                                   cur, prev = 0.0;
+
+    value = cf->args->elts;
+
     if (value[1].len < 2 || value[1].data[0] != '$') {
         ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
                            "invalid variable name \"%V\"", &value[1]);
@@ -610,24 +658,72 @@ ngx_http_cnt_map_to_range_index(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     value[1].len--;
     value[1].data++;
 
-    v_idx = ngx_http_get_variable_index(cf, &value[1]);
-    if (v_idx == NGX_ERROR) {
+    v_data->idx = var_index(cf, &value[1]);
+    if (v_data->idx == NGX_ERROR) {
         return NGX_CONF_ERROR;
     }
 
-    v_data->idx = v_idx;
-
     if (cf->args->nelts > 3) {
+        rc = ngx_http_cnt_parse_range_gen(cf, &value[3], cf->args->nelts - 3,
+                                          &v_data->gen);
+        if (rc == NGX_ERROR) {
+            return NGX_CONF_ERROR;
+        }
+
+        nbounds = rc == NGX_OK ? v_data->gen.nbounds : cf->args->nelts - 3;
+
         v_range = ngx_pcalloc(cf->pool, sizeof(ngx_array_t));
         if (v_range == NULL
-            || ngx_array_init(v_range, cf->pool, cf->args->nelts - 3,
+            || ngx_array_init(v_range, cf->pool, nbounds,
                               sizeof(ngx_http_cnt_range_boundary_data_t))
                != NGX_OK)
         {
             return NGX_CONF_ERROR;
         }
 
-        for (i = 3; i < cf->args->nelts; i++) {
+        /* generated bounds get rendered for the tags of histogram bins with
+         * 15 significant digits, which is enough to tell apart bounds of any
+         * magnitude unless they differ only in the last bits */
+
+        for (i = 0; rc == NGX_OK && i < nbounds; i++) {
+            cur = ngx_http_cnt_range_gen_bound(&v_data->gen, i);
+
+            if (isinf(cur) || (i > 0 && prev >= cur)) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "generated range must increase "
+                                   "monotonically and stay finite");
+                return NGX_CONF_ERROR;
+            }
+
+            len = snprintf((char *) buf, buf_size, "%.15g", cur);
+
+            if (i > 0 && (size_t) len == pcur->s_value.len
+                && ngx_strncmp(buf, pcur->s_value.data, len) == 0)
+            {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "generated bounds \"%*s\" cannot be told "
+                                   "apart in tags of histogram bins",
+                                   len, buf);
+                return NGX_CONF_ERROR;
+            }
+
+            pcur = ngx_array_push(v_range);
+            if (pcur == NULL) {
+                return NGX_CONF_ERROR;
+            }
+            pcur->value = cur;
+
+            pcur->s_value.len = len;
+            pcur->s_value.data = buf;
+            pcur->s_value.data = ngx_pstrdup(cf->pool, &pcur->s_value);
+            if (pcur->s_value.data == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            prev = cur;
+        }
+
+        for (i = 3; rc == NGX_DECLINED && i < cf->args->nelts; i++) {
             len = ngx_min(value[i].len, buf_size - 1);
             ngx_memcpy(buf, value[i].data, len);
             buf[len] = '\0';
@@ -989,13 +1085,518 @@ ngx_http_cnt_histogram_special_var(ngx_conf_t *cf, void *conf,
 }
 
 
+/* declares a histogram which observes values of a variable as
+ * "$name observe $variable buckets bound ... [scale=] [multi=]" in the
+ * counter set, returns its index in the set */
+
+ngx_int_t
+ngx_http_cnt_histogram_observe_declare(ngx_conf_t *cf,
+                                       ngx_http_cnt_set_t *cnt_set,
+                                       ngx_http_cnt_declare_pt declare,
+                                       ngx_http_cnt_var_index_pt var_index)
+{
+    ngx_uint_t                            i, nelts, point = 0, digits;
+    ngx_uint_t                            scaled = 0;
+    ngx_int_t                             val, prev = 0, *bound;
+    ngx_http_cnt_multi_e                  multi = ngx_http_cnt_multi_none;
+    ngx_str_t                            *value, suffix, tag;
+    ngx_http_cnt_set_histogram_data_t    *var;
+    ngx_http_cnt_histogram_var_handle_t  *cnt;
+    u_char                               *p, buf[4];
+
+    value = cf->args->elts;
+    nelts = cf->args->nelts;
+
+    while (nelts > 5 && value[nelts - 1].len > 6) {
+        if (ngx_strncmp(value[nelts - 1].data, "scale=", 6) == 0
+            && !scaled)
+        {
+            val = ngx_http_cnt_parse_scale(cf, &value[nelts - 1]);
+            if (val == NGX_ERROR) {
+                return NGX_ERROR;
+            }
+            point = val;
+            scaled = 1;
+        } else if (ngx_strncmp(value[nelts - 1].data, "multi=", 6) == 0
+                   && multi == ngx_http_cnt_multi_none)
+        {
+            multi = ngx_http_cnt_parse_multi(cf, &value[nelts - 1], 1);
+            if (multi == ngx_http_cnt_multi_none) {
+                return NGX_ERROR;
+            }
+        } else {
+            break;
+        }
+        nelts--;
+    }
+
+    if (nelts < 6 || value[3].len < 2 || value[3].data[0] != '$'
+        || value[4].len != 7 || ngx_strncmp(value[4].data, "buckets", 7) != 0)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "histogram observation must be declared as "
+                           "\"observe $variable buckets bound ...\"");
+        return NGX_ERROR;
+    }
+
+    if (nelts - 5 >= (ngx_uint_t) ngx_http_cnt_histogram_max_bins) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "number of buckets must be less than %i",
+                           ngx_http_cnt_histogram_max_bins);
+        return NGX_ERROR;
+    }
+
+    /* without explicit scale, the values are observed with the precision of
+     * the finest bucket bound */
+
+    if (!scaled) {
+        for (i = 5; i < nelts; i++) {
+            p = ngx_strlchr(value[i].data, value[i].data + value[i].len, '.');
+            if (p != NULL) {
+                digits = value[i].data + value[i].len - p - 1;
+                point = ngx_min(ngx_max(point, digits),
+                                NGX_HTTP_CNT_MAX_POINT);
+            }
+        }
+    }
+
+    var = ngx_http_cnt_histogram_push(cf, cnt_set, nelts - 4, nelts - 5);
+    if (var == NULL) {
+        return NGX_ERROR;
+    }
+
+    value[3].len--;
+    value[3].data++;
+
+    var->observe_idx = var_index(cf, &value[3]);
+    if (var->observe_idx == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+    var->point = point;
+    var->multi = multi;
+
+    suffix.data = buf;
+
+    for (i = 5; i <= nelts; i++) {
+        if (i < nelts) {
+            p = ngx_strlchr(value[i].data, value[i].data + value[i].len, '.');
+            if (p != NULL
+                && (ngx_uint_t) (value[i].data + value[i].len - p - 1) > point)
+            {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "bucket bound \"%V\" is finer than "
+                                   "the scale", &value[i]);
+                return NGX_ERROR;
+            }
+            val = ngx_http_cnt_parse_value(value[i].data, value[i].len,
+                                           point);
+            if (val == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "not a number \"%V\"", &value[i]);
+                return NGX_ERROR;
+            }
+            if (i > 5 && prev >= val) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "range must increase monotonically");
+                return NGX_ERROR;
+            }
+            bound = ngx_array_push(&var->buckets);
+            if (bound == NULL) {
+                return NGX_ERROR;
+            }
+            *bound = val;
+            prev = val;
+            tag = value[i];
+        } else {
+            ngx_str_set(&tag, "+Inf");
+        }
+
+        cnt = ngx_array_push(&var->cnt_data);
+        if (cnt == NULL) {
+            return NGX_ERROR;
+        }
+        suffix.len = ngx_sprintf(buf, "_%02ui", i - 5) - buf;
+        if (ngx_http_cnt_histogram_observe_counter(cf, declare, &value[1],
+                                                   &suffix, &tag, 0, 0, cnt)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    ngx_str_set(&suffix, "_cnt");
+    ngx_str_set(&tag, "cnt");
+    if (ngx_http_cnt_histogram_observe_counter(cf, declare, &value[1],
+                                               &suffix, &tag, 0, 0,
+                                               &var->cnt_cnt)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    ngx_str_set(&suffix, "_err");
+    ngx_str_set(&tag, "err");
+    if (ngx_http_cnt_histogram_observe_counter(cf, declare, &value[1],
+                                               &suffix, &tag, 0, 0,
+                                               &var->cnt_err)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    /* the sum is a fixed-point counter with the scale of the observation */
+
+    ngx_str_set(&suffix, "_sum");
+    ngx_str_set(&tag, "sum");
+    if (ngx_http_cnt_histogram_observe_counter(cf, declare, &value[1],
+                                               &suffix, &tag, point,
+                                               scaled || point > 0,
+                                               &var->cnt_sum)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    return cnt_set->histograms.nelts - 1;
+}
+
+
+/* declares a histogram which observes the index of the bin in a variable as
+ * "$name number $variable" in the counter set, returns its index in the set;
+ * the counters are named like the counters of histograms bound to the index
+ * of the bin */
+
+ngx_int_t
+ngx_http_cnt_histogram_bins_declare(ngx_conf_t *cf,
+                                    ngx_http_cnt_set_t *cnt_set,
+                                    ngx_http_cnt_declare_pt declare,
+                                    ngx_http_cnt_var_index_pt var_index)
+{
+    ngx_uint_t                            i;
+    ngx_int_t                             val;
+    ngx_str_t                            *value, suffix, tag;
+    ngx_http_cnt_set_histogram_data_t    *var;
+    ngx_http_cnt_histogram_var_handle_t  *cnt;
+    u_char                                buf[4];
+
+    value = cf->args->elts;
+
+    if (cf->args->nelts != 4) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid number of arguments in \"histogram\" "
+                           "directive");
+        return NGX_ERROR;
+    }
+
+    val = ngx_atoi(value[2].data, value[2].len);
+    if (val == NGX_ERROR) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "not a number \"%V\"",
+                           &value[2]);
+        return NGX_ERROR;
+    }
+    if (val == 0 || val > ngx_http_cnt_histogram_max_bins) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "number of bins must be greater than 0 but "
+                           "not greater than %i",
+                           ngx_http_cnt_histogram_max_bins);
+        return NGX_ERROR;
+    }
+    if (value[3].len < 2 || value[3].data[0] != '$') {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid variable name \"%V\"", &value[3]);
+        return NGX_ERROR;
+    }
+    value[3].len--;
+    value[3].data++;
+
+    var = ngx_http_cnt_histogram_push(cf, cnt_set, val, 0);
+    if (var == NULL) {
+        return NGX_ERROR;
+    }
+
+    var->observe_idx = var_index(cf, &value[3]);
+    if (var->observe_idx == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    suffix.data = buf;
+    ngx_str_null(&tag);
+
+    for (i = 0; i < (ngx_uint_t) val; i++) {
+        cnt = ngx_array_push(&var->cnt_data);
+        if (cnt == NULL) {
+            return NGX_ERROR;
+        }
+        suffix.len = ngx_sprintf(buf, "_%02ui", i) - buf;
+        if (ngx_http_cnt_histogram_observe_counter(cf, declare, &value[1],
+                                                   &suffix, &tag, 0, 0, cnt)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    ngx_str_set(&suffix, "_cnt");
+    ngx_str_set(&tag, "cnt");
+    if (ngx_http_cnt_histogram_observe_counter(cf, declare, &value[1],
+                                               &suffix, &tag, 0, 0,
+                                               &var->cnt_cnt)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    ngx_str_set(&suffix, "_err");
+    ngx_str_set(&tag, "err");
+    if (ngx_http_cnt_histogram_observe_counter(cf, declare, &value[1],
+                                               &suffix, &tag, 0, 0,
+                                               &var->cnt_err)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    return cnt_set->histograms.nelts - 1;
+}
+
+
+/* adds a histogram which observes values directly to the counter set, its
+ * name is the first argument of the directive */
+
+static ngx_http_cnt_set_histogram_data_t *
+ngx_http_cnt_histogram_push(ngx_conf_t *cf, ngx_http_cnt_set_t *cnt_set,
+                            ngx_uint_t nbins, ngx_uint_t nbuckets)
+{
+    ngx_str_t                            *value;
+    ngx_http_cnt_set_histogram_data_t    *var;
+
+    value = cf->args->elts;
+
+    if (cnt_set->histograms.nalloc == 0
+        && ngx_array_init(&cnt_set->histograms, cf->pool, 1,
+                          sizeof(ngx_http_cnt_set_histogram_data_t))
+            != NGX_OK)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "failed to allocate memory for histogram data");
+        return NULL;
+    }
+
+    var = ngx_array_push(&cnt_set->histograms);
+    if (var == NULL) {
+        return NULL;
+    }
+
+    ngx_memzero(var, sizeof(ngx_http_cnt_set_histogram_data_t));
+
+    if (ngx_array_init(&var->cnt_data, cf->pool, nbins,
+                       sizeof(ngx_http_cnt_histogram_var_handle_t)) != NGX_OK
+        || (nbuckets > 0
+            && ngx_array_init(&var->buckets, cf->pool, nbuckets,
+                              sizeof(ngx_int_t)) != NGX_OK))
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "failed to allocate memory for histogram data");
+        return NULL;
+    }
+
+    var->self = NGX_ERROR;
+    var->bound_idx = NGX_ERROR;
+    var->observe_idx = NGX_ERROR;
+    var->multi = ngx_http_cnt_multi_none;
+    var->name = value[1];
+    var->cnt_sum.slot = NGX_ERROR;
+
+    return var;
+}
+
+
+/* declares a counter of a histogram which observes values directly with the
+ * declaration hook, the counter gets updated directly in the shared memory */
+
+static ngx_int_t
+ngx_http_cnt_histogram_observe_counter(ngx_conf_t *cf,
+                                       ngx_http_cnt_declare_pt declare,
+                                       ngx_str_t *base_name, ngx_str_t *suffix,
+                                       ngx_str_t *tag, ngx_uint_t point,
+                                       ngx_uint_t scaled,
+                                       ngx_http_cnt_histogram_var_handle_t
+                                       *handle)
+{
+    ngx_str_t                             name;
+
+    name.len = 1 + base_name->len + suffix->len;
+    name.data = ngx_pnalloc(cf->pool, name.len);
+    if (name.data == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "failed to allocate memory for histogram data");
+        return NGX_ERROR;
+    }
+    (void) ngx_sprintf(name.data, "$%V%V", base_name, suffix);
+
+    handle->name = name;
+    handle->tag = *tag;
+    ngx_str_null(&handle->inc_var_name);
+
+    /* the counter is declared without the leading dollar */
+
+    name.len--;
+    name.data++;
+
+    handle->slot = declare(cf, &name, &point, scaled, &handle->idx);
+
+    return handle->slot == NGX_ERROR ? NGX_ERROR : NGX_OK;
+}
+
+
+ngx_int_t
+ngx_http_cnt_histogram_observe(ngx_http_cnt_vars_t *vars,
+                               ngx_http_cnt_set_t *cnt_set,
+                               ngx_int_t histogram,
+                               ngx_http_cnt_observation_t *obs)
+{
+    ngx_int_t                             l = 0, m, h, val, rc, *bound;
+    ngx_str_t                             elt;
+    ngx_http_variable_value_t            *var;
+    ngx_http_cnt_set_histogram_data_t    *data;
+    ngx_http_cnt_histogram_var_handle_t  *cnt_data;
+
+    /* returns NGX_DONE when there are no more values to observe */
+
+    if (obs->done) {
+        return NGX_DONE;
+    }
+
+    data = &((ngx_http_cnt_set_histogram_data_t *)
+             cnt_set->histograms.elts)[histogram];
+
+    obs->value = 0;
+
+    if (obs->pos == NULL) {
+        var = vars->value(vars->data, data->observe_idx);
+        if (var == NULL || !var->valid || var->not_found) {
+            obs->done = 1;
+            goto bad_data;
+        }
+
+        if (data->multi != ngx_http_cnt_multi_each) {
+            obs->done = 1;
+            rc = ngx_http_cnt_parse_var_value(var, data->point, data->multi,
+                                              &val);
+            if (rc == NGX_DECLINED) {
+                return NGX_DONE;
+            }
+            if (rc != NGX_OK || val < 0) {
+                goto bad_data;
+            }
+            goto observe;
+        }
+
+        obs->pos = var->data;
+        obs->last = var->data + var->len;
+    }
+
+    if (!ngx_http_cnt_next_elt(&obs->pos, obs->last, &elt)) {
+        obs->done = 1;
+        return NGX_DONE;
+    }
+
+    val = ngx_http_cnt_parse_value(elt.data, elt.len, data->point);
+    if (val == NGX_ERROR) {
+        goto bad_data;
+    }
+
+observe:
+
+    cnt_data = data->cnt_data.elts;
+
+    /* without buckets, the value is the index of the bin */
+
+    if (data->buckets.nelts == 0) {
+        if (val >= (ngx_int_t) data->cnt_data.nelts) {
+            goto bad_data;
+        }
+        l = val;
+        val = 0;
+        goto found;
+    }
+
+    bound = data->buckets.elts;
+    h = data->buckets.nelts;
+
+    /* logarithmic inclusive upper bound search algorithm */
+    while (l < h) {
+        m = l + (h - l) / 2;
+        if (val > bound[m]) {
+            l = m + 1;
+        } else {
+            h = m;
+        }
+    }
+
+found:
+
+    obs->bin = cnt_data[l].slot;
+    obs->cnt = data->cnt_cnt.slot;
+    obs->sum = data->cnt_sum.slot;
+    obs->value = val;
+
+    return NGX_OK;
+
+bad_data:
+
+    obs->bin = data->cnt_err.slot;
+
+    return NGX_DECLINED;
+}
+
+
+/* the tags of the bins of a histogram bound to a range index are the bounds
+ * of the range, the last bin is unbounded */
+
+void
+ngx_http_cnt_histogram_range_tags(ngx_http_cnt_set_histogram_data_t *histogram,
+                                  ngx_http_cnt_map_to_range_index_data_t
+                                  *v_data)
+{
+    ngx_uint_t                            k;
+    ngx_http_cnt_histogram_var_handle_t  *vars;
+    ngx_http_cnt_range_boundary_data_t   *boundary;
+
+    vars = histogram->cnt_data.elts;
+
+    for (k = 0; k < histogram->cnt_data.nelts; k++) {
+        if (v_data->range == NULL || k == v_data->range->nelts) {
+            ngx_str_set(&vars[k].tag, "+Inf");
+            break;
+        }
+        boundary = v_data->range->elts;
+        vars[k].tag = boundary[k].s_value;
+    }
+}
+
+
 static ngx_int_t
 ngx_http_cnt_get_range_index(ngx_http_request_t *r,
                              ngx_http_variable_value_t *v, uintptr_t  data)
 {
-    ngx_http_cnt_map_to_range_index_data_t  *v_data =
-            (ngx_http_cnt_map_to_range_index_data_t *) data;
+    ngx_http_cnt_vars_t                      vars;
+
+    ngx_http_cnt_request_vars(r, &vars);
+
+    return ngx_http_cnt_map_to_range(&vars,
+                    (ngx_http_cnt_map_to_range_index_data_t *) data, v);
+}
+
+
+/* maps the value of the source variable to the index of its range, or to
+ * "error" if the value is not a number */
 
+ngx_int_t
+ngx_http_cnt_map_to_range(ngx_http_cnt_vars_t *vars,
+                          ngx_http_cnt_map_to_range_index_data_t *v_data,
+                          ngx_http_variable_value_t *v)
+{
     ngx_int_t                                l = 0, m, h;
     ngx_http_variable_value_t               *var;
     static const size_t                      buf_size = 32;
@@ -1008,7 +1609,7 @@ ngx_http_cnt_get_range_index(ngx_http_request_t *r,
         goto bad_data;
     }
 
-    var = ngx_http_get_indexed_variable(r, v_data->idx);
+    var = vars->value(vars->data, v_data->idx);
     if (var == NULL || !var->valid || var->not_found) {
         goto bad_data;
     }
@@ -1033,6 +1634,11 @@ ngx_http_cnt_get_range_index(ngx_http_request_t *r,
         return NGX_OK;
     }
 
+    if (v_data->gen.type != ngx_http_cnt_range_list) {
+        l = ngx_http_cnt_range_gen_index(&v_data->gen, v_data->range, val);
+        goto found;
+    }
+
     range = v_data->range->elts;
     h = v_data->range->nelts;
 
@@ -1046,7 +1652,9 @@ ngx_http_cnt_get_range_index(ngx_http_request_t *r,
         }
     }
 
-    vbuf = ngx_pnalloc(r->pool, NGX_INT64_LEN);
+found:
+
+    vbuf = ngx_pnalloc(vars->pool, NGX_INT64_LEN);
     if (vbuf == NULL) {
         return NGX_ERROR;
     }
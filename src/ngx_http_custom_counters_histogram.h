@@ -22,6 +22,71 @@
 #include <ngx_core.h>
 #include <ngx_http.h>
 
+#include "ngx_http_custom_counters_module.h"
+
+
+typedef struct {
+    ngx_int_t                             idx;
+    ngx_int_t                             slot;
+    ngx_str_t                             name;
+    ngx_str_t                             inc_var_name;
+    ngx_str_t                             tag;
+} ngx_http_cnt_histogram_var_handle_t;
+
+
+/* histograms either get bound to a variable with the index of the bin, or
+ * observe values of a variable directly: the latter have no inc variables,
+ * their counters get updated with the observation in the log phase; the
+ * histograms of stream servers may also observe the index of the bin, then
+ * they have neither buckets nor the sum */
+
+typedef struct {
+    ngx_int_t                             self;
+    ngx_int_t                             bound_idx;
+    ngx_int_t                             observe_idx;
+    ngx_uint_t                            point;
+    ngx_http_cnt_multi_e                  multi;
+    ngx_array_t                           buckets;
+    ngx_str_t                             name;
+    ngx_array_t                           cnt_data;
+    ngx_http_cnt_histogram_var_handle_t   cnt_cnt;
+    ngx_http_cnt_histogram_var_handle_t   cnt_err;
+    ngx_http_cnt_histogram_var_handle_t   cnt_sum;
+} ngx_http_cnt_set_histogram_data_t;
+
+
+/* self is the index of the variable with the range index */
+
+typedef struct {
+    ngx_int_t                             self;
+    ngx_int_t                             idx;
+    ngx_array_t                          *range;
+    ngx_http_cnt_range_gen_t              gen;
+} ngx_http_cnt_map_to_range_index_data_t;
+
+
+typedef struct {
+    double                                value;
+    ngx_str_t                             s_value;
+} ngx_http_cnt_range_boundary_data_t;
+
+
+/* slots of counters to increment after an observation: the bin, the total
+ * count and the sum by value, or only the bin which is then the error
+ * counter, the sum is NGX_ERROR if the histogram has no sum; the position is
+ * the state of observing each value of a list, it must be NULL and done must
+ * be zero before the first observation */
+
+typedef struct {
+    ngx_int_t                   bin;
+    ngx_int_t                   cnt;
+    ngx_int_t                   sum;
+    ngx_int_t                   value;
+    u_char                     *pos;
+    u_char                     *last;
+    ngx_uint_t                  done;
+} ngx_http_cnt_observation_t;
+
 
 char *ngx_http_cnt_histogram(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
 ngx_int_t ngx_http_cnt_init_histograms(ngx_cycle_t *cycle);
@@ -29,6 +94,24 @@ ngx_int_t ngx_http_cnt_histograms(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data);
 char *ngx_http_cnt_map_to_range_index(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
+ngx_int_t ngx_http_cnt_histogram_observe_declare(ngx_conf_t *cf,
+    ngx_http_cnt_set_t *cnt_set, ngx_http_cnt_declare_pt declare,
+    ngx_http_cnt_var_index_pt var_index);
+ngx_int_t ngx_http_cnt_histogram_bins_declare(ngx_conf_t *cf,
+    ngx_http_cnt_set_t *cnt_set, ngx_http_cnt_declare_pt declare,
+    ngx_http_cnt_var_index_pt var_index);
+ngx_int_t ngx_http_cnt_histogram_observe(ngx_http_cnt_vars_t *vars,
+    ngx_http_cnt_set_t *cnt_set, ngx_int_t histogram,
+    ngx_http_cnt_observation_t *obs);
+void ngx_http_cnt_histogram_range_tags(
+    ngx_http_cnt_set_histogram_data_t *histogram,
+    ngx_http_cnt_map_to_range_index_data_t *v_data);
+char *ngx_http_cnt_parse_range(ngx_conf_t *cf,
+    ngx_http_cnt_var_index_pt var_index,
+    ngx_http_cnt_map_to_range_index_data_t *v_data);
+ngx_int_t ngx_http_cnt_map_to_range(ngx_http_cnt_vars_t *vars,
+    ngx_http_cnt_map_to_range_index_data_t *v_data,
+    ngx_http_variable_value_t *v);
 
 #endif /* NGX_HTTP_CUSTOM_COUNTERS_HISTOGRAM_H */
 
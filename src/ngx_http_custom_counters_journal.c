@@ -0,0 +1,844 @@
+/*
+ * =============================================================================
+ *
+ *       Filename:  ngx_http_custom_counters_journal.c
+ *
+ *    Description:  journal of persistent counters
+ *
+ *        Version:  4.0
+ *        Created:  18.10.2026 15:04:19
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Alexey Radkov (), 
+ *        Company:  
+ *
+ * =============================================================================
+ */
+
+#ifdef NGX_HTTP_CUSTOM_COUNTERS_PERSISTENCY
+
+#include "ngx_http_custom_counters_module.h"
+#include "ngx_http_custom_counters_persistency.h"
+#include "ngx_http_custom_counters_journal.h"
+#include "ngx_http_custom_counters_metrics.h"
+#include "ngx_http_custom_counters_probes.h"
+
+
+/* the journal starts with a header which is followed by records aligned to
+ * 8 bytes: snapshots of all persistent counter sets go first, and deltas of
+ * changed counters get appended after them; a delta record refers to a set
+ * by the position of its snapshot in the journal, and to a counter by its
+ * slot in the snapshot's block */
+
+#define NGX_HTTP_CNT_JOURNAL_MAGIC       "NGXCNTJ1"
+#define NGX_HTTP_CNT_JOURNAL_BYTE_ORDER  0x01020304
+#define NGX_HTTP_CNT_JOURNAL_SNAPSHOT    1
+#define NGX_HTTP_CNT_JOURNAL_DELTA       2
+
+/* compaction interval when the backup interval was not specified */
+#define NGX_HTTP_CNT_JOURNAL_COMPACTION  60
+
+
+typedef struct {
+    u_char                      magic[8];
+    uint32_t                    byte_order;
+    uint32_t                    atomic_size;
+} ngx_http_cnt_journal_header_t;
+
+
+typedef struct {
+    uint32_t                    type;
+    uint32_t                    set;
+    uint64_t                    len;       /* including this header */
+} ngx_http_cnt_journal_record_t;
+
+
+/* a snapshot record contains the length of the name of the set as uint64_t,
+ * the name padded to 8 bytes, and the block of the set as in shared memory;
+ * a delta record contains an array of deltas */
+
+typedef struct {
+    uint64_t                    slot;
+    int64_t                     delta;
+} ngx_http_cnt_journal_delta_t;
+
+
+typedef struct {
+    ngx_event_t                 event;
+    ngx_fd_t                    fd;
+    ngx_http_cnt_main_conf_t   *mcf;
+    ngx_atomic_int_t          **last;
+    ngx_atomic_int_t           *epoch;
+    u_char                     *buf;
+    u_char                     *tmp;
+    time_t                      compacted;
+    time_t                      compaction;
+    ngx_uint_t                  compact;   /* the write is a compaction */
+    ngx_http_cnt_write_ctx_t    ctx;
+#if (NGX_THREADS)
+    ngx_thread_task_t          *task;
+#endif
+} ngx_http_cnt_journal_t;
+
+
+static void ngx_http_cnt_journal_handler(ngx_event_t *ev);
+static ngx_int_t ngx_http_cnt_compact_journal(ngx_http_cnt_journal_t *journal,
+    ngx_log_t *log);
+static ngx_int_t ngx_http_cnt_flush_journal(ngx_http_cnt_journal_t *journal,
+    ngx_log_t *log);
+static ngx_int_t ngx_http_cnt_write_journal(ngx_http_cnt_journal_t *journal,
+    ngx_log_t *log);
+static void ngx_http_cnt_write_journal_data(ngx_http_cnt_journal_t *journal);
+static ngx_int_t ngx_http_cnt_finalize_journal_write(
+    ngx_http_cnt_journal_t *journal, ngx_log_t *log);
+#if (NGX_THREADS)
+static void ngx_http_cnt_journal_thread_handler(void *data, ngx_log_t *log);
+static void ngx_http_cnt_journal_event_handler(ngx_event_t *ev);
+#endif
+
+
+static ngx_http_cnt_journal_t  *ngx_http_cnt_journal;
+
+
+ngx_int_t
+ngx_http_cnt_read_persistent_journal(ngx_conf_t *cf,
+                                     ngx_http_cnt_main_conf_t *mcf)
+{
+    ngx_uint_t                      i, n;
+    ngx_file_t                      file;
+    ngx_file_info_t                 file_info;
+    size_t                          file_size, len, name_len;
+    ssize_t                         size;
+    u_char                         *buf, *p, *end, *payload;
+    ngx_http_cnt_journal_header_t  *hdr;
+    ngx_http_cnt_journal_record_t  *rec;
+    ngx_http_cnt_journal_delta_t   *deltas;
+    ngx_http_cnt_journal_set_t     *sets, *set;
+    ngx_http_cnt_shm_block_t       *block;
+    volatile ngx_atomic_int_t      *values;
+
+    /* like the persistent storage, the journal is needed only until the
+     * counters get loaded into shared memory zones */
+
+    if (ngx_array_init(&mcf->persistent_journal_sets, cf->temp_pool, 1,
+                       sizeof(ngx_http_cnt_journal_set_t)) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(&file, sizeof(ngx_file_t));
+
+    file.name = mcf->persistent_journal;
+    file.log = cf->log;
+
+    file.fd = ngx_open_file(file.name.data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+
+    if (file.fd == NGX_INVALID_FILE) {
+        if (ngx_errno == NGX_ENOENT) {
+            /* Nginx was shut down gracefully or the journal is new */
+            return NGX_OK;
+        }
+
+        ngx_conf_log_error(NGX_LOG_ERR, cf, ngx_errno,
+                           ngx_open_file_n " \"%V\" failed", &file.name);
+        return NGX_ERROR;
+    }
+
+    if (ngx_fd_info(file.fd, &file_info) == NGX_FILE_ERROR) {
+        ngx_conf_log_error(NGX_LOG_ERR, cf, ngx_errno,
+                           ngx_fd_info_n " \"%V\" failed", &file.name);
+        goto cleanup;
+    }
+
+    file_size = (size_t) ngx_file_size(&file_info);
+
+    if (file_size < sizeof(ngx_http_cnt_journal_header_t)) {
+        /* the journal was not written completely */
+        goto cleanup_ok;
+    }
+
+    /* unlike data of persistent storages, the journal gets read into
+     * writable memory: the deltas are applied to the snapshots in place */
+
+    buf = ngx_palloc(cf->temp_pool, file_size);
+    if (buf == NULL) {
+        goto cleanup;
+    }
+
+    size = ngx_read_file(&file, buf, file_size, 0);
+
+    if (size == NGX_ERROR) {
+        ngx_conf_log_error(NGX_LOG_ERR, cf, ngx_errno,
+                           ngx_read_file_n " \"%V\" failed", &file.name);
+        goto cleanup;
+    }
+
+    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+        ngx_conf_log_error(NGX_LOG_ERR, cf, ngx_errno,
+                           ngx_close_file_n " \"%V\" failed", &file.name);
+    }
+
+    if ((size_t) size != file_size) {
+        ngx_conf_log_error(NGX_LOG_ERR, cf, 0,
+                           ngx_read_file_n " \"%V\" returned only %z bytes "
+                           "instead of %z", &file.name, size, file_size);
+        return NGX_ERROR;
+    }
+
+    hdr = (ngx_http_cnt_journal_header_t *) buf;
+
+    if (ngx_memcmp(hdr->magic, NGX_HTTP_CNT_JOURNAL_MAGIC,
+                   sizeof(hdr->magic)) != 0
+        || hdr->byte_order != NGX_HTTP_CNT_JOURNAL_BYTE_ORDER
+        || hdr->atomic_size != sizeof(ngx_atomic_int_t))
+    {
+        goto corrupted;
+    }
+
+    p = buf + sizeof(ngx_http_cnt_journal_header_t);
+    end = buf + file_size;
+
+    while ((size_t) (end - p) >= sizeof(ngx_http_cnt_journal_record_t)) {
+        rec = (ngx_http_cnt_journal_record_t *) p;
+
+        if (rec->len < sizeof(ngx_http_cnt_journal_record_t)
+            || rec->len % 8 != 0 || rec->len > (uint64_t) (end - p))
+        {
+            ngx_conf_log_error(NGX_LOG_NOTICE, cf, 0,
+                               "journal \"%V\" ends with an incomplete "
+                               "record, ignoring it", &file.name);
+            break;
+        }
+
+        payload = p + sizeof(ngx_http_cnt_journal_record_t);
+        len = rec->len - sizeof(ngx_http_cnt_journal_record_t);
+
+        sets = mcf->persistent_journal_sets.elts;
+
+        switch (rec->type) {
+
+        case NGX_HTTP_CNT_JOURNAL_SNAPSHOT:
+            if (rec->set != mcf->persistent_journal_sets.nelts
+                || len < sizeof(uint64_t))
+            {
+                goto corrupted;
+            }
+
+            name_len = *(uint64_t *) payload;
+            len -= sizeof(uint64_t);
+
+            if (name_len > len || ngx_align(name_len, 8) > len) {
+                goto corrupted;
+            }
+
+            block = (ngx_http_cnt_shm_block_t *)
+                    (payload + sizeof(uint64_t) + ngx_align(name_len, 8));
+
+            if (ngx_http_cnt_shm_block_check(block,
+                                             len - ngx_align(name_len, 8))
+                != NGX_OK)
+            {
+                goto corrupted;
+            }
+
+            set = ngx_array_push(&mcf->persistent_journal_sets);
+            if (set == NULL) {
+                return NGX_ERROR;
+            }
+
+            set->name.len = name_len;
+            set->name.data = payload + sizeof(uint64_t);
+            set->block = block;
+
+            break;
+
+        case NGX_HTTP_CNT_JOURNAL_DELTA:
+            if (rec->set >= mcf->persistent_journal_sets.nelts
+                || len % sizeof(ngx_http_cnt_journal_delta_t) != 0)
+            {
+                goto corrupted;
+            }
+
+            block = sets[rec->set].block;
+            values = ngx_http_cnt_shm_values(block);
+            deltas = (ngx_http_cnt_journal_delta_t *) payload;
+            n = len / sizeof(ngx_http_cnt_journal_delta_t);
+
+            for (i = 0; i < n; i++) {
+                if (deltas[i].slot >= (uint64_t) block->nelts) {
+                    goto corrupted;
+                }
+                values[deltas[i].slot] += deltas[i].delta;
+            }
+
+            break;
+
+        default:
+            goto corrupted;
+        }
+
+        p += rec->len;
+    }
+
+    return NGX_OK;
+
+corrupted:
+
+    ngx_conf_log_error(NGX_LOG_ERR, cf, 0,
+                       "journal \"%V\" is corrupted, delete it and run again",
+                       &file.name);
+
+    return NGX_ERROR;
+
+cleanup_ok:
+
+    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+        ngx_conf_log_error(NGX_LOG_ERR, cf, ngx_errno,
+                           ngx_close_file_n " \"%V\" failed", &file.name);
+    }
+
+    return NGX_OK;
+
+cleanup:
+
+    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+        ngx_conf_log_error(NGX_LOG_ERR, cf, ngx_errno,
+                           ngx_close_file_n " \"%V\" failed", &file.name);
+    }
+
+    return NGX_ERROR;
+}
+
+
+ngx_int_t
+ngx_http_cnt_load_persistent_journal(ngx_array_t *journal, ngx_str_t cnt_set,
+                                     ngx_http_cnt_shm_block_t *block)
+{
+    ngx_uint_t                      i;
+    ngx_http_cnt_journal_set_t     *sets;
+
+    sets = journal->elts;
+
+    for (i = 0; i < journal->nelts; i++) {
+        if (sets[i].name.len == cnt_set.len
+            && ngx_strncmp(sets[i].name.data, cnt_set.data, cnt_set.len) == 0)
+        {
+            ngx_http_cnt_shm_block_load(block, sets[i].block);
+            break;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_http_cnt_init_persistent_journal(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                      i;
+    ngx_http_cnt_main_conf_t       *mcf;
+    ngx_http_cnt_journal_t         *journal;
+    ngx_http_cnt_set_t             *cnt_set;
+    ngx_http_cnt_set_var_data_t    *sets;
+    ngx_http_cnt_shm_block_t       *block;
+    size_t                          size, dsize;
+
+    mcf = ngx_http_cycle_get_module_main_conf(cycle,
+                                              ngx_http_custom_counters_module);
+
+    if (mcf == NULL || mcf->persistent_journal_interval == 0) {
+        return NGX_OK;
+    }
+
+    /* only one process may write the journal, otherwise deltas would be
+     * counted more than once */
+
+    if (ngx_process != NGX_PROCESS_SINGLE
+        && (ngx_process != NGX_PROCESS_WORKER || ngx_worker != 0))
+    {
+        return NGX_OK;
+    }
+
+    journal = ngx_pcalloc(cycle->pool, sizeof(ngx_http_cnt_journal_t));
+    if (journal == NULL) {
+        return NGX_ERROR;
+    }
+
+    journal->last = ngx_palloc(cycle->pool, sizeof(ngx_atomic_int_t *)
+                                            * mcf->persistent_sets.nelts);
+    if (journal->last == NULL) {
+        return NGX_ERROR;
+    }
+
+    journal->epoch = ngx_palloc(cycle->pool, sizeof(ngx_atomic_int_t)
+                                             * mcf->persistent_sets.nelts);
+    if (journal->epoch == NULL) {
+        return NGX_ERROR;
+    }
+
+    size = sizeof(ngx_http_cnt_journal_header_t);
+    dsize = 0;
+
+    sets = mcf->persistent_sets.elts;
+
+    for (i = 0; i < mcf->persistent_sets.nelts; i++) {
+        cnt_set = &((ngx_http_cnt_set_t *) mcf->cnt_sets.elts)[sets[i].self];
+        block = cnt_set->zone->data;
+
+        size += sizeof(ngx_http_cnt_journal_record_t) + sizeof(uint64_t)
+                + ngx_align(cnt_set->name.len, 8)
+                + ngx_align(ngx_http_cnt_shm_block_size(&cnt_set->vars), 8);
+        dsize += sizeof(ngx_http_cnt_journal_record_t)
+                + sizeof(ngx_http_cnt_journal_delta_t) * block->nelts;
+
+        journal->last[i] = ngx_palloc(cycle->pool, sizeof(ngx_atomic_int_t)
+                                                   * block->nelts);
+        if (journal->last[i] == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    journal->buf = ngx_palloc(cycle->pool, ngx_max(size, dsize));
+    if (journal->buf == NULL) {
+        return NGX_ERROR;
+    }
+
+    journal->tmp = ngx_pnalloc(cycle->pool,
+                        NGX_HTTP_CNT_TMP_NAME_LEN(&mcf->persistent_journal));
+    if (journal->tmp == NULL) {
+        return NGX_ERROR;
+    }
+
+    journal->fd = NGX_INVALID_FILE;
+    journal->mcf = mcf;
+    journal->compaction = mcf->persistent_collection_check > 0 ?
+            mcf->persistent_collection_check : NGX_HTTP_CNT_JOURNAL_COMPACTION;
+
+    journal->event.handler = ngx_http_cnt_journal_handler;
+    journal->event.data = journal;
+    journal->event.log = cycle->log;
+    journal->event.cancelable = 1;
+
+#if (NGX_THREADS)
+    if (mcf->persistent_thread_pool != NULL) {
+        journal->task = ngx_thread_task_alloc(cycle->pool, 0);
+        if (journal->task == NULL) {
+            return NGX_ERROR;
+        }
+
+        journal->task->ctx = journal;
+        journal->task->handler = ngx_http_cnt_journal_thread_handler;
+        journal->task->event.handler = ngx_http_cnt_journal_event_handler;
+        journal->task->event.data = journal;
+        journal->task->event.log = cycle->log;
+    }
+#endif
+
+    ngx_http_cnt_journal = journal;
+
+    /* start a new journal with snapshots of the counters: a journal written
+     * by a process of the previous cycle gets replaced here, and the process
+     * keeps writing into the replaced file which is not used any longer */
+
+    if (ngx_http_cnt_compact_journal(journal, cycle->log) != NGX_OK) {
+        ngx_log_error(NGX_LOG_ERR, cycle->log, 0,
+                      "failed to write persistent counters journal");
+    }
+
+    ngx_add_timer(&journal->event, mcf->persistent_journal_interval);
+
+    return NGX_OK;
+}
+
+
+void
+ngx_http_cnt_exit_persistent_journal(ngx_cycle_t *cycle)
+{
+    ngx_http_cnt_journal_t         *journal = ngx_http_cnt_journal;
+
+    if (journal == NULL) {
+        return;
+    }
+
+#if (NGX_THREADS)
+    if (journal->task != NULL) {
+        /* thread pools get destroyed before this module exits, and a write
+         * which was posted to the pool has finished by now, however its
+         * completion handler has not been run */
+
+        if (journal->task->event.active
+            && ngx_http_cnt_finalize_journal_write(journal, cycle->log)
+               != NGX_OK)
+        {
+            ngx_log_error(NGX_LOG_ERR, cycle->log, 0,
+                          "failed to write persistent counters journal");
+        }
+
+        journal->task = NULL;
+    }
+#endif
+
+    if (journal->fd == NGX_INVALID_FILE) {
+        return;
+    }
+
+    if (ngx_http_cnt_flush_journal(journal, cycle->log) != NGX_OK) {
+        ngx_log_error(NGX_LOG_ERR, cycle->log, 0,
+                      "failed to write persistent counters journal");
+    }
+
+    if (journal->fd != NGX_INVALID_FILE
+        && ngx_close_file(journal->fd) == NGX_FILE_ERROR)
+    {
+        ngx_log_error(NGX_LOG_ERR, cycle->log, ngx_errno,
+                      ngx_close_file_n " \"%V\" failed",
+                      &journal->mcf->persistent_journal);
+    }
+
+    journal->fd = NGX_INVALID_FILE;
+}
+
+
+void
+ngx_http_cnt_remove_persistent_journal(ngx_cycle_t *cycle)
+{
+    ngx_http_cnt_main_conf_t       *mcf;
+
+    mcf = ngx_http_cycle_get_module_main_conf(cycle,
+                                              ngx_http_custom_counters_module);
+
+    if (mcf == NULL || mcf->persistent_journal_interval == 0) {
+        return;
+    }
+
+    /* the main storage has just been written, and it is more recent than
+     * the journal */
+
+    if (ngx_delete_file(mcf->persistent_journal.data) == NGX_FILE_ERROR
+        && ngx_errno != NGX_ENOENT)
+    {
+        ngx_log_error(NGX_LOG_ERR, cycle->log, ngx_errno,
+                      ngx_delete_file_n " \"%V\" failed",
+                      &mcf->persistent_journal);
+    }
+}
+
+
+static void
+ngx_http_cnt_journal_handler(ngx_event_t *ev)
+{
+    ngx_http_cnt_journal_t         *journal = ev->data;
+    ngx_int_t                       rc;
+
+#if (NGX_THREADS)
+    /* the counters which change meanwhile are not lost: their deltas are
+     * counted from the values written last time */
+
+    if (journal->task != NULL && journal->task->event.active) {
+        ngx_log_error(NGX_LOG_INFO, ev->log, 0,
+                      "previous persistent counters journal write has not "
+                      "finished yet, skipping this one");
+        goto next;
+    }
+#endif
+
+    if (journal->fd == NGX_INVALID_FILE
+        || ngx_time() - journal->compacted >= journal->compaction)
+    {
+        rc = ngx_http_cnt_compact_journal(journal, ev->log);
+    } else {
+        rc = ngx_http_cnt_flush_journal(journal, ev->log);
+    }
+
+    if (rc != NGX_OK) {
+        ngx_log_error(NGX_LOG_ERR, ev->log, 0,
+                      "failed to write persistent counters journal");
+    }
+
+#if (NGX_THREADS)
+next:
+#endif
+
+    ngx_add_timer(ev, journal->mcf->persistent_journal_interval);
+}
+
+
+static ngx_int_t
+ngx_http_cnt_compact_journal(ngx_http_cnt_journal_t *journal, ngx_log_t *log)
+{
+    ngx_uint_t                      i, j;
+    ngx_http_cnt_main_conf_t       *mcf = journal->mcf;
+    ngx_http_cnt_journal_header_t  *hdr;
+    ngx_http_cnt_journal_record_t  *rec;
+    ngx_http_cnt_set_t             *cnt_set;
+    ngx_http_cnt_set_var_data_t    *sets;
+    ngx_http_cnt_shm_block_t       *block;
+    volatile ngx_atomic_int_t      *values;
+    u_char                         *last, *p;
+    size_t                          size;
+
+    hdr = (ngx_http_cnt_journal_header_t *) journal->buf;
+
+    ngx_memcpy(hdr->magic, NGX_HTTP_CNT_JOURNAL_MAGIC, sizeof(hdr->magic));
+    hdr->byte_order = NGX_HTTP_CNT_JOURNAL_BYTE_ORDER;
+    hdr->atomic_size = sizeof(ngx_atomic_int_t);
+
+    last = journal->buf + sizeof(ngx_http_cnt_journal_header_t);
+
+    sets = mcf->persistent_sets.elts;
+
+    for (i = 0; i < mcf->persistent_sets.nelts; i++) {
+        cnt_set = &((ngx_http_cnt_set_t *) mcf->cnt_sets.elts)[sets[i].self];
+
+        rec = (ngx_http_cnt_journal_record_t *) last;
+        rec->type = NGX_HTTP_CNT_JOURNAL_SNAPSHOT;
+        rec->set = i;
+
+        journal->epoch[i] = ngx_http_cnt_shm_block_epoch(cnt_set->zone->data);
+
+        p = last + sizeof(ngx_http_cnt_journal_record_t);
+
+        *(uint64_t *) p = cnt_set->name.len;
+        p += sizeof(uint64_t);
+
+        size = ngx_align(cnt_set->name.len, 8);
+        ngx_memzero(p, size);
+        ngx_memcpy(p, cnt_set->name.data, cnt_set->name.len);
+        p += size;
+
+        block = (ngx_http_cnt_shm_block_t *) p;
+        size = ngx_http_cnt_shm_block_copy(p, cnt_set->zone->data,
+                                           &cnt_set->vars);
+        ngx_memzero(p + size, ngx_align(size, 8) - size);
+        p += ngx_align(size, 8);
+
+        /* further deltas are counted from the values in the snapshot */
+
+        values = ngx_http_cnt_shm_values(block);
+
+        for (j = 0; j < (ngx_uint_t) block->nelts; j++) {
+            journal->last[i][j] = values[j];
+        }
+
+        rec->len = p - last;
+        last = p;
+    }
+
+    ngx_http_cnt_write_ctx_init(&journal->ctx, mcf, &mcf->persistent_journal,
+                                journal->tmp);
+
+    journal->ctx.buf = journal->buf;
+    journal->ctx.len = last - journal->buf;
+    journal->ctx.keep_open = 1;
+
+    journal->compact = 1;
+
+    return ngx_http_cnt_write_journal(journal, log);
+}
+
+
+static ngx_int_t
+ngx_http_cnt_flush_journal(ngx_http_cnt_journal_t *journal, ngx_log_t *log)
+{
+    ngx_uint_t                      i, j, n;
+    ngx_http_cnt_main_conf_t       *mcf = journal->mcf;
+    ngx_http_cnt_journal_record_t  *rec;
+    ngx_http_cnt_journal_delta_t   *deltas;
+    ngx_http_cnt_set_t             *cnt_set;
+    ngx_http_cnt_set_var_data_t    *sets;
+    ngx_http_cnt_shm_block_t       *block;
+    volatile ngx_atomic_int_t      *values;
+    ngx_atomic_int_t                value, epoch;
+    u_char                         *last;
+
+    last = journal->buf;
+
+    sets = mcf->persistent_sets.elts;
+
+    for (i = 0; i < mcf->persistent_sets.nelts; i++) {
+        cnt_set = &((ngx_http_cnt_set_t *) mcf->cnt_sets.elts)[sets[i].self];
+        block = cnt_set->zone->data;
+
+        /* sets which have not changed since the previous flush are skipped */
+
+        epoch = ngx_http_cnt_shm_block_epoch(block);
+        if (epoch == journal->epoch[i]) {
+            continue;
+        }
+
+        journal->epoch[i] = epoch;
+
+        values = ngx_http_cnt_shm_values(block);
+
+        rec = (ngx_http_cnt_journal_record_t *) last;
+        deltas = (ngx_http_cnt_journal_delta_t *) (rec + 1);
+        n = 0;
+
+        for (j = 0; j < (ngx_uint_t) block->nelts; j++) {
+            value = values[j];
+
+            if (value == journal->last[i][j]) {
+                continue;
+            }
+
+            deltas[n].slot = j;
+            deltas[n].delta = value - journal->last[i][j];
+            journal->last[i][j] = value;
+            n++;
+        }
+
+        if (n == 0) {
+            continue;
+        }
+
+        rec->type = NGX_HTTP_CNT_JOURNAL_DELTA;
+        rec->set = i;
+        rec->len = sizeof(ngx_http_cnt_journal_record_t)
+                + sizeof(ngx_http_cnt_journal_delta_t) * n;
+
+        last += rec->len;
+    }
+
+    if (last == journal->buf) {
+        return NGX_OK;
+    }
+
+    ngx_http_cnt_write_ctx_init(&journal->ctx, mcf, &mcf->persistent_journal,
+                                journal->tmp);
+
+    journal->ctx.fd = journal->fd;
+    journal->ctx.buf = journal->buf;
+    journal->ctx.len = last - journal->buf;
+
+    journal->compact = 0;
+
+    return ngx_http_cnt_write_journal(journal, log);
+}
+
+
+static ngx_int_t
+ngx_http_cnt_write_journal(ngx_http_cnt_journal_t *journal, ngx_log_t *log)
+{
+#if (NGX_THREADS)
+    /* only rendering of the records happens in the event loop, writing and
+     * syncing the journal is done in the thread pool */
+
+    if (journal->task != NULL) {
+        return ngx_thread_task_post(journal->mcf->persistent_thread_pool,
+                                    journal->task);
+    }
+#endif
+
+    ngx_http_cnt_write_journal_data(journal);
+
+    return ngx_http_cnt_finalize_journal_write(journal, log);
+}
+
+
+static void
+ngx_http_cnt_write_journal_data(ngx_http_cnt_journal_t *journal)
+{
+    ngx_http_cnt_write_ctx_t       *ctx = &journal->ctx;
+    ngx_atomic_uint_t               start = 0;
+
+    /* this may run in a thread: a failure is reported via ctx->failed,
+     * ctx->failed_name and ctx->err */
+
+    if (journal->compact) {
+        ngx_http_cnt_write_file(ctx);
+        return;
+    }
+
+    if (ctx->self_metrics != NULL) {
+        start = ngx_http_cnt_self_metrics_now();
+    }
+
+    ngx_http_cnt_probe2(persistent__write__start, ctx->name.data, ctx->len);
+
+    if (ngx_http_cnt_write_fd(ctx->fd, ctx->buf, ctx->len) != NGX_OK) {
+        ctx->err = ngx_errno;
+        ctx->failed = ngx_write_fd_n;
+        ctx->failed_name = ctx->name.data;
+
+    } else if (ctx->fsync != NGX_HTTP_CNT_FSYNC_NONE && fsync(ctx->fd) == -1)
+    {
+        ctx->err = ngx_errno;
+        ctx->failed = "fsync()";
+        ctx->failed_name = ctx->name.data;
+    }
+
+    ngx_http_cnt_probe2(persistent__write__end, ctx->name.data,
+                        ctx->failed != NULL);
+
+    if (ctx->self_metrics != NULL && ctx->failed == NULL) {
+        ngx_http_cnt_self_metrics_sample(ctx->self_metrics,
+                                         ngx_http_cnt_self_persistent_writes,
+                                         start, ctx->len);
+    }
+}
+
+
+static ngx_int_t
+ngx_http_cnt_finalize_journal_write(ngx_http_cnt_journal_t *journal,
+                                    ngx_log_t *log)
+{
+    ngx_http_cnt_write_ctx_t       *ctx = &journal->ctx;
+    ngx_str_t                      *name = &journal->mcf->persistent_journal;
+
+    if (journal->compact) {
+        if (ctx->fd != NGX_INVALID_FILE) {
+            if (journal->fd != NGX_INVALID_FILE
+                && ngx_close_file(journal->fd) == NGX_FILE_ERROR)
+            {
+                ngx_log_error(NGX_LOG_ERR, log, ngx_errno,
+                              ngx_close_file_n " \"%V\" failed", name);
+            }
+
+            journal->fd = ctx->fd;
+            journal->compacted = ngx_time();
+        }
+
+    } else if (ctx->failed != NULL) {
+        /* the deltas were lost, the next compaction will write snapshots
+         * that include them */
+
+        if (ngx_close_file(journal->fd) == NGX_FILE_ERROR) {
+            ngx_log_error(NGX_LOG_ERR, log, ngx_errno,
+                          ngx_close_file_n " \"%V\" failed", name);
+        }
+
+        journal->fd = NGX_INVALID_FILE;
+    }
+
+    if (ctx->failed != NULL) {
+        ngx_log_error(NGX_LOG_ERR, log, ctx->err, "%s \"%s\" failed",
+                      ctx->failed, ctx->failed_name);
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+#if (NGX_THREADS)
+
+static void
+ngx_http_cnt_journal_thread_handler(void *data, ngx_log_t *log)
+{
+    ngx_http_cnt_write_journal_data(data);
+}
+
+
+static void
+ngx_http_cnt_journal_event_handler(ngx_event_t *ev)
+{
+    if (ngx_http_cnt_finalize_journal_write(ev->data, ev->log) != NGX_OK) {
+        ngx_log_error(NGX_LOG_ERR, ev->log, 0,
+                      "failed to write persistent counters journal");
+    }
+}
+
+#endif
+
+#endif
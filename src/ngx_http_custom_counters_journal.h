@@ -0,0 +1,48 @@
+/*
+ * =============================================================================
+ *
+ *       Filename:  ngx_http_custom_counters_journal.h
+ *
+ *    Description:  journal of persistent counters
+ *
+ *        Version:  4.0
+ *        Created:  18.10.2026 15:02:36
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Alexey Radkov (), 
+ *        Company:  
+ *
+ * =============================================================================
+ */
+
+#ifndef NGX_HTTP_CUSTOM_COUNTERS_JOURNAL_H
+#define NGX_HTTP_CUSTOM_COUNTERS_JOURNAL_H
+
+#ifdef NGX_HTTP_CUSTOM_COUNTERS_PERSISTENCY
+
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+#include "ngx_http_custom_counters_module.h"
+#include "ngx_http_custom_counters_shm.h"
+
+
+typedef struct {
+    ngx_str_t                   name;
+    ngx_http_cnt_shm_block_t   *block;
+} ngx_http_cnt_journal_set_t;
+
+
+ngx_int_t ngx_http_cnt_read_persistent_journal(ngx_conf_t *cf,
+    ngx_http_cnt_main_conf_t *mcf);
+ngx_int_t ngx_http_cnt_load_persistent_journal(ngx_array_t *journal,
+    ngx_str_t cnt_set, ngx_http_cnt_shm_block_t *block);
+ngx_int_t ngx_http_cnt_init_persistent_journal(ngx_cycle_t *cycle);
+void ngx_http_cnt_exit_persistent_journal(ngx_cycle_t *cycle);
+void ngx_http_cnt_remove_persistent_journal(ngx_cycle_t *cycle);
+
+#endif
+
+#endif /* NGX_HTTP_CUSTOM_COUNTERS_JOURNAL_H */
+
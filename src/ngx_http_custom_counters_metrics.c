@@ -0,0 +1,595 @@
+/*
+ * =============================================================================
+ *
+ *       Filename:  ngx_http_custom_counters_metrics.c
+ *
+ *    Description:  self-instrumentation of the module
+ *
+ *        Version:  4.0
+ *        Created:  18.10.2026 19:14:02
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Alexey Radkov (), 
+ *        Company:  
+ *
+ * =============================================================================
+ */
+
+#include "ngx_http_custom_counters_module.h"
+#include "ngx_http_custom_counters_metrics.h"
+
+
+typedef struct {
+    ngx_str_t                            *name;
+    ngx_http_cnt_hot_slot_t              *slot;
+    ngx_atomic_uint_t                     samples;
+    ngx_atomic_uint_t                     ns;
+} ngx_http_cnt_hot_slot_report_t;
+
+
+static size_t ngx_http_cnt_hot_slots_block_size(ngx_http_cnt_hot_slots_t *hs);
+static ngx_int_t ngx_http_cnt_hot_slots_shm_init(ngx_shm_zone_t *shm_zone,
+    void *data);
+static ngx_int_t ngx_http_cnt_hot_slot_cmp(const void *one, const void *two);
+
+
+static ngx_str_t  ngx_http_cnt_hot_slots_zone_name =
+    ngx_string("hot_slots_custom_counters");
+
+/* the order must correspond to ngx_http_cnt_self_metric_e */
+
+static ngx_str_t  ngx_http_cnt_self_metrics_names[] = {
+    ngx_string("$cnt_self_update_early_samples"),
+    ngx_string("$cnt_self_update_early_ns"),
+    ngx_string("$cnt_self_update_log_samples"),
+    ngx_string("$cnt_self_update_log_ns"),
+    ngx_string("$cnt_self_collection_samples"),
+    ngx_string("$cnt_self_collection_ns"),
+    ngx_string("$cnt_self_collection_bytes"),
+    ngx_string("$cnt_self_persistent_writes"),
+    ngx_string("$cnt_self_persistent_write_ns"),
+    ngx_string("$cnt_self_persistent_write_bytes"),
+    ngx_string("$cnt_self_rt_var_errors")
+};
+
+
+char *
+ngx_http_cnt_self_metrics(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_uint_t                            i;
+    ngx_int_t                             sample = 1, v_idx;
+    ngx_http_cnt_main_conf_t             *mcf;
+    ngx_http_cnt_srv_conf_t              *scf;
+    ngx_http_cnt_self_metrics_t          *sm;
+    ngx_http_cnt_set_t                   *cnt_sets, *cnt_set;
+    ngx_str_t                            *value;
+    ngx_conf_t                            cf_cnt;
+    ngx_array_t                           cf_cnt_args;
+    ngx_str_t                            *counter_cmd, *counter_name;
+
+    mcf = ngx_http_conf_get_module_main_conf(cf,
+                                             ngx_http_custom_counters_module);
+
+    if (mcf->self_metrics != NULL) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (cf->args->nelts == 2) {
+        if (value[1].len <= 7 || ngx_strncmp(value[1].data, "sample=", 7) != 0)
+        {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid parameter \"%V\"", &value[1]);
+            return NGX_CONF_ERROR;
+        }
+
+        sample = ngx_atoi(value[1].data + 7, value[1].len - 7);
+        if (sample == NGX_ERROR || sample == 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid sample rate \"%V\"", &value[1]);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    sm = ngx_pcalloc(cf->pool, sizeof(ngx_http_cnt_self_metrics_t));
+    if (sm == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (ngx_array_init(&cf_cnt_args, cf->temp_pool, 2, sizeof(ngx_str_t))
+        != NGX_OK)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    counter_cmd = ngx_array_push(&cf_cnt_args);
+    if (counter_cmd == NULL) {
+        return NGX_CONF_ERROR;
+    }
+    ngx_str_set(counter_cmd, "counter");
+    counter_name = ngx_array_push(&cf_cnt_args);
+    if (counter_name == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    cf_cnt = *cf;
+    cf_cnt.args = &cf_cnt_args;
+
+    scf = ngx_http_conf_get_module_srv_conf(cf,
+                                            ngx_http_custom_counters_module);
+
+    /* the metrics are declared as no-op counters, they get updated directly
+     * in the shared memory */
+
+    for (i = 0; i < ngx_http_cnt_self_nmetrics; i++) {
+        *counter_name = ngx_http_cnt_self_metrics_names[i];
+        if (ngx_http_cnt_counter_impl(&cf_cnt, NULL, conf, 0)) {
+            return NGX_CONF_ERROR;
+        }
+
+        /* the counter implementation has stripped the leading dollar */
+
+        v_idx = ngx_http_get_variable_index(cf, counter_name);
+        if (v_idx == NGX_ERROR) {
+            return NGX_CONF_ERROR;
+        }
+
+        cnt_sets = mcf->cnt_sets.elts;
+        cnt_set = &cnt_sets[scf->cnt_set];
+
+        sm->idx[i] = ngx_http_cnt_index_lookup(cnt_set->vars_index, v_idx);
+        if (sm->idx[i] == NGX_ERROR) {
+            return NGX_CONF_ERROR;
+        }
+
+        sm->zone = cnt_set->zone;
+    }
+
+    sm->sample = sample;
+    mcf->self_metrics = sm;
+
+    return NGX_CONF_OK;
+}
+
+
+char *
+ngx_http_cnt_hot_slots(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_cnt_main_conf_t             *mcf = conf;
+
+    ngx_uint_t                            i;
+    ngx_int_t                             val;
+    ngx_str_t                            *value;
+    ngx_http_cnt_hot_slots_t             *hs;
+
+    if (mcf->hot_slots != NULL) {
+        return "is duplicate";
+    }
+
+    hs = ngx_pcalloc(cf->pool, sizeof(ngx_http_cnt_hot_slots_t));
+    if (hs == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    hs->sample = 100;
+    hs->top = 10;
+
+    value = cf->args->elts;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+        if (value[i].len > 7 && ngx_strncmp(value[i].data, "sample=", 7) == 0)
+        {
+            val = ngx_atoi(value[i].data + 7, value[i].len - 7);
+            if (val == NGX_ERROR || val == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid sample rate \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+            hs->sample = val;
+        } else if (value[i].len > 4
+                   && ngx_strncmp(value[i].data, "top=", 4) == 0)
+        {
+            val = ngx_atoi(value[i].data + 4, value[i].len - 4);
+            if (val == NGX_ERROR || val == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid number of slots \"%V\"",
+                                   &value[i]);
+                return NGX_CONF_ERROR;
+            }
+            hs->top = val;
+        } else {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid parameter \"%V\"", &value[i]);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    mcf->hot_slots = hs;
+
+    return NGX_CONF_OK;
+}
+
+
+ngx_int_t
+ngx_http_cnt_init_hot_slots(ngx_conf_t *cf, ngx_http_cnt_main_conf_t *mcf)
+{
+    ngx_uint_t                            i, pages;
+    ngx_http_cnt_hot_slots_t             *hs = mcf->hot_slots;
+    ngx_http_cnt_set_t                   *cnt_sets;
+    size_t                                size;
+
+    if (hs == NULL) {
+        return NGX_OK;
+    }
+
+    if (mcf->cnt_sets.nelts == 0) {
+        mcf->hot_slots = NULL;
+        return NGX_OK;
+    }
+
+    hs->offsets = ngx_palloc(cf->pool,
+                             mcf->cnt_sets.nelts * sizeof(ngx_uint_t));
+    if (hs->offsets == NULL) {
+        return NGX_ERROR;
+    }
+
+    cnt_sets = mcf->cnt_sets.elts;
+
+    hs->nsets = mcf->cnt_sets.nelts;
+
+    for (i = 0; i < hs->nsets; i++) {
+        hs->offsets[i] = hs->nslots;
+        hs->nslots += cnt_sets[i].vars.nelts;
+    }
+
+    /* the slots of the previous cycle stay in the zone while its workers
+     * shut down, so two generations plus the slab pool header must fit */
+
+    pages = 2 * (ngx_align(ngx_http_cnt_hot_slots_block_size(hs),
+                           ngx_pagesize) / ngx_pagesize);
+    size = (pages + 1) * ngx_pagesize
+            + ngx_align(pages * sizeof(ngx_slab_page_t), ngx_pagesize);
+
+    hs->zone = ngx_shared_memory_add(cf, &ngx_http_cnt_hot_slots_zone_name,
+                                     ngx_max(size, 8 * ngx_pagesize),
+                                     &ngx_http_custom_counters_module);
+    if (hs->zone == NULL) {
+        return NGX_ERROR;
+    }
+
+    hs->zone->init = ngx_http_cnt_hot_slots_shm_init;
+    hs->zone->data = hs;
+
+    return NGX_OK;
+}
+
+
+static size_t
+ngx_http_cnt_hot_slots_block_size(ngx_http_cnt_hot_slots_t *hs)
+{
+    return sizeof(ngx_http_cnt_hot_slots_block_t)
+            + hs->nsets * sizeof(ngx_uint_t)
+            + hs->nslots * sizeof(ngx_http_cnt_hot_slot_t);
+}
+
+
+static ngx_int_t
+ngx_http_cnt_hot_slots_shm_init(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_cnt_hot_slots_t             *hs = shm_zone->data;
+    ngx_http_cnt_hot_slots_block_t       *block, *oblock = data;
+
+    ngx_slab_pool_t                      *shpool;
+
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        shm_zone->data = shpool->data;
+        return NGX_OK;
+    }
+
+    /* workers of the old cycle keep sampling into the old generation at
+     * their own offsets, it is reused when the layout of the slots did not
+     * change, otherwise it is freed only on the next reload */
+
+    if (oblock != NULL && oblock->nsets == hs->nsets
+        && oblock->nslots == hs->nslots
+        && ngx_memcmp(ngx_http_cnt_hot_slots_offsets(oblock), hs->offsets,
+                      hs->nsets * sizeof(ngx_uint_t)) == 0)
+    {
+        shm_zone->data = oblock;
+        return NGX_OK;
+    }
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    if (oblock != NULL && oblock->prev != NULL) {
+        ngx_slab_free_locked(shpool, oblock->prev);
+        oblock->prev = NULL;
+    }
+
+    block = ngx_slab_calloc_locked(shpool,
+                                   ngx_http_cnt_hot_slots_block_size(hs));
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    if (block == NULL) {
+        ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                      "not enough shared memory for custom counters "
+                      "hot slots");
+        return NGX_ERROR;
+    }
+
+    block->prev = oblock;
+    block->nsets = hs->nsets;
+    block->nslots = hs->nslots;
+    ngx_memcpy(ngx_http_cnt_hot_slots_offsets(block), hs->offsets,
+               hs->nsets * sizeof(ngx_uint_t));
+
+    shpool->data = block;
+    shm_zone->data = block;
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_http_cnt_hot_slots_report(ngx_http_request_t *r,
+                              ngx_http_variable_value_t *v, uintptr_t data)
+{
+    ngx_uint_t                            i, j, n, n_cnt_sets = 0;
+    ngx_http_cnt_main_conf_t             *mcf;
+    ngx_http_cnt_hot_slots_t             *hs;
+    ngx_http_cnt_set_t                   *cnt_sets;
+    ngx_http_cnt_set_var_data_t          *vars;
+    ngx_http_cnt_hot_slot_t              *slots;
+    ngx_http_cnt_hot_slot_report_t       *report;
+    size_t                                len = 2, max_nslots = 0;
+    u_char                               *buf, *last;
+
+    mcf = ngx_http_get_module_main_conf(r, ngx_http_custom_counters_module);
+    hs = mcf->hot_slots;
+
+    if (hs == NULL) {
+        ngx_str_set(v, "{}");
+        goto done;
+    }
+
+    cnt_sets = mcf->cnt_sets.elts;
+
+    for (i = 0; i < mcf->cnt_sets.nelts; i++) {
+        len += cnt_sets[i].name.len + 6;
+        vars = cnt_sets[i].vars.elts;
+        for (j = 0; j < cnt_sets[i].vars.nelts; j++) {
+            len += vars[j].name.len + 4 * NGX_ATOMIC_T_LEN
+                    + sizeof("\"\":{\"samples\":,\"ns\":,\"avg_ns\":,"
+                             "\"max_ns\":},") - 1;
+        }
+        max_nslots = ngx_max(max_nslots, cnt_sets[i].vars.nelts);
+    }
+
+    buf = ngx_pnalloc(r->pool, len);
+    if (buf == NULL) {
+        return NGX_ERROR;
+    }
+
+    report = ngx_palloc(r->pool,
+                        max_nslots * sizeof(ngx_http_cnt_hot_slot_report_t));
+    if (report == NULL && max_nslots > 0) {
+        return NGX_ERROR;
+    }
+
+    slots = ngx_http_cnt_hot_slots_data(hs->zone->data);
+
+    last = ngx_sprintf(buf, "{");
+
+    for (i = 0; i < mcf->cnt_sets.nelts; i++) {
+        vars = cnt_sets[i].vars.elts;
+        n = 0;
+
+        for (j = 0; j < cnt_sets[i].vars.nelts; j++) {
+            report[n].slot = &slots[hs->offsets[i] + j];
+            if (report[n].slot->samples == 0) {
+                continue;
+            }
+            report[n].name = &vars[j].name;
+            report[n].samples = report[n].slot->samples;
+            report[n].ns = report[n].slot->ns;
+            n++;
+        }
+
+        if (n == 0) {
+            continue;
+        }
+
+        /* the hottest slots are those with the most time spent in them */
+
+        ngx_sort(report, n, sizeof(ngx_http_cnt_hot_slot_report_t),
+                 ngx_http_cnt_hot_slot_cmp);
+
+        if (n_cnt_sets++ > 0) {
+            *last++ = ',';
+        }
+
+        last = ngx_sprintf(last, "\"%V\":{", &cnt_sets[i].name);
+
+        for (j = 0; j < ngx_min(n, hs->top); j++) {
+            last = ngx_sprintf(last, "\"%V\":{\"samples\":%uA,\"ns\":%uA,"
+                               "\"avg_ns\":%uA,\"max_ns\":%uA},",
+                               report[j].name, report[j].samples,
+                               report[j].ns,
+                               report[j].ns / report[j].samples,
+                               report[j].slot->max_ns);
+        }
+
+        *(last - 1) = '}';
+    }
+
+    last = ngx_sprintf(last, "}");
+
+    v->len = last - buf;
+    v->data = buf;
+
+done:
+
+    v->valid        = 1;
+    v->no_cacheable = 0;
+    v->not_found    = 0;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_cnt_hot_slot_cmp(const void *one, const void *two)
+{
+    const ngx_http_cnt_hot_slot_report_t  *first = one, *second = two;
+
+    if (first->ns == second->ns) {
+        return 0;
+    }
+
+    return first->ns < second->ns ? 1 : -1;
+}
+
+
+ngx_int_t
+ngx_http_cnt_shm_stats(ngx_http_request_t *r, ngx_http_variable_value_t *v,
+                       uintptr_t data)
+{
+    ngx_uint_t                            i, j, n, n_cnt_sets = 0;
+    ngx_uint_t                            pages, pfree, live, slab_pages;
+    ngx_uint_t                            chunks, mapped;
+    ngx_http_cnt_main_conf_t             *mcf;
+    ngx_http_cnt_set_t                   *cnt_sets;
+    ngx_shm_zone_t                       *zone;
+    ngx_slab_pool_t                      *shpool;
+    ngx_slab_stat_t                      *stats;
+    ngx_http_cnt_shm_block_t             *block;
+    size_t                                len = 2, size;
+    u_char                               *buf, *last;
+
+    mcf = ngx_http_get_module_main_conf(r, ngx_http_custom_counters_module);
+    cnt_sets = mcf->cnt_sets.elts;
+
+    /* there are not more size classes than the page shift */
+
+    stats = ngx_palloc(r->pool, ngx_pagesize_shift * sizeof(ngx_slab_stat_t));
+    if (stats == NULL) {
+        return NGX_ERROR;
+    }
+
+    for (i = 0; i < mcf->cnt_sets.nelts; i++) {
+        len += cnt_sets[i].name.len + cnt_sets[i].zone->shm.name.len
+                + 12 * NGX_ATOMIC_T_LEN
+                + sizeof("\"\":{\"zone\":\"\",\"size\":,\"pages\":,"
+                         "\"free_pages\":,\"live\":{\"bytes\":,\"pages\":,"
+                         "\"nelts\":,\"generation\":,\"mapped\":},"
+                         "\"garbage\":{\"pages\":,\"chunks\":},"
+                         "\"remap\":{\"kept\":,\"added\":,\"dropped\":},"
+                         "\"slabs\":[]},") - 1
+                + ngx_pagesize_shift
+                    * (5 * NGX_ATOMIC_T_LEN
+                       + sizeof("{\"size\":,\"total\":,\"used\":,\"reqs\":,"
+                                "\"fails\":},") - 1);
+    }
+
+    buf = ngx_pnalloc(r->pool, len);
+    if (buf == NULL) {
+        return NGX_ERROR;
+    }
+
+    last = ngx_sprintf(buf, "{");
+
+    for (i = 0; i < mcf->cnt_sets.nelts; i++) {
+        zone = cnt_sets[i].zone;
+        shpool = (ngx_slab_pool_t *) zone->shm.addr;
+        block = zone->data;
+
+        /* only the pool totals are copied under the lock, the cost does not
+         * depend on the number of allocations in the zone */
+
+        ngx_shmtx_lock(&shpool->mutex);
+
+        pages = shpool->last - shpool->pages;
+        pfree = shpool->pfree;
+        n = ngx_min(ngx_pagesize_shift - shpool->min_shift,
+                    ngx_pagesize_shift);
+        ngx_memcpy(stats, shpool->stats, n * sizeof(ngx_slab_stat_t));
+
+        ngx_shmtx_unlock(&shpool->mutex);
+
+        /* a block of a mapped persistent storage lives outside the zone */
+
+        mapped = (u_char *) block < zone->shm.addr
+                 || (u_char *) block >= zone->shm.addr + zone->shm.size;
+
+        size = block->size;
+        live = 0;
+        chunks = 0;
+        slab_pages = 0;
+
+        for (j = 0; j < n; j++) {
+            chunks += stats[j].used;
+            slab_pages += (stats[j].total << (j + shpool->min_shift))
+                          / ngx_pagesize;
+        }
+
+        if (!mapped) {
+            if (size > ngx_pagesize / 2) {
+                live = ngx_align(size, ngx_pagesize) / ngx_pagesize;
+            } else if (chunks > 0) {
+                chunks--;
+            }
+        }
+
+        if (n_cnt_sets++ > 0) {
+            *last++ = ',';
+        }
+
+        last = ngx_sprintf(last, "\"%V\":{\"zone\":\"%V\",\"size\":%uz,"
+                           "\"pages\":%ui,\"free_pages\":%ui,"
+                           "\"live\":{\"bytes\":%uz,\"pages\":%ui,"
+                           "\"nelts\":%A,\"generation\":%A,\"mapped\":%ui},"
+                           "\"garbage\":{\"pages\":%ui,\"chunks\":%ui},"
+                           "\"remap\":{\"kept\":%A,\"added\":%A,"
+                           "\"dropped\":%A},\"slabs\":[",
+                           &cnt_sets[i].name, &zone->shm.name, zone->shm.size,
+                           pages, pfree, size, live, block->nelts,
+                           block->generation, mapped,
+                           pages - pfree > live + slab_pages ?
+                               pages - pfree - live - slab_pages : 0,
+                           chunks, block->remap_kept, block->remap_added,
+                           block->remap_dropped);
+
+        for (j = 0; j < n; j++) {
+            if (stats[j].total == 0 && stats[j].reqs == 0) {
+                continue;
+            }
+
+            last = ngx_sprintf(last, "{\"size\":%ui,\"total\":%ui,"
+                               "\"used\":%ui,\"reqs\":%ui,\"fails\":%ui},",
+                               (ngx_uint_t) 1 << (j + shpool->min_shift),
+                               stats[j].total, stats[j].used, stats[j].reqs,
+                               stats[j].fails);
+        }
+
+        if (*(last - 1) == ',') {
+            last--;
+        }
+
+        last = ngx_sprintf(last, "]}");
+    }
+
+    last = ngx_sprintf(last, "}");
+
+    v->len          = last - buf;
+    v->data         = buf;
+    v->valid        = 1;
+    v->no_cacheable = 0;
+    v->not_found    = 0;
+
+    return NGX_OK;
+}
@@ -0,0 +1,219 @@
+/*
+ * =============================================================================
+ *
+ *       Filename:  ngx_http_custom_counters_metrics.h
+ *
+ *    Description:  self-instrumentation of the module
+ *
+ *        Version:  4.0
+ *        Created:  18.10.2026 19:12:37
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Alexey Radkov (), 
+ *        Company:  
+ *
+ * =============================================================================
+ */
+
+#ifndef NGX_HTTP_CUSTOM_COUNTERS_METRICS_H
+#define NGX_HTTP_CUSTOM_COUNTERS_METRICS_H
+
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+#include "ngx_http_custom_counters_module.h"
+
+
+typedef enum {
+    ngx_http_cnt_self_update_early_samples,
+    ngx_http_cnt_self_update_early_ns,
+    ngx_http_cnt_self_update_log_samples,
+    ngx_http_cnt_self_update_log_ns,
+    ngx_http_cnt_self_collection_samples,
+    ngx_http_cnt_self_collection_ns,
+    ngx_http_cnt_self_collection_bytes,
+    ngx_http_cnt_self_persistent_writes,
+    ngx_http_cnt_self_persistent_write_ns,
+    ngx_http_cnt_self_persistent_write_bytes,
+    ngx_http_cnt_self_rt_var_errors,
+    ngx_http_cnt_self_nmetrics
+} ngx_http_cnt_self_metric_e;
+
+
+/* the metrics are normal counters of the counter set of the server where
+ * they were declared; the tick is not shared, every worker samples its own
+ * requests */
+
+struct ngx_http_cnt_self_metrics_s {
+    ngx_shm_zone_t             *zone;
+    ngx_uint_t                  sample;
+    ngx_uint_t                  tick;
+    ngx_int_t                   idx[ngx_http_cnt_self_nmetrics];
+};
+
+
+/* contention of counters: sampled updates time every operation on a slot
+ * and accumulate the results in a dedicated shared memory zone, the slots
+ * of every counter set start at its offset there */
+
+typedef struct {
+    ngx_atomic_t                samples;
+    ngx_atomic_t                ns;
+    ngx_atomic_t                max_ns;
+} ngx_http_cnt_hot_slot_t;
+
+
+/* a generation of slots in the zone: the offsets of the counter sets follow
+ * the header, and the slots follow the offsets; the previous generation
+ * stays in the zone for workers of the old cycle until the next reload */
+
+typedef struct ngx_http_cnt_hot_slots_block_s  ngx_http_cnt_hot_slots_block_t;
+
+struct ngx_http_cnt_hot_slots_block_s {
+    ngx_http_cnt_hot_slots_block_t  *prev;
+    ngx_uint_t                       nsets;
+    ngx_uint_t                       nslots;
+};
+
+
+struct ngx_http_cnt_hot_slots_s {
+    ngx_shm_zone_t             *zone;
+    ngx_uint_t                 *offsets;
+    ngx_uint_t                  nsets;
+    ngx_uint_t                  nslots;
+    ngx_uint_t                  sample;
+    ngx_uint_t                  tick;
+    ngx_uint_t                  top;
+};
+
+
+char *ngx_http_cnt_self_metrics(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+char *ngx_http_cnt_hot_slots(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+ngx_int_t ngx_http_cnt_init_hot_slots(ngx_conf_t *cf,
+    ngx_http_cnt_main_conf_t *mcf);
+ngx_int_t ngx_http_cnt_hot_slots_report(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data);
+ngx_int_t ngx_http_cnt_shm_stats(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data);
+
+
+static ngx_inline ngx_uint_t
+ngx_http_cnt_self_metrics_sampled(ngx_http_cnt_self_metrics_t *sm)
+{
+    if (sm == NULL || ++sm->tick < sm->sample) {
+        return 0;
+    }
+
+    sm->tick = 0;
+
+    return 1;
+}
+
+
+/* a monotonic clock in nanoseconds, the cached time of Nginx has only
+ * millisecond resolution which is too coarse for the measured operations */
+
+static ngx_inline ngx_atomic_uint_t
+ngx_http_cnt_self_metrics_now(void)
+{
+#if (NGX_HAVE_CLOCK_MONOTONIC)
+    struct timespec             ts;
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (ngx_atomic_uint_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+#else
+    struct timeval              tv;
+
+    ngx_gettimeofday(&tv);
+
+    return (ngx_atomic_uint_t) tv.tv_sec * 1000000000 + tv.tv_usec * 1000;
+#endif
+}
+
+
+static ngx_inline void
+ngx_http_cnt_self_metrics_add(ngx_http_cnt_self_metrics_t *sm,
+    ngx_http_cnt_self_metric_e metric, ngx_atomic_int_t value)
+{
+    ngx_http_cnt_shm_block_t   *block = sm->zone->data;
+
+    (void) ngx_atomic_fetch_add(
+                    &ngx_http_cnt_shm_values(block)[sm->idx[metric]], value);
+    ngx_http_cnt_shm_block_touch(block);
+}
+
+
+/* adds a sample of an operation: its count, duration since start and,
+ * if the operation has a size metric, the size */
+
+static ngx_inline void
+ngx_http_cnt_self_metrics_sample(ngx_http_cnt_self_metrics_t *sm,
+    ngx_http_cnt_self_metric_e metric, ngx_atomic_uint_t start, size_t size)
+{
+    ngx_http_cnt_self_metrics_add(sm, metric, 1);
+    ngx_http_cnt_self_metrics_add(sm, metric + 1,
+                            ngx_http_cnt_self_metrics_now() - start);
+
+    if (metric == ngx_http_cnt_self_collection_samples
+        || metric == ngx_http_cnt_self_persistent_writes)
+    {
+        ngx_http_cnt_self_metrics_add(sm, metric + 2, size);
+    }
+}
+
+
+static ngx_inline ngx_uint_t *
+ngx_http_cnt_hot_slots_offsets(ngx_http_cnt_hot_slots_block_t *block)
+{
+    return (ngx_uint_t *) (block + 1);
+}
+
+
+static ngx_inline ngx_http_cnt_hot_slot_t *
+ngx_http_cnt_hot_slots_data(ngx_http_cnt_hot_slots_block_t *block)
+{
+    return (ngx_http_cnt_hot_slot_t *)
+            (ngx_http_cnt_hot_slots_offsets(block) + block->nsets);
+}
+
+
+static ngx_inline ngx_uint_t
+ngx_http_cnt_hot_slots_sampled(ngx_http_cnt_hot_slots_t *hs)
+{
+    if (hs == NULL || ++hs->tick < hs->sample) {
+        return 0;
+    }
+
+    hs->tick = 0;
+
+    return 1;
+}
+
+
+static ngx_inline void
+ngx_http_cnt_hot_slot_add(ngx_http_cnt_hot_slots_t *hs, ngx_uint_t cnt_set,
+    ngx_uint_t slot, ngx_atomic_uint_t ns)
+{
+    ngx_http_cnt_hot_slot_t    *hot;
+
+    /* workers of the old cycle keep using the generation of their zone */
+
+    hot = ngx_http_cnt_hot_slots_data(hs->zone->data)
+            + hs->offsets[cnt_set] + slot;
+
+    (void) ngx_atomic_fetch_add(&hot->samples, 1);
+    (void) ngx_atomic_fetch_add(&hot->ns, ns);
+
+    /* a concurrent update may lose a maximum, this is acceptable for
+     * statistics */
+
+    if (ns > hot->max_ns) {
+        hot->max_ns = ns;
+    }
+}
+
+#endif /* NGX_HTTP_CUSTOM_COUNTERS_METRICS_H */
+
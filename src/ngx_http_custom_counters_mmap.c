@@ -0,0 +1,462 @@
+/*
+ * =============================================================================
+ *
+ *       Filename:  ngx_http_custom_counters_mmap.c
+ *
+ *    Description:  persistent counters mapped into memory
+ *
+ *        Version:  4.0
+ *        Created:  18.10.2026 17:43:27
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Alexey Radkov (), 
+ *        Company:  
+ *
+ * =============================================================================
+ */
+
+#ifdef NGX_HTTP_CUSTOM_COUNTERS_PERSISTENCY
+
+#include "ngx_http_custom_counters_module.h"
+#include "ngx_http_custom_counters_persistency.h"
+#include "ngx_http_custom_counters_mmap.h"
+
+
+/* the mapped storage is a binary storage whose blocks are used as the blocks
+ * of the counter sets instead of the blocks in shared memory zones, the hash
+ * of the layout in its header tells whether the blocks in an existing storage
+ * can be used as they are; a storage with a new layout is built in a
+ * temporary file which replaces the storage only when the new cycle has been
+ * initialized, so that a failed reload leaves the storage of the running
+ * cycle intact */
+
+typedef struct {
+    ngx_event_t                    event;
+    ngx_http_cnt_main_conf_t      *mcf;
+    ngx_err_t                      err;
+#if (NGX_THREADS)
+    ngx_thread_task_t             *task;
+#endif
+} ngx_http_cnt_msync_t;
+
+
+static ngx_uint_t ngx_http_cnt_persistent_mmap_reused(ngx_conf_t *cf,
+    ngx_http_cnt_main_conf_t *mcf, uint64_t layout);
+static void ngx_http_cnt_unmap_persistent_mmap(void *data);
+static void ngx_http_cnt_msync_handler(ngx_event_t *ev);
+static ngx_err_t ngx_http_cnt_msync(ngx_http_cnt_main_conf_t *mcf);
+#if (NGX_THREADS)
+static void ngx_http_cnt_msync_thread_handler(void *data, ngx_log_t *log);
+static void ngx_http_cnt_msync_event_handler(ngx_event_t *ev);
+#endif
+
+
+ngx_int_t
+ngx_http_cnt_init_persistent_mmap(ngx_conf_t *cf,
+                                  ngx_http_cnt_main_conf_t *mcf)
+{
+    ngx_uint_t                     i, fresh;
+    ngx_http_cnt_set_t            *cnt_set;
+    ngx_http_cnt_set_var_data_t   *sets;
+    ngx_http_cnt_binary_header_t  *hdr;
+    ngx_http_cnt_write_ctx_t       ctx;
+    ngx_pool_cleanup_t            *cln;
+    ngx_fd_t                       fd;
+    uint64_t                      *offsets;
+    u_char                        *buf, *addr, *tmp;
+    size_t                         size;
+
+    if (mcf->persistent_format != NGX_HTTP_CNT_FORMAT_MMAP) {
+        return NGX_OK;
+    }
+
+    /* do not replace the storage when testing the configuration, the counters
+     * get loaded into shared memory as usual */
+
+    if (ngx_test_config) {
+        return NGX_OK;
+    }
+
+    size = mcf->persistent_buf_len;
+
+    buf = ngx_pcalloc(cf->temp_pool, size);
+    if (buf == NULL) {
+        return NGX_ERROR;
+    }
+
+    (void) ngx_http_cnt_init_binary(mcf, buf);
+
+    hdr = (ngx_http_cnt_binary_header_t *) buf;
+    hdr->layout = ngx_crc32_long(buf, size);
+
+    fresh = !ngx_http_cnt_persistent_mmap_reused(cf, mcf, hdr->layout);
+
+    /* the cleanup also removes the temporary file if the cycle fails */
+
+    cln = ngx_pool_cleanup_add(cf->cycle->pool, 0);
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    cln->handler = ngx_http_cnt_unmap_persistent_mmap;
+    cln->data = mcf;
+
+    if (fresh) {
+        /* build a storage of the new layout in the temporary file, the
+         * counters get loaded into it in the shared memory init function */
+
+        tmp = ngx_pnalloc(cf->cycle->pool,
+                          NGX_HTTP_CNT_TMP_NAME_LEN(&mcf->persistent_storage));
+        if (tmp == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_http_cnt_write_ctx_init(&ctx, mcf, &mcf->persistent_storage, tmp);
+
+        ctx.buf = buf;
+        ctx.len = size;
+        ctx.keep_open = 1;
+        ctx.keep_tmp = 1;
+
+        /* shared memory zones are not initialized yet */
+        ctx.self_metrics = NULL;
+
+        ngx_http_cnt_write_file(&ctx);
+
+        if (ctx.failed != NULL) {
+            ngx_conf_log_error(NGX_LOG_ERR, cf, ctx.err, "%s \"%s\" failed",
+                               ctx.failed, ctx.failed_name);
+
+            if (ctx.fd != NGX_INVALID_FILE
+                && ngx_close_file(ctx.fd) == NGX_FILE_ERROR)
+            {
+                ngx_conf_log_error(NGX_LOG_ERR, cf, ngx_errno,
+                                   ngx_close_file_n " \"%V\" failed",
+                                   &mcf->persistent_storage);
+            }
+
+            return NGX_ERROR;
+        }
+
+        mcf->persistent_mmap_tmp.len = ngx_strlen(tmp);
+        mcf->persistent_mmap_tmp.data = tmp;
+
+        fd = ctx.fd;
+
+    } else {
+        fd = ngx_open_file(mcf->persistent_storage.data, NGX_FILE_RDWR,
+                           NGX_FILE_OPEN, 0);
+
+        if (fd == NGX_INVALID_FILE) {
+            ngx_conf_log_error(NGX_LOG_ERR, cf, ngx_errno,
+                               ngx_open_file_n " \"%V\" failed",
+                               &mcf->persistent_storage);
+            return NGX_ERROR;
+        }
+    }
+
+    /* the mapping is inherited by the worker processes */
+
+    addr = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+
+    if (addr == MAP_FAILED) {
+        ngx_conf_log_error(NGX_LOG_ERR, cf, ngx_errno,
+                           "mmap(\"%V\") failed", &mcf->persistent_storage);
+        addr = NULL;
+    }
+
+    if (ngx_close_file(fd) == NGX_FILE_ERROR) {
+        ngx_conf_log_error(NGX_LOG_ERR, cf, ngx_errno,
+                           ngx_close_file_n " \"%V\" failed",
+                           &mcf->persistent_storage);
+    }
+
+    if (addr == NULL) {
+        return NGX_ERROR;
+    }
+
+    mcf->persistent_mmap.len = size;
+    mcf->persistent_mmap.data = addr;
+
+    offsets = (uint64_t *) (addr + hdr->offsets);
+
+    sets = mcf->persistent_sets.elts;
+
+    for (i = 0; i < mcf->persistent_sets.nelts; i++) {
+        cnt_set = &((ngx_http_cnt_set_t *) mcf->cnt_sets.elts)[sets[i].self];
+        cnt_set->persistent_block = (ngx_http_cnt_shm_block_t *)
+                (addr + offsets[sets[i].idx]);
+        cnt_set->persistent_fresh = fresh;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_uint_t
+ngx_http_cnt_persistent_mmap_reused(ngx_conf_t *cf,
+                                    ngx_http_cnt_main_conf_t *mcf,
+                                    uint64_t layout)
+{
+    ngx_http_cnt_main_conf_t      *omcf;
+    ngx_http_cnt_binary_header_t  *hdr;
+
+    if (!mcf->persistent_binary
+        || mcf->persistent_collection.len != mcf->persistent_buf_len)
+    {
+        return 0;
+    }
+
+    hdr = (ngx_http_cnt_binary_header_t *) mcf->persistent_collection.data;
+
+    /* storages written by Nginx, including the backup storage, have no layout
+     * hash */
+
+    if (hdr->layout != layout) {
+        return 0;
+    }
+
+    if (ngx_is_init_cycle(cf->cycle->old_cycle)) {
+        return 1;
+    }
+
+    /* on reload, the counters in the storage are up to date only if the
+     * previous cycle mapped the same storage */
+
+    omcf = ngx_http_cycle_get_module_main_conf(cf->cycle->old_cycle,
+                                               ngx_http_custom_counters_module);
+
+    return omcf != NULL && omcf->persistent_mmap.len > 0
+           && omcf->persistent_storage.len == mcf->persistent_storage.len
+           && ngx_strncmp(omcf->persistent_storage.data,
+                          mcf->persistent_storage.data,
+                          mcf->persistent_storage.len) == 0;
+}
+
+
+ngx_int_t
+ngx_http_cnt_commit_persistent_mmap(ngx_cycle_t *cycle)
+{
+    ngx_http_cnt_main_conf_t      *mcf;
+    ngx_http_cnt_write_ctx_t       ctx;
+
+    mcf = ngx_http_cycle_get_module_main_conf(cycle,
+                                              ngx_http_custom_counters_module);
+
+    if (mcf == NULL || mcf->persistent_mmap_tmp.len == 0) {
+        return NGX_OK;
+    }
+
+    /* the cycle has been initialized and the counters of the previous cycle
+     * have been remapped into the new storage, it may replace the old one */
+
+    if (ngx_rename_file(mcf->persistent_mmap_tmp.data,
+                        mcf->persistent_storage.data)
+        == NGX_FILE_ERROR)
+    {
+        /* the new storage is still used, and it gets removed along with
+         * the cycle */
+
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                      ngx_rename_file_n " \"%V\" to \"%V\" failed",
+                      &mcf->persistent_mmap_tmp, &mcf->persistent_storage);
+        return NGX_OK;
+    }
+
+    ngx_http_cnt_write_ctx_init(&ctx, mcf, &mcf->persistent_storage,
+                                mcf->persistent_mmap_tmp.data);
+
+    ngx_str_null(&mcf->persistent_mmap_tmp);
+
+    ngx_http_cnt_sync_dir(&ctx);
+
+    if (ctx.failed != NULL) {
+        ngx_log_error(NGX_LOG_ERR, cycle->log, ctx.err, "%s \"%s\" failed",
+                      ctx.failed, ctx.failed_name);
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_cnt_unmap_persistent_mmap(void *data)
+{
+    ngx_http_cnt_main_conf_t      *mcf = data;
+
+    if (mcf->persistent_mmap.len > 0
+        && munmap(mcf->persistent_mmap.data, mcf->persistent_mmap.len) == -1)
+    {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      "munmap(%p, %uz) failed", mcf->persistent_mmap.data,
+                      mcf->persistent_mmap.len);
+    }
+
+    /* the cycle failed before the storage with the new layout replaced the
+     * storage of the running cycle */
+
+    if (mcf->persistent_mmap_tmp.len > 0
+        && ngx_delete_file(mcf->persistent_mmap_tmp.data) == NGX_FILE_ERROR)
+    {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      ngx_delete_file_n " \"%V\" failed",
+                      &mcf->persistent_mmap_tmp);
+    }
+}
+
+
+ngx_int_t
+ngx_http_cnt_init_persistent_msync(ngx_cycle_t *cycle)
+{
+    ngx_http_cnt_main_conf_t      *mcf;
+    ngx_http_cnt_msync_t          *ms;
+
+    mcf = ngx_http_cycle_get_module_main_conf(cycle,
+                                              ngx_http_custom_counters_module);
+
+    if (mcf == NULL || mcf->persistent_mmap.len == 0
+        || mcf->persistent_collection_check == 0)
+    {
+        return NGX_OK;
+    }
+
+    /* one process is enough to sync the whole mapping */
+
+    if (ngx_process != NGX_PROCESS_SINGLE
+        && (ngx_process != NGX_PROCESS_WORKER || ngx_worker != 0))
+    {
+        return NGX_OK;
+    }
+
+    ms = ngx_pcalloc(cycle->pool, sizeof(ngx_http_cnt_msync_t));
+    if (ms == NULL) {
+        return NGX_ERROR;
+    }
+
+#if (NGX_THREADS)
+    if (mcf->persistent_thread_pool != NULL) {
+        ms->task = ngx_thread_task_alloc(cycle->pool, 0);
+        if (ms->task == NULL) {
+            return NGX_ERROR;
+        }
+
+        ms->task->ctx = ms;
+        ms->task->handler = ngx_http_cnt_msync_thread_handler;
+        ms->task->event.handler = ngx_http_cnt_msync_event_handler;
+        ms->task->event.data = ms;
+        ms->task->event.log = cycle->log;
+    }
+#endif
+
+    ms->mcf = mcf;
+
+    ms->event.handler = ngx_http_cnt_msync_handler;
+    ms->event.data = ms;
+    ms->event.log = cycle->log;
+    ms->event.cancelable = 1;
+
+    ngx_add_timer(&ms->event, mcf->persistent_collection_check * 1000);
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_http_cnt_sync_persistent_mmap(ngx_http_cnt_main_conf_t *mcf,
+                                  ngx_log_t *log)
+{
+    ngx_err_t                      err;
+
+    err = ngx_http_cnt_msync(mcf);
+
+    if (err != 0) {
+        ngx_log_error(NGX_LOG_ERR, log, err, "msync(\"%V\") failed",
+                      &mcf->persistent_storage);
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_cnt_msync_handler(ngx_event_t *ev)
+{
+    ngx_http_cnt_msync_t          *ms = ev->data;
+
+#if (NGX_THREADS)
+    /* with MS_SYNC, msync() waits until all dirty pages of the mapping have
+     * been written, this must not block the event loop */
+
+    if (ms->task != NULL) {
+        if (ms->task->event.active) {
+            ngx_log_error(NGX_LOG_INFO, ev->log, 0,
+                          "previous sync of persistent counters has not "
+                          "finished yet, skipping this one");
+
+        } else if (ngx_thread_task_post(ms->mcf->persistent_thread_pool,
+                                        ms->task)
+                   != NGX_OK)
+        {
+            ngx_log_error(NGX_LOG_ERR, ev->log, 0,
+                          "failed to sync persistent counters");
+        }
+
+        ngx_add_timer(ev, ms->mcf->persistent_collection_check * 1000);
+        return;
+    }
+#endif
+
+    (void) ngx_http_cnt_sync_persistent_mmap(ms->mcf, ev->log);
+
+    ngx_add_timer(ev, ms->mcf->persistent_collection_check * 1000);
+}
+
+
+static ngx_err_t
+ngx_http_cnt_msync(ngx_http_cnt_main_conf_t *mcf)
+{
+    int                            flags;
+
+    /* this function can be called from a thread, and so it does not log */
+
+    flags = mcf->persistent_fsync == NGX_HTTP_CNT_FSYNC_NONE ?
+            MS_ASYNC : MS_SYNC;
+
+    if (msync(mcf->persistent_mmap.data, mcf->persistent_mmap.len, flags)
+        == -1)
+    {
+        return ngx_errno;
+    }
+
+    return 0;
+}
+
+
+#if (NGX_THREADS)
+
+static void
+ngx_http_cnt_msync_thread_handler(void *data, ngx_log_t *log)
+{
+    ngx_http_cnt_msync_t          *ms = data;
+
+    ms->err = ngx_http_cnt_msync(ms->mcf);
+}
+
+
+static void
+ngx_http_cnt_msync_event_handler(ngx_event_t *ev)
+{
+    ngx_http_cnt_msync_t          *ms = ev->data;
+
+    if (ms->err != 0) {
+        ngx_log_error(NGX_LOG_ERR, ev->log, ms->err, "msync(\"%V\") failed",
+                      &ms->mcf->persistent_storage);
+    }
+}
+
+#endif
+
+#endif
+
@@ -0,0 +1,40 @@
+/*
+ * =============================================================================
+ *
+ *       Filename:  ngx_http_custom_counters_mmap.h
+ *
+ *    Description:  persistent counters mapped into memory
+ *
+ *        Version:  4.0
+ *        Created:  18.10.2026 17:41:05
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Alexey Radkov (), 
+ *        Company:  
+ *
+ * =============================================================================
+ */
+
+#ifndef NGX_HTTP_CUSTOM_COUNTERS_MMAP_H
+#define NGX_HTTP_CUSTOM_COUNTERS_MMAP_H
+
+#ifdef NGX_HTTP_CUSTOM_COUNTERS_PERSISTENCY
+
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+#include "ngx_http_custom_counters_module.h"
+
+
+ngx_int_t ngx_http_cnt_init_persistent_mmap(ngx_conf_t *cf,
+    ngx_http_cnt_main_conf_t *mcf);
+ngx_int_t ngx_http_cnt_commit_persistent_mmap(ngx_cycle_t *cycle);
+ngx_int_t ngx_http_cnt_init_persistent_msync(ngx_cycle_t *cycle);
+ngx_int_t ngx_http_cnt_sync_persistent_mmap(ngx_http_cnt_main_conf_t *mcf,
+    ngx_log_t *log);
+
+#endif
+
+#endif /* NGX_HTTP_CUSTOM_COUNTERS_MMAP_H */
+
@@ -17,12 +17,19 @@
  */
 
 #include <ngx_config.h>
+#include <math.h>
 
 #include "ngx_http_custom_counters_module.h"
 #ifdef NGX_HTTP_CUSTOM_COUNTERS_PERSISTENCY
 #include "ngx_http_custom_counters_persistency.h"
+#include "ngx_http_custom_counters_journal.h"
+#include "ngx_http_custom_counters_mmap.h"
 #endif
 #include "ngx_http_custom_counters_histogram.h"
+#include "ngx_http_custom_counters_array.h"
+#include "ngx_http_custom_counters_metrics.h"
+#include "ngx_http_custom_counters_probes.h"
+#include "ngx_http_custom_counters_shm.h"
 
 
 static time_t  ngx_http_cnt_start_time;
@@ -31,44 +38,34 @@ static time_t  ngx_http_cnt_start_time_reload;
 static const ngx_str_t  ngx_http_cnt_shm_name_prefix =
     ngx_string("custom_counters_");
 
-
-typedef enum {
-    ngx_http_cnt_op_set,
-    ngx_http_cnt_op_inc,
-    ngx_http_cnt_op_undo
-} ngx_http_cnt_op_e;
+static const ngx_int_t  ngx_http_cnt_range_max_bounds = 1024;
 
 
 typedef struct {
-    ngx_int_t                   self;
-    ngx_uint_t                  negative;
-} ngx_http_cnt_rt_var_data_t;
-
+    ngx_array_t                 cnt_data;
+    ngx_http_cnt_index_t       *cnt_data_index;
+    ngx_flag_t                  subrequests;
+} ngx_http_cnt_loc_conf_t;
 
-typedef struct {
-    ngx_http_cnt_op_e           op;
-    ngx_int_t                   self;
-    ngx_int_t                   idx;
-    ngx_int_t                   value;
-    ngx_array_t                 rt_vars;
-    ngx_uint_t                  early;
-} ngx_http_cnt_data_t;
 
+/* operations of subrequests accumulated in the main request, there is only
+ * one operation per counter: an increment or the value to set; the buckets
+ * of an open addressing hash keep positions of operations plus one */
 
 typedef struct {
-    ngx_array_t                *cnt_sets;
     ngx_uint_t                  cnt_set;
-#ifdef NGX_HTTP_CUSTOM_COUNTERS_PERSISTENCY
-    ngx_str_t                   persistent_collection;
-    jsmntok_t                  *persistent_collection_tok;
-    int                         persistent_collection_size;
-#endif
-} ngx_http_cnt_shm_data_t;
+    ngx_int_t                   idx;
+    ngx_http_cnt_op_e           op;
+    ngx_int_t                   value;
+} ngx_http_cnt_batch_op_t;
 
 
 typedef struct {
-    ngx_array_t                 cnt_data;
-} ngx_http_cnt_loc_conf_t;
+    ngx_http_cnt_main_conf_t   *mcf;
+    ngx_array_t                 ops;
+    ngx_uint_t                 *buckets;
+    ngx_uint_t                  nbuckets;
+} ngx_http_cnt_batch_t;
 
 
 static ngx_int_t ngx_http_cnt_add_vars(ngx_conf_t *cf);
@@ -81,8 +78,24 @@ static char *ngx_http_cnt_merge_srv_conf(ngx_conf_t *cf, void *parent,
 static char *ngx_http_cnt_merge_loc_conf(ngx_conf_t *cf, void *parent,
     void *child);
 static ngx_int_t ngx_http_cnt_init_module(ngx_cycle_t *cycle);
+static ngx_int_t ngx_http_cnt_init_process(ngx_cycle_t *cycle);
+static void ngx_http_cnt_exit_process(ngx_cycle_t *cycle);
 static void ngx_http_cnt_exit_master(ngx_cycle_t *cycle);
-static ngx_int_t ngx_http_cnt_shm_init(ngx_shm_zone_t *shm_zone, void *data);
+static ngx_http_cnt_shm_block_t *ngx_http_cnt_shm_find_old_block(
+    ngx_shm_zone_t *shm_zone);
+#ifdef NGX_HTTP_CUSTOM_COUNTERS_PERSISTENCY
+static void ngx_http_cnt_shm_data_persistent_init(
+    ngx_http_cnt_shm_data_t *shm_data, ngx_http_cnt_main_conf_t *mcf);
+#endif
+static ngx_int_t ngx_http_cnt_adopt_stream_sets(ngx_conf_t *cf,
+    ngx_http_cnt_main_conf_t *mcf);
+static void ngx_http_cnt_shm_remap(ngx_shm_zone_t *shm_zone,
+    ngx_http_cnt_set_t *cnt_set, ngx_http_cnt_shm_block_t *block,
+    ngx_http_cnt_shm_block_t *oblock);
+#ifdef NGX_HTTP_CUSTOM_COUNTERS_PERSISTENCY
+static void ngx_http_cnt_shm_load_persistent(ngx_shm_zone_t *shm_zone,
+    ngx_http_cnt_set_t *cnt_set, ngx_http_cnt_shm_block_t *block);
+#endif
 static ngx_int_t ngx_http_cnt_get_value(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t  data);
 static ngx_int_t ngx_http_cnt_collection(ngx_http_request_t *r,
@@ -94,6 +107,10 @@ static ngx_int_t ngx_http_cnt_uptime(ngx_http_request_t *r,
 static ngx_int_t ngx_http_cnt_stub_status(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data);
 #endif
+static ngx_int_t ngx_http_cnt_parse_signed_value(ngx_str_t *elt,
+    ngx_uint_t point, ngx_int_t *value);
+static ngx_int_t ngx_http_cnt_loc_conf_init(ngx_conf_t *cf,
+    ngx_http_cnt_loc_conf_t *lcf);
 static char *ngx_http_cnt_counter(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
 static char *ngx_http_cnt_early_counter(ngx_conf_t *cf, ngx_command_t *cmd,
@@ -101,24 +118,39 @@ static char *ngx_http_cnt_early_counter(ngx_conf_t *cf, ngx_command_t *cmd,
 static char *ngx_http_cnt_counter_set_id(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
 static char *ngx_http_cnt_merge(ngx_conf_t *cf, ngx_array_t *dst,
+    ngx_http_cnt_index_t *index,
     ngx_http_cnt_data_t *cnt_data);
 static ngx_inline ngx_int_t ngx_http_cnt_phase_handler_impl(
     ngx_http_request_t *r, ngx_uint_t early);
 static ngx_int_t ngx_http_cnt_rewrite_phase_handler(ngx_http_request_t *r);
 static ngx_int_t ngx_http_cnt_log_phase_handler(ngx_http_request_t *r);
 static ngx_int_t ngx_http_cnt_update(ngx_http_request_t *r, ngx_uint_t early);
+static ngx_http_variable_value_t *ngx_http_cnt_request_var_value(void *data,
+    ngx_uint_t index);
+static ngx_str_t *ngx_http_cnt_request_var_name(void *data, ngx_uint_t index);
+static ngx_int_t ngx_http_cnt_update_histogram(ngx_http_request_t *r,
+    ngx_http_cnt_vars_t *vars, ngx_uint_t cnt_set_idx,
+    ngx_http_cnt_set_t *cnt_set, ngx_int_t histogram, ngx_uint_t batch);
+static ngx_http_cnt_batch_t *ngx_http_cnt_get_batch(ngx_http_request_t *r,
+    ngx_uint_t create);
+static ngx_int_t ngx_http_cnt_batch_add(ngx_http_request_t *r,
+    ngx_uint_t cnt_set, ngx_int_t idx, ngx_http_cnt_op_e op, ngx_int_t value);
+static ngx_int_t ngx_http_cnt_batch_rehash(ngx_pool_t *pool,
+    ngx_http_cnt_batch_t *batch);
+static void ngx_http_cnt_batch_flush(ngx_http_cnt_batch_t *batch);
+static void ngx_http_cnt_batch_cleanup(void *data);
 
 
 static ngx_command_t  ngx_http_cnt_commands[] = {
 
     { ngx_string("counter"),
-      NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF|NGX_CONF_TAKE123,
+      NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF|NGX_CONF_1MORE,
       ngx_http_cnt_counter,
       NGX_HTTP_LOC_CONF_OFFSET,
       0,
       NULL },
     { ngx_string("early_counter"),
-      NGX_HTTP_LOC_CONF|NGX_CONF_TAKE23,
+      NGX_HTTP_LOC_CONF|NGX_CONF_2MORE,
       ngx_http_cnt_early_counter,
       NGX_HTTP_LOC_CONF_OFFSET,
       0,
@@ -129,6 +161,12 @@ static ngx_command_t  ngx_http_cnt_commands[] = {
       NGX_HTTP_SRV_CONF_OFFSET,
       0,
       NULL },
+    { ngx_string("counters_subrequests"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_cnt_loc_conf_t, subrequests),
+      NULL },
     { ngx_string("counters_survive_reload"),
       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_CONF_FLAG,
       ngx_conf_set_flag_slot,
@@ -136,11 +174,23 @@ static ngx_command_t  ngx_http_cnt_commands[] = {
       offsetof(ngx_http_cnt_srv_conf_t, survive_reload),
       NULL },
     { ngx_string("histogram"),
-      NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF|NGX_CONF_TAKE23,
+      NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF|NGX_CONF_2MORE,
       ngx_http_cnt_histogram,
       NGX_HTTP_LOC_CONF_OFFSET,
       0,
       NULL },
+    { ngx_string("counter_array"),
+      NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF|NGX_CONF_2MORE,
+      ngx_http_cnt_counter_array,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+    { ngx_string("histogram2d"),
+      NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF|NGX_CONF_2MORE,
+      ngx_http_cnt_histogram2d,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
     { ngx_string("map_to_range_index"),
       NGX_HTTP_MAIN_CONF|NGX_CONF_2MORE,
       ngx_http_cnt_map_to_range_index,
@@ -149,12 +199,24 @@ static ngx_command_t  ngx_http_cnt_commands[] = {
       NULL },
 #ifdef NGX_HTTP_CUSTOM_COUNTERS_PERSISTENCY
     { ngx_string("counters_persistent_storage"),
-      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE12,
+      NGX_HTTP_MAIN_CONF|NGX_CONF_1MORE,
       ngx_http_cnt_counters_persistent_storage,
       NGX_HTTP_MAIN_CONF_OFFSET,
       0,
       NULL },
 #endif
+    { ngx_string("counters_self_metrics"),
+      NGX_HTTP_SRV_CONF|NGX_CONF_NOARGS|NGX_CONF_TAKE1,
+      ngx_http_cnt_self_metrics,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+    { ngx_string("counters_hot_slots"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_NOARGS|NGX_CONF_TAKE12,
+      ngx_http_cnt_hot_slots,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
     { ngx_string("display_unreachable_counter_as"),
       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_CONF_TAKE1,
       ngx_conf_set_str_slot,
@@ -170,6 +232,9 @@ static ngx_http_variable_t  ngx_http_cnt_vars[] =
 {
     { ngx_string("cnt_collection"), NULL, ngx_http_cnt_collection, 0, 0, 0 },
     { ngx_string("cnt_histograms"), NULL, ngx_http_cnt_histograms, 0, 0, 0 },
+    { ngx_string("cnt_hot_slots"), NULL, ngx_http_cnt_hot_slots_report,
+                 0, 0, 0 },
+    { ngx_string("cnt_shm_stats"), NULL, ngx_http_cnt_shm_stats, 0, 0, 0 },
     { ngx_string("cnt_uptime"), NULL, ngx_http_cnt_uptime, 0, 0, 0 },
     { ngx_string("cnt_uptime_reload"), NULL, ngx_http_cnt_uptime, 1, 0, 0 },
     { ngx_string("cnt_start_time"), NULL, ngx_http_cnt_uptime, 2, 0, 0 },
@@ -217,10 +282,10 @@ ngx_module_t  ngx_http_custom_counters_module = {
     NGX_HTTP_MODULE,                         /* module type */
     NULL,                                    /* init master */
     ngx_http_cnt_init_module,                /* init module */
-    NULL,                                    /* init process */
+    ngx_http_cnt_init_process,               /* init process */
     NULL,                                    /* init thread */
     NULL,                                    /* exit thread */
-    NULL,                                    /* exit process */
+    ngx_http_cnt_exit_process,               /* exit process */
     ngx_http_cnt_exit_master,                /* exit master */
     NGX_MODULE_V1_PADDING
 };
@@ -248,7 +313,8 @@ ngx_http_cnt_add_vars(ngx_conf_t *cf)
 static ngx_int_t
 ngx_http_cnt_init(ngx_conf_t *cf)
 {
-    ngx_uint_t                   i, j;
+    ngx_uint_t                   i;
+    ngx_int_t                    idx;
     ngx_http_core_main_conf_t   *cmcf;
     ngx_http_core_srv_conf_t   **cscfp;
     ngx_http_cnt_main_conf_t    *mcf;
@@ -262,7 +328,6 @@ ngx_http_cnt_init(ngx_conf_t *cf)
     cscfp = cmcf->servers.elts;
     mcf = ngx_http_conf_get_module_main_conf(cf,
                                              ngx_http_custom_counters_module);
-    cnt_sets = mcf->cnt_sets.elts;
 
     for (i = 0; i < cmcf->servers.nelts; i++) {
         scf = cscfp[i]->ctx->srv_conf[
@@ -278,14 +343,9 @@ ngx_http_cnt_init(ngx_conf_t *cf)
                             cscfp[i]->server_names.elts)[
                                 cscfp[i]->server_names.nelts - 1].name;
         }
-        for (j = 0; j < mcf->cnt_sets.nelts; j++) {
-            if (cnt_sets[j].name.len == cnt_set_id.len
-                && ngx_strncmp(cnt_sets[j].name.data, cnt_set_id.data,
-                               cnt_set_id.len) == 0)
-            {
-                scf->cnt_set = j;
-                break;
-            }
+        idx = ngx_http_cnt_find_set(mcf, &cnt_set_id);
+        if (idx != NGX_ERROR) {
+            scf->cnt_set = idx;
         }
     }
 
@@ -303,8 +363,33 @@ ngx_http_cnt_init(ngx_conf_t *cf)
 
     *h = ngx_http_cnt_log_phase_handler;
 
+    if (ngx_http_cnt_adopt_stream_sets(cf, mcf) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    cnt_sets = mcf->cnt_sets.elts;
+
+    for (i = 0; i < mcf->cnt_sets.nelts; i++) {
+        cnt_sets[i].zone->shm.size =
+                ngx_http_cnt_shm_zone_size(&cnt_sets[i].vars);
+    }
+
     ngx_http_cnt_set_collection_buf_len(mcf);
 
+    if (ngx_http_cnt_init_hot_slots(cf, mcf) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+#ifdef NGX_HTTP_CUSTOM_COUNTERS_PERSISTENCY
+    if (ngx_http_cnt_init_persistent_layout(cf, mcf) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (ngx_http_cnt_init_persistent_mmap(cf, mcf) != NGX_OK) {
+        return NGX_ERROR;
+    }
+#endif
+
     now = ngx_time();
 
     if (ngx_http_cnt_start_time == 0) {
@@ -332,6 +417,9 @@ ngx_http_cnt_create_main_conf(ngx_conf_t *cf)
         return NULL;
     }
 
+    ngx_rbtree_init(&mcf->cnt_sets_index, &mcf->cnt_sets_sentinel,
+                    ngx_str_rbtree_insert_value);
+
     return mcf;
 }
 
@@ -356,7 +444,16 @@ ngx_http_cnt_create_srv_conf(ngx_conf_t *cf)
 static void *
 ngx_http_cnt_create_loc_conf(ngx_conf_t *cf)
 {
-    return ngx_pcalloc(cf->pool, sizeof(ngx_http_cnt_loc_conf_t));
+    ngx_http_cnt_loc_conf_t  *lcf;
+
+    lcf = ngx_pcalloc(cf->pool, sizeof(ngx_http_cnt_loc_conf_t));
+    if (lcf == NULL) {
+        return NULL;
+    }
+
+    lcf->subrequests = NGX_CONF_UNSET;
+
+    return lcf;
 }
 
 
@@ -393,54 +490,67 @@ ngx_http_cnt_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_http_cnt_loc_conf_t     *prev = parent;
     ngx_http_cnt_loc_conf_t     *conf = child;
 
-    ngx_uint_t                   i, j, size;
-    ngx_http_cnt_data_t         *cnt_data, *prev_cnt_data;
+    ngx_uint_t                   i;
+    ngx_http_cnt_main_conf_t    *mcf;
+    ngx_http_cnt_data_t         *cnt_data;
     ngx_array_t                  child_data;
-    ngx_http_cnt_rt_var_data_t  *rt_var;
+    ngx_http_cnt_index_t        *index;
+
+    ngx_conf_merge_value(conf->subrequests, prev->subrequests, 0);
+
+    /* main requests look for batches of subrequests only if some location
+     * counts subrequests */
+
+    if (conf->subrequests) {
+        mcf = ngx_http_conf_get_module_main_conf(cf,
+                                            ngx_http_custom_counters_module);
+        mcf->subrequests = 1;
+    }
 
     if (prev->cnt_data.nelts == 0) {
         return NGX_CONF_OK;
     }
 
-    size = ngx_max(prev->cnt_data.nelts, conf->cnt_data.nelts);
-    if (ngx_array_init(&child_data, cf->pool, size,
+    /* counter operations are immutable after merging, a location that does
+     * not declare own counters shares them with its parent */
+
+    if (conf->cnt_data.nelts == 0) {
+        conf->cnt_data = prev->cnt_data;
+        conf->cnt_data_index = prev->cnt_data_index;
+        return NGX_CONF_OK;
+    }
+
+    /* the child data starts with a copy of the parent data, and therefore
+     * the parent index is valid for it, the own index of the child maps only
+     * counters which are not in the parent data; run-time variables of the
+     * copied operations stay shared with the parent until they get merged */
+
+    index = ngx_http_cnt_index_create(cf, prev->cnt_data_index);
+    if (index == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (ngx_array_init(&child_data, cf->pool,
+                       ngx_max(prev->cnt_data.nelts, conf->cnt_data.nelts),
                        sizeof(ngx_http_cnt_data_t)) != NGX_OK)
     {
         return NGX_CONF_ERROR;
     }
 
-    prev_cnt_data = prev->cnt_data.elts;
-    for (i = 0; i < prev->cnt_data.nelts; i++) {
-        cnt_data = ngx_array_push(&child_data);
-        if (cnt_data == NULL) {
-            return NGX_CONF_ERROR;
-        }
-        *cnt_data = prev_cnt_data[i];
-        size = cnt_data->rt_vars.nelts;
-        if (size > 0) {
-            if (ngx_array_init(&cnt_data->rt_vars, cf->pool, size,
-                               sizeof(ngx_http_cnt_rt_var_data_t)) != NGX_OK)
-            {
-                return NGX_CONF_ERROR;
-            }
-            for (j = 0; j < size; j++) {
-                rt_var = ngx_array_push(&cnt_data->rt_vars);
-                if (rt_var == NULL) {
-                    return NGX_CONF_ERROR;
-                }
-                *rt_var = ((ngx_http_cnt_rt_var_data_t *)
-                           prev_cnt_data[i].rt_vars.elts)[j];
-            }
-        }
-    }
+    ngx_memcpy(child_data.elts, prev->cnt_data.elts,
+               prev->cnt_data.nelts * sizeof(ngx_http_cnt_data_t));
+    child_data.nelts = prev->cnt_data.nelts;
 
     cnt_data = conf->cnt_data.elts;
     for (i = 0; i < conf->cnt_data.nelts; i++) {
-        if (ngx_http_cnt_merge(cf, &child_data, &cnt_data[i]) != NGX_CONF_OK) {
+        if (ngx_http_cnt_merge(cf, &child_data, index, &cnt_data[i])
+            != NGX_CONF_OK)
+        {
             return NGX_CONF_ERROR;
         }
     }
     conf->cnt_data = child_data;
+    conf->cnt_data_index = index;
 
     return NGX_CONF_OK;
 }
@@ -457,99 +567,381 @@ ngx_http_cnt_init_module(ngx_cycle_t *cycle)
     if (ngx_http_cnt_init_persistent_storage(cycle) != NGX_OK) {
         return NGX_ERROR;
     }
+
+    if (ngx_http_cnt_commit_persistent_mmap(cycle) != NGX_OK) {
+        return NGX_ERROR;
+    }
+#endif
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_cnt_init_process(ngx_cycle_t *cycle)
+{
+#ifdef NGX_HTTP_CUSTOM_COUNTERS_PERSISTENCY
+    if (ngx_http_cnt_init_persistent_thread_pool(cycle) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (ngx_http_cnt_init_persistent_journal(cycle) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (ngx_http_cnt_init_persistent_msync(cycle) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (ngx_http_cnt_init_persistent_backup(cycle) != NGX_OK) {
+        return NGX_ERROR;
+    }
 #endif
 
     return NGX_OK;
 }
 
 
+static void
+ngx_http_cnt_exit_process(ngx_cycle_t *cycle)
+{
+#ifdef NGX_HTTP_CUSTOM_COUNTERS_PERSISTENCY
+    ngx_http_cnt_exit_persistent_journal(cycle);
+#endif
+}
+
+
 static void
 ngx_http_cnt_exit_master(ngx_cycle_t *cycle)
 {
 #ifdef NGX_HTTP_CUSTOM_COUNTERS_PERSISTENCY
-    (void) ngx_http_cnt_write_persistent_counters(NULL, cycle, 0);
+    if (ngx_http_cnt_write_persistent_counters(cycle) == NGX_OK) {
+        ngx_http_cnt_remove_persistent_journal(cycle);
+    }
 #endif
 }
 
 
-static ngx_int_t
+ngx_int_t
 ngx_http_cnt_shm_init(ngx_shm_zone_t *shm_zone, void *data)
 {
-    ngx_atomic_int_t         *shm_data, *oshm_data = data;
-    ngx_http_cnt_shm_data_t  *bound_shm_data = shm_zone->data;
+    ngx_http_cnt_shm_block_t  *block, *oblock = data;
+    ngx_http_cnt_shm_data_t   *bound_shm_data = shm_zone->data;
 
-    ngx_slab_pool_t          *shpool;
-    ngx_http_cnt_set_t       *cnt_sets, *cnt_set;
-    ngx_int_t                 nelts;
-    size_t                    size;
+    ngx_slab_pool_t           *shpool;
+    ngx_http_cnt_set_t        *cnt_sets, *cnt_set;
+    size_t                     size;
+    ngx_uint_t                 foreign = 0, remap = 0;
 
     cnt_sets = bound_shm_data->cnt_sets->elts;
     cnt_set = &cnt_sets[bound_shm_data->cnt_set];
 
     shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
-    nelts = cnt_set->vars.nelts;
-    size = sizeof(ngx_atomic_int_t) * (nelts + 1);
+    size = ngx_http_cnt_shm_block_size(&cnt_set->vars);
+
+    if (oblock == NULL && !shm_zone->shm.exists) {
+        oblock = ngx_http_cnt_shm_find_old_block(shm_zone);
+        foreign = 1;
+    }
+
+    /* the old block may live in a mapped persistent storage rather than in
+     * the zone, it must be neither reused nor freed then */
+
+    if (oblock != NULL
+        && ((u_char *) oblock < shm_zone->shm.addr
+            || (u_char *) oblock >= shm_zone->shm.addr + shm_zone->shm.size))
+    {
+        foreign = 1;
+    }
+
+#ifdef NGX_HTTP_CUSTOM_COUNTERS_PERSISTENCY
+    if (cnt_set->persistent_block != NULL) {
+        block = cnt_set->persistent_block;
+
+        /* the counters in a reused mapped storage are already up to date */
+
+        if (cnt_set->persistent_fresh) {
+            if (oblock == NULL) {
+                ngx_http_cnt_shm_load_persistent(shm_zone, cnt_set, block);
+            } else {
+                ngx_http_cnt_shm_remap(shm_zone, cnt_set, block, oblock);
+            }
+        }
+
+        if (oblock != NULL && !foreign) {
+            ngx_shmtx_lock(&shpool->mutex);
+            ngx_slab_free_locked(shpool, oblock);
+            ngx_shmtx_unlock(&shpool->mutex);
+        }
+
+        shm_zone->data = block;
+
+        ngx_http_cnt_probe3(shm__init, cnt_set->name.data, cnt_set->name.len,
+                            NGX_HTTP_CNT_SHM_INIT_PERSISTENT);
+
+        return NGX_OK;
+    }
+#endif
 
-    if (oshm_data != NULL) {
+    if (oblock != NULL) {
         if (cnt_set->survive_reload) {
-            if (nelts == oshm_data[0]) {
-                shm_zone->data = data;
+            if (!foreign
+                && ngx_http_cnt_shm_block_same_layout(oblock, &cnt_set->vars))
+            {
+                shm_zone->data = oblock;
+                ngx_http_cnt_probe3(shm__init, cnt_set->name.data,
+                                    cnt_set->name.len,
+                                    NGX_HTTP_CNT_SHM_INIT_REUSE);
                 return NGX_OK;
-            } else {
-                ngx_log_error(NGX_LOG_WARN, shm_zone->shm.log, 0,
-                              "custom counters set \"%V\" cannot survive "
-                              "reload because its size has changed",
-                              &cnt_set->name);
             }
-        } else if (nelts <= oshm_data[0]) {
+            remap = 1;
+        } else if (!foreign && (size_t) oblock->size >= size) {
             ngx_shmtx_lock(&shpool->mutex);
-            ngx_memzero(oshm_data, size);
-            oshm_data[0] = nelts;
+            size = oblock->size;
+            ngx_memzero(oblock, size);
+            ngx_http_cnt_shm_block_init(oblock, &cnt_set->vars, size);
             ngx_shmtx_unlock(&shpool->mutex);
-            shm_zone->data = oshm_data;
+            shm_zone->data = oblock;
+            ngx_http_cnt_probe3(shm__init, cnt_set->name.data,
+                                cnt_set->name.len, NGX_HTTP_CNT_SHM_INIT_RESET);
             return NGX_OK;
         }
     }
 
     if (shm_zone->shm.exists) {
         shm_zone->data = shpool->data;
+        ngx_http_cnt_probe3(shm__init, cnt_set->name.data, cnt_set->name.len,
+                            NGX_HTTP_CNT_SHM_INIT_ATTACH);
         return NGX_OK;
     }
 
     ngx_shmtx_lock(&shpool->mutex);
 
-    shm_data = ngx_slab_calloc_locked(shpool, size);
-    if (shm_data == NULL) {
+    block = ngx_slab_calloc_locked(shpool, size);
+    if (block == NULL) {
         ngx_shmtx_unlock(&shpool->mutex);
+        ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                      "not enough shared memory for custom counters set "
+                      "\"%V\"", &cnt_set->name);
         return NGX_ERROR;
     }
-    shm_data[0] = nelts;
+    ngx_http_cnt_shm_block_init(block, &cnt_set->vars, size);
 
-    if (oshm_data == NULL) {
+    if (oblock == NULL) {
 #ifdef NGX_HTTP_CUSTOM_COUNTERS_PERSISTENCY
-        if (ngx_http_cnt_load_persistent_counters(shm_zone->shm.log,
-                                    bound_shm_data->persistent_collection,
-                                    bound_shm_data->persistent_collection_tok,
-                                    bound_shm_data->persistent_collection_size,
-                                    cnt_set->name, &cnt_set->vars,
-                                    shm_data + 1) != NGX_OK)
-        {
-            ngx_log_error(NGX_LOG_ERR, shm_zone->shm.log, 0,
-                          "failed to load persistent counters collection, "
-                          "proceeding anyway");
-        }
+        ngx_http_cnt_shm_load_persistent(shm_zone, cnt_set, block);
 #endif
     } else {
-        /* FIXME: this is not always safe: too slow workers may write in
-         * recently allocated areas when nginx reloads its configuration too
-         * fast and having been already freed areas get reused */
-        ngx_slab_free_locked(shpool, oshm_data);
+        if (remap) {
+            ngx_http_cnt_shm_remap(shm_zone, cnt_set, block, oblock);
+        }
+
+        /* the old block from a resized zone gets freed along with the zone */
+        if (!foreign) {
+            /* FIXME: this is not always safe: too slow workers may write in
+             * recently allocated areas when nginx reloads its configuration
+             * too fast and having been already freed areas get reused */
+            ngx_slab_free_locked(shpool, oblock);
+        }
     }
 
     ngx_shmtx_unlock(&shpool->mutex);
 
-    shpool->data = shm_data;
-    shm_zone->data = shm_data;
+    shpool->data = block;
+    shm_zone->data = block;
+
+    ngx_http_cnt_probe3(shm__init, cnt_set->name.data, cnt_set->name.len,
+                        remap ? NGX_HTTP_CNT_SHM_INIT_REMAP :
+                                NGX_HTTP_CNT_SHM_INIT_NEW);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_cnt_shm_remap(ngx_shm_zone_t *shm_zone, ngx_http_cnt_set_t *cnt_set,
+                       ngx_http_cnt_shm_block_t *block,
+                       ngx_http_cnt_shm_block_t *oblock)
+{
+    ngx_http_cnt_shm_block_remap(block, oblock);
+    ngx_log_error(NGX_LOG_NOTICE, shm_zone->shm.log, 0,
+                  "custom counters set \"%V\" was remapped by names "
+                  "on reload: %i kept, %i added, %i dropped",
+                  &cnt_set->name, (ngx_int_t) block->remap_kept,
+                  (ngx_int_t) block->remap_added,
+                  (ngx_int_t) block->remap_dropped);
+}
+
+
+#ifdef NGX_HTTP_CUSTOM_COUNTERS_PERSISTENCY
+
+static void
+ngx_http_cnt_shm_load_persistent(ngx_shm_zone_t *shm_zone,
+                                 ngx_http_cnt_set_t *cnt_set,
+                                 ngx_http_cnt_shm_block_t *block)
+{
+    ngx_http_cnt_shm_data_t   *bound_shm_data = shm_zone->data;
+    ngx_int_t                  rc = NGX_OK;
+
+    /* JSON data was converted into the binary format at configuration */
+
+    if (bound_shm_data->persistent_collection != NULL
+        && bound_shm_data->persistent_collection->len > 0)
+    {
+        rc = ngx_http_cnt_load_persistent_counters_binary(
+                                    *bound_shm_data->persistent_collection,
+                                    cnt_set->name, block);
+    }
+
+    if (rc == NGX_OK && bound_shm_data->persistent_journal != NULL) {
+        rc = ngx_http_cnt_load_persistent_journal(
+                                    bound_shm_data->persistent_journal,
+                                    cnt_set->name, block);
+    }
+
+    ngx_http_cnt_probe3(persistent__load, cnt_set->name.data,
+                        cnt_set->name.len, rc);
+
+    if (rc != NGX_OK) {
+        ngx_log_error(NGX_LOG_ERR, shm_zone->shm.log, 0,
+                      "failed to load persistent counters collection, "
+                      "proceeding anyway");
+    }
+}
+
+#endif
+
+
+static ngx_http_cnt_shm_block_t *
+ngx_http_cnt_shm_find_old_block(ngx_shm_zone_t *shm_zone)
+{
+    ngx_uint_t                 i;
+    ngx_list_part_t           *part;
+    ngx_shm_zone_t            *ozone;
+
+    /* when the size of the zone changes on reload, Nginx allocates a new zone
+     * and does not pass the data of the old zone, however the old cycle is
+     * still alive at this moment and can be looked up via ngx_cycle */
+
+    part = (ngx_list_part_t *) &ngx_cycle->shared_memory.part;
+    ozone = part->elts;
+
+    for (i = 0; /* void */ ; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+            part = part->next;
+            ozone = part->elts;
+            i = 0;
+        }
+
+        if (ozone[i].tag != shm_zone->tag
+            || ozone[i].shm.name.len != shm_zone->shm.name.len
+            || ngx_strncmp(ozone[i].shm.name.data, shm_zone->shm.name.data,
+                           shm_zone->shm.name.len) != 0)
+        {
+            continue;
+        }
+
+        return ozone[i].data;
+    }
+
+    return NULL;
+}
+
+
+#ifdef NGX_HTTP_CUSTOM_COUNTERS_PERSISTENCY
+
+static void
+ngx_http_cnt_shm_data_persistent_init(ngx_http_cnt_shm_data_t *shm_data,
+                                      ngx_http_cnt_main_conf_t *mcf)
+{
+    /* sets of the stream module get the persistent storage when they are
+     * adopted by the http module */
+
+    if (mcf == NULL) {
+        shm_data->persistent_collection = NULL;
+        shm_data->persistent_journal = NULL;
+        return;
+    }
+
+    shm_data->persistent_collection = &mcf->persistent_collection;
+    shm_data->persistent_journal = mcf->persistent_journal_interval > 0 ?
+            &mcf->persistent_journal_sets : NULL;
+}
+
+#endif
+
+
+static ngx_int_t
+ngx_http_cnt_adopt_stream_sets(ngx_conf_t *cf, ngx_http_cnt_main_conf_t *mcf)
+{
+    ngx_uint_t                 i;
+    ngx_list_part_t           *part;
+    ngx_shm_zone_t            *zone;
+    ngx_http_cnt_shm_data_t   *shm_data;
+    ngx_http_cnt_set_t        *cnt_set;
+    ngx_http_cnt_set_node_t   *sn;
+
+    /* counter sets of stream servers were declared before the http block,
+     * they are found by their zones and copied into the main configuration,
+     * so that they appear in the collection and the persistent storage like
+     * sets of http servers; the stream module keeps using its own copies
+     * which share the zones */
+
+    part = &cf->cycle->shared_memory.part;
+    zone = part->elts;
+
+    for (i = 0; /* void */ ; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+            part = part->next;
+            zone = part->elts;
+            i = 0;
+        }
+
+        if (zone[i].tag != &ngx_http_custom_counters_module
+            || zone[i].init != ngx_http_cnt_shm_init)
+        {
+            continue;
+        }
+
+        shm_data = zone[i].data;
+        if (shm_data->cnt_sets == &mcf->cnt_sets) {
+            continue;
+        }
+
+        cnt_set = ngx_array_push(&mcf->cnt_sets);
+        if (cnt_set == NULL) {
+            return NGX_ERROR;
+        }
+
+        *cnt_set = ((ngx_http_cnt_set_t *) shm_data->cnt_sets->elts)[
+                                                        shm_data->cnt_set];
+
+        sn = ngx_palloc(cf->temp_pool, sizeof(ngx_http_cnt_set_node_t));
+        if (sn == NULL) {
+            return NGX_ERROR;
+        }
+
+        sn->sn.node.key = ngx_crc32_short(cnt_set->name.data,
+                                          cnt_set->name.len);
+        sn->sn.str = cnt_set->name;
+        sn->cnt_set = mcf->cnt_sets.nelts - 1;
+
+        ngx_rbtree_insert(&mcf->cnt_sets_index, &sn->sn.node);
+
+        shm_data->cnt_sets = &mcf->cnt_sets;
+        shm_data->cnt_set = mcf->cnt_sets.nelts - 1;
+#ifdef NGX_HTTP_CUSTOM_COUNTERS_PERSISTENCY
+        ngx_http_cnt_shm_data_persistent_init(shm_data, mcf);
+#endif
+    }
 
     return NGX_OK;
 }
@@ -566,6 +958,7 @@ ngx_http_cnt_get_value(ngx_http_request_t *r, ngx_http_variable_value_t *v,
     ngx_http_cnt_srv_conf_t           *scf;
     ngx_shm_zone_t                    *shm;
     ngx_http_cnt_var_data_t           *var_data;
+    ngx_http_cnt_set_var_data_t       *vars;
     volatile ngx_atomic_int_t         *shm_data;
     ngx_http_cnt_set_t                *cnt_sets, *cnt_set;
     ngx_int_t                          idx = NGX_ERROR;
@@ -602,13 +995,14 @@ ngx_http_cnt_get_value(ngx_http_request_t *r, ngx_http_variable_value_t *v,
         goto unreachable_cnt;
     }
 
-    shm_data = (volatile ngx_atomic_int_t *) shm->data + 1;
+    shm_data = ngx_http_cnt_shm_values(shm->data);
     buf = ngx_pnalloc(r->pool, NGX_ATOMIC_T_LEN);
     if (buf == NULL) {
         return NGX_ERROR;
     }
 
-    last = ngx_sprintf(buf, "%A", shm_data[idx]);
+    vars = cnt_set->vars.elts;
+    last = ngx_http_cnt_sprintf_value(buf, shm_data[idx], vars[idx].point);
 
     v->len          = last - buf;
     v->data         = buf;
@@ -655,16 +1049,11 @@ ngx_http_cnt_build_collection(ngx_http_request_t *r, ngx_cycle_t *cycle,
                               ngx_str_t *collection,
                               ngx_uint_t survive_reload_only)
 {
-    ngx_uint_t                         i, j;
     ngx_http_cnt_main_conf_t          *mcf;
     ngx_pool_t                        *pool;
-    ngx_shm_zone_t                    *shm;
-    volatile ngx_atomic_int_t         *shm_data;
-    ngx_http_cnt_set_t                *cnt_sets;
-    ngx_http_cnt_set_var_data_t       *vars;
-    ngx_uint_t                         nelts, size;
-    ngx_uint_t                         n_cnt_sets = 0;
+    ngx_uint_t                         size;
     u_char                            *buf, *last;
+    ngx_atomic_uint_t                  start = 0;
 
     ngx_str_set(collection, "{}");
 
@@ -680,8 +1069,7 @@ ngx_http_cnt_build_collection(ngx_http_request_t *r, ngx_cycle_t *cycle,
         pool = r->pool;
     }
 
-    nelts = mcf->cnt_sets.nelts;
-    if (nelts == 0) {
+    if (mcf->cnt_sets.nelts == 0) {
         return NGX_OK;
     }
 
@@ -695,59 +1083,464 @@ ngx_http_cnt_build_collection(ngx_http_request_t *r, ngx_cycle_t *cycle,
         return NGX_ERROR;
     }
 
-    last = ngx_sprintf(buf, "{");
-
-    cnt_sets = mcf->cnt_sets.elts;
-    for (i = 0; i < nelts; i++) {
-        if (survive_reload_only && !cnt_sets[i].survive_reload) {
-            continue;
-        }
+    if (mcf->self_metrics != NULL) {
+        start = ngx_http_cnt_self_metrics_now();
+    }
 
-        n_cnt_sets++;
-        last = ngx_sprintf(last, "\"%V\":{", &cnt_sets[i].name);
-        shm = cnt_sets[i].zone;
-        shm_data = (volatile ngx_atomic_int_t *) shm->data + 1;
+    ngx_http_cnt_probe2(collection__start, mcf->cnt_sets.nelts, size);
 
-        vars = cnt_sets[i].vars.elts;
-        for (j = 0; j < cnt_sets[i].vars.nelts; j++) {
-            last = ngx_sprintf(last, "\"%V\":%A,", &vars[j].name,
-                               shm_data[vars[j].idx]);
-        }
-        if (j > 0) {
-            last--;
-        }
+    last = ngx_http_cnt_render_collection(mcf, buf, survive_reload_only);
 
-        last = ngx_sprintf(last, "},");
+    collection->data = buf;
+    collection->len = last - buf;
+
+    ngx_http_cnt_probe1(collection__end, collection->len);
+
+    /* collections are not sampled as they are rare and far more expensive
+     * than reading the clock */
+
+    if (mcf->self_metrics != NULL) {
+        ngx_http_cnt_self_metrics_sample(mcf->self_metrics,
+                                         ngx_http_cnt_self_collection_samples,
+                                         start, collection->len);
     }
-    if (n_cnt_sets > 0) {
+
+    return NGX_OK;
+}
+
+
+u_char *
+ngx_http_cnt_render_collection(ngx_http_cnt_main_conf_t *mcf, u_char *buf,
+                               ngx_uint_t survive_reload_only)
+{
+    ngx_uint_t                         i;
+    ngx_http_cnt_set_t                *cnt_sets;
+    ngx_uint_t                         n_cnt_sets = 0;
+    u_char                            *last;
+
+    /* the buffer must be at least mcf->collection_buf_len bytes long */
+
+    last = ngx_sprintf(buf, "{");
+
+    cnt_sets = mcf->cnt_sets.elts;
+    for (i = 0; i < mcf->cnt_sets.nelts; i++) {
+        if (survive_reload_only && !cnt_sets[i].survive_reload) {
+            continue;
+        }
+
+        if (n_cnt_sets++ > 0) {
+            *last++ = ',';
+        }
+
+        last = ngx_http_cnt_render_set(&cnt_sets[i], last);
+    }
+
+    return ngx_sprintf(last, "}");
+}
+
+
+u_char *
+ngx_http_cnt_render_set(ngx_http_cnt_set_t *cnt_set, u_char *buf)
+{
+    ngx_uint_t                         i;
+    volatile ngx_atomic_int_t         *shm_data;
+    ngx_http_cnt_set_var_data_t       *vars;
+    ngx_http_cnt_set_array_data_t     *arrays;
+    u_char                            *last;
+
+    /* the buffer must be at least ngx_http_cnt_set_buf_len() bytes long */
+
+    last = ngx_sprintf(buf, "\"%V\":{", &cnt_set->name);
+    shm_data = ngx_http_cnt_shm_values(cnt_set->zone->data);
+
+    /* elements of counter arrays are rendered in nested objects after all
+     * other counters */
+
+    vars = cnt_set->vars.elts;
+    for (i = 0; i < cnt_set->vars.nelts; i++) {
+        if (vars[i].array != NGX_ERROR) {
+            continue;
+        }
+        last = ngx_sprintf(last, "\"%V\":", &vars[i].name);
+        last = ngx_http_cnt_sprintf_value(last, shm_data[vars[i].idx],
+                                          vars[i].point);
+        *last++ = ',';
+    }
+
+    arrays = cnt_set->arrays.elts;
+    for (i = 0; i < cnt_set->arrays.nelts; i++) {
+        last = ngx_sprintf(last, "\"%V\":", &arrays[i].name);
+        last = ngx_http_cnt_render_array(cnt_set, i, last);
+        *last++ = ',';
+    }
+
+    if (last[-1] == ',') {
         last--;
     }
 
-    last = ngx_sprintf(last, "}");
+    return ngx_sprintf(last, "}");
+}
+
+
+size_t
+ngx_http_cnt_set_buf_len(ngx_http_cnt_set_t *cnt_set)
+{
+    ngx_uint_t                         i;
+    ngx_http_cnt_set_var_data_t       *vars;
+    size_t                             len;
+
+    len = 2 + 2 + 1 + 1 + cnt_set->name.len;
+
+    vars = cnt_set->vars.elts;
+    for (i = 0; i < cnt_set->vars.nelts; i++) {
+        len += 2 + 1 + 1 + vars[i].name.len + NGX_ATOMIC_T_LEN;
+    }
+
+    return len + ngx_http_cnt_arrays_buf_len(cnt_set);
+}
+
+
+/* values of fixed-point counters get rendered as decimals with exactly point
+ * fractional digits, they fit in NGX_ATOMIC_T_LEN as the sign takes the place
+ * of the terminating zero */
+
+u_char *
+ngx_http_cnt_sprintf_value(u_char *buf, ngx_atomic_int_t value,
+                           ngx_uint_t point)
+{
+    ngx_uint_t                         i;
+    ngx_atomic_uint_t                  n, scale;
+
+    if (point == 0) {
+        return ngx_sprintf(buf, "%A", value);
+    }
+
+    n = value;
+    if (value < 0) {
+        *buf++ = '-';
+        n = 0 - n;
+    }
+
+    for (scale = 1, i = 0; i < point; i++) {
+        scale *= 10;
+    }
+
+    buf = ngx_sprintf(buf, "%uA.", n / scale);
+
+    n %= scale;
+    for (i = point; i > 0; i--) {
+        buf[i - 1] = (u_char) ('0' + n % 10);
+        n /= 10;
+    }
+
+    return buf + point;
+}
+
+
+/* parses a non-negative decimal number into a fixed-point value with point
+ * fractional digits, extra digits get truncated; unlike ngx_atofp(), this
+ * accepts values like $request_time in counters with a finer scale */
+
+ngx_int_t
+ngx_http_cnt_parse_value(u_char *data, size_t len, ngx_uint_t point)
+{
+    ngx_int_t                          n, d;
+    ngx_uint_t                         dot = 0, digits = 0, frac = 0;
+
+    if (point == 0) {
+        return ngx_atoi(data, len);
+    }
+
+    for (n = 0; len > 0; len--, data++) {
+        if (*data == '.') {
+            if (dot) {
+                return NGX_ERROR;
+            }
+            dot = 1;
+            continue;
+        }
+
+        if (*data < '0' || *data > '9') {
+            return NGX_ERROR;
+        }
+
+        digits++;
+
+        if (dot && frac++ >= point) {
+            continue;
+        }
+
+        d = *data - '0';
+
+        if (n > (NGX_MAX_INT_T_VALUE - d) / 10) {
+            return NGX_ERROR;
+        }
+
+        n = n * 10 + d;
+    }
+
+    if (digits == 0) {
+        return NGX_ERROR;
+    }
+
+    for ( /* void */ ; frac < point; frac++) {
+        if (n > NGX_MAX_INT_T_VALUE / 10) {
+            return NGX_ERROR;
+        }
+
+        n *= 10;
+    }
+
+    return n;
+}
 
-    collection->data = buf;
-    collection->len = last - buf;
+
+static ngx_int_t
+ngx_http_cnt_parse_signed_value(ngx_str_t *elt, ngx_uint_t point,
+                                ngx_int_t *value)
+{
+    if (elt->len > 1 && elt->data[0] == '-') {
+        *value = ngx_http_cnt_parse_value(elt->data + 1, elt->len - 1, point);
+        if (*value == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+        *value = -*value;
+        return NGX_OK;
+    }
+
+    *value = ngx_http_cnt_parse_value(elt->data, elt->len, point);
+
+    return *value == NGX_ERROR ? NGX_ERROR : NGX_OK;
+}
+
+
+/* reads a value of a variable which may be a list like $upstream_status,
+ * returns NGX_DECLINED if the list has no values */
+
+ngx_int_t
+ngx_http_cnt_parse_var_value(ngx_http_variable_value_t *var, ngx_uint_t point,
+                             ngx_http_cnt_multi_e multi, ngx_int_t *value)
+{
+    u_char                            *pos, *last;
+    ngx_str_t                          elt;
+    ngx_int_t                          val;
+    ngx_uint_t                         n = 0;
+
+    if (multi == ngx_http_cnt_multi_none) {
+        elt.len = var->len;
+        elt.data = var->data;
+        return ngx_http_cnt_parse_signed_value(&elt, point, value);
+    }
+
+    pos = var->data;
+    last = pos + var->len;
+
+    *value = 0;
+
+    while (ngx_http_cnt_next_elt(&pos, last, &elt)) {
+        if (ngx_http_cnt_parse_signed_value(&elt, point, &val) != NGX_OK) {
+            return NGX_ERROR;
+        }
+        *value = multi == ngx_http_cnt_multi_last ? val : *value + val;
+        n++;
+    }
+
+    return n == 0 ? NGX_DECLINED : NGX_OK;
+}
+
+
+ngx_int_t
+ngx_http_cnt_parse_scale(ngx_conf_t *cf, ngx_str_t *value)
+{
+    ngx_int_t                          val;
+    ngx_uint_t                         point = 0;
+
+    val = ngx_atoi(value->data + 6, value->len - 6);
+
+    while (val > 1 && val % 10 == 0 && point < NGX_HTTP_CNT_MAX_POINT) {
+        val /= 10;
+        point++;
+    }
+
+    if (val != 1) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "bad value of \"%V\", must be a power of 10 "
+                           "not greater than 1000000000", value);
+        return NGX_ERROR;
+    }
+
+    return point;
+}
+
+
+/* generated ranges are declared as "linear start width n" or as
+ * "exponential start factor n"; returns NGX_DECLINED if the range is listed
+ * bound by bound */
+
+ngx_int_t
+ngx_http_cnt_parse_range_gen(ngx_conf_t *cf, ngx_str_t *value,
+                             ngx_uint_t nelts, ngx_http_cnt_range_gen_t *gen)
+{
+    ngx_uint_t                         i;
+    ngx_int_t                          n;
+    static const size_t                buf_size = 32;
+    u_char                             buf[buf_size], *p;
+    ngx_int_t                          len;
+    double                             arg[2];
+
+    if (value[0].len == 6 && ngx_strncmp(value[0].data, "linear", 6) == 0) {
+        gen->type = ngx_http_cnt_range_linear;
+    } else if (value[0].len == 11
+               && ngx_strncmp(value[0].data, "exponential", 11) == 0)
+    {
+        gen->type = ngx_http_cnt_range_exponential;
+    } else {
+        return NGX_DECLINED;
+    }
+
+    if (nelts != 4) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "%V range must be declared as \"%V start %s n\"",
+                           &value[0], &value[0],
+                           gen->type == ngx_http_cnt_range_linear ?
+                           "width" : "factor");
+        return NGX_ERROR;
+    }
+
+    for (i = 0; i < 2; i++) {
+        len = ngx_min(value[i + 1].len, buf_size - 1);
+        ngx_memcpy(buf, value[i + 1].data, len);
+        buf[len] = '\0';
+
+        errno = 0;
+        arg[i] = strtod((char *) buf, (char **) &p);
+        if (errno != 0 || p - buf < len) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "failed to read \"%V\" as double value",
+                               &value[i + 1]);
+            return NGX_ERROR;
+        }
+    }
+
+    n = ngx_atoi(value[3].data, value[3].len);
+    if (n == NGX_ERROR || n == 0 || n > ngx_http_cnt_range_max_bounds) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "number of bounds must be between 1 and %i",
+                           ngx_http_cnt_range_max_bounds);
+        return NGX_ERROR;
+    }
+
+    if (gen->type == ngx_http_cnt_range_linear) {
+        if (!(arg[1] > 0.0)) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "width of linear range must be positive");
+            return NGX_ERROR;
+        }
+    } else if (!(arg[0] > 0.0) || !(arg[1] > 1.0)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "exponential range must have positive start "
+                           "and factor greater than 1");
+        return NGX_ERROR;
+    }
+
+    gen->start = arg[0];
+    gen->step = arg[1];
+    gen->log_step = gen->type == ngx_http_cnt_range_exponential ?
+                    log(arg[1]) : 0.0;
+    gen->nbounds = n;
 
     return NGX_OK;
 }
 
 
+double
+ngx_http_cnt_range_gen_bound(ngx_http_cnt_range_gen_t *gen, ngx_uint_t n)
+{
+    if (gen->type == ngx_http_cnt_range_linear) {
+        return gen->start + n * gen->step;
+    }
+
+    return gen->start * pow(gen->step, n);
+}
+
+
+/* returns the same index as the inclusive upper bound search in the listed
+ * bounds: the index estimated by a division or a logarithm may be off by
+ * one due to rounding, and gets corrected against the neighbouring bounds
+ * generated at configuration, which are the first members of the elements
+ * of the range */
+
+ngx_uint_t
+ngx_http_cnt_range_gen_index(ngx_http_cnt_range_gen_t *gen,
+                             ngx_array_t *range, double value)
+{
+    ngx_uint_t                         n;
+    double                             x;
+    u_char                            *bounds = range->elts;
+
+    if (!(value > gen->start)) {
+        return 0;
+    }
+
+    x = gen->type == ngx_http_cnt_range_linear ?
+        (value - gen->start) / gen->step : log(value / gen->start)
+                                           / gen->log_step;
+
+    n = x < (double) gen->nbounds ? (ngx_uint_t) ceil(x) : gen->nbounds;
+
+    while (n > 0 && value <= *(double *) (bounds + (n - 1) * range->size)) {
+        n--;
+    }
+
+    while (n < gen->nbounds && value > *(double *) (bounds + n * range->size))
+    {
+        n++;
+    }
+
+    return n;
+}
+
+
+/* returns ngx_http_cnt_multi_none on errors */
+
+ngx_http_cnt_multi_e
+ngx_http_cnt_parse_multi(ngx_conf_t *cf, ngx_str_t *value, ngx_uint_t each)
+{
+    ngx_str_t                          mode;
+
+    mode.len = value->len - 6;
+    mode.data = value->data + 6;
+
+    if (mode.len == 3 && ngx_strncmp(mode.data, "sum", 3) == 0) {
+        return ngx_http_cnt_multi_sum;
+    }
+
+    if (mode.len == 4 && ngx_strncmp(mode.data, "last", 4) == 0) {
+        return ngx_http_cnt_multi_last;
+    }
+
+    if (each && mode.len == 4 && ngx_strncmp(mode.data, "each", 4) == 0) {
+        return ngx_http_cnt_multi_each;
+    }
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "bad value of \"%V\", must be \"sum\", \"last\"%s",
+                       value, each ? ", or \"each\"" : "");
+
+    return ngx_http_cnt_multi_none;
+}
+
+
 static void
 ngx_http_cnt_set_collection_buf_len(ngx_http_cnt_main_conf_t *mcf)
 {
-    ngx_uint_t                         i, j;
+    ngx_uint_t                         i;
     ngx_http_cnt_set_t                *cnt_sets;
-    ngx_http_cnt_set_var_data_t       *vars;
     ngx_uint_t                         len = 2;
 
     cnt_sets = mcf->cnt_sets.elts;
     for (i = 0; i < mcf->cnt_sets.nelts; i++) {
-        len += 2 + 2 + 1 + 1 + cnt_sets[i].name.len;
-
-        vars = cnt_sets[i].vars.elts;
-        for (j = 0; j < cnt_sets[i].vars.nelts; j++) {
-            len += 2 + 1 + 1 + vars[j].name.len + NGX_ATOMIC_T_LEN;
-        }
+        len += ngx_http_cnt_set_buf_len(&cnt_sets[i]);
     }
 
     mcf->collection_buf_len = len;
@@ -846,16 +1639,94 @@ ngx_http_cnt_stub_status(ngx_http_request_t *r, ngx_http_variable_value_t *v,
 #endif
 
 
+ngx_http_cnt_index_t *
+ngx_http_cnt_index_create(ngx_conf_t *cf, ngx_http_cnt_index_t *parent)
+{
+    ngx_http_cnt_index_t          *index;
+
+    index = ngx_palloc(cf->temp_pool, sizeof(ngx_http_cnt_index_t));
+    if (index == NULL) {
+        return NULL;
+    }
+
+    ngx_rbtree_init(&index->tree, &index->sentinel, ngx_rbtree_insert_value);
+    index->parent = parent;
+
+    return index;
+}
+
+
+ngx_int_t
+ngx_http_cnt_index_insert(ngx_conf_t *cf, ngx_http_cnt_index_t *index,
+                          ngx_rbtree_key_t key, ngx_uint_t idx)
+{
+    ngx_http_cnt_index_node_t     *node;
+
+    node = ngx_palloc(cf->temp_pool, sizeof(ngx_http_cnt_index_node_t));
+    if (node == NULL) {
+        return NGX_ERROR;
+    }
+
+    node->node.key = key;
+    node->idx = idx;
+
+    ngx_rbtree_insert(&index->tree, &node->node);
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_http_cnt_index_lookup(ngx_http_cnt_index_t *index, ngx_rbtree_key_t key)
+{
+    ngx_rbtree_node_t             *node, *sentinel;
+
+    for ( /* void */ ; index != NULL; index = index->parent) {
+        node = index->tree.root;
+        sentinel = index->tree.sentinel;
+
+        while (node != sentinel) {
+            if (key < node->key) {
+                node = node->left;
+                continue;
+            }
+
+            if (key > node->key) {
+                node = node->right;
+                continue;
+            }
+
+            return ((ngx_http_cnt_index_node_t *) node)->idx;
+        }
+    }
+
+    return NGX_ERROR;
+}
+
+
+ngx_int_t
+ngx_http_cnt_find_set(ngx_http_cnt_main_conf_t *mcf, ngx_str_t *name)
+{
+    ngx_str_node_t                *sn;
+
+    sn = ngx_str_rbtree_lookup(&mcf->cnt_sets_index, name,
+                               ngx_crc32_short(name->data, name->len));
+    if (sn == NULL) {
+        return NGX_ERROR;
+    }
+
+    return ((ngx_http_cnt_set_node_t *) sn)->cnt_set;
+}
+
+
 ngx_int_t
 ngx_http_cnt_counter_set_init(ngx_conf_t *cf, ngx_http_cnt_main_conf_t *mcf,
                               ngx_http_cnt_srv_conf_t *scf)
 {
-    ngx_uint_t                     i;
+    ngx_int_t                      idx;
     ngx_http_core_srv_conf_t      *cscf;
     ngx_str_t                      cnt_set_id;
-    ngx_http_cnt_set_t            *cnt_sets, *cnt_set;
-    ngx_str_t                      cnt_name;
-    ngx_http_cnt_shm_data_t       *shm_data;
+    ngx_http_cnt_set_node_t       *sn;
 
     cscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_core_module);
 
@@ -879,27 +1750,53 @@ ngx_http_cnt_counter_set_init(ngx_conf_t *cf, ngx_http_cnt_main_conf_t *mcf,
         }
     }
 
-    cnt_sets = mcf->cnt_sets.elts;
     if (scf->cnt_set == NGX_CONF_UNSET_UINT) {
-        for (i = 0; i < mcf->cnt_sets.nelts; i++) {
-            if (cnt_sets[i].name.len == cnt_set_id.len
-                && ngx_strncmp(cnt_sets[i].name.data, cnt_set_id.data,
-                               cnt_set_id.len) == 0)
-            {
-                scf->cnt_set = i;
-            }
+        idx = ngx_http_cnt_find_set(mcf, &cnt_set_id);
+        if (idx != NGX_ERROR) {
+            scf->cnt_set = idx;
         }
     }
     if (scf->cnt_set != NGX_CONF_UNSET_UINT) {
         return NGX_OK;
     }
 
-    cnt_set = ngx_array_push(&mcf->cnt_sets);
+    idx = ngx_http_cnt_counter_set_create(cf, &mcf->cnt_sets, &cnt_set_id,
+                                          mcf);
+    if (idx == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    sn = ngx_palloc(cf->temp_pool, sizeof(ngx_http_cnt_set_node_t));
+    if (sn == NULL) {
+        return NGX_ERROR;
+    }
+
+    sn->sn.node.key = ngx_crc32_short(cnt_set_id.data, cnt_set_id.len);
+    sn->sn.str = cnt_set_id;
+    sn->cnt_set = idx;
+
+    ngx_rbtree_insert(&mcf->cnt_sets_index, &sn->sn.node);
+
+    scf->cnt_set = idx;
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_http_cnt_counter_set_create(ngx_conf_t *cf, ngx_array_t *cnt_sets,
+                                ngx_str_t *name, ngx_http_cnt_main_conf_t *mcf)
+{
+    ngx_http_cnt_set_t            *cnt_set;
+    ngx_str_t                      cnt_name;
+    ngx_http_cnt_shm_data_t       *shm_data;
+
+    cnt_set = ngx_array_push(cnt_sets);
     if (cnt_set == NULL) {
         return NGX_ERROR;
     }
-    cnt_set->name = cnt_set_id;
-    cnt_name.len = ngx_http_cnt_shm_name_prefix.len + cnt_set_id.len;
+    cnt_set->name = *name;
+    cnt_name.len = ngx_http_cnt_shm_name_prefix.len + name->len;
     cnt_name.data = ngx_pnalloc(cf->pool, cnt_name.len);
     if (cnt_name.data == NULL) {
         return NGX_ERROR;
@@ -908,41 +1805,59 @@ ngx_http_cnt_counter_set_init(ngx_conf_t *cf, ngx_http_cnt_main_conf_t *mcf,
                ngx_http_cnt_shm_name_prefix.data,
                ngx_http_cnt_shm_name_prefix.len);
     ngx_memcpy(cnt_name.data + ngx_http_cnt_shm_name_prefix.len,
-               cnt_set_id.data,
-               cnt_set_id.len);
-    cnt_set->zone = ngx_shared_memory_add(cf, &cnt_name, 2 * ngx_pagesize,
+               name->data,
+               name->len);
+
+    /* the size of the zone is set when all counters of the set are known,
+     * sets of http and stream servers share the namespace of zones */
+
+    cnt_set->zone = ngx_shared_memory_add(cf, &cnt_name, 0,
                                           &ngx_http_custom_counters_module);
     if (cnt_set->zone == NULL) {
         return NGX_ERROR;
     }
 
+    if (cnt_set->zone->data != NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "custom counters set \"%V\" was already declared "
+                           "in another context", name);
+        return NGX_ERROR;
+    }
+
     if (ngx_array_init(&cnt_set->vars, cf->pool, 1,
                        sizeof(ngx_http_cnt_set_var_data_t)) != NGX_OK)
     {
         return NGX_ERROR;
     }
 
+    cnt_set->vars_index = ngx_http_cnt_index_create(cf, NULL);
+    if (cnt_set->vars_index == NULL) {
+        return NGX_ERROR;
+    }
+
     ngx_memzero(&cnt_set->histograms, sizeof(ngx_array_t));
+    ngx_memzero(&cnt_set->arrays, sizeof(ngx_array_t));
 
     shm_data = ngx_palloc(cf->pool, sizeof(ngx_http_cnt_shm_data_t));
     if (shm_data == NULL) {
         return NGX_ERROR;
     }
 
-    scf->cnt_set = mcf->cnt_sets.nelts - 1;
-    shm_data->cnt_sets = &mcf->cnt_sets;
-    shm_data->cnt_set = scf->cnt_set;
+    shm_data->cnt_sets = cnt_sets;
+    shm_data->cnt_set = cnt_sets->nelts - 1;
 #ifdef NGX_HTTP_CUSTOM_COUNTERS_PERSISTENCY
-    shm_data->persistent_collection = mcf->persistent_collection;
-    shm_data->persistent_collection_tok = mcf->persistent_collection_tok;
-    shm_data->persistent_collection_size = mcf->persistent_collection_size;
+    ngx_http_cnt_shm_data_persistent_init(shm_data, mcf);
 #endif
 
     cnt_set->zone->init = ngx_http_cnt_shm_init;
     cnt_set->zone->data = shm_data;
     cnt_set->survive_reload = 0;
+#ifdef NGX_HTTP_CUSTOM_COUNTERS_PERSISTENCY
+    cnt_set->persistent_block = NULL;
+    cnt_set->persistent_fresh = 0;
+#endif
 
-    return NGX_OK;
+    return shm_data->cnt_set;
 }
 
 
@@ -1004,40 +1919,163 @@ ngx_http_cnt_var_data_init(ngx_conf_t *cf, ngx_http_cnt_srv_conf_t *scf,
 }
 
 
+/* adds a counter with variable index v_idx to the counter set, returns its
+ * slot in the set; the scale of the counter is set in its first declaration,
+ * other declarations may omit it */
+
+ngx_int_t
+ngx_http_cnt_set_add_counter(ngx_conf_t *cf, ngx_http_cnt_set_t *cnt_set,
+                             ngx_str_t *name, ngx_int_t v_idx,
+                             ngx_uint_t *point, ngx_uint_t scaled)
+{
+    ngx_http_cnt_set_var_data_t   *var;
+    ngx_int_t                      idx;
+
+    idx = ngx_http_cnt_index_lookup(cnt_set->vars_index, v_idx);
+    if (idx == NGX_ERROR) {
+        var = ngx_array_push(&cnt_set->vars);
+        if (var == NULL) {
+            return NGX_ERROR;
+        }
+        idx = cnt_set->vars.nelts - 1;
+        var->self = v_idx;
+        var->idx = idx;
+        var->name = *name;
+        var->point = *point;
+        var->array = NGX_ERROR;
+        if (ngx_http_cnt_index_insert(cf, cnt_set->vars_index, v_idx, idx)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+        return idx;
+    }
+
+    var = &((ngx_http_cnt_set_var_data_t *) cnt_set->vars.elts)[idx];
+    if (!scaled) {
+        *point = var->point;
+    } else if (var->point != *point) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "custom counter \"%V\" was declared with "
+                           "a different scale", name);
+        return NGX_ERROR;
+    }
+
+    return idx;
+}
+
+
+/* declares a counter in the counter set of the server, returns its slot in
+ * the set */
+
+ngx_int_t
+ngx_http_cnt_counter_var_init(ngx_conf_t *cf, ngx_http_cnt_main_conf_t *mcf,
+                              ngx_http_cnt_srv_conf_t *scf, ngx_str_t *name,
+                              ngx_uint_t *point, ngx_uint_t scaled,
+                              ngx_int_t *v_idx)
+{
+    ngx_http_variable_t           *v;
+    ngx_http_cnt_set_t            *cnt_sets;
+    ngx_int_t                      idx;
+
+    if (ngx_http_cnt_counter_set_init(cf, mcf, scf) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    v = ngx_http_add_variable(cf, name, NGX_HTTP_VAR_CHANGEABLE);
+    if (v == NULL) {
+        return NGX_ERROR;
+    }
+    *v_idx = ngx_http_get_variable_index(cf, name);
+    if (*v_idx == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    cnt_sets = mcf->cnt_sets.elts;
+    idx = ngx_http_cnt_set_add_counter(cf, &cnt_sets[scf->cnt_set], name,
+                                       *v_idx, point, scaled);
+    if (idx == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+    if (v->get_handler != NULL && v->get_handler != ngx_http_cnt_get_value) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "custom counter variable has a different setter");
+        return NGX_ERROR;
+    }
+    if (ngx_http_cnt_var_data_init(cf, scf, v, idx, ngx_http_cnt_get_value,
+                                   NGX_ERROR)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    return idx;
+}
+
+
+/* the declaration hook of http servers, the counter set is the set of the
+ * current server */
+
+ngx_int_t
+ngx_http_cnt_declare_counter(ngx_conf_t *cf, ngx_str_t *name,
+                             ngx_uint_t *point, ngx_uint_t scaled,
+                             ngx_int_t *v_idx)
+{
+    ngx_http_cnt_main_conf_t      *mcf;
+    ngx_http_cnt_srv_conf_t       *scf;
+
+    mcf = ngx_http_conf_get_module_main_conf(cf,
+                                             ngx_http_custom_counters_module);
+    scf = ngx_http_conf_get_module_srv_conf(cf,
+                                            ngx_http_custom_counters_module);
+
+    return ngx_http_cnt_counter_var_init(cf, mcf, scf, name, point, scaled,
+                                         v_idx);
+}
+
+
 char *
 ngx_http_cnt_counter_impl(ngx_conf_t *cf, ngx_command_t *cmd, void *conf,
                           ngx_uint_t early)
 {
     ngx_http_cnt_loc_conf_t       *lcf = conf;
 
-    ngx_uint_t                     i;
-    ngx_http_cnt_main_conf_t      *mcf;
-    ngx_http_cnt_srv_conf_t       *scf;
-    ngx_str_t                     *value;
-    ngx_http_variable_t           *v;
-    ngx_http_cnt_set_t            *cnt_sets, *cnt_set;
     ngx_http_cnt_data_t            cnt_data;
-    ngx_http_cnt_set_var_data_t   *vars, *var;
-    ngx_http_cnt_rt_var_data_t    *rt_var;
-    ngx_int_t                      idx = NGX_ERROR, v_idx;
-    ngx_http_cnt_op_e              op = ngx_http_cnt_op_inc;
-    ngx_int_t                      val;
-    ngx_uint_t                     negative = 0;
 
-    if (lcf->cnt_data.nalloc == 0
-        && ngx_array_init(&lcf->cnt_data, cf->pool, 1,
-                          sizeof(ngx_http_cnt_data_t)) != NGX_OK)
+    if (ngx_http_cnt_loc_conf_init(cf, lcf) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (ngx_http_cnt_parse_counter(cf, ngx_http_cnt_declare_counter,
+                                   ngx_http_get_variable_index, &cnt_data)
+        != NGX_CONF_OK)
     {
-        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                           "failed to allocate memory for custom counters in "
-                           "location configuration data");
         return NGX_CONF_ERROR;
     }
 
-    mcf = ngx_http_conf_get_module_main_conf(cf,
-                                             ngx_http_custom_counters_module);
-    scf = ngx_http_conf_get_module_srv_conf(cf,
-                                            ngx_http_custom_counters_module);
+    cnt_data.early = early;
+
+    return ngx_http_cnt_merge(cf, &lcf->cnt_data, lcf->cnt_data_index,
+                              &cnt_data);
+}
+
+
+/* parses arguments "$name [op [value]] [scale=] [multi=]" of directive
+ * counter, the counter gets declared with the declaration hook */
+
+char *
+ngx_http_cnt_parse_counter(ngx_conf_t *cf, ngx_http_cnt_declare_pt declare,
+                           ngx_http_cnt_var_index_pt var_index,
+                           ngx_http_cnt_data_t *cnt_data)
+{
+    ngx_str_t                     *value;
+    ngx_http_cnt_rt_var_data_t    *rt_var;
+    ngx_int_t                      idx = NGX_ERROR, v_idx;
+    ngx_http_cnt_op_e              op = ngx_http_cnt_op_inc;
+    ngx_str_t                     *arg;
+    ngx_int_t                      val, scale;
+    ngx_uint_t                     i, negative = 0, point = 0, scaled = 0;
+    ngx_http_cnt_multi_e           multi = ngx_http_cnt_multi_none;
 
     value = cf->args->elts;
 
@@ -1049,53 +2087,57 @@ ngx_http_cnt_counter_impl(ngx_conf_t *cf, ngx_command_t *cmd, void *conf,
     value[1].len--;
     value[1].data++;
 
-    if (ngx_http_cnt_counter_set_init(cf, mcf, scf) != NGX_OK) {
-        return NGX_CONF_ERROR;
-    }
-
-    v = ngx_http_add_variable(cf, &value[1], NGX_HTTP_VAR_CHANGEABLE);
-    if (v == NULL) {
-        return NGX_CONF_ERROR;
-    }
-    v_idx = ngx_http_get_variable_index(cf, &value[1]);
-    if (v_idx == NGX_ERROR) {
-        return NGX_CONF_ERROR;
-    }
+    /* options scale= and multi= are optional last arguments */
 
-    cnt_sets = mcf->cnt_sets.elts;
-    cnt_set = &cnt_sets[scf->cnt_set];
-    vars = cnt_set->vars.elts;
-    for (i = 0; i < cnt_set->vars.nelts; i++) {
-        if (vars[i].self == v_idx) {
-            idx = i;
+    while (cf->args->nelts > 2) {
+        arg = &value[cf->args->nelts - 1];
+        if (arg->len > 6 && ngx_strncmp(arg->data, "scale=", 6) == 0
+            && !scaled)
+        {
+            val = ngx_http_cnt_parse_scale(cf, arg);
+            if (val == NGX_ERROR) {
+                return NGX_CONF_ERROR;
+            }
+            point = val;
+            scaled = 1;
+        } else if (arg->len > 6 && ngx_strncmp(arg->data, "multi=", 6) == 0
+                   && multi == ngx_http_cnt_multi_none)
+        {
+            multi = ngx_http_cnt_parse_multi(cf, arg, 0);
+            if (multi == ngx_http_cnt_multi_none) {
+                return NGX_CONF_ERROR;
+            }
+        } else {
             break;
         }
+        cf->args->nelts--;
     }
-    if (idx == NGX_ERROR) {
-        var = ngx_array_push(&cnt_set->vars);
-        if (var == NULL) {
-            return NGX_CONF_ERROR;
-        }
-        idx = i;
-        var->self = v_idx;
-        var->idx = idx;
-        var->name = value[1];
-    }
-    if (v->get_handler != NULL && v->get_handler != ngx_http_cnt_get_value) {
+
+    if (cf->args->nelts > 4) {
         ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                           "custom counter variable has a different setter");
+                           "invalid number of arguments in \"%V\" directive",
+                           &value[0]);
         return NGX_CONF_ERROR;
     }
-    if (ngx_http_cnt_var_data_init(cf, scf, v, idx, ngx_http_cnt_get_value,
-                                   NGX_ERROR)
-        != NGX_OK)
-    {
+
+    idx = declare(cf, &value[1], &point, scaled, &v_idx);
+    if (idx == NGX_ERROR) {
         return NGX_CONF_ERROR;
     }
 
-    val = cf->args->nelts == 2 ? 0 : 1;
+    for (scale = 1, i = 0; i < point; i++) {
+        scale *= 10;
+    }
+
+    val = cf->args->nelts == 2 ? 0 : scale;
 
-    ngx_memzero(&cnt_data.rt_vars, sizeof(ngx_array_t));
+    ngx_memzero(&cnt_data->rt_vars, sizeof(ngx_array_t));
+
+    if (multi != ngx_http_cnt_multi_none && cf->args->nelts != 4) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "option \"multi=\" requires a variable");
+        return NGX_CONF_ERROR;
+    }
 
     if (cf->args->nelts == 4) {
         if (value[3].len > 1 && value[3].data[0] == '-') {
@@ -1106,21 +2148,22 @@ ngx_http_cnt_counter_impl(ngx_conf_t *cf, ngx_command_t *cmd, void *conf,
         if (value[3].len > 1 && value[3].data[0] == '$') {
             value[3].len--;
             value[3].data++;
-            val = ngx_http_get_variable_index(cf, &value[3]);
+            val = var_index(cf, &value[3]);
             if (val == NGX_ERROR) {
                 return NGX_CONF_ERROR;
             }
-            if (ngx_array_init(&cnt_data.rt_vars, cf->pool, 1,
+            if (ngx_array_init(&cnt_data->rt_vars, cf->pool, 1,
                                sizeof(ngx_http_cnt_rt_var_data_t)) != NGX_OK)
             {
                 return NGX_CONF_ERROR;
             }
-            rt_var = ngx_array_push(&cnt_data.rt_vars);
+            rt_var = ngx_array_push(&cnt_data->rt_vars);
             if (rt_var == NULL) {
                 return NGX_CONF_ERROR;
             }
             rt_var->self = val;
             rt_var->negative = negative;
+            rt_var->multi = multi;
             /* FIXME: rt_var can be freed later in ngx_http_cnt_merge() after
              * pushing its data into the corresponding lcf->cnt_data storage
              * if the latter was already containing references to run-time
@@ -1129,7 +2172,12 @@ ngx_http_cnt_counter_impl(ngx_conf_t *cf, ngx_command_t *cmd, void *conf,
              * would lead to huge memory losses */
             val = 0;
         } else {
-            val = ngx_atoi(value[3].data, value[3].len);
+            if (multi != ngx_http_cnt_multi_none) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "option \"multi=\" requires a variable");
+                return NGX_CONF_ERROR;
+            }
+            val = ngx_http_cnt_parse_value(value[3].data, value[3].len, point);
             if (val == NGX_ERROR) {
                 ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
                                    "not a number \"%V\"", &value[3]);
@@ -1163,13 +2211,65 @@ ngx_http_cnt_counter_impl(ngx_conf_t *cf, ngx_command_t *cmd, void *conf,
         }
     }
 
-    cnt_data.self  = v_idx;
-    cnt_data.idx   = idx;
-    cnt_data.op    = op;
-    cnt_data.value = val;
-    cnt_data.early = early;
+    cnt_data->self  = v_idx;
+    cnt_data->idx   = idx;
+    cnt_data->op    = op;
+    cnt_data->value = val;
+    cnt_data->early = 0;
+    cnt_data->point = point;
+
+    return NGX_CONF_OK;
+}
+
+
+char *
+ngx_http_cnt_observe_impl(ngx_conf_t *cf, void *conf, ngx_int_t self,
+                          ngx_int_t idx, ngx_http_cnt_observe_e type,
+                          ngx_uint_t undo)
+{
+    ngx_http_cnt_loc_conf_t       *lcf = conf;
+
+    ngx_http_cnt_data_t            cnt_data;
+
+    if (ngx_http_cnt_loc_conf_init(cf, lcf) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_memzero(&cnt_data, sizeof(ngx_http_cnt_data_t));
+
+    cnt_data.self = self;
+    cnt_data.idx  = idx;
+    cnt_data.op   = undo ? ngx_http_cnt_op_undo
+                         : type == ngx_http_cnt_observe_array
+                           ? ngx_http_cnt_op_index : ngx_http_cnt_op_observe;
+
+    return ngx_http_cnt_merge(cf, &lcf->cnt_data, lcf->cnt_data_index,
+                              &cnt_data);
+}
+
+
+static ngx_int_t
+ngx_http_cnt_loc_conf_init(ngx_conf_t *cf, ngx_http_cnt_loc_conf_t *lcf)
+{
+    if (lcf->cnt_data.nalloc > 0) {
+        return NGX_OK;
+    }
+
+    if (ngx_array_init(&lcf->cnt_data, cf->pool, 1,
+                       sizeof(ngx_http_cnt_data_t)) != NGX_OK)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "failed to allocate memory for custom counters "
+                           "in location configuration data");
+        return NGX_ERROR;
+    }
+
+    lcf->cnt_data_index = ngx_http_cnt_index_create(cf, NULL);
+    if (lcf->cnt_data_index == NULL) {
+        return NGX_ERROR;
+    }
 
-    return ngx_http_cnt_merge(cf, &lcf->cnt_data, &cnt_data);
+    return NGX_OK;
 }
 
 
@@ -1213,27 +2313,29 @@ ngx_http_cnt_counter_set_id(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 
 static char *
 ngx_http_cnt_merge(ngx_conf_t *cf, ngx_array_t *dst,
-                   ngx_http_cnt_data_t *cnt_data)
+                   ngx_http_cnt_index_t *index, ngx_http_cnt_data_t *cnt_data)
 {
     ngx_http_cnt_data_t               *data = dst->elts;
 
-    ngx_uint_t                         i, size;
+    ngx_uint_t                         size;
     ngx_http_cnt_data_t               *new_data;
+    ngx_array_t                        rt_vars;
     ngx_http_cnt_rt_var_data_t        *rt_var;
-    ngx_int_t                          idx = NGX_ERROR;
+    ngx_int_t                          idx;
 
-    for (i = 0; i < dst->nelts; i++) {
-        if (data[i].self == cnt_data->self) {
-            idx = i;
-            break;
-        }
-    }
+    idx = ngx_http_cnt_index_lookup(index, cnt_data->self);
     if (idx == NGX_ERROR) {
         new_data = ngx_array_push(dst);
         if (new_data == NULL) {
             return NGX_CONF_ERROR;
         }
         *new_data = *cnt_data;
+        if (ngx_http_cnt_index_insert(cf, index, cnt_data->self,
+                                      dst->nelts - 1)
+            != NGX_OK)
+        {
+            return NGX_CONF_ERROR;
+        }
     } else {
         new_data = &data[idx];
         if (new_data->early != cnt_data->early) {
@@ -1249,21 +2351,24 @@ ngx_http_cnt_merge(ngx_conf_t *cf, ngx_array_t *dst,
             new_data->value += cnt_data->value;
             size = cnt_data->rt_vars.nelts;
             if (size > 0) {
-                if (new_data->rt_vars.nalloc == 0
-                    && ngx_array_init(&new_data->rt_vars, cf->pool, size,
-                                      sizeof(ngx_http_cnt_rt_var_data_t))
-                       != NGX_OK)
+                /* the run-time variables may be shared with the parent
+                 * location, merge them into a new array */
+                rt_vars = new_data->rt_vars;
+                if (ngx_array_init(&new_data->rt_vars, cf->pool,
+                                   rt_vars.nelts + size,
+                                   sizeof(ngx_http_cnt_rt_var_data_t))
+                    != NGX_OK)
                 {
                     return NGX_CONF_ERROR;
                 }
-                for (i = 0; i < size; i++) {
-                    rt_var = ngx_array_push(&new_data->rt_vars);
-                    if (rt_var == NULL) {
-                        return NGX_CONF_ERROR;
-                    }
-                    *rt_var = ((ngx_http_cnt_rt_var_data_t *)
-                               cnt_data->rt_vars.elts)[i];
+                rt_var = new_data->rt_vars.elts;
+                if (rt_vars.nelts > 0) {
+                    ngx_memcpy(rt_var, rt_vars.elts, rt_vars.nelts
+                               * sizeof(ngx_http_cnt_rt_var_data_t));
                 }
+                ngx_memcpy(rt_var + rt_vars.nelts, cnt_data->rt_vars.elts,
+                           size * sizeof(ngx_http_cnt_rt_var_data_t));
+                new_data->rt_vars.nelts = rt_vars.nelts + size;
             }
         } else {
             *new_data = *cnt_data;
@@ -1277,12 +2382,34 @@ ngx_http_cnt_merge(ngx_conf_t *cf, ngx_array_t *dst,
 static ngx_inline ngx_int_t
 ngx_http_cnt_phase_handler_impl(ngx_http_request_t *r, ngx_uint_t early)
 {
+    ngx_http_cnt_main_conf_t      *mcf;
+    ngx_http_cnt_loc_conf_t       *lcf;
+    ngx_http_cnt_batch_t          *batch;
+
+    /* the log phase runs in subrequests only with log_subrequest on */
+
     if (r != r->main) {
-        return NGX_DECLINED;
+        lcf = ngx_http_get_module_loc_conf(r, ngx_http_custom_counters_module);
+        if (!lcf->subrequests) {
+            return NGX_DECLINED;
+        }
     }
 
     (void) ngx_http_cnt_update(r, early);
 
+    if (r == r->main && !early) {
+        mcf = ngx_http_get_module_main_conf(r,
+                                            ngx_http_custom_counters_module);
+        if (!mcf->subrequests) {
+            return NGX_DECLINED;
+        }
+
+        batch = ngx_http_cnt_get_batch(r, 0);
+        if (batch != NULL) {
+            ngx_http_cnt_batch_flush(batch);
+        }
+    }
+
     return NGX_DECLINED;
 }
 
@@ -1304,24 +2431,20 @@ ngx_http_cnt_log_phase_handler(ngx_http_request_t *r)
 static ngx_int_t
 ngx_http_cnt_update(ngx_http_request_t *r, ngx_uint_t early)
 {
-    ngx_uint_t                     i, j;
+    ngx_uint_t                     i;
     ngx_http_cnt_main_conf_t      *mcf;
     ngx_http_cnt_srv_conf_t       *scf;
     ngx_http_cnt_loc_conf_t       *lcf;
-    ngx_http_core_main_conf_t     *cmcf;
     ngx_http_cnt_data_t           *cnt_data;
     volatile ngx_atomic_int_t     *shm_data, *dst;
+    ngx_http_cnt_shm_block_t      *block;
     ngx_slab_pool_t               *shpool;
-    ngx_http_cnt_rt_var_data_t    *rt_vars;
-    ngx_http_variable_value_t     *var;
+    ngx_http_cnt_vars_t            vars;
     ngx_http_cnt_set_t            *cnt_sets, *cnt_set;
     ngx_int_t                      value, val;
-    ngx_str_t                      base_var;
-    ngx_http_variable_t           *v;
-    ngx_uint_t                     negative, invalid;
-#ifdef NGX_HTTP_CUSTOM_COUNTERS_PERSISTENCY
-    time_t                         now;
-#endif
+    ngx_uint_t                     changed = 0;
+    ngx_uint_t                     sampled, hot, batch;
+    ngx_atomic_uint_t              start = 0, t = 0;
 
     scf = ngx_http_get_module_srv_conf(r, ngx_http_custom_counters_module);
     if (scf->cnt_set == NGX_CONF_UNSET_UINT) {
@@ -1330,90 +2453,470 @@ ngx_http_cnt_update(ngx_http_request_t *r, ngx_uint_t early)
 
     mcf = ngx_http_get_module_main_conf(r, ngx_http_custom_counters_module);
 
+    sampled = ngx_http_cnt_self_metrics_sampled(mcf->self_metrics);
+    if (sampled) {
+        start = ngx_http_cnt_self_metrics_now();
+    }
+
+    /* operations of subrequests get applied in the log phase of the main
+     * request at once */
+
+    batch = r != r->main;
+
+    hot = !batch && ngx_http_cnt_hot_slots_sampled(mcf->hot_slots);
+
     cnt_sets = mcf->cnt_sets.elts;
     cnt_set = &cnt_sets[scf->cnt_set];
 
-    shm_data = (volatile ngx_atomic_int_t *) cnt_set->zone->data + 1;
+    block = cnt_set->zone->data;
+    shm_data = ngx_http_cnt_shm_values(block);
 
     lcf = ngx_http_get_module_loc_conf(r, ngx_http_custom_counters_module);
     cnt_data = lcf->cnt_data.elts;
 
+    ngx_http_cnt_request_vars(r, &vars);
+
+    ngx_http_cnt_probe4(update__entry, r, early, scf->cnt_set,
+                        lcf->cnt_data.nelts);
+
     for (i = 0; i < lcf->cnt_data.nelts; i++) {
         if (cnt_data[i].early != early) {
             continue;
         }
-        dst = &shm_data[cnt_data[i].idx];
-        rt_vars = cnt_data[i].rt_vars.elts;
-        value = cnt_data[i].value;
-        invalid = 0;
-        for (j = 0; j < cnt_data[i].rt_vars.nelts; j++) {
-            var = ngx_http_get_indexed_variable(r, rt_vars[j].self);
-            if (var == NULL || !var->valid || var->not_found) {
-                invalid = 1;
-                continue;
+        if (cnt_data[i].op == ngx_http_cnt_op_observe) {
+            switch (ngx_http_cnt_update_histogram(r, &vars, scf->cnt_set,
+                                                  cnt_set, cnt_data[i].idx,
+                                                  batch))
+            {
+            case NGX_ERROR:
+                return NGX_ERROR;
+            case NGX_OK:
+                changed = 1;
             }
-            negative = 0;
-            base_var.len = var->len;
-            base_var.data = var->data;
-            if (var->len > 1 && var->data[0] == '-') {
-                base_var.len--;
-                base_var.data++;
-                negative = 1;
+            continue;
+        }
+        if (cnt_data[i].op == ngx_http_cnt_op_index) {
+            val = ngx_http_cnt_array_slot(r, cnt_set, cnt_data[i].idx);
+            if (batch) {
+                if (ngx_http_cnt_batch_add(r, scf->cnt_set, val,
+                                           ngx_http_cnt_op_inc, 1)
+                    != NGX_OK)
+                {
+                    return NGX_ERROR;
+                }
+                continue;
             }
-            val = ngx_atoi(base_var.data, base_var.len);
-            if (val == NGX_ERROR) {
-                cmcf = ngx_http_get_module_main_conf(r, ngx_http_core_module);
-                v = cmcf->variables.elts;
-                ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
-                              "[custom counters] variable \"%V\" has value "
-                              "\"%v\" which is not a number",
-                              &v[rt_vars[j].self].name, var);
-                invalid = 1;
+            (void) ngx_atomic_fetch_add(&shm_data[val], 1);
+            changed = 1;
+            ngx_http_cnt_probe4(update__op, scf->cnt_set, val,
+                                ngx_http_cnt_op_inc, 1);
+            continue;
+        }
+        dst = &shm_data[cnt_data[i].idx];
+        if (ngx_http_cnt_data_value(&vars, &cnt_data[i], mcf->self_metrics,
+                                    &value)
+            != NGX_OK)
+        {
+            continue;
+        }
+        if (batch) {
+            if (cnt_data[i].op == ngx_http_cnt_op_undo
+                || (cnt_data[i].op == ngx_http_cnt_op_inc && value == 0))
+            {
                 continue;
             }
-            if (negative) {
-                val = -val;
+            if (ngx_http_cnt_batch_add(r, scf->cnt_set, cnt_data[i].idx,
+                                       cnt_data[i].op, value)
+                != NGX_OK)
+            {
+                return NGX_ERROR;
             }
-            value += rt_vars[j].negative ? -val : val;
-        }
-        if (invalid) {
             continue;
         }
         if (cnt_data[i].op == ngx_http_cnt_op_set) {
             shpool = (ngx_slab_pool_t *) cnt_set->zone->shm.addr;
+            if (hot) {
+                t = ngx_http_cnt_self_metrics_now();
+            }
             ngx_shmtx_lock(&shpool->mutex);
             *dst = value;
             ngx_shmtx_unlock(&shpool->mutex);
+            if (hot) {
+                ngx_http_cnt_hot_slot_add(mcf->hot_slots, scf->cnt_set,
+                                          cnt_data[i].idx,
+                                          ngx_http_cnt_self_metrics_now() - t);
+            }
+            changed = 1;
+            ngx_http_cnt_probe4(update__op, scf->cnt_set, cnt_data[i].idx,
+                                ngx_http_cnt_op_set, value);
         } else if (cnt_data[i].op == ngx_http_cnt_op_inc) {
             if (value != 0) {
                 /* FIXME: currently there is no protection against overflows
                  * and underflows, e.g. value 9223372036854775807 on a 64-bit
                  * architecture will become -9223372036854775808 rather than 0
                  * after incrementing by one */
+                if (hot) {
+                    t = ngx_http_cnt_self_metrics_now();
+                }
                 (void) ngx_atomic_fetch_add(dst, value);
+                if (hot) {
+                    ngx_http_cnt_hot_slot_add(mcf->hot_slots, scf->cnt_set,
+                                        cnt_data[i].idx,
+                                        ngx_http_cnt_self_metrics_now() - t);
+                }
+                changed = 1;
+                ngx_http_cnt_probe4(update__op, scf->cnt_set, cnt_data[i].idx,
+                                    ngx_http_cnt_op_inc, value);
             }
         }
     }
 
-#ifdef NGX_HTTP_CUSTOM_COUNTERS_PERSISTENCY
-    if (early) {
-        return NGX_OK;
+    if (changed) {
+        ngx_http_cnt_shm_block_touch(block);
     }
 
-    now = ngx_time();
+    ngx_http_cnt_probe3(update__exit, r, early, changed);
+
+    if (sampled) {
+        ngx_http_cnt_self_metrics_sample(mcf->self_metrics, early ?
+                                    ngx_http_cnt_self_update_early_samples :
+                                    ngx_http_cnt_self_update_log_samples,
+                                    start, 0);
+    }
+
+    return NGX_OK;
+}
+
+
+/* computes the value of a counter operation, returns NGX_DECLINED if any of
+ * its run-time variables has no value or is not a number */
+
+ngx_int_t
+ngx_http_cnt_data_value(ngx_http_cnt_vars_t *vars,
+                        ngx_http_cnt_data_t *cnt_data,
+                        ngx_http_cnt_self_metrics_t *self_metrics,
+                        ngx_int_t *value)
+{
+    ngx_uint_t                     i;
+    ngx_http_cnt_rt_var_data_t    *rt_vars;
+    ngx_http_variable_value_t     *var;
+    ngx_int_t                      val, rc;
+    ngx_uint_t                     invalid = 0;
+
+    rt_vars = cnt_data->rt_vars.elts;
+    *value = cnt_data->value;
+
+    for (i = 0; i < cnt_data->rt_vars.nelts; i++) {
+        var = vars->value(vars->data, rt_vars[i].self);
+        if (var == NULL || !var->valid || var->not_found) {
+            invalid = 1;
+            continue;
+        }
+        rc = ngx_http_cnt_parse_var_value(var, cnt_data->point,
+                                          rt_vars[i].multi, &val);
+        if (rc == NGX_DECLINED) {
+            invalid = 1;
+            continue;
+        }
+        if (rc == NGX_ERROR) {
+            ngx_log_error(NGX_LOG_WARN, vars->log, 0,
+                          "[custom counters] variable \"%V\" has value "
+                          "\"%v\" which is not a number",
+                          vars->name(vars->data, rt_vars[i].self), var);
+            if (self_metrics != NULL) {
+                ngx_http_cnt_self_metrics_add(self_metrics,
+                                            ngx_http_cnt_self_rt_var_errors, 1);
+            }
+            invalid = 1;
+            continue;
+        }
+        *value += rt_vars[i].negative ? -val : val;
+    }
+
+    return invalid ? NGX_DECLINED : NGX_OK;
+}
+
+
+void
+ngx_http_cnt_request_vars(ngx_http_request_t *r, ngx_http_cnt_vars_t *vars)
+{
+    vars->data  = r;
+    vars->pool  = r->pool;
+    vars->log   = r->connection->log;
+    vars->value = ngx_http_cnt_request_var_value;
+    vars->name  = ngx_http_cnt_request_var_name;
+}
+
+
+static ngx_http_variable_value_t *
+ngx_http_cnt_request_var_value(void *data, ngx_uint_t index)
+{
+    return ngx_http_get_indexed_variable(data, index);
+}
+
+
+static ngx_str_t *
+ngx_http_cnt_request_var_name(void *data, ngx_uint_t index)
+{
+    ngx_http_core_main_conf_t     *cmcf;
+    ngx_http_variable_t           *v;
+
+    cmcf = ngx_http_get_module_main_conf((ngx_http_request_t *) data,
+                                         ngx_http_core_module);
+    v = cmcf->variables.elts;
+
+    return &v[index].name;
+}
+
+
+/* returns NGX_OK if the shared memory was updated */
+
+static ngx_int_t
+ngx_http_cnt_update_histogram(ngx_http_request_t *r, ngx_http_cnt_vars_t *vars,
+                              ngx_uint_t cnt_set_idx,
+                              ngx_http_cnt_set_t *cnt_set, ngx_int_t histogram,
+                              ngx_uint_t batch)
+{
+    ngx_int_t                      rc, changed = NGX_DECLINED;
+    ngx_http_cnt_observation_t     obs;
+    volatile ngx_atomic_int_t     *shm_data;
+
+    shm_data = ngx_http_cnt_shm_values(cnt_set->zone->data);
+
+    obs.pos = NULL;
+    obs.done = 0;
+
+    for ( ;; ) {
+        rc = ngx_http_cnt_histogram_observe(vars, cnt_set, histogram, &obs);
+        if (rc == NGX_DONE) {
+            return changed;
+        }
+
+        if (batch) {
+            if (ngx_http_cnt_batch_add(r, cnt_set_idx, obs.bin,
+                                       ngx_http_cnt_op_inc, 1)
+                != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+            if (rc == NGX_OK
+                && (ngx_http_cnt_batch_add(r, cnt_set_idx, obs.cnt,
+                                           ngx_http_cnt_op_inc, 1)
+                    != NGX_OK
+                    || ngx_http_cnt_batch_add(r, cnt_set_idx, obs.sum,
+                                              ngx_http_cnt_op_inc, obs.value)
+                       != NGX_OK))
+            {
+                return NGX_ERROR;
+            }
+            continue;
+        }
+
+        (void) ngx_atomic_fetch_add(&shm_data[obs.bin], 1);
+
+        if (rc == NGX_OK) {
+            (void) ngx_atomic_fetch_add(&shm_data[obs.cnt], 1);
+            (void) ngx_atomic_fetch_add(&shm_data[obs.sum], obs.value);
+        }
+
+        ngx_http_cnt_probe4(update__op, cnt_set_idx, obs.bin,
+                            ngx_http_cnt_op_observe, obs.value);
+
+        changed = NGX_OK;
+    }
+}
+
+
+static ngx_http_cnt_batch_t *
+ngx_http_cnt_get_batch(ngx_http_request_t *r, ngx_uint_t create)
+{
+    ngx_http_request_t            *mr = r->main;
+    ngx_http_cnt_batch_t          *batch;
+    ngx_pool_cleanup_t            *cln;
+
+    batch = ngx_http_get_module_ctx(mr, ngx_http_custom_counters_module);
+    if (batch != NULL) {
+        return batch;
+    }
+
+    /* the context gets cleared on internal redirects of the main request,
+     * the batch itself lives in a cleanup of the request pool which also
+     * applies the operations left if the log phase did not run */
+
+    for (cln = mr->pool->cleanup; cln != NULL; cln = cln->next) {
+        if (cln->handler == ngx_http_cnt_batch_cleanup) {
+            batch = cln->data;
+            ngx_http_set_ctx(mr, batch, ngx_http_custom_counters_module);
+            return batch;
+        }
+    }
+
+    if (!create) {
+        return NULL;
+    }
+
+    cln = ngx_pool_cleanup_add(mr->pool, sizeof(ngx_http_cnt_batch_t));
+    if (cln == NULL) {
+        return NULL;
+    }
+
+    batch = cln->data;
+    ngx_memzero(batch, sizeof(ngx_http_cnt_batch_t));
+    batch->mcf = ngx_http_get_module_main_conf(r,
+                                            ngx_http_custom_counters_module);
+    if (ngx_array_init(&batch->ops, mr->pool, 4,
+                       sizeof(ngx_http_cnt_batch_op_t)) != NGX_OK)
+    {
+        return NULL;
+    }
+
+    cln->handler = ngx_http_cnt_batch_cleanup;
+
+    ngx_http_set_ctx(mr, batch, ngx_http_custom_counters_module);
+
+    return batch;
+}
+
+
+static ngx_int_t
+ngx_http_cnt_batch_add(ngx_http_request_t *r, ngx_uint_t cnt_set,
+                       ngx_int_t idx, ngx_http_cnt_op_e op, ngx_int_t value)
+{
+    ngx_uint_t                     h, mask;
+    ngx_http_cnt_batch_t          *batch;
+    ngx_http_cnt_batch_op_t       *ops;
+
+    batch = ngx_http_cnt_get_batch(r, 1);
+    if (batch == NULL) {
+        return NGX_ERROR;
+    }
+
+    /* fan-out pages update the same counters many times, they get merged
+     * into a single operation; the hash is kept at most half full */
+
+    if (2 * batch->ops.nelts >= batch->nbuckets
+        && ngx_http_cnt_batch_rehash(r->main->pool, batch) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
 
-    if (mcf->persistent_collection_check > 0
-        && now - mcf->persistent_collection_last_check
-            > mcf->persistent_collection_check)
+    mask = batch->nbuckets - 1;
+
+    for (h = ngx_hash(cnt_set, idx) & mask; batch->buckets[h] != 0;
+         h = (h + 1) & mask)
     {
-        if (ngx_http_cnt_write_persistent_counters(r, NULL, 1) != NGX_OK) {
-            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                          "failed to save persistent counters backup");
+        ops = (ngx_http_cnt_batch_op_t *) batch->ops.elts
+                + batch->buckets[h] - 1;
+        if (ops->cnt_set == cnt_set && ops->idx == idx) {
+            if (op == ngx_http_cnt_op_set) {
+                ops->op = ngx_http_cnt_op_set;
+                ops->value = value;
+            } else {
+                ops->value += value;
+            }
+            return NGX_OK;
         }
-        mcf->persistent_collection_last_check = now;
     }
-#endif
+
+    ops = ngx_array_push(&batch->ops);
+    if (ops == NULL) {
+        return NGX_ERROR;
+    }
+
+    ops->cnt_set = cnt_set;
+    ops->idx = idx;
+    ops->op = op;
+    ops->value = value;
+
+    batch->buckets[h] = batch->ops.nelts;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_cnt_batch_rehash(ngx_pool_t *pool, ngx_http_cnt_batch_t *batch)
+{
+    ngx_uint_t                     i, h, mask, nbuckets;
+    ngx_uint_t                    *buckets;
+    ngx_http_cnt_batch_op_t       *ops;
+
+    nbuckets = batch->nbuckets == 0 ? 16 : 2 * batch->nbuckets;
+
+    buckets = ngx_pcalloc(pool, nbuckets * sizeof(ngx_uint_t));
+    if (buckets == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (batch->buckets != NULL) {
+        ngx_pfree(pool, batch->buckets);
+    }
+
+    ops = batch->ops.elts;
+    mask = nbuckets - 1;
+
+    for (i = 0; i < batch->ops.nelts; i++) {
+        for (h = ngx_hash(ops[i].cnt_set, ops[i].idx) & mask; buckets[h] != 0;
+             h = (h + 1) & mask)
+        {
+            /* void */
+        }
+        buckets[h] = i + 1;
+    }
+
+    batch->buckets = buckets;
+    batch->nbuckets = nbuckets;
 
     return NGX_OK;
 }
 
+
+static void
+ngx_http_cnt_batch_flush(ngx_http_cnt_batch_t *batch)
+{
+    ngx_uint_t                     i;
+    ngx_http_cnt_batch_op_t       *ops;
+    ngx_http_cnt_set_t            *cnt_sets;
+    ngx_http_cnt_shm_block_t      *block;
+    ngx_slab_pool_t               *shpool;
+    volatile ngx_atomic_int_t     *dst;
+
+    ops = batch->ops.elts;
+    cnt_sets = batch->mcf->cnt_sets.elts;
+
+    for (i = 0; i < batch->ops.nelts; i++) {
+        block = cnt_sets[ops[i].cnt_set].zone->data;
+        dst = &ngx_http_cnt_shm_values(block)[ops[i].idx];
+
+        if (ops[i].op == ngx_http_cnt_op_set) {
+            shpool = (ngx_slab_pool_t *)
+                    cnt_sets[ops[i].cnt_set].zone->shm.addr;
+            ngx_shmtx_lock(&shpool->mutex);
+            *dst = ops[i].value;
+            ngx_shmtx_unlock(&shpool->mutex);
+        } else if (ops[i].value != 0) {
+            (void) ngx_atomic_fetch_add(dst, ops[i].value);
+        } else {
+            continue;
+        }
+
+        ngx_http_cnt_shm_block_touch(block);
+        ngx_http_cnt_probe4(update__op, ops[i].cnt_set, ops[i].idx,
+                            ops[i].op, ops[i].value);
+    }
+
+    batch->ops.nelts = 0;
+
+    if (batch->buckets != NULL) {
+        ngx_memzero(batch->buckets, batch->nbuckets * sizeof(ngx_uint_t));
+    }
+}
+
+
+static void
+ngx_http_cnt_batch_cleanup(void *data)
+{
+    ngx_http_cnt_batch_t          *batch = data;
+
+    ngx_http_cnt_batch_flush(batch);
+}
@@ -22,24 +22,164 @@
 #include <ngx_core.h>
 #include <ngx_http.h>
 
+#include "ngx_http_custom_counters_shm.h"
+
 #ifdef NGX_HTTP_CUSTOM_COUNTERS_PERSISTENCY
-#include "ngx_http_custom_counters_forward_jsmntok.h"
+#if (NGX_THREADS)
+#include <ngx_thread_pool.h>
+#endif
 #endif
 
 
+/* the scale of fixed-point counters is limited by nanoseconds */
+#define NGX_HTTP_CNT_MAX_POINT  9
+
+
+/* how to read variables with lists of values like $upstream_response_time,
+ * observing each value is applicable only to histograms */
+
+typedef enum {
+    ngx_http_cnt_multi_none,
+    ngx_http_cnt_multi_sum,
+    ngx_http_cnt_multi_last,
+    ngx_http_cnt_multi_each
+} ngx_http_cnt_multi_e;
+
+
+/* ranges of map_to_range_index are either listed bound by bound or generated
+ * from a start, a step and the number of bounds: linear bounds grow by the
+ * step, exponential bounds by the factor of the step; the index of a value
+ * in a generated range gets computed directly rather than searched */
+
+typedef enum {
+    ngx_http_cnt_range_list,
+    ngx_http_cnt_range_linear,
+    ngx_http_cnt_range_exponential
+} ngx_http_cnt_range_e;
+
+
+typedef struct {
+    ngx_http_cnt_range_e        type;
+    double                      start;
+    double                      step;
+    double                      log_step;
+    ngx_uint_t                  nbounds;
+} ngx_http_cnt_range_gen_t;
+
+
+/* what gets observed in the log phase: a histogram or a counter array */
+
+typedef enum {
+    ngx_http_cnt_observe_histogram,
+    ngx_http_cnt_observe_array
+} ngx_http_cnt_observe_e;
+
+
+typedef enum {
+    ngx_http_cnt_op_set,
+    ngx_http_cnt_op_inc,
+    ngx_http_cnt_op_undo,
+    ngx_http_cnt_op_observe,
+    ngx_http_cnt_op_index
+} ngx_http_cnt_op_e;
+
+
+typedef struct {
+    ngx_int_t                   self;
+    ngx_uint_t                  negative;
+    ngx_http_cnt_multi_e        multi;
+} ngx_http_cnt_rt_var_data_t;
+
+
+/* in observations of histograms and counter arrays, self is the index of
+ * their variable and idx is their index in the counter set */
+
+typedef struct {
+    ngx_http_cnt_op_e           op;
+    ngx_int_t                   self;
+    ngx_int_t                   idx;
+    ngx_int_t                   value;
+    ngx_array_t                 rt_vars;
+    ngx_uint_t                  early;
+    ngx_uint_t                  point;
+} ngx_http_cnt_data_t;
+
+
+/* counters, observations of histograms and range indexes are shared with the
+ * stream module: at the configuration time, they get the indexes of
+ * variables and declare counters in the counter set of the current server
+ * with the hooks of the module, at run time they read variables of the
+ * request or the session with the lookup */
+
+typedef ngx_int_t (*ngx_http_cnt_var_index_pt)(ngx_conf_t *cf,
+    ngx_str_t *name);
+typedef ngx_int_t (*ngx_http_cnt_declare_pt)(ngx_conf_t *cf, ngx_str_t *name,
+    ngx_uint_t *point, ngx_uint_t scaled, ngx_int_t *v_idx);
+
+
+typedef struct {
+    void                       *data;
+    ngx_pool_t                 *pool;
+    ngx_log_t                  *log;
+    ngx_http_variable_value_t *(*value)(void *data, ngx_uint_t index);
+    ngx_str_t                 *(*name)(void *data, ngx_uint_t index);
+} ngx_http_cnt_vars_t;
+
+
+/* values of fixed-point counters are stored multiplied by 10 ^ point,
+ * elements of counter arrays refer to the index of their array in the
+ * counter set */
+
 typedef struct {
     ngx_int_t                   self;
     ngx_int_t                   idx;
     ngx_str_t                   name;
+    ngx_uint_t                  point;
+    ngx_int_t                   array;
 } ngx_http_cnt_set_var_data_t;
 
 
+/* configuration time indexes of variable indexes, an index may extend the
+ * index of a prefix of the same array; the nodes are allocated from the
+ * temporary pool and must not be used after the configuration is loaded */
+
+typedef struct ngx_http_cnt_index_s  ngx_http_cnt_index_t;
+
+struct ngx_http_cnt_index_s {
+    ngx_rbtree_t                tree;
+    ngx_rbtree_node_t           sentinel;
+    ngx_http_cnt_index_t       *parent;
+};
+
+
+typedef struct {
+    ngx_rbtree_node_t           node;
+    ngx_uint_t                  idx;
+} ngx_http_cnt_index_node_t;
+
+
+typedef struct {
+    ngx_str_node_t              sn;
+    ngx_uint_t                  cnt_set;
+} ngx_http_cnt_set_node_t;
+
+
+typedef struct ngx_http_cnt_self_metrics_s  ngx_http_cnt_self_metrics_t;
+typedef struct ngx_http_cnt_hot_slots_s  ngx_http_cnt_hot_slots_t;
+
+
 typedef struct {
     ngx_str_t                   name;
     ngx_array_t                 vars;
+    ngx_http_cnt_index_t       *vars_index;
     ngx_array_t                 histograms;
+    ngx_array_t                 arrays;
     ngx_shm_zone_t             *zone;
     ngx_uint_t                  survive_reload;
+#ifdef NGX_HTTP_CUSTOM_COUNTERS_PERSISTENCY
+    ngx_http_cnt_shm_block_t   *persistent_block;
+    ngx_uint_t                  persistent_fresh;
+#endif
 } ngx_http_cnt_set_t;
 
 
@@ -50,6 +190,19 @@ typedef struct {
 } ngx_http_cnt_var_data_t;
 
 
+/* data bound to the zone of a counter set before the zone gets initialized,
+ * the array of sets is either of the http or of the stream module */
+
+typedef struct {
+    ngx_array_t                *cnt_sets;
+    ngx_uint_t                  cnt_set;
+#ifdef NGX_HTTP_CUSTOM_COUNTERS_PERSISTENCY
+    ngx_str_t                  *persistent_collection;
+    ngx_array_t                *persistent_journal;
+#endif
+} ngx_http_cnt_shm_data_t;
+
+
 typedef struct {
     ngx_uint_t                  cnt_set;
     ngx_str_t                   cnt_set_id;
@@ -60,30 +213,129 @@ typedef struct {
 
 typedef struct {
     ngx_array_t                 cnt_sets;
+    ngx_rbtree_t                cnt_sets_index;
+    ngx_rbtree_node_t           cnt_sets_sentinel;
     ngx_str_t                   histograms;
     ngx_uint_t                  collection_buf_len;
+    ngx_http_cnt_self_metrics_t *self_metrics;
+    ngx_http_cnt_hot_slots_t   *hot_slots;
+    ngx_flag_t                  subrequests;   /* enabled in any location */
 #ifdef NGX_HTTP_CUSTOM_COUNTERS_PERSISTENCY
     ngx_str_t                   persistent_storage;
     ngx_str_t                   persistent_storage_backup;
+    ngx_str_t                   persistent_storage_dir;
+    ngx_uint_t                  persistent_fsync;
+    ngx_uint_t                  persistent_format;
+    ngx_array_t                 persistent_sets;
+    size_t                      persistent_buf_len;
     ngx_str_t                   persistent_collection;
-    jsmntok_t                  *persistent_collection_tok;
-    int                         persistent_collection_size;
+    ngx_str_t                   persistent_collection_name;
+    ngx_uint_t                  persistent_binary;
     time_t                      persistent_collection_check;
-    time_t                      persistent_collection_last_check;
-    ngx_uint_t                  persistent_storage_backup_requires_init;
+    ngx_str_t                   persistent_journal;
+    ngx_msec_t                  persistent_journal_interval;
+    ngx_array_t                 persistent_journal_sets;
+    ngx_str_t                   persistent_mmap;
+    ngx_str_t                   persistent_mmap_tmp;
+    ngx_array_t                 persistent_fragments;
+#if (NGX_THREADS)
+    ngx_str_t                   persistent_thread_pool_name;
+    ngx_thread_pool_t          *persistent_thread_pool;
+#endif
 #endif
 } ngx_http_cnt_main_conf_t;
 
 
 ngx_int_t ngx_http_cnt_build_collection(ngx_http_request_t *r,
     ngx_cycle_t *cycle, ngx_str_t *collection, ngx_uint_t survive_reload_only);
+u_char *ngx_http_cnt_render_collection(ngx_http_cnt_main_conf_t *mcf,
+    u_char *buf, ngx_uint_t survive_reload_only);
+u_char *ngx_http_cnt_render_set(ngx_http_cnt_set_t *cnt_set, u_char *buf);
+size_t ngx_http_cnt_set_buf_len(ngx_http_cnt_set_t *cnt_set);
+ngx_http_cnt_index_t *ngx_http_cnt_index_create(ngx_conf_t *cf,
+    ngx_http_cnt_index_t *parent);
+ngx_int_t ngx_http_cnt_index_insert(ngx_conf_t *cf, ngx_http_cnt_index_t *index,
+    ngx_rbtree_key_t key, ngx_uint_t idx);
+ngx_int_t ngx_http_cnt_index_lookup(ngx_http_cnt_index_t *index,
+    ngx_rbtree_key_t key);
+ngx_int_t ngx_http_cnt_find_set(ngx_http_cnt_main_conf_t *mcf,
+    ngx_str_t *name);
 ngx_int_t ngx_http_cnt_counter_set_init(ngx_conf_t *cf,
     ngx_http_cnt_main_conf_t *mcf, ngx_http_cnt_srv_conf_t *scf);
+ngx_int_t ngx_http_cnt_counter_set_create(ngx_conf_t *cf,
+    ngx_array_t *cnt_sets, ngx_str_t *name, ngx_http_cnt_main_conf_t *mcf);
+ngx_int_t ngx_http_cnt_shm_init(ngx_shm_zone_t *shm_zone, void *data);
+ngx_int_t ngx_http_cnt_set_add_counter(ngx_conf_t *cf,
+    ngx_http_cnt_set_t *cnt_set, ngx_str_t *name, ngx_int_t v_idx,
+    ngx_uint_t *point, ngx_uint_t scaled);
+ngx_int_t ngx_http_cnt_counter_var_init(ngx_conf_t *cf,
+    ngx_http_cnt_main_conf_t *mcf, ngx_http_cnt_srv_conf_t *scf,
+    ngx_str_t *name, ngx_uint_t *point, ngx_uint_t scaled, ngx_int_t *v_idx);
+ngx_int_t ngx_http_cnt_declare_counter(ngx_conf_t *cf, ngx_str_t *name,
+    ngx_uint_t *point, ngx_uint_t scaled, ngx_int_t *v_idx);
 char *ngx_http_cnt_counter_impl(ngx_conf_t *cf, ngx_command_t *cmd, void *conf,
     ngx_uint_t early);
+char *ngx_http_cnt_parse_counter(ngx_conf_t *cf,
+    ngx_http_cnt_declare_pt declare, ngx_http_cnt_var_index_pt var_index,
+    ngx_http_cnt_data_t *cnt_data);
+ngx_int_t ngx_http_cnt_data_value(ngx_http_cnt_vars_t *vars,
+    ngx_http_cnt_data_t *cnt_data, ngx_http_cnt_self_metrics_t *self_metrics,
+    ngx_int_t *value);
+void ngx_http_cnt_request_vars(ngx_http_request_t *r,
+    ngx_http_cnt_vars_t *vars);
 ngx_int_t ngx_http_cnt_var_data_init(ngx_conf_t *cf,
     ngx_http_cnt_srv_conf_t *scf, ngx_http_variable_t *v, ngx_int_t idx,
     ngx_http_get_variable_pt handler, ngx_int_t bin_idx);
+char *ngx_http_cnt_observe_impl(ngx_conf_t *cf, void *conf, ngx_int_t self,
+    ngx_int_t idx, ngx_http_cnt_observe_e type, ngx_uint_t undo);
+u_char *ngx_http_cnt_sprintf_value(u_char *buf, ngx_atomic_int_t value,
+    ngx_uint_t point);
+ngx_int_t ngx_http_cnt_parse_value(u_char *data, size_t len, ngx_uint_t point);
+ngx_int_t ngx_http_cnt_parse_var_value(ngx_http_variable_value_t *var,
+    ngx_uint_t point, ngx_http_cnt_multi_e multi, ngx_int_t *value);
+ngx_int_t ngx_http_cnt_parse_scale(ngx_conf_t *cf, ngx_str_t *value);
+ngx_http_cnt_multi_e ngx_http_cnt_parse_multi(ngx_conf_t *cf, ngx_str_t *value,
+    ngx_uint_t each);
+ngx_int_t ngx_http_cnt_parse_range_gen(ngx_conf_t *cf, ngx_str_t *value,
+    ngx_uint_t nelts, ngx_http_cnt_range_gen_t *gen);
+double ngx_http_cnt_range_gen_bound(ngx_http_cnt_range_gen_t *gen,
+    ngx_uint_t n);
+ngx_uint_t ngx_http_cnt_range_gen_index(ngx_http_cnt_range_gen_t *gen,
+    ngx_array_t *range, double value);
+
+
+/* elements of lists are separated by commas, and groups of elements written
+ * by different upstreams by colons; a dash stands for a missing value */
+
+static ngx_inline ngx_uint_t
+ngx_http_cnt_next_elt(u_char **pos, u_char *last, ngx_str_t *elt)
+{
+    u_char                     *p = *pos;
+
+    for ( ;; ) {
+        while (p < last && (*p == ' ' || *p == ',' || *p == ':')) {
+            p++;
+        }
+
+        if (p == last) {
+            *pos = p;
+            return 0;
+        }
+
+        elt->data = p;
+
+        while (p < last && *p != ' ' && *p != ',' && *p != ':') {
+            p++;
+        }
+
+        elt->len = p - elt->data;
+
+        if (elt->len != 1 || elt->data[0] != '-') {
+            *pos = p;
+            return 1;
+        }
+    }
+}
 
 
 extern ngx_module_t  ngx_http_custom_counters_module;
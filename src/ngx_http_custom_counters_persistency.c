@@ -20,10 +20,85 @@
 
 #include "ngx_http_custom_counters_module.h"
 #include "ngx_http_custom_counters_persistency.h"
+#include "ngx_http_custom_counters_journal.h"
+#include "ngx_http_custom_counters_mmap.h"
+#include "ngx_http_custom_counters_metrics.h"
+#include "ngx_http_custom_counters_probes.h"
 
-#define JSMN_STATIC
-#define JSMN_STRICT
-#include <jsmn.h>
+
+/* rendered JSON of a persistent set, it gets re-rendered only when the epoch
+ * of the set's block changes */
+
+typedef struct {
+    u_char                     *buf;
+    size_t                      len;
+    ngx_atomic_int_t            epoch;
+    ngx_uint_t                  valid;
+} ngx_http_cnt_fragment_t;
+
+
+/* values get parsed with the scale of the counters of the current set */
+
+typedef struct {
+    u_char                       *pos;
+    u_char                       *last;
+    const char                   *err;
+    ngx_conf_t                   *cf;
+    ngx_http_cnt_set_var_data_t  *vars;
+} ngx_http_cnt_json_parser_t;
+
+
+typedef struct {
+    ngx_event_t                 event;
+    ngx_http_cnt_main_conf_t   *mcf;
+    ngx_http_cnt_write_ctx_t   *ctx;
+#if (NGX_THREADS)
+    ngx_thread_task_t          *task;
+#endif
+} ngx_http_cnt_backup_t;
+
+
+static ngx_int_t ngx_http_cnt_read_persistent_collection(ngx_conf_t *cf,
+    ngx_http_cnt_main_conf_t *mcf, ngx_str_t *storage, size_t file_size);
+static ngx_int_t ngx_http_cnt_check_binary_collection(u_char *buf,
+    size_t size);
+static ngx_int_t ngx_http_cnt_parse_persistent_collection(ngx_conf_t *cf,
+    ngx_http_cnt_main_conf_t *mcf, size_t size);
+static ngx_int_t ngx_http_cnt_json_set(ngx_http_cnt_json_parser_t *jp,
+    ngx_http_cnt_shm_block_t *block, ngx_str_t *array);
+static ngx_int_t ngx_http_cnt_json_matrix(ngx_http_cnt_json_parser_t *jp,
+    ngx_http_cnt_shm_block_t *block, ngx_str_t *histogram);
+static void ngx_http_cnt_json_store(ngx_http_cnt_json_parser_t *jp,
+    ngx_http_cnt_shm_block_t *block, u_char *name, size_t len,
+    ngx_str_t *num);
+static ngx_int_t ngx_http_cnt_json_token(ngx_http_cnt_json_parser_t *jp,
+    u_char ch);
+static ngx_int_t ngx_http_cnt_json_string(ngx_http_cnt_json_parser_t *jp,
+    ngx_str_t *str);
+static ngx_int_t ngx_http_cnt_json_number(ngx_http_cnt_json_parser_t *jp,
+    ngx_str_t *num);
+static ngx_int_t ngx_http_cnt_json_value(ngx_str_t *num, ngx_uint_t point,
+    ngx_int_t *val);
+static size_t ngx_http_cnt_binary_layout(ngx_http_cnt_main_conf_t *mcf,
+    ngx_http_cnt_binary_header_t *hdr);
+static u_char *ngx_http_cnt_render_binary(ngx_http_cnt_main_conf_t *mcf,
+    u_char *buf);
+static u_char *ngx_http_cnt_render_json(ngx_http_cnt_main_conf_t *mcf,
+    u_char *buf);
+static u_char *ngx_http_cnt_render_persistent(ngx_http_cnt_main_conf_t *mcf,
+    u_char *buf);
+
+static void ngx_http_cnt_write_file_impl(ngx_http_cnt_write_ctx_t *ctx);
+static void ngx_http_cnt_backup_ctx_init(ngx_http_cnt_write_ctx_t *ctx,
+    ngx_http_cnt_main_conf_t *mcf);
+static void ngx_http_cnt_backup_handler(ngx_event_t *ev);
+static ngx_int_t ngx_http_cnt_write_backup(ngx_http_cnt_backup_t *backup,
+    ngx_log_t *log);
+
+#if (NGX_THREADS)
+static void ngx_http_cnt_backup_thread_handler(void *data, ngx_log_t *log);
+static void ngx_http_cnt_backup_event_handler(ngx_event_t *ev);
+#endif
 
 
 char *
@@ -32,23 +107,13 @@ ngx_http_cnt_counters_persistent_storage(ngx_conf_t *cf, ngx_command_t *cmd,
 {
     ngx_http_cnt_main_conf_t      *mcf = conf;
     ngx_str_t                     *value = cf->args->elts;
-    ngx_str_t                      path;
-    ngx_file_t                     file, backup_file;
+    ngx_str_t                      path, dir_name, *storage = NULL;
+    ngx_str_t                      name;
     ngx_file_info_t                file_info, file_info_backup;
-    size_t                         file_size = 0;
-    ngx_copy_file_t                copy_file;
-    ngx_fd_t                       fd;
-    u_char                        *buf = NULL;
-    ssize_t                        n;
-    ngx_uint_t                     len;
-    jsmn_parser                    jparse;
-    jsmntok_t                     *jtok = NULL;
-    int                            jrc, jsz;
+    ngx_dir_t                      dir;
+    ngx_uint_t                     i, len;
     ngx_uint_t                     not_found = 0, backup_not_found = 0;
-    ngx_uint_t                     copy_backup_file = 0;
-    ngx_uint_t                     copy_backup_started = 0;
-    ngx_uint_t                     copy_backup_ok = 0;
-    ngx_uint_t                     cleanup_backup = 0;
+    u_char                        *slash = NULL, *p;
 
     if (mcf->persistent_storage.len > 0) {
         ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
@@ -70,6 +135,115 @@ ngx_http_cnt_counters_persistent_storage(ngx_conf_t *cf, ngx_command_t *cmd,
         return NGX_CONF_ERROR;
     }
 
+    for (i = 2; i < cf->args->nelts; i++) {
+        if (value[i].len > 12
+            && ngx_strncmp(value[i].data, "thread_pool=", 12) == 0)
+        {
+#if (NGX_THREADS)
+            /* the pool gets looked up when the worker starts, so that the
+             * writes can fall back to the worker if it was not declared */
+
+            mcf->persistent_thread_pool_name.len = value[i].len - 12;
+            mcf->persistent_thread_pool_name.data = value[i].data + 12;
+
+            continue;
+#else
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "\"thread_pool\" is unsupported "
+                               "on this platform");
+            return NGX_CONF_ERROR;
+#endif
+        }
+
+        if (value[i].len > 6 && ngx_strncmp(value[i].data, "fsync=", 6) == 0)
+        {
+            name.len = value[i].len - 6;
+            name.data = value[i].data + 6;
+
+            if (name.len == 4 && ngx_strncmp(name.data, "none", 4) == 0) {
+                mcf->persistent_fsync = NGX_HTTP_CNT_FSYNC_NONE;
+            } else if (name.len == 4 && ngx_strncmp(name.data, "data", 4) == 0)
+            {
+                mcf->persistent_fsync = NGX_HTTP_CNT_FSYNC_DATA;
+            } else if (name.len == 3 && ngx_strncmp(name.data, "dir", 3) == 0)
+            {
+                mcf->persistent_fsync = NGX_HTTP_CNT_FSYNC_DIR;
+            } else {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid fsync policy \"%V\"", &name);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (value[i].len > 7 && ngx_strncmp(value[i].data, "format=", 7) == 0)
+        {
+            name.len = value[i].len - 7;
+            name.data = value[i].data + 7;
+
+            if (name.len == 4 && ngx_strncmp(name.data, "json", 4) == 0) {
+                mcf->persistent_format = NGX_HTTP_CNT_FORMAT_JSON;
+            } else if (name.len == 6
+                       && ngx_strncmp(name.data, "binary", 6) == 0)
+            {
+                mcf->persistent_format = NGX_HTTP_CNT_FORMAT_BINARY;
+            } else if (name.len == 4 && ngx_strncmp(name.data, "mmap", 4) == 0)
+            {
+                mcf->persistent_format = NGX_HTTP_CNT_FORMAT_MMAP;
+            } else {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid format \"%V\"", &name);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (value[i].len > 8
+            && ngx_strncmp(value[i].data, "journal=", 8) == 0)
+        {
+            name.len = value[i].len - 8;
+            name.data = value[i].data + 8;
+
+            mcf->persistent_journal_interval = ngx_parse_time(&name, 0);
+
+            if (mcf->persistent_journal_interval == (ngx_msec_t) NGX_ERROR
+                || mcf->persistent_journal_interval == 0)
+            {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "bad journal interval \"%V\"", &name);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (i == 2) {
+            mcf->persistent_collection_check = ngx_parse_time(&value[2], 1);
+
+            if (mcf->persistent_collection_check == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_ERR, cf, 0,
+                                   "bad check interval \"%V\"", &value[2]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (mcf->persistent_journal_interval > 0
+        && mcf->persistent_format == NGX_HTTP_CNT_FORMAT_MMAP)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"journal\" cannot be used with \"format=mmap\"");
+        return NGX_CONF_ERROR;
+    }
+
     if (path.data[0] != '/') {
         if (ngx_get_full_name(cf->pool, &cf->cycle->prefix, &path) != NGX_OK) {
             return NGX_CONF_ERROR;
@@ -86,51 +260,68 @@ ngx_http_cnt_counters_persistent_storage(ngx_conf_t *cf, ngx_command_t *cmd,
     mcf->persistent_storage.data[path.len] = '\0';
     mcf->persistent_storage.len = path.len;
 
-    /* BEWARE: unnecessary reading persistent storage on every reload of Nginx,
-     * however this should not be very harmful */
-    ngx_memzero(&file, sizeof(ngx_file_t));
+    len = path.len + 2;
+    mcf->persistent_storage_backup.data = ngx_pnalloc(cf->pool, len);
+    if (mcf->persistent_storage_backup.data == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_memcpy(mcf->persistent_storage_backup.data, path.data, path.len);
+    mcf->persistent_storage_backup.data[path.len] = '~';
+    mcf->persistent_storage_backup.data[path.len + 1] = '\0';
+    mcf->persistent_storage_backup.len = path.len + 1;
 
-    file.name = mcf->persistent_storage;
-    file.log = cf->log;
+    if (mcf->persistent_journal_interval > 0) {
+        len = path.len + sizeof(".journal");
+        mcf->persistent_journal.data = ngx_pnalloc(cf->pool, len);
+        if (mcf->persistent_journal.data == NULL) {
+            return NGX_CONF_ERROR;
+        }
 
-    file.fd = ngx_open_file(file.name.data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+        p = ngx_cpymem(mcf->persistent_journal.data, path.data, path.len);
+        ngx_memcpy(p, ".journal", sizeof(".journal"));
+        mcf->persistent_journal.len = len - 1;
+    }
 
-    if (file.fd == NGX_INVALID_FILE) {
-        ngx_err_t   err = ngx_errno;
-        ngx_dir_t   dir;
-        ngx_str_t   dir_name;
-        u_char     *slash = NULL, *p = file.name.data;
+    p = path.data;
 
-        do {
-            p = ngx_strlchr(p, file.name.data + file.name.len, '/');
-            if (p != NULL) {
-                slash = p++;
-            }
-        } while (p != NULL);
-
-        if (slash == NULL) {
-            ngx_str_set(&dir_name, "./");
-        } else {
-            dir_name.len = slash + 1 - file.name.data;
-            dir_name.data = ngx_pnalloc(cf->pool, dir_name.len + 1);
-            if (dir_name.data == NULL) {
-                ngx_conf_log_error(NGX_LOG_ERR, cf, 0,
-                                "failed to allocate memory to parse JSON data");
-                return NGX_CONF_ERROR;
-            }
-            ngx_memcpy(dir_name.data, file.name.data, dir_name.len);
-            dir_name.data[dir_name.len] = '\0';
+    do {
+        p = ngx_strlchr(p, path.data + path.len, '/');
+        if (p != NULL) {
+            slash = p++;
+        }
+    } while (p != NULL);
+
+    if (slash == NULL) {
+        ngx_str_set(&dir_name, "./");
+    } else {
+        dir_name.len = slash + 1 - path.data;
+        dir_name.data = ngx_pnalloc(cf->pool, dir_name.len + 1);
+        if (dir_name.data == NULL) {
+            return NGX_CONF_ERROR;
         }
+        ngx_memcpy(dir_name.data, path.data, dir_name.len);
+        dir_name.data[dir_name.len] = '\0';
+    }
+
+    mcf->persistent_storage_dir = dir_name;
+
+    /* BEWARE: unnecessary reading persistent storage on every reload of Nginx,
+     * however this should not be very harmful */
 
-        if (err != ENOENT) {
+    if (ngx_file_info(mcf->persistent_storage.data, &file_info)
+        == NGX_FILE_ERROR)
+    {
+        if (ngx_errno != NGX_ENOENT) {
             ngx_conf_log_error(NGX_LOG_ERR, cf, ngx_errno,
-                               ngx_open_file_n " \"%V\" failed", &file.name);
+                               ngx_file_info_n " \"%V\" failed",
+                               &mcf->persistent_storage);
             return NGX_CONF_ERROR;
         }
 
         if (ngx_open_dir(&dir_name, &dir) == NGX_ERROR) {
             ngx_conf_log_error(NGX_LOG_ERR, cf, ngx_errno,
-                               ngx_open_file_n " \"%V\" failed", &file.name);
+                               ngx_open_dir_n " \"%V\" failed", &dir_name);
             return NGX_CONF_ERROR;
         }
 
@@ -141,417 +332,216 @@ ngx_http_cnt_counters_persistent_storage(ngx_conf_t *cf, ngx_command_t *cmd,
 
         /* the file does not exist yet */
         not_found = 1;
-    }
 
-    len = path.len + 2;
-    mcf->persistent_storage_backup.data = ngx_pnalloc(cf->pool, len);
-    if (mcf->persistent_storage_backup.data == NULL) {
-        if (not_found) {
-            return NGX_CONF_ERROR;
-        } else {
-            goto cleanup;
-        }
+    } else {
+        storage = &mcf->persistent_storage;
     }
 
-    ngx_memcpy(mcf->persistent_storage_backup.data, path.data, path.len);
-    mcf->persistent_storage_backup.data[path.len] = '~';
-    mcf->persistent_storage_backup.data[path.len + 1] = '\0';
-    mcf->persistent_storage_backup.len = path.len + 1;
-
     if (ngx_file_info(mcf->persistent_storage_backup.data, &file_info_backup)
         == NGX_FILE_ERROR)
     {
-        if (ngx_errno != ENOENT) {
+        if (ngx_errno != NGX_ENOENT) {
             ngx_conf_log_error(NGX_LOG_ERR, cf, ngx_errno,
                                ngx_file_info_n " \"%V\" failed",
                                &mcf->persistent_storage_backup);
-            if (not_found) {
-                return NGX_CONF_ERROR;
-            } else {
-                goto cleanup;
-            }
+            return NGX_CONF_ERROR;
         }
 
         backup_not_found = 1;
-
-        if (not_found) {
-            goto collection_check;
-        }
     }
 
-    if (!backup_not_found) {
-        if (not_found) {
-            ngx_conf_log_error(NGX_LOG_NOTICE, cf, 0,
-                               "backup persistent storage exists "
-                               "while main persistent storage does not, "
-                               "copying backup content into the main storage");
-            copy_backup_file = 1;
-        } else {
-            if (ngx_fd_info(file.fd, &file_info) == NGX_FILE_ERROR) {
-                ngx_conf_log_error(NGX_LOG_ERR, cf, ngx_errno,
-                                   ngx_fd_info_n " \"%V\" failed", &file.name);
-                goto cleanup;
-            }
-
-            if (ngx_file_mtime(&file_info_backup) > ngx_file_mtime(&file_info))
-            {
-                ngx_conf_log_error(NGX_LOG_NOTICE, cf, 0,
-                                   "backup persistent storage was modified "
-                                   "later than main persistent storage, "
-                                   "copying its content into the main storage");
-                copy_backup_file = 1;
-
-                /* close main persistent storage */
-
-                if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
-                    ngx_conf_log_error(NGX_LOG_ERR, cf, ngx_errno,
-                                       ngx_close_file_n " \"%V\" failed",
-                                       &file.name);
-                }
-            }
-        }
-
-        if (copy_backup_file) {
-
-            do {
-                /* check that backup is not corrupted */
-
-                ngx_memzero(&backup_file, sizeof(ngx_file_t));
-
-                backup_file.name = mcf->persistent_storage_backup;
-                backup_file.log = cf->log;
-
-                backup_file.fd = ngx_open_file(backup_file.name.data,
-                                            NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
-
-                if (backup_file.fd == NGX_INVALID_FILE) {
-                    ngx_conf_log_error(NGX_LOG_ERR, cf, ngx_errno,
-                                       ngx_open_file_n " \"%V\" failed",
-                                       &backup_file.name);
-                    break;
-                }
-
-                cleanup_backup = 1;
-
-                file_size = (size_t) ngx_file_size(&file_info_backup);
-
-                if (file_size == 0) {
-                    break;
-                }
-
-                buf = ngx_alloc(file_size, cf->log);
-                if (buf == NULL) {
-                    ngx_conf_log_error(NGX_LOG_ERR, cf, 0,
-                                       "failed to allocate memory to parse "
-                                       "JSON data");
-                    break;
-                }
-
-                n = ngx_read_file(&backup_file, buf, file_size, 0);
-
-                if (n == NGX_ERROR) {
-                    ngx_conf_log_error(NGX_LOG_ERR, cf, ngx_errno,
-                                       ngx_read_file_n " \"%V\" failed",
-                                       &backup_file.name);
-                    break;
-                }
-
-                if (ngx_close_file(backup_file.fd) == NGX_FILE_ERROR) {
-                    ngx_conf_log_error(NGX_LOG_ERR, cf, ngx_errno,
-                                       ngx_close_file_n " \"%V\" failed",
-                                       &backup_file.name);
-                }
-
-                cleanup_backup = 0;
-
-                if ((size_t) n != file_size) {
-                    ngx_conf_log_error(NGX_LOG_ERR, cf, 0,
-                                       ngx_read_file_n " \"%V\" returned only "
-                                       "%z bytes instead of %z",
-                                       &backup_file.name, n, file_size);
-                    break;
-                }
-
-                jsmn_init(&jparse);
-
-                jrc = jsmn_parse(&jparse, (char *) buf, file_size, NULL, 0);
-                if (jrc < 0) {
-                    ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "JSON parse error: "
-                                       "%d", jrc);
-                    break;
-                }
-
-                jsz = jrc;
-                jtok = ngx_alloc(sizeof(jsmntok_t) * jsz, cf->log);
-                if (jtok == NULL) {
-                    ngx_conf_log_error(NGX_LOG_ERR, cf, 0,
-                                       "failed to allocate memory to parse "
-                                       "JSON data");
-                    break;
-                }
-
-                jsmn_init(&jparse);
-
-                jrc = jsmn_parse(&jparse, (char *) buf, file_size, jtok, jsz);
-                if (jrc < 0) {
-                    ngx_conf_log_error(NGX_LOG_ERR, cf, 0,
-                                       "JSON parse error: %d", jrc);
-                    break;
-                }
-                if (jtok[0].type != JSMN_OBJECT) {
-                    ngx_conf_log_error(NGX_LOG_ERR, cf, 0,
-                                       "unexpected structure of JSON data: "
-                                       "the whole data is not an object");
-                    break;
-                }
-
-                copy_backup_started = 1;
-
-                /* copy backup into the main storage */
-
-                copy_file.size = ngx_file_size(&file_info_backup);
-                copy_file.buf_size = 0;
-                copy_file.access = NGX_FILE_DEFAULT_ACCESS;
-                copy_file.time = ngx_file_mtime(&file_info_backup);
-                copy_file.log = cf->log;
-
-                if (ngx_copy_file(mcf->persistent_storage_backup.data,
-                                  mcf->persistent_storage.data, &copy_file)
-                    != NGX_OK)
-                {
-                    ngx_conf_log_error(NGX_LOG_ERR, cf, 0,
-                                       "failed to copy backup persistent "
-                                       "storage into main persistent storage");
-                    break;
-                }
-
-                copy_backup_ok = 1;
-
-            } while (0);
-
-            ngx_free(buf);
-            ngx_free(jtok);
-
-            if (cleanup_backup) {
-                if (ngx_close_file(backup_file.fd) == NGX_FILE_ERROR) {
-                    ngx_conf_log_error(NGX_LOG_ERR, cf, ngx_errno,
-                                       ngx_close_file_n " \"%V\" failed",
-                                       &backup_file.name);
-                }
-            }
+    /* both storages are replaced atomically when written, and therefore the
+     * more recent of them is always complete: there is no need to check and
+     * copy the backup into the main storage, an empty backup could have been
+     * left by older versions of the module and must be ignored */
 
-            if (copy_backup_started) {
-                if (!copy_backup_ok) {
-                    return NGX_CONF_ERROR;
-                }
-            } else {
-                if (file_size == 0) {
-                    ngx_conf_log_error(NGX_LOG_NOTICE, cf, 0,
-                                       "backup file \"%V\" was not copied as "
-                                       "it was empty", &backup_file.name);
-                } else {
-                    ngx_conf_log_error(NGX_LOG_NOTICE, cf, 0,
-                                       "backup file \"%V\" was not copied as "
-                                       "it seemed to be corrupted",
-                                       &backup_file.name);
-                }
-                if (not_found) {
-                    goto collection_check;
-                }
-            }
+    if (!backup_not_found && ngx_file_size(&file_info_backup) > 0
+        && (not_found
+            || ngx_file_mtime(&file_info_backup) > ngx_file_mtime(&file_info)))
+    {
+        ngx_conf_log_error(NGX_LOG_NOTICE, cf, 0,
+                           "backup persistent storage was modified later "
+                           "than main persistent storage, loading counters "
+                           "from the backup");
+        storage = &mcf->persistent_storage_backup;
+        file_info = file_info_backup;
+    }
 
-            /* reopen main persistent storage */
+    if (storage != NULL
+        && ngx_http_cnt_read_persistent_collection(cf, mcf, storage,
+                                        (size_t) ngx_file_size(&file_info))
+           != NGX_OK)
+    {
+        return NGX_CONF_ERROR;
+    }
 
-            file.fd = ngx_open_file(file.name.data, NGX_FILE_RDONLY,
-                                    NGX_FILE_OPEN, 0);
+    /* the journal was written after the storage had been loaded by the
+     * previous run of Nginx, and therefore it takes precedence */
 
-            if (file.fd == NGX_INVALID_FILE) {
-                ngx_conf_log_error(NGX_LOG_ERR, cf, ngx_errno,
-                                   ngx_open_file_n " \"%V\" failed",
-                                   &file.name);
-                return NGX_CONF_ERROR;
-            }
-        }
+    if (mcf->persistent_journal_interval > 0
+        && ngx_http_cnt_read_persistent_journal(cf, mcf) != NGX_OK)
+    {
+        return NGX_CONF_ERROR;
     }
 
-    if (ngx_fd_info(file.fd, &file_info) == NGX_FILE_ERROR) {
-        ngx_conf_log_error(NGX_LOG_ERR, cf, ngx_errno,
-                           ngx_fd_info_n " \"%V\" failed", &file.name);
-        goto cleanup;
-    }
+    return NGX_CONF_OK;
+}
 
-    file_size = (size_t) ngx_file_size(&file_info);
+
+static ngx_int_t
+ngx_http_cnt_read_persistent_collection(ngx_conf_t *cf,
+                                        ngx_http_cnt_main_conf_t *mcf,
+                                        ngx_str_t *storage, size_t file_size)
+{
+    ngx_fd_t                       fd;
+    u_char                        *buf;
+    ngx_pool_cleanup_t            *cln;
+    ngx_http_cnt_mmap_t           *map;
 
     if (file_size == 0) {
         ngx_conf_log_error(NGX_LOG_ERR, cf, 0,
                            "file \"%V\" is empty, delete it and run again",
-                           &file.name);
-        goto cleanup;
+                           storage);
+        return NGX_ERROR;
     }
 
-    buf = ngx_pnalloc(cf->pool, file_size);
-    if (buf == NULL) {
-        ngx_conf_log_error(NGX_LOG_ERR, cf, 0,
-                           "failed to allocate memory to parse JSON data");
-        goto cleanup;
+    /* the storage is needed only until the counters get loaded into shared
+     * memory zones, the temporary pool gets destroyed after the modules have
+     * been initialized */
+
+    cln = ngx_pool_cleanup_add(cf->temp_pool, sizeof(ngx_http_cnt_mmap_t));
+    if (cln == NULL) {
+        return NGX_ERROR;
     }
 
-    n = ngx_read_file(&file, buf, file_size, 0);
+    fd = ngx_open_file(storage->data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
 
-    if (n == NGX_ERROR) {
+    if (fd == NGX_INVALID_FILE) {
         ngx_conf_log_error(NGX_LOG_ERR, cf, ngx_errno,
-                           ngx_read_file_n " \"%V\" failed", &file.name);
-        goto cleanup;
+                           ngx_open_file_n " \"%V\" failed", storage);
+        return NGX_ERROR;
     }
 
-    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
-        ngx_conf_log_error(NGX_LOG_ERR, cf, ngx_errno,
-                           ngx_close_file_n " \"%V\" failed", &file.name);
-    }
+    /* the storage is mapped rather than read: loading a binary storage then
+     * touches only the pages of the counter sets found in the configuration */
 
-    if ((size_t) n != file_size) {
-        ngx_conf_log_error(NGX_LOG_ERR, cf, 0,
-                           ngx_read_file_n " \"%V\" returned only %z bytes "
-                           "instead of %z", &file.name, n, file_size);
-        return NGX_CONF_ERROR;
-    }
+    buf = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
 
-    jsmn_init(&jparse);
+    if (buf == MAP_FAILED) {
+        ngx_conf_log_error(NGX_LOG_ERR, cf, ngx_errno,
+                           "mmap(\"%V\") failed", storage);
+        buf = NULL;
+    }
 
-    jrc = jsmn_parse(&jparse, (char *) buf, file_size, NULL, 0);
-    if (jrc < 0) {
-        ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "JSON parse error: %d", jrc);
-        ngx_conf_log_error(NGX_LOG_ERR, cf, 0,
-                           "file \"%V\" is corrupted, delete it and run again",
-                           &file.name);
-        return NGX_CONF_ERROR;
+    if (ngx_close_file(fd) == NGX_FILE_ERROR) {
+        ngx_conf_log_error(NGX_LOG_ERR, cf, ngx_errno,
+                           ngx_close_file_n " \"%V\" failed", storage);
     }
 
-    jsz = jrc;
-    jtok = ngx_palloc(cf->pool, sizeof(jsmntok_t) * jsz);
-    if (jtok == NULL) {
-        ngx_conf_log_error(NGX_LOG_ERR, cf, 0,
-                           "failed to allocate memory to parse JSON data");
-        return NGX_CONF_ERROR;
+    if (buf == NULL) {
+        return NGX_ERROR;
     }
 
-    jsmn_init(&jparse);
+    map = cln->data;
+    map->addr = buf;
+    map->size = file_size;
 
-    jrc = jsmn_parse(&jparse, (char *) buf, file_size, jtok, jsz);
-    if (jrc < 0) {
-        ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "JSON parse error: %d", jrc);
-        ngx_conf_log_error(NGX_LOG_ERR, cf, 0,
-                           "file \"%V\" is corrupted, delete it and run again",
-                           &file.name);
-        return NGX_CONF_ERROR;
-    }
-    if (jtok[0].type != JSMN_OBJECT) {
-        ngx_conf_log_error(NGX_LOG_ERR, cf, 0,
-                           "unexpected structure of JSON data: "
-                           "the whole data is not an object");
-        ngx_conf_log_error(NGX_LOG_ERR, cf, 0,
-                           "file \"%V\" is corrupted, delete it and run again",
-                           &file.name);
-        return NGX_CONF_ERROR;
-    }
+    cln->handler = ngx_http_cnt_unmap_persistent_storage;
 
     mcf->persistent_collection.len = file_size;
     mcf->persistent_collection.data = buf;
-    mcf->persistent_collection_tok = jtok;
-    mcf->persistent_collection_size = jsz;
-
-collection_check:
+    mcf->persistent_collection_name = *storage;
 
-    if (cf->args->nelts > 2) {
-        mcf->persistent_collection_check = ngx_parse_time(&value[2], 1);
-
-        if (mcf->persistent_collection_check == NGX_ERROR) {
+    if (file_size >= sizeof(NGX_HTTP_CNT_BINARY_MAGIC) - 1
+        && ngx_memcmp(buf, NGX_HTTP_CNT_BINARY_MAGIC,
+                      sizeof(NGX_HTTP_CNT_BINARY_MAGIC) - 1) == 0)
+    {
+        if (ngx_http_cnt_check_binary_collection(buf, file_size) != NGX_OK) {
             ngx_conf_log_error(NGX_LOG_ERR, cf, 0,
-                               "bad check interval \"%V\"", &value[2]);
-            return NGX_CONF_ERROR;
+                               "unexpected structure of binary data");
+            goto corrupted;
         }
 
-        if (backup_not_found) {
-            /* create backup file with the master process permissions,
-             * later, in the module init function it must be chown()-ed */
+        mcf->persistent_binary = 1;
+
+        return NGX_OK;
+    }
 
-            fd = ngx_open_file(mcf->persistent_storage_backup.data,
-                               NGX_FILE_WRONLY, NGX_FILE_TRUNCATE,
-                               NGX_FILE_DEFAULT_ACCESS);
+    /* JSON data gets parsed when the persistent sets are known */
 
-            if (fd == NGX_INVALID_FILE) {
-                ngx_conf_log_error(NGX_LOG_ERR, cf, ngx_errno,
-                                   ngx_open_file_n " \"%V\" failed",
-                                   &mcf->persistent_storage_backup);
-                return NGX_CONF_ERROR;
-            }
+    return NGX_OK;
 
-            if (ngx_close_file(fd) == NGX_FILE_ERROR) {
-                ngx_conf_log_error(NGX_LOG_ERR, cf, ngx_errno,
-                                   ngx_close_file_n " \"%V\" failed",
-                                   &mcf->persistent_storage_backup);
-            }
+corrupted:
 
-            mcf->persistent_storage_backup_requires_init = 1;
-        }
-    }
+    ngx_conf_log_error(NGX_LOG_ERR, cf, 0,
+                       "file \"%V\" is corrupted, delete it and run again",
+                       storage);
 
-    return NGX_CONF_OK;
+    return NGX_ERROR;
+}
 
-cleanup:
 
-    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
-        ngx_conf_log_error(NGX_LOG_ERR, cf, ngx_errno,
-                           ngx_close_file_n " \"%V\" failed", &file.name);
-    }
+void
+ngx_http_cnt_unmap_persistent_storage(void *data)
+{
+    ngx_http_cnt_mmap_t           *map = data;
 
-    return NGX_CONF_ERROR;
+    if (munmap(map->addr, map->size) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      "munmap(%p, %uz) failed", map->addr, map->size);
+    }
 }
 
 
-ngx_int_t
-ngx_http_cnt_init_persistent_storage(ngx_cycle_t *cycle)
+static ngx_int_t
+ngx_http_cnt_check_binary_collection(u_char *buf, size_t size)
 {
-    ngx_http_cnt_main_conf_t      *mcf;
-    ngx_core_conf_t               *ccf;
-    ngx_file_info_t                file_info;
+    uint64_t                       i, *offsets;
+    ngx_http_cnt_binary_header_t  *hdr;
+    ngx_http_cnt_shm_index_t      *index;
+    ngx_http_cnt_shm_index_elt_t  *buckets;
+
+    hdr = (ngx_http_cnt_binary_header_t *) buf;
+
+    if (size < sizeof(ngx_http_cnt_binary_header_t)
+        || hdr->byte_order != NGX_HTTP_CNT_BINARY_BYTE_ORDER
+        || hdr->atomic_size != sizeof(ngx_atomic_int_t)
+        || hdr->size != size
+        || hdr->index != ngx_align(sizeof(ngx_http_cnt_binary_header_t), 8)
+        || hdr->offsets % 8 != 0 || hdr->offsets < hdr->index
+        || hdr->offsets > size
+        || hdr->nsets > (size - hdr->offsets) / sizeof(uint64_t))
+    {
+        return NGX_ERROR;
+    }
 
-    mcf = ngx_http_cycle_get_module_main_conf(cycle,
-                                              ngx_http_custom_counters_module);
+    index = (ngx_http_cnt_shm_index_t *) (buf + hdr->index);
 
-    if (mcf->persistent_collection_check == 0
-        || mcf->persistent_storage_backup.len == 0)
+    if (ngx_http_cnt_shm_index_check(index, hdr->offsets - hdr->index)
+        != NGX_OK)
     {
-        return NGX_OK;
+        return NGX_ERROR;
     }
 
-    ccf = (ngx_core_conf_t *) ngx_get_conf(cycle->conf_ctx, ngx_core_module);
-    if (!ccf || ccf->user == (ngx_uid_t) NGX_CONF_UNSET_UINT) {
-        return NGX_OK;
-    }
+    buckets = (ngx_http_cnt_shm_index_elt_t *) (index + 1);
 
-    if (ngx_file_info(mcf->persistent_storage_backup.data, &file_info)
-        == NGX_FILE_ERROR)
-    {
-        if (mcf->persistent_storage_backup_requires_init) {
-            ngx_log_error(NGX_LOG_ERR, cycle->log, ngx_errno,
-                          ngx_file_info_n " \"%V\" failed",
-                          &mcf->persistent_storage_backup);
+    for (i = 0; i < index->size; i++) {
+        if (buckets[i].slot > hdr->nsets) {
             return NGX_ERROR;
         }
-
-        file_info.st_uid = ccf->user;
     }
 
-    if ((mcf->persistent_storage_backup_requires_init
-         || file_info.st_uid != ccf->user)
-        && chown((const char *) mcf->persistent_storage_backup.data,
-                 ccf->user, -1) == -1)
-    {
-        ngx_log_error(NGX_LOG_ERR, cycle->log, ngx_errno,
-                      "chown(\"%s\", %d) failed",
-                      mcf->persistent_storage_backup.data, ccf->user);
-        return NGX_ERROR;
+    offsets = (uint64_t *) (buf + hdr->offsets);
+
+    for (i = 0; i < hdr->nsets; i++) {
+        if (offsets[i] % NGX_ALIGNMENT != 0 || offsets[i] >= size
+            || ngx_http_cnt_shm_block_check((ngx_http_cnt_shm_block_t *)
+                                            (buf + offsets[i]),
+                                            size - offsets[i])
+               != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
     }
 
     return NGX_OK;
@@ -559,170 +549,1160 @@ ngx_http_cnt_init_persistent_storage(ngx_cycle_t *cycle)
 
 
 ngx_int_t
-ngx_http_cnt_load_persistent_counters(ngx_log_t *log, ngx_str_t collection,
-                                      jsmntok_t *collection_tok,
-                                      int collection_size, ngx_str_t cnt_set,
-                                      ngx_array_t *vars,
-                                      ngx_atomic_int_t *shm_data)
-{
-    ngx_int_t                      i, j, k;
-    ngx_http_cnt_set_var_data_t   *elts;
-    ngx_int_t                      nelts;
-    ngx_int_t                      idx, val;
-    ngx_str_t                      tok;
-    ngx_uint_t                     skip;
-
-    nelts = vars->nelts;
-    if (nelts == 0) {
+ngx_http_cnt_init_persistent_layout(ngx_conf_t *cf,
+                                    ngx_http_cnt_main_conf_t *mcf)
+{
+    ngx_uint_t                     i;
+    ngx_http_cnt_set_t            *cnt_sets;
+    ngx_http_cnt_set_var_data_t   *set;
+    ngx_http_cnt_binary_header_t   hdr;
+    size_t                         size;
+
+    mcf->persistent_buf_len = mcf->collection_buf_len;
+
+    if (mcf->persistent_storage.len == 0) {
         return NGX_OK;
     }
 
-    elts = vars->elts;
+    /* names of persistent sets with their positions in the binary storage and
+     * the journal, they are indexed like counters in a set */
 
-    for (i = 1; i < collection_size; i++) {
-        if (collection_tok[i].type != JSMN_STRING) {
-            ngx_log_error(NGX_LOG_ERR, log, 0,
-                          "unexpected structure of JSON data: "
-                          "key is not a string");
-            return NGX_ERROR;
-        }
-
-        skip = 0;
-        tok.len = collection_tok[i].end - collection_tok[i].start;
-        tok.data = &collection.data[collection_tok[i].start];
+    if (ngx_array_init(&mcf->persistent_sets, cf->pool, 1,
+                       sizeof(ngx_http_cnt_set_var_data_t)) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
 
-        i++;
+    cnt_sets = mcf->cnt_sets.elts;
 
-        if (tok.len != cnt_set.len
-            || ngx_strncmp(tok.data, cnt_set.data, tok.len) != 0)
-        {
-            skip = 1;
+    for (i = 0; i < mcf->cnt_sets.nelts; i++) {
+        if (!cnt_sets[i].survive_reload) {
+            continue;
         }
 
-        if (i >= collection_size || collection_tok[i].type != JSMN_OBJECT) {
-            ngx_log_error(NGX_LOG_ERR, log, 0,
-                          "unexpected structure of JSON data: "
-                          "value is not an object");
+        set = ngx_array_push(&mcf->persistent_sets);
+        if (set == NULL) {
             return NGX_ERROR;
         }
 
-        if (skip) {
-            i += 2 * collection_tok[i].size;
-            continue;
-        }
-
-        for (j = 0; j < collection_tok[i].size; j++) {
-            idx = i + 1 + j * 2;
+        set->self = i;
+        set->idx = mcf->persistent_sets.nelts - 1;
+        set->name = cnt_sets[i].name;
+    }
 
-            if (collection_tok[idx].type != JSMN_STRING
-                && collection_tok[idx + 1].type != JSMN_PRIMITIVE)
-            {
-                ngx_log_error(NGX_LOG_ERR, log, 0,
-                              "unexpected structure of JSON data: "
-                              "value is not a string / primitive pair");
-                return NGX_ERROR;
-            }
+    size = ngx_http_cnt_binary_layout(mcf, &hdr);
 
-            tok.len = collection_tok[idx].end - collection_tok[idx].start;
-            tok.data = &collection.data[collection_tok[idx].start];
-            for (k = 0; k < nelts; k++) {
-                if (elts[k].name.len == tok.len
-                    && ngx_strncmp(elts[k].name.data, tok.data, tok.len) == 0)
-                {
-                    tok.len =
-                            collection_tok[idx + 1].end -
-                            collection_tok[idx + 1].start;
-                    tok.data =
-                            &collection.data[collection_tok[idx + 1].start];
-
-                    val = ngx_atoi(tok.data, tok.len);
-                    if (val == NGX_ERROR) {
-                        ngx_log_error(NGX_LOG_ERR, log, 0,
-                                      "not a number \"%V\"", &tok);
-                        return NGX_ERROR;
-                    }
-
-                    shm_data[elts[k].idx] = val;
-
-                    break;
-                }
-            }
+    for (i = 0; i < mcf->cnt_sets.nelts; i++) {
+        if (cnt_sets[i].survive_reload) {
+            size += ngx_http_cnt_shm_block_size(&cnt_sets[i].vars);
         }
+    }
+
+    if (mcf->persistent_collection.len > 0 && !mcf->persistent_binary
+        && ngx_http_cnt_parse_persistent_collection(cf, mcf, size) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
 
-        i += j * 2;
+    if (mcf->persistent_format != NGX_HTTP_CNT_FORMAT_JSON) {
+        mcf->persistent_buf_len = size;
     }
 
     return NGX_OK;
 }
 
 
-ngx_int_t
-ngx_http_cnt_write_persistent_counters(ngx_http_request_t *r,
-                                       ngx_cycle_t *cycle, ngx_uint_t backup)
+static ngx_int_t
+ngx_http_cnt_parse_persistent_collection(ngx_conf_t *cf,
+                                         ngx_http_cnt_main_conf_t *mcf,
+                                         size_t size)
 {
-    ngx_http_cnt_main_conf_t      *mcf;
-    ngx_log_t                     *log;
-    ngx_str_t                      collection;
-    ngx_file_t                     file;
-
-    if (r == NULL) {
-        if (cycle == NULL) {
-            return NGX_ERROR;
-        }
-        mcf = ngx_http_cycle_get_module_main_conf(cycle,
-                                            ngx_http_custom_counters_module);
-        log = cycle->log;
-    } else {
-        mcf = ngx_http_get_module_main_conf(r, ngx_http_custom_counters_module);
-        log = r->connection->log;
+    ngx_int_t                      slot;
+    ngx_str_t                      name;
+    ngx_http_cnt_json_parser_t     jp;
+    ngx_http_cnt_set_t            *cnt_sets;
+    ngx_http_cnt_set_var_data_t   *sets;
+    ngx_http_cnt_binary_header_t  *hdr;
+    ngx_http_cnt_shm_index_t      *index;
+    ngx_http_cnt_shm_block_t      *block;
+    uint64_t                      *offsets;
+    u_char                        *buf;
+
+    /* JSON data gets parsed in a single pass right into a binary storage of
+     * the persistent sets of the configuration, which then gets loaded like
+     * a storage in the binary format; both live in the temporary pool */
+
+    buf = ngx_pcalloc(cf->temp_pool, size);
+    if (buf == NULL) {
+        return NGX_ERROR;
     }
 
-    if (mcf->persistent_storage.len == 0) {
-        return NGX_OK;
-    }
+    (void) ngx_http_cnt_init_binary(mcf, buf);
 
-    ngx_memzero(&file, sizeof(ngx_file_t));
+    hdr = (ngx_http_cnt_binary_header_t *) buf;
+    index = (ngx_http_cnt_shm_index_t *) (buf + hdr->index);
+    offsets = (uint64_t *) (buf + hdr->offsets);
 
-    file.name = backup ? mcf->persistent_storage_backup :
-            mcf->persistent_storage;
-    file.log = log;
+    jp.pos = mcf->persistent_collection.data;
+    jp.last = jp.pos + mcf->persistent_collection.len;
+    jp.err = NULL;
+    jp.cf = cf;
 
-    file.fd = ngx_open_file(file.name.data, NGX_FILE_WRONLY,
-                            NGX_FILE_TRUNCATE, NGX_FILE_DEFAULT_ACCESS);
+    cnt_sets = mcf->cnt_sets.elts;
+    sets = mcf->persistent_sets.elts;
 
-    if (file.fd == NGX_INVALID_FILE) {
-        ngx_log_error(NGX_LOG_ERR, log, ngx_errno,
-                      ngx_open_file_n " \"%V\" failed", &file.name);
-        return NGX_ERROR;
+    if (ngx_http_cnt_json_token(&jp, '{') != NGX_OK) {
+        jp.err = "the whole data is not an object";
+        goto corrupted;
     }
 
-    if (ngx_http_cnt_build_collection(r, cycle, &collection, 1) != NGX_OK) {
-        goto cleanup;
-    }
+    if (ngx_http_cnt_json_token(&jp, '}') != NGX_OK) {
 
-    if (ngx_write_file(&file, collection.data, collection.len, 0) == NGX_ERROR)
-    {
-        ngx_log_error(NGX_LOG_ERR, log, ngx_errno,
-                      ngx_write_fd_n " \"%V\" failed", &file.name);
+        for ( ;; ) {
+            if (ngx_http_cnt_json_string(&jp, &name) != NGX_OK) {
+                jp.err = "key is not a string";
+                goto corrupted;
+            }
+
+            if (ngx_http_cnt_json_token(&jp, ':') != NGX_OK
+                || ngx_http_cnt_json_token(&jp, '{') != NGX_OK)
+            {
+                jp.err = "value is not an object";
+                goto corrupted;
+            }
+
+            /* counters of sets that are not persistent anymore get parsed
+             * but not applied */
+
+            slot = ngx_http_cnt_shm_index_lookup(index, name.data, name.len);
+            block = slot == NGX_ERROR ? NULL : (ngx_http_cnt_shm_block_t *)
+                                               (buf + offsets[slot]);
+            jp.vars = slot == NGX_ERROR ? NULL
+                                        : cnt_sets[sets[slot].self].vars.elts;
+
+            if (ngx_http_cnt_json_set(&jp, block, NULL) != NGX_OK) {
+                goto corrupted;
+            }
+
+            if (ngx_http_cnt_json_token(&jp, '}') == NGX_OK) {
+                break;
+            }
+
+            if (ngx_http_cnt_json_token(&jp, ',') != NGX_OK) {
+                jp.err = "expected ',' or '}' after value";
+                goto corrupted;
+            }
+        }
     }
 
-    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
-        ngx_log_error(NGX_LOG_ERR, log, ngx_errno,
-                      ngx_close_file_n " \"%V\" failed", &file.name);
-        return NGX_ERROR;
+    if (ngx_http_cnt_json_token(&jp, '\0') != NGX_OK) {
+        jp.err = "extra data after the object";
+        goto corrupted;
     }
 
+    mcf->persistent_collection.len = size;
+    mcf->persistent_collection.data = buf;
+    mcf->persistent_binary = 1;
+
     return NGX_OK;
 
-cleanup:
+corrupted:
 
-    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
-        ngx_log_error(NGX_LOG_ERR, log, ngx_errno,
-                      ngx_close_file_n " \"%V\" failed", &file.name);
+    ngx_conf_log_error(NGX_LOG_ERR, cf, 0,
+                       "unexpected structure of JSON data: %s at offset %uz",
+                       jp.err,
+                       (size_t) (jp.pos - mcf->persistent_collection.data));
+    ngx_conf_log_error(NGX_LOG_ERR, cf, 0,
+                       "file \"%V\" is corrupted, delete it and run again",
+                       &mcf->persistent_collection_name);
+
+    return NGX_ERROR;
+}
+
+
+static ngx_int_t
+ngx_http_cnt_json_set(ngx_http_cnt_json_parser_t *jp,
+                      ngx_http_cnt_shm_block_t *block, ngx_str_t *array)
+{
+    ngx_str_t                      name, num;
+    u_char                         buf[256];
+
+    if (ngx_http_cnt_json_token(jp, '}') == NGX_OK) {
+        return NGX_OK;
+    }
+
+    for ( ;; ) {
+        if (ngx_http_cnt_json_string(jp, &name) != NGX_OK) {
+            jp->err = "key is not a string";
+            return NGX_ERROR;
+        }
+
+        if (ngx_http_cnt_json_token(jp, ':') != NGX_OK) {
+            jp->err = "expected ':' after key";
+            return NGX_ERROR;
+        }
+
+        /* counter arrays are nested objects keyed by the indexes of their
+         * elements, the elements are counters named after the array with
+         * the index as a suffix */
+
+        if (array == NULL && ngx_http_cnt_json_token(jp, '{') == NGX_OK) {
+            if (ngx_http_cnt_json_set(jp, block, &name) != NGX_OK) {
+                return NGX_ERROR;
+            }
+            goto next;
+        }
+
+        if (array == NULL && ngx_http_cnt_json_token(jp, '[') == NGX_OK) {
+            if (ngx_http_cnt_json_matrix(jp, block, &name) != NGX_OK) {
+                return NGX_ERROR;
+            }
+            goto next;
+        }
+
+        if (ngx_http_cnt_json_number(jp, &num) != NGX_OK) {
+            jp->err = "value is not a number";
+            return NGX_ERROR;
+        }
+
+        if (array != NULL) {
+            if (array->len + 1 + name.len > sizeof(buf)) {
+                goto next;
+            }
+            name.len = ngx_sprintf(buf, "%V_%V", array, &name) - buf;
+            name.data = buf;
+        }
+
+        ngx_http_cnt_json_store(jp, block, name.data, name.len, &num);
+
+    next:
+
+        if (ngx_http_cnt_json_token(jp, '}') == NGX_OK) {
+            return NGX_OK;
+        }
+
+        if (ngx_http_cnt_json_token(jp, ',') != NGX_OK) {
+            jp->err = "expected ',' or '}' after value";
+            return NGX_ERROR;
+        }
+    }
+}
+
+
+/* two-dimensional histograms are arrays of rows, their bins are counters
+ * named after the histogram with the row and the column as suffixes */
+
+static ngx_int_t
+ngx_http_cnt_json_matrix(ngx_http_cnt_json_parser_t *jp,
+                         ngx_http_cnt_shm_block_t *block,
+                         ngx_str_t *histogram)
+{
+    ngx_uint_t                     row, col;
+    ngx_str_t                      num;
+    u_char                         buf[256], *p;
+
+    if (ngx_http_cnt_json_token(jp, ']') == NGX_OK) {
+        return NGX_OK;
+    }
+
+    for (row = 0; /* void */; row++) {
+        if (ngx_http_cnt_json_token(jp, '[') != NGX_OK) {
+            jp->err = "row is not an array";
+            return NGX_ERROR;
+        }
+
+        for (col = 0; ngx_http_cnt_json_token(jp, ']') != NGX_OK; col++) {
+            if (col > 0 && ngx_http_cnt_json_token(jp, ',') != NGX_OK) {
+                jp->err = "expected ',' or ']' after value";
+                return NGX_ERROR;
+            }
+
+            if (ngx_http_cnt_json_number(jp, &num) != NGX_OK) {
+                jp->err = "value is not a number";
+                return NGX_ERROR;
+            }
+
+            if (histogram->len + 2 * (1 + NGX_INT_T_LEN) <= sizeof(buf)) {
+                p = ngx_sprintf(buf, "%V_%ui_%ui", histogram, row, col);
+                ngx_http_cnt_json_store(jp, block, buf, p - buf, &num);
+            }
+        }
+
+        if (ngx_http_cnt_json_token(jp, ']') == NGX_OK) {
+            return NGX_OK;
+        }
+
+        if (ngx_http_cnt_json_token(jp, ',') != NGX_OK) {
+            jp->err = "expected ',' or ']' after row";
+            return NGX_ERROR;
+        }
+    }
+}
+
+
+/* a value with more fractional digits than the scale of its counter, e.g.
+ * after the scale was decreased, is not loaded rather than misscaled */
+
+static void
+ngx_http_cnt_json_store(ngx_http_cnt_json_parser_t *jp,
+                        ngx_http_cnt_shm_block_t *block, u_char *name,
+                        size_t len, ngx_str_t *num)
+{
+    ngx_int_t                      slot, val;
+
+    if (block == NULL) {
+        return;
+    }
+
+    slot = ngx_http_cnt_shm_index_lookup((ngx_http_cnt_shm_index_t *)
+                                         ((u_char *) block + block->index),
+                                         name, len);
+    if (slot == NGX_ERROR) {
+        return;
+    }
+
+    if (ngx_http_cnt_json_value(num, jp->vars[slot].point, &val) != NGX_OK) {
+        ngx_conf_log_error(NGX_LOG_WARN, jp->cf, 0,
+                           "value \"%V\" of counter \"%*s\" does not fit "
+                           "its scale and was not loaded", num, len, name);
+        return;
+    }
+
+    ngx_http_cnt_shm_values(block)[slot] = val;
+}
+
+
+static ngx_int_t
+ngx_http_cnt_json_token(ngx_http_cnt_json_parser_t *jp, u_char ch)
+{
+    /* '\0' stands for the end of data */
+
+    while (jp->pos < jp->last) {
+        switch (*jp->pos) {
+        case ' ':
+        case '\t':
+        case '\r':
+        case '\n':
+            jp->pos++;
+            continue;
+        }
+
+        if (*jp->pos != ch || ch == '\0') {
+            return NGX_ERROR;
+        }
+
+        jp->pos++;
+
+        return NGX_OK;
+    }
+
+    return ch == '\0' ? NGX_OK : NGX_ERROR;
+}
+
+
+static ngx_int_t
+ngx_http_cnt_json_string(ngx_http_cnt_json_parser_t *jp, ngx_str_t *str)
+{
+    u_char                        *p;
+
+    /* escape sequences are not decoded: names of counters and sets written
+     * by Nginx do not contain them */
+
+    if (ngx_http_cnt_json_token(jp, '"') != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    for (p = jp->pos; p < jp->last; p++) {
+        if (*p == '\\') {
+            p++;
+            continue;
+        }
+
+        if (*p == '"') {
+            str->len = p - jp->pos;
+            str->data = jp->pos;
+            jp->pos = p + 1;
+            return NGX_OK;
+        }
     }
 
     return NGX_ERROR;
 }
 
+
+/* returns the number as it was written, it gets parsed when the scale of
+ * its counter is known */
+
+static ngx_int_t
+ngx_http_cnt_json_number(ngx_http_cnt_json_parser_t *jp, ngx_str_t *num)
+{
+    ngx_uint_t                     point = 0;
+
+    num->data = ngx_http_cnt_json_token(jp, '-') == NGX_OK ? jp->pos - 1
+                                                           : jp->pos;
+
+    if (jp->pos == jp->last || *jp->pos < '0' || *jp->pos > '9') {
+        return NGX_ERROR;
+    }
+
+    for ( /* void */ ; jp->pos < jp->last; jp->pos++) {
+        if (*jp->pos == '.' && !point && jp->pos + 1 < jp->last
+            && jp->pos[1] >= '0' && jp->pos[1] <= '9')
+        {
+            point = 1;
+            continue;
+        }
+
+        if (*jp->pos < '0' || *jp->pos > '9') {
+            break;
+        }
+    }
+
+    num->len = jp->pos - num->data;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_cnt_json_value(ngx_str_t *num, ngx_uint_t point, ngx_int_t *val)
+{
+    u_char                        *data, *dot;
+    size_t                         len;
+    ngx_int_t                      n;
+    ngx_uint_t                     negative = 0;
+
+    data = num->data;
+    len = num->len;
+
+    if (len > 0 && *data == '-') {
+        negative = 1;
+        data++;
+        len--;
+    }
+
+    dot = ngx_strlchr(data, data + len, '.');
+    if (dot != NULL && (ngx_uint_t) (data + len - dot - 1) > point) {
+        return NGX_DECLINED;
+    }
+
+    n = ngx_http_cnt_parse_value(data, len, point);
+    if (n == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    *val = negative ? -n : n;
+
+    return NGX_OK;
+}
+
+
+static size_t
+ngx_http_cnt_binary_layout(ngx_http_cnt_main_conf_t *mcf,
+                           ngx_http_cnt_binary_header_t *hdr)
+{
+    ngx_memcpy(hdr->magic, NGX_HTTP_CNT_BINARY_MAGIC, sizeof(hdr->magic));
+
+    hdr->byte_order = NGX_HTTP_CNT_BINARY_BYTE_ORDER;
+    hdr->atomic_size = sizeof(ngx_atomic_int_t);
+    hdr->nsets = mcf->persistent_sets.nelts;
+    hdr->index = ngx_align(sizeof(ngx_http_cnt_binary_header_t), 8);
+    hdr->offsets = ngx_align(hdr->index
+                        + ngx_http_cnt_shm_index_size(&mcf->persistent_sets),
+                             8);
+    hdr->layout = 0;
+
+    /* returns the offset of the first block */
+    return ngx_align(hdr->offsets + sizeof(uint64_t) * hdr->nsets,
+                     NGX_ALIGNMENT);
+}
+
+
+static u_char *
+ngx_http_cnt_render_binary(ngx_http_cnt_main_conf_t *mcf, u_char *buf)
+{
+    ngx_uint_t                     i;
+    ngx_http_cnt_set_t            *cnt_set;
+    ngx_http_cnt_set_var_data_t   *sets;
+    ngx_http_cnt_binary_header_t  *hdr;
+    uint64_t                      *offsets;
+    u_char                        *last;
+
+    hdr = (ngx_http_cnt_binary_header_t *) buf;
+
+    last = buf + ngx_http_cnt_binary_layout(mcf, hdr);
+
+    ngx_http_cnt_shm_index_init((ngx_http_cnt_shm_index_t *)
+                                (buf + hdr->index), &mcf->persistent_sets);
+
+    offsets = (uint64_t *) (buf + hdr->offsets);
+
+    sets = mcf->persistent_sets.elts;
+
+    for (i = 0; i < mcf->persistent_sets.nelts; i++) {
+        cnt_set = &((ngx_http_cnt_set_t *) mcf->cnt_sets.elts)[sets[i].self];
+
+        offsets[sets[i].idx] = last - buf;
+        last += ngx_http_cnt_shm_block_copy(last, cnt_set->zone->data,
+                                            &cnt_set->vars);
+    }
+
+    hdr->size = last - buf;
+
+    return last;
+}
+
+
+u_char *
+ngx_http_cnt_init_binary(ngx_http_cnt_main_conf_t *mcf, u_char *buf)
+{
+    ngx_uint_t                     i;
+    ngx_http_cnt_set_t            *cnt_set;
+    ngx_http_cnt_set_var_data_t   *sets;
+    ngx_http_cnt_binary_header_t  *hdr;
+    uint64_t                      *offsets;
+    u_char                        *last;
+    size_t                         size;
+
+    /* same as ngx_http_cnt_render_binary() but the counters are zeros, the
+     * buffer must be zeroed too */
+
+    hdr = (ngx_http_cnt_binary_header_t *) buf;
+
+    last = buf + ngx_http_cnt_binary_layout(mcf, hdr);
+
+    ngx_http_cnt_shm_index_init((ngx_http_cnt_shm_index_t *)
+                                (buf + hdr->index), &mcf->persistent_sets);
+
+    offsets = (uint64_t *) (buf + hdr->offsets);
+
+    sets = mcf->persistent_sets.elts;
+
+    for (i = 0; i < mcf->persistent_sets.nelts; i++) {
+        cnt_set = &((ngx_http_cnt_set_t *) mcf->cnt_sets.elts)[sets[i].self];
+
+        offsets[sets[i].idx] = last - buf;
+        size = ngx_http_cnt_shm_block_size(&cnt_set->vars);
+        ngx_http_cnt_shm_block_init((ngx_http_cnt_shm_block_t *) last,
+                                    &cnt_set->vars, size);
+        last += size;
+    }
+
+    hdr->size = last - buf;
+
+    return last;
+}
+
+
+static u_char *
+ngx_http_cnt_render_json(ngx_http_cnt_main_conf_t *mcf, u_char *buf)
+{
+    ngx_uint_t                     i;
+    ngx_http_cnt_set_t            *cnt_set;
+    ngx_http_cnt_set_var_data_t   *sets;
+    ngx_http_cnt_fragment_t       *fragments;
+    ngx_atomic_int_t               epoch;
+    u_char                        *last;
+
+    sets = mcf->persistent_sets.elts;
+
+    /* fragments are kept in the process which writes the storage, they get
+     * allocated on the first write */
+
+    if (mcf->persistent_fragments.nalloc == 0
+        && mcf->persistent_sets.nelts > 0)
+    {
+        if (ngx_array_init(&mcf->persistent_fragments, ngx_cycle->pool,
+                           mcf->persistent_sets.nelts,
+                           sizeof(ngx_http_cnt_fragment_t))
+            != NGX_OK)
+        {
+            return ngx_http_cnt_render_collection(mcf, buf, 1);
+        }
+
+        fragments = mcf->persistent_fragments.elts;
+
+        for (i = 0; i < mcf->persistent_sets.nelts; i++) {
+            cnt_set = &((ngx_http_cnt_set_t *)
+                        mcf->cnt_sets.elts)[sets[i].self];
+
+            fragments[i].buf = ngx_pnalloc(ngx_cycle->pool,
+                                           ngx_http_cnt_set_buf_len(cnt_set));
+            if (fragments[i].buf == NULL) {
+                mcf->persistent_fragments.nalloc = 0;
+                return ngx_http_cnt_render_collection(mcf, buf, 1);
+            }
+
+            fragments[i].valid = 0;
+        }
+
+        mcf->persistent_fragments.nelts = mcf->persistent_sets.nelts;
+    }
+
+    fragments = mcf->persistent_fragments.elts;
+
+    last = ngx_sprintf(buf, "{");
+
+    for (i = 0; i < mcf->persistent_sets.nelts; i++) {
+        cnt_set = &((ngx_http_cnt_set_t *) mcf->cnt_sets.elts)[sets[i].self];
+
+        epoch = ngx_http_cnt_shm_block_epoch(cnt_set->zone->data);
+
+        if (!fragments[i].valid || fragments[i].epoch != epoch) {
+            fragments[i].len = ngx_http_cnt_render_set(cnt_set,
+                                                       fragments[i].buf)
+                               - fragments[i].buf;
+            fragments[i].epoch = epoch;
+            fragments[i].valid = 1;
+        }
+
+        if (i > 0) {
+            *last++ = ',';
+        }
+
+        last = ngx_cpymem(last, fragments[i].buf, fragments[i].len);
+    }
+
+    return ngx_sprintf(last, "}");
+}
+
+
+static u_char *
+ngx_http_cnt_render_persistent(ngx_http_cnt_main_conf_t *mcf, u_char *buf)
+{
+    if (mcf->persistent_format != NGX_HTTP_CNT_FORMAT_JSON) {
+        return ngx_http_cnt_render_binary(mcf, buf);
+    }
+
+    return ngx_http_cnt_render_json(mcf, buf);
+}
+
+
+ngx_int_t
+ngx_http_cnt_init_persistent_storage(ngx_cycle_t *cycle)
+{
+    ngx_http_cnt_main_conf_t      *mcf;
+    ngx_core_conf_t               *ccf;
+    ngx_file_info_t                file_info;
+    ngx_uid_t                      user;
+    ngx_gid_t                      group;
+    ngx_uint_t                     mode;
+
+    mcf = ngx_http_cycle_get_module_main_conf(cycle,
+                                              ngx_http_custom_counters_module);
+
+    /* workers replace the backup storage and the journal by renaming their
+     * temporary files, this requires write permission on the directory which
+     * the master process does not grant, and therefore it only gets checked
+     * here with the credentials of the workers */
+
+    if (mcf->persistent_storage.len == 0
+        || ((mcf->persistent_collection_check == 0
+             || mcf->persistent_format == NGX_HTTP_CNT_FORMAT_MMAP)
+            && mcf->persistent_journal_interval == 0))
+    {
+        return NGX_OK;
+    }
+
+    user = geteuid();
+    group = getegid();
+
+    ccf = (ngx_core_conf_t *) ngx_get_conf(cycle->conf_ctx, ngx_core_module);
+    if (ccf != NULL && ccf->user != (ngx_uid_t) NGX_CONF_UNSET_UINT) {
+        user = ccf->user;
+        group = ccf->group;
+    }
+
+    if (user == 0) {
+        return NGX_OK;
+    }
+
+    if (ngx_file_info(mcf->persistent_storage_dir.data, &file_info)
+        == NGX_FILE_ERROR)
+    {
+        ngx_log_error(NGX_LOG_ERR, cycle->log, ngx_errno,
+                      ngx_file_info_n " \"%V\" failed",
+                      &mcf->persistent_storage_dir);
+        return NGX_ERROR;
+    }
+
+    if (file_info.st_uid == user) {
+        mode = S_IWUSR|S_IXUSR;
+    } else if (file_info.st_gid == group) {
+        mode = S_IWGRP|S_IXGRP;
+    } else {
+        mode = S_IWOTH|S_IXOTH;
+    }
+
+    if ((ngx_file_access(&file_info) & mode) != mode) {
+        ngx_log_error(NGX_LOG_WARN, cycle->log, 0,
+                      "directory \"%V\" of the persistent storage is not "
+                      "writable by worker processes, the backup storage and "
+                      "the journal will not be written",
+                      &mcf->persistent_storage_dir);
+    }
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_http_cnt_load_persistent_counters_binary(ngx_str_t collection,
+                                             ngx_str_t cnt_set,
+                                             ngx_http_cnt_shm_block_t *block)
+{
+    ngx_int_t                      slot;
+    ngx_http_cnt_binary_header_t  *hdr;
+    uint64_t                      *offsets;
+
+    /* the collection was checked when read, applying values is linear in the
+     * number of counters in the set */
+
+    hdr = (ngx_http_cnt_binary_header_t *) collection.data;
+
+    slot = ngx_http_cnt_shm_index_lookup((ngx_http_cnt_shm_index_t *)
+                                         (collection.data + hdr->index),
+                                         cnt_set.data, cnt_set.len);
+    if (slot == NGX_ERROR) {
+        return NGX_OK;
+    }
+
+    offsets = (uint64_t *) (collection.data + hdr->offsets);
+
+    ngx_http_cnt_shm_block_load(block, (ngx_http_cnt_shm_block_t *)
+                                (collection.data + offsets[slot]));
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_http_cnt_write_persistent_counters(ngx_cycle_t *cycle)
+{
+    ngx_http_cnt_main_conf_t      *mcf;
+    ngx_log_t                     *log;
+    ngx_http_cnt_write_ctx_t       ctx;
+    u_char                        *tmp, *buf;
+
+    mcf = ngx_http_cycle_get_module_main_conf(cycle,
+                                              ngx_http_custom_counters_module);
+    log = cycle->log;
+
+    if (mcf == NULL || mcf->persistent_storage.len == 0) {
+        return NGX_OK;
+    }
+
+    /* the mapped storage is always up to date */
+    if (mcf->persistent_mmap.len > 0) {
+        return ngx_http_cnt_sync_persistent_mmap(mcf, log);
+    }
+
+    tmp = ngx_pnalloc(cycle->pool,
+                      NGX_HTTP_CNT_TMP_NAME_LEN(&mcf->persistent_storage));
+    if (tmp == NULL) {
+        return NGX_ERROR;
+    }
+
+    buf = ngx_pnalloc(cycle->pool, mcf->persistent_buf_len);
+    if (buf == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_http_cnt_write_ctx_init(&ctx, mcf, &mcf->persistent_storage, tmp);
+
+    ctx.buf = buf;
+    ctx.len = ngx_http_cnt_render_persistent(mcf, buf) - buf;
+
+    ngx_http_cnt_write_file(&ctx);
+
+    if (ctx.failed != NULL) {
+        ngx_log_error(NGX_LOG_ERR, log, ctx.err, "%s \"%s\" failed",
+                      ctx.failed, ctx.failed_name);
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+void
+ngx_http_cnt_write_ctx_init(ngx_http_cnt_write_ctx_t *ctx,
+                            ngx_http_cnt_main_conf_t *mcf, ngx_str_t *name,
+                            u_char *tmp)
+{
+    ngx_memzero(ctx, sizeof(ngx_http_cnt_write_ctx_t));
+
+    ctx->name = *name;
+    ctx->tmp = tmp;
+    ctx->dir = mcf->persistent_storage_dir.data;
+    ctx->fsync = mcf->persistent_fsync;
+    ctx->self_metrics = mcf->self_metrics;
+}
+
+
+void
+ngx_http_cnt_write_file(ngx_http_cnt_write_ctx_t *ctx)
+{
+    ngx_atomic_uint_t              start = 0;
+
+    ngx_http_cnt_probe2(persistent__write__start, ctx->name.data, ctx->len);
+
+    /* the metrics are atomic and can be updated from a thread */
+
+    if (ctx->self_metrics != NULL) {
+        start = ngx_http_cnt_self_metrics_now();
+    }
+
+    ngx_http_cnt_write_file_impl(ctx);
+
+    ngx_http_cnt_probe2(persistent__write__end, ctx->name.data,
+                        ctx->failed != NULL);
+
+    if (ctx->self_metrics != NULL && ctx->failed == NULL) {
+        ngx_http_cnt_self_metrics_sample(ctx->self_metrics,
+                                         ngx_http_cnt_self_persistent_writes,
+                                         start, ctx->len);
+    }
+}
+
+
+static void
+ngx_http_cnt_write_file_impl(ngx_http_cnt_write_ctx_t *ctx)
+{
+    ngx_fd_t                       fd;
+
+    /* this function can be called from a thread, and so it does not log:
+     * a failure is reported via ctx->failed, ctx->failed_name and ctx->err */
+
+    ctx->fd = NGX_INVALID_FILE;
+    ctx->err = 0;
+    ctx->failed = NULL;
+
+    /* the temporary file name contains the pid as more than one process may
+     * write the same storage at the same time */
+    (void) ngx_sprintf(ctx->tmp, "%V.%P%Z", &ctx->name, ngx_pid);
+
+    /* a file kept open may get mapped into memory */
+    fd = ngx_open_file(ctx->tmp,
+                       (ctx->keep_open ? NGX_FILE_RDWR : NGX_FILE_WRONLY),
+                       NGX_FILE_TRUNCATE, NGX_FILE_DEFAULT_ACCESS);
+
+    if (fd == NGX_INVALID_FILE) {
+        ctx->err = ngx_errno;
+        ctx->failed = ngx_open_file_n;
+        ctx->failed_name = ctx->tmp;
+        return;
+    }
+
+    if (ngx_http_cnt_write_fd(fd, ctx->buf, ctx->len) != NGX_OK) {
+        ctx->err = ngx_errno;
+        ctx->failed = ngx_write_fd_n;
+        ctx->failed_name = ctx->tmp;
+    }
+
+    if (ctx->failed == NULL && ctx->fsync != NGX_HTTP_CNT_FSYNC_NONE
+        && fsync(fd) == -1)
+    {
+        ctx->err = ngx_errno;
+        ctx->failed = "fsync()";
+        ctx->failed_name = ctx->tmp;
+    }
+
+    if (!ctx->keep_open || ctx->failed != NULL) {
+        if (ngx_close_file(fd) == NGX_FILE_ERROR && ctx->failed == NULL) {
+            ctx->err = ngx_errno;
+            ctx->failed = ngx_close_file_n;
+            ctx->failed_name = ctx->tmp;
+        }
+
+        fd = NGX_INVALID_FILE;
+    }
+
+    /* a temporary file kept by the caller replaces the storage later */
+
+    if (ctx->failed == NULL && !ctx->keep_tmp
+        && ngx_rename_file(ctx->tmp, ctx->name.data) == NGX_FILE_ERROR)
+    {
+        ctx->err = ngx_errno;
+        ctx->failed = ngx_rename_file_n;
+        ctx->failed_name = ctx->tmp;
+
+        if (fd != NGX_INVALID_FILE) {
+            (void) ngx_close_file(fd);
+        }
+    }
+
+    if (ctx->failed != NULL) {
+        (void) ngx_delete_file(ctx->tmp);
+        return;
+    }
+
+    ctx->fd = fd;
+
+    if (!ctx->keep_tmp) {
+        ngx_http_cnt_sync_dir(ctx);
+    }
+}
+
+
+void
+ngx_http_cnt_sync_dir(ngx_http_cnt_write_ctx_t *ctx)
+{
+    ngx_fd_t                       fd;
+
+    if (ctx->fsync != NGX_HTTP_CNT_FSYNC_DIR) {
+        return;
+    }
+
+    /* make the rename durable */
+
+    fd = ngx_open_file(ctx->dir, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+
+    if (fd == NGX_INVALID_FILE) {
+        ctx->err = ngx_errno;
+        ctx->failed = ngx_open_file_n;
+        ctx->failed_name = ctx->dir;
+        return;
+    }
+
+    if (fsync(fd) == -1) {
+        ctx->err = ngx_errno;
+        ctx->failed = "fsync()";
+        ctx->failed_name = ctx->dir;
+    }
+
+    if (ngx_close_file(fd) == NGX_FILE_ERROR && ctx->failed == NULL) {
+        ctx->err = ngx_errno;
+        ctx->failed = ngx_close_file_n;
+        ctx->failed_name = ctx->dir;
+    }
+}
+
+
+ngx_int_t
+ngx_http_cnt_write_fd(ngx_fd_t fd, u_char *buf, size_t len)
+{
+    ssize_t                        n;
+    size_t                         written = 0;
+
+    while (written < len) {
+        n = ngx_write_fd(fd, buf + written, len - written);
+
+        if (n == -1) {
+            if (ngx_errno == NGX_EINTR) {
+                continue;
+            }
+
+            return NGX_ERROR;
+        }
+
+        written += n;
+    }
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_http_cnt_init_persistent_thread_pool(ngx_cycle_t *cycle)
+{
+#if (NGX_THREADS)
+    ngx_http_cnt_main_conf_t      *mcf;
+
+    mcf = ngx_http_cycle_get_module_main_conf(cycle,
+                                              ngx_http_custom_counters_module);
+
+    if (mcf == NULL || mcf->persistent_thread_pool_name.len == 0) {
+        return NGX_OK;
+    }
+
+    /* the pool is used by the single process which writes the backup, the
+     * journal, or syncs the mapped storage */
+
+    if (ngx_process != NGX_PROCESS_SINGLE
+        && (ngx_process != NGX_PROCESS_WORKER || ngx_worker != 0))
+    {
+        return NGX_OK;
+    }
+
+    mcf->persistent_thread_pool =
+            ngx_thread_pool_get(cycle, &mcf->persistent_thread_pool_name);
+
+    if (mcf->persistent_thread_pool == NULL) {
+        ngx_log_error(NGX_LOG_WARN, cycle->log, 0,
+                      "thread pool \"%V\" was not found, persistent "
+                      "counters will be written in the worker",
+                      &mcf->persistent_thread_pool_name);
+    }
 #endif
 
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_http_cnt_init_persistent_backup(ngx_cycle_t *cycle)
+{
+    ngx_http_cnt_main_conf_t      *mcf;
+    ngx_http_cnt_backup_t         *backup;
+    size_t                         size;
+
+    mcf = ngx_http_cycle_get_module_main_conf(cycle,
+                                              ngx_http_custom_counters_module);
+
+    if (mcf == NULL || mcf->persistent_storage.len == 0
+        || mcf->persistent_collection_check == 0
+        || mcf->persistent_journal_interval > 0
+        || mcf->persistent_format == NGX_HTTP_CNT_FORMAT_MMAP)
+    {
+        return NGX_OK;
+    }
+
+    /* backups are written by a single process, otherwise every worker would
+     * write the same counters */
+
+    if (ngx_process != NGX_PROCESS_SINGLE
+        && (ngx_process != NGX_PROCESS_WORKER || ngx_worker != 0))
+    {
+        return NGX_OK;
+    }
+
+    backup = ngx_pcalloc(cycle->pool, sizeof(ngx_http_cnt_backup_t));
+    if (backup == NULL) {
+        return NGX_ERROR;
+    }
+
+    /* the context is followed by the name of the temporary file and the
+     * snapshot buffer, they live as long as the worker */
+
+    size = sizeof(ngx_http_cnt_write_ctx_t) + mcf->persistent_buf_len
+           + NGX_HTTP_CNT_TMP_NAME_LEN(&mcf->persistent_storage_backup);
+
+#if (NGX_THREADS)
+    if (mcf->persistent_thread_pool != NULL) {
+        backup->task = ngx_thread_task_alloc(cycle->pool, size);
+        if (backup->task == NULL) {
+            return NGX_ERROR;
+        }
+
+        backup->ctx = backup->task->ctx;
+
+        backup->task->handler = ngx_http_cnt_backup_thread_handler;
+        backup->task->event.handler = ngx_http_cnt_backup_event_handler;
+        backup->task->event.data = backup->ctx;
+        backup->task->event.log = cycle->log;
+
+    } else
+#endif
+    {
+        backup->ctx = ngx_palloc(cycle->pool, size);
+        if (backup->ctx == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    ngx_http_cnt_backup_ctx_init(backup->ctx, mcf);
+
+    backup->mcf = mcf;
+
+    backup->event.handler = ngx_http_cnt_backup_handler;
+    backup->event.data = backup;
+    backup->event.log = cycle->log;
+    backup->event.cancelable = 1;
+
+    ngx_add_timer(&backup->event, mcf->persistent_collection_check * 1000);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_cnt_backup_ctx_init(ngx_http_cnt_write_ctx_t *ctx,
+                             ngx_http_cnt_main_conf_t *mcf)
+{
+    ngx_http_cnt_write_ctx_init(ctx, mcf, &mcf->persistent_storage_backup,
+                                (u_char *) (ctx + 1));
+
+    ctx->buf = ctx->tmp
+            + NGX_HTTP_CNT_TMP_NAME_LEN(&mcf->persistent_storage_backup);
+}
+
+
+static void
+ngx_http_cnt_backup_handler(ngx_event_t *ev)
+{
+    ngx_http_cnt_backup_t         *backup = ev->data;
+
+    if (ngx_http_cnt_write_backup(backup, ev->log) != NGX_OK) {
+        ngx_log_error(NGX_LOG_ERR, ev->log, 0,
+                      "failed to save persistent counters backup");
+    }
+
+    ngx_add_timer(ev, backup->mcf->persistent_collection_check * 1000);
+}
+
+
+static ngx_int_t
+ngx_http_cnt_write_backup(ngx_http_cnt_backup_t *backup, ngx_log_t *log)
+{
+    ngx_http_cnt_main_conf_t      *mcf = backup->mcf;
+    ngx_http_cnt_write_ctx_t      *ctx = backup->ctx;
+
+#if (NGX_THREADS)
+    if (backup->task != NULL) {
+        if (backup->task->event.active) {
+            ngx_log_error(NGX_LOG_WARN, log, 0,
+                          "previous persistent counters backup has not been "
+                          "written yet, skipping this one");
+            return NGX_OK;
+        }
+
+        /* only taking the snapshot happens in the event loop, opening and
+         * writing the backup file is done in the thread pool */
+
+        ctx->len = ngx_http_cnt_render_persistent(mcf, ctx->buf) - ctx->buf;
+
+        return ngx_thread_task_post(mcf->persistent_thread_pool,
+                                    backup->task);
+    }
+#endif
+
+    ctx->len = ngx_http_cnt_render_persistent(mcf, ctx->buf) - ctx->buf;
+
+    ngx_http_cnt_write_file(ctx);
+
+    if (ctx->failed != NULL) {
+        ngx_log_error(NGX_LOG_ERR, log, ctx->err, "%s \"%s\" failed",
+                      ctx->failed, ctx->failed_name);
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+#if (NGX_THREADS)
+
+static void
+ngx_http_cnt_backup_thread_handler(void *data, ngx_log_t *log)
+{
+    ngx_http_cnt_write_file(data);
+}
+
+
+static void
+ngx_http_cnt_backup_event_handler(ngx_event_t *ev)
+{
+    ngx_http_cnt_write_ctx_t      *ctx = ev->data;
+
+    if (ctx->failed != NULL) {
+        ngx_log_error(NGX_LOG_ERR, ev->log, ctx->err, "%s \"%s\" failed",
+                      ctx->failed, ctx->failed_name);
+        ngx_log_error(NGX_LOG_ERR, ev->log, 0,
+                      "failed to save persistent counters backup");
+    }
+}
+
+#endif
+
+#endif
@@ -24,17 +24,81 @@
 #include <ngx_core.h>
 #include <ngx_http.h>
 
-#include "ngx_http_custom_counters_forward_jsmntok.h"
+#include "ngx_http_custom_counters_shm.h"
+
+
+#define NGX_HTTP_CNT_FSYNC_NONE  0
+#define NGX_HTTP_CNT_FSYNC_DATA  1
+#define NGX_HTTP_CNT_FSYNC_DIR   2
+
+#define NGX_HTTP_CNT_FORMAT_JSON    0
+#define NGX_HTTP_CNT_FORMAT_BINARY  1
+#define NGX_HTTP_CNT_FORMAT_MMAP    2
+
+/* binary persistent storage: the header is followed by the index of counter
+ * sets names whose slots refer to the offsets of the sets blocks, the blocks
+ * have the same layout as in shared memory, all offsets are relative to the
+ * start of the file */
+
+#define NGX_HTTP_CNT_BINARY_MAGIC       "NGXCNTB1"
+#define NGX_HTTP_CNT_BINARY_BYTE_ORDER  0x01020304
+
+/* length of "<name>.<pid>" with the terminating zero */
+#define NGX_HTTP_CNT_TMP_NAME_LEN(name)  ((name)->len + NGX_INT64_LEN + 2)
+
+
+typedef struct {
+    u_char                      magic[8];
+    uint32_t                    byte_order;
+    uint32_t                    atomic_size;
+    uint64_t                    size;
+    uint64_t                    nsets;
+    uint64_t                    index;
+    uint64_t                    offsets;
+    uint64_t                    layout;    /* hash of a mapped storage */
+} ngx_http_cnt_binary_header_t;
+
+
+typedef struct {
+    u_char                     *addr;
+    size_t                      size;
+} ngx_http_cnt_mmap_t;
+
+
+typedef struct {
+    ngx_str_t                   name;
+    u_char                     *tmp;
+    u_char                     *dir;
+    ngx_uint_t                  fsync;
+    ngx_uint_t                  keep_open;
+    ngx_uint_t                  keep_tmp;
+    ngx_fd_t                    fd;
+    u_char                     *buf;
+    size_t                      len;
+    ngx_err_t                   err;
+    const char                 *failed;
+    u_char                     *failed_name;
+    ngx_http_cnt_self_metrics_t *self_metrics;
+} ngx_http_cnt_write_ctx_t;
 
 
 char *ngx_http_cnt_counters_persistent_storage(ngx_conf_t *cf,
     ngx_command_t *cmd, void *conf);
 ngx_int_t ngx_http_cnt_init_persistent_storage(ngx_cycle_t *cycle);
-ngx_int_t ngx_http_cnt_load_persistent_counters(ngx_log_t* log,
-    ngx_str_t collection, jsmntok_t *collection_tok, int collection_size,
-    ngx_str_t cnt_set, ngx_array_t *vars, ngx_atomic_int_t *shm_data);
-ngx_int_t ngx_http_cnt_write_persistent_counters(ngx_http_request_t *r,
-    ngx_cycle_t *cycle, ngx_uint_t backup);
+ngx_int_t ngx_http_cnt_init_persistent_layout(ngx_conf_t *cf,
+    ngx_http_cnt_main_conf_t *mcf);
+ngx_int_t ngx_http_cnt_load_persistent_counters_binary(ngx_str_t collection,
+    ngx_str_t cnt_set, ngx_http_cnt_shm_block_t *block);
+ngx_int_t ngx_http_cnt_write_persistent_counters(ngx_cycle_t *cycle);
+ngx_int_t ngx_http_cnt_init_persistent_thread_pool(ngx_cycle_t *cycle);
+ngx_int_t ngx_http_cnt_init_persistent_backup(ngx_cycle_t *cycle);
+void ngx_http_cnt_write_ctx_init(ngx_http_cnt_write_ctx_t *ctx,
+    ngx_http_cnt_main_conf_t *mcf, ngx_str_t *name, u_char *tmp);
+void ngx_http_cnt_write_file(ngx_http_cnt_write_ctx_t *ctx);
+void ngx_http_cnt_sync_dir(ngx_http_cnt_write_ctx_t *ctx);
+ngx_int_t ngx_http_cnt_write_fd(ngx_fd_t fd, u_char *buf, size_t len);
+u_char *ngx_http_cnt_init_binary(ngx_http_cnt_main_conf_t *mcf, u_char *buf);
+void ngx_http_cnt_unmap_persistent_storage(void *data);
 
 #endif
 
@@ -0,0 +1,60 @@
+/*
+ * =============================================================================
+ *
+ *       Filename:  ngx_http_custom_counters_probes.h
+ *
+ *    Description:  USDT probes
+ *
+ *        Version:  4.0
+ *        Created:  18.10.2026 20:03:48
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Alexey Radkov (), 
+ *        Company:  
+ *
+ * =============================================================================
+ */
+
+#ifndef NGX_HTTP_CUSTOM_COUNTERS_PROBES_H
+#define NGX_HTTP_CUSTOM_COUNTERS_PROBES_H
+
+
+/* decisions of ngx_http_cnt_shm_init() passed in probe shm__init */
+
+#define NGX_HTTP_CNT_SHM_INIT_NEW         0
+#define NGX_HTTP_CNT_SHM_INIT_REUSE       1
+#define NGX_HTTP_CNT_SHM_INIT_REMAP       2
+#define NGX_HTTP_CNT_SHM_INIT_RESET       3
+#define NGX_HTTP_CNT_SHM_INIT_ATTACH      4
+#define NGX_HTTP_CNT_SHM_INIT_PERSISTENT  5
+
+
+/* the probes are compiled only when the module was configured with
+ * NGX_HTTP_CUSTOM_COUNTERS_USDT=yes, otherwise their arguments are not even
+ * evaluated; a probe is a nop until a tracer attaches to it */
+
+#ifdef NGX_HTTP_CUSTOM_COUNTERS_USDT
+
+#include <sys/sdt.h>
+
+#define ngx_http_cnt_probe1(name, a1)                                         \
+    DTRACE_PROBE1(custom_counters, name, a1)
+#define ngx_http_cnt_probe2(name, a1, a2)                                     \
+    DTRACE_PROBE2(custom_counters, name, a1, a2)
+#define ngx_http_cnt_probe3(name, a1, a2, a3)                                 \
+    DTRACE_PROBE3(custom_counters, name, a1, a2, a3)
+#define ngx_http_cnt_probe4(name, a1, a2, a3, a4)                             \
+    DTRACE_PROBE4(custom_counters, name, a1, a2, a3, a4)
+
+#else
+
+#define ngx_http_cnt_probe1(name, a1)
+#define ngx_http_cnt_probe2(name, a1, a2)
+#define ngx_http_cnt_probe3(name, a1, a2, a3)
+#define ngx_http_cnt_probe4(name, a1, a2, a3, a4)
+
+#endif
+
+#endif /* NGX_HTTP_CUSTOM_COUNTERS_PROBES_H */
+
@@ -0,0 +1,382 @@
+/*
+ * =============================================================================
+ *
+ *       Filename:  ngx_http_custom_counters_shm.c
+ *
+ *    Description:  layout of counters in shared memory
+ *
+ *        Version:  4.0
+ *        Created:  18.10.2026 12:14:07
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Alexey Radkov (), 
+ *        Company:  
+ *
+ * =============================================================================
+ */
+
+#include "ngx_http_custom_counters_module.h"
+#include "ngx_http_custom_counters_shm.h"
+
+
+static ngx_uint_t ngx_http_cnt_shm_index_buckets(ngx_uint_t nelts);
+
+
+static ngx_uint_t
+ngx_http_cnt_shm_index_buckets(ngx_uint_t nelts)
+{
+    ngx_uint_t                     size = 2;
+
+    /* keep the load factor not greater than 0.5, this guarantees that there
+     * is always an empty bucket to stop probing at */
+    while (size < nelts * 2) {
+        size *= 2;
+    }
+
+    return size;
+}
+
+
+size_t
+ngx_http_cnt_shm_index_size(ngx_array_t *vars)
+{
+    ngx_uint_t                     i;
+    ngx_http_cnt_set_var_data_t   *elts = vars->elts;
+    size_t                         size;
+
+    size = sizeof(ngx_http_cnt_shm_index_t)
+            + sizeof(ngx_http_cnt_shm_index_elt_t)
+                * ngx_http_cnt_shm_index_buckets(vars->nelts);
+
+    for (i = 0; i < vars->nelts; i++) {
+        size += elts[i].name.len;
+    }
+
+    return size;
+}
+
+
+void
+ngx_http_cnt_shm_index_init(ngx_http_cnt_shm_index_t *index,
+                            ngx_array_t *vars)
+{
+    ngx_uint_t                     i, j, mask;
+    ngx_http_cnt_set_var_data_t   *elts = vars->elts;
+    ngx_http_cnt_shm_index_elt_t  *buckets;
+    u_char                        *names;
+    uint32_t                       hash, offset = 0;
+
+    index->size = ngx_http_cnt_shm_index_buckets(vars->nelts);
+    mask = index->size - 1;
+
+    buckets = (ngx_http_cnt_shm_index_elt_t *) (index + 1);
+    names = (u_char *) (buckets + index->size);
+
+    ngx_memzero(buckets, sizeof(ngx_http_cnt_shm_index_elt_t) * index->size);
+
+    for (i = 0; i < vars->nelts; i++) {
+        hash = (uint32_t) ngx_hash_key(elts[i].name.data, elts[i].name.len);
+
+        for (j = hash & mask; buckets[j].slot != 0; j = (j + 1) & mask) {
+            /* void */
+        }
+
+        buckets[j].hash = hash;
+        buckets[j].slot = elts[i].idx + 1;
+        buckets[j].name = offset;
+        buckets[j].name_len = elts[i].name.len;
+
+        ngx_memcpy(names + offset, elts[i].name.data, elts[i].name.len);
+        offset += elts[i].name.len;
+    }
+
+    index->names_len = offset;
+}
+
+
+ngx_int_t
+ngx_http_cnt_shm_index_lookup(ngx_http_cnt_shm_index_t *index, u_char *name,
+                              size_t len)
+{
+    ngx_uint_t                     j, mask;
+    ngx_http_cnt_shm_index_elt_t  *buckets;
+    u_char                        *names;
+    uint32_t                       hash;
+
+    if (index->size == 0) {
+        return NGX_ERROR;
+    }
+
+    mask = index->size - 1;
+
+    buckets = (ngx_http_cnt_shm_index_elt_t *) (index + 1);
+    names = (u_char *) (buckets + index->size);
+
+    hash = (uint32_t) ngx_hash_key(name, len);
+
+    for (j = hash & mask; buckets[j].slot != 0; j = (j + 1) & mask) {
+        if (buckets[j].hash == hash && buckets[j].name_len == len
+            && ngx_memcmp(names + buckets[j].name, name, len) == 0)
+        {
+            return buckets[j].slot - 1;
+        }
+    }
+
+    return NGX_ERROR;
+}
+
+
+size_t
+ngx_http_cnt_shm_block_size(ngx_array_t *vars)
+{
+    size_t                         size;
+
+    size = sizeof(ngx_http_cnt_shm_block_t)
+            + sizeof(ngx_atomic_int_t) * vars->nelts
+            + ngx_http_cnt_shm_index_size(vars);
+
+    return ngx_align(size, NGX_ALIGNMENT);
+}
+
+
+size_t
+ngx_http_cnt_shm_zone_size(ngx_array_t *vars)
+{
+    size_t                         size;
+    ngx_uint_t                     pages, n = 2;
+
+    /* two generations of the block must fit in the zone at the same time
+     * while a reload remaps counters, plus one page for the slab pool header
+     * and slab page descriptors; the result is rounded up to a power of two
+     * pages, so that adding a few counters does not usually resize the zone
+     * which would otherwise turn remapping into copying between zones */
+    pages = 2 * (ngx_align(ngx_http_cnt_shm_block_size(vars), ngx_pagesize)
+                 / ngx_pagesize);
+
+    size = (pages + 1) * ngx_pagesize
+            + ngx_align(pages * sizeof(ngx_slab_page_t), ngx_pagesize);
+
+    while (n * ngx_pagesize < size) {
+        n *= 2;
+    }
+
+    return n * ngx_pagesize;
+}
+
+
+void
+ngx_http_cnt_shm_block_init(ngx_http_cnt_shm_block_t *block,
+                            ngx_array_t *vars, size_t size)
+{
+    block->nelts = vars->nelts;
+    block->size = size;
+    block->index = sizeof(ngx_http_cnt_shm_block_t)
+            + sizeof(ngx_atomic_int_t) * vars->nelts;
+
+    ngx_http_cnt_shm_index_init((ngx_http_cnt_shm_index_t *)
+                                ((u_char *) block + block->index), vars);
+}
+
+
+ngx_uint_t
+ngx_http_cnt_shm_block_same_layout(ngx_http_cnt_shm_block_t *block,
+                                   ngx_array_t *vars)
+{
+    ngx_uint_t                     i;
+    ngx_http_cnt_set_var_data_t   *elts = vars->elts;
+    ngx_http_cnt_shm_index_t      *index;
+
+    if (block->nelts != (ngx_atomic_int_t) vars->nelts) {
+        return 0;
+    }
+
+    index = (ngx_http_cnt_shm_index_t *) ((u_char *) block + block->index);
+
+    for (i = 0; i < vars->nelts; i++) {
+        if (ngx_http_cnt_shm_index_lookup(index, elts[i].name.data,
+                                          elts[i].name.len)
+            != elts[i].idx)
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+
+void
+ngx_http_cnt_shm_block_remap(ngx_http_cnt_shm_block_t *block,
+                             ngx_http_cnt_shm_block_t *oblock)
+{
+    ngx_uint_t                     i;
+    ngx_http_cnt_shm_index_t      *index, *oindex;
+    ngx_http_cnt_shm_index_elt_t  *buckets;
+    u_char                        *names;
+    volatile ngx_atomic_int_t     *values, *ovalues;
+    ngx_int_t                      slot;
+
+    index = (ngx_http_cnt_shm_index_t *) ((u_char *) block + block->index);
+    oindex = (ngx_http_cnt_shm_index_t *) ((u_char *) oblock + oblock->index);
+
+    buckets = (ngx_http_cnt_shm_index_elt_t *) (index + 1);
+    names = (u_char *) (buckets + index->size);
+
+    values = ngx_http_cnt_shm_values(block);
+    ovalues = ngx_http_cnt_shm_values(oblock);
+
+    block->generation = oblock->generation + 1;
+    block->remap_kept = 0;
+    block->remap_added = 0;
+
+    for (i = 0; i < index->size; i++) {
+        if (buckets[i].slot == 0) {
+            continue;
+        }
+
+        slot = ngx_http_cnt_shm_index_lookup(oindex, names + buckets[i].name,
+                                             buckets[i].name_len);
+        if (slot == NGX_ERROR) {
+            block->remap_added++;
+            continue;
+        }
+
+        values[buckets[i].slot - 1] = ovalues[slot];
+        block->remap_kept++;
+    }
+
+    block->remap_dropped = oblock->nelts - block->remap_kept;
+}
+
+
+void
+ngx_http_cnt_shm_block_load(ngx_http_cnt_shm_block_t *block,
+                            ngx_http_cnt_shm_block_t *oblock)
+{
+    /* load values from a block saved outside of shared memory, this is not a
+     * reload and must not leave remapping marks */
+
+    ngx_http_cnt_shm_block_remap(block, oblock);
+
+    block->generation = 0;
+    block->remap_kept = 0;
+    block->remap_added = 0;
+    block->remap_dropped = 0;
+}
+
+
+size_t
+ngx_http_cnt_shm_block_copy(u_char *dst, ngx_http_cnt_shm_block_t *block,
+                            ngx_array_t *vars)
+{
+    size_t                         size;
+
+    /* a block reused on reload may be bigger than needed */
+    size = ngx_min((size_t) block->size, ngx_http_cnt_shm_block_size(vars));
+
+    ngx_memcpy(dst, block, size);
+    ((ngx_http_cnt_shm_block_t *) dst)->size = size;
+
+    return size;
+}
+
+
+ngx_int_t
+ngx_http_cnt_shm_index_check(ngx_http_cnt_shm_index_t *index, size_t size)
+{
+    ngx_uint_t                     i;
+    ngx_http_cnt_shm_index_elt_t  *buckets;
+
+    /* check an index that came from outside, e.g. from a file */
+
+    if (size < sizeof(ngx_http_cnt_shm_index_t)
+        || index->size == 0 || (index->size & (index->size - 1)) != 0
+        || index->size > (size - sizeof(ngx_http_cnt_shm_index_t))
+                                / sizeof(ngx_http_cnt_shm_index_elt_t)
+        || index->names_len > size - sizeof(ngx_http_cnt_shm_index_t)
+                - sizeof(ngx_http_cnt_shm_index_elt_t) * index->size)
+    {
+        return NGX_ERROR;
+    }
+
+    buckets = (ngx_http_cnt_shm_index_elt_t *) (index + 1);
+
+    for (i = 0; i < index->size; i++) {
+        if (buckets[i].slot != 0
+            && (buckets[i].name > index->names_len
+                || buckets[i].name_len > index->names_len - buckets[i].name))
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    /* an index without empty buckets would make lookups loop forever */
+    for (i = 0; i < index->size; i++) {
+        if (buckets[i].slot == 0) {
+            return NGX_OK;
+        }
+    }
+
+    return NGX_ERROR;
+}
+
+
+ngx_int_t
+ngx_http_cnt_shm_block_check(ngx_http_cnt_shm_block_t *block, size_t size)
+{
+    ngx_uint_t                     i;
+    ngx_http_cnt_shm_index_t      *index;
+    ngx_http_cnt_shm_index_elt_t  *buckets;
+
+    /* check a block that came from outside, e.g. from a file */
+
+    if (size < sizeof(ngx_http_cnt_shm_block_t)
+        || block->size < (ngx_atomic_int_t) sizeof(ngx_http_cnt_shm_block_t)
+        || (size_t) block->size > size
+        || block->nelts < 0
+        || (size_t) block->nelts
+            > (block->size - sizeof(ngx_http_cnt_shm_block_t))
+                / sizeof(ngx_atomic_int_t)
+        || block->index != (ngx_atomic_int_t)
+                (sizeof(ngx_http_cnt_shm_block_t)
+                 + sizeof(ngx_atomic_int_t) * block->nelts))
+    {
+        return NGX_ERROR;
+    }
+
+    index = (ngx_http_cnt_shm_index_t *) ((u_char *) block + block->index);
+
+    if (ngx_http_cnt_shm_index_check(index, block->size - block->index)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    buckets = (ngx_http_cnt_shm_index_elt_t *) (index + 1);
+
+    for (i = 0; i < index->size; i++) {
+        if (buckets[i].slot > (uint32_t) block->nelts) {
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+ngx_atomic_int_t
+ngx_http_cnt_shm_block_epoch(ngx_http_cnt_shm_block_t *block)
+{
+    /* the flag gets cleared before the caller reads the counters, and then
+     * a concurrent change will advance the epoch once again */
+
+    if (block->dirty) {
+        block->dirty = 0;
+        ngx_memory_barrier();
+        return ngx_atomic_fetch_add((ngx_atomic_t *) &block->epoch, 1) + 1;
+    }
+
+    return block->epoch;
+}
+
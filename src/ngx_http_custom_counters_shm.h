@@ -0,0 +1,92 @@
+/*
+ * =============================================================================
+ *
+ *       Filename:  ngx_http_custom_counters_shm.h
+ *
+ *    Description:  layout of counters in shared memory
+ *
+ *        Version:  4.0
+ *        Created:  18.10.2026 12:10:41
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Alexey Radkov (), 
+ *        Company:  
+ *
+ * =============================================================================
+ */
+
+#ifndef NGX_HTTP_CUSTOM_COUNTERS_SHM_H
+#define NGX_HTTP_CUSTOM_COUNTERS_SHM_H
+
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+/* a block of counters in a shared memory zone: the header is followed by
+ * the values of the counters and the name index, all offsets are relative
+ * to the start of the block */
+
+typedef struct {
+    ngx_atomic_int_t            nelts;
+    ngx_atomic_int_t            size;
+    ngx_atomic_int_t            index;
+    ngx_atomic_int_t            generation;
+    ngx_atomic_int_t            remap_kept;
+    ngx_atomic_int_t            remap_added;
+    ngx_atomic_int_t            remap_dropped;
+    ngx_atomic_int_t            dirty;
+    ngx_atomic_int_t            epoch;
+} ngx_http_cnt_shm_block_t;
+
+
+typedef struct {
+    uint32_t                    hash;
+    uint32_t                    slot;      /* slot + 1, 0 marks empty bucket */
+    uint32_t                    name;      /* offset of the name in names */
+    uint32_t                    name_len;
+} ngx_http_cnt_shm_index_elt_t;
+
+
+typedef struct {
+    uint32_t                    size;      /* number of buckets, power of 2 */
+    uint32_t                    names_len;
+} ngx_http_cnt_shm_index_t;
+
+
+#define ngx_http_cnt_shm_values(block)                                        \
+    ((volatile ngx_atomic_int_t *) ((u_char *) (block)                        \
+                                    + sizeof(ngx_http_cnt_shm_block_t)))
+
+/* writers mark the block as changed, readers that cache data derived from
+ * the block compare the epoch of the block with the epoch of their data */
+
+#define ngx_http_cnt_shm_block_touch(block)                                   \
+    (void) ((block)->dirty || ((block)->dirty = 1))
+
+
+size_t ngx_http_cnt_shm_block_size(ngx_array_t *vars);
+size_t ngx_http_cnt_shm_zone_size(ngx_array_t *vars);
+void ngx_http_cnt_shm_block_init(ngx_http_cnt_shm_block_t *block,
+    ngx_array_t *vars, size_t size);
+size_t ngx_http_cnt_shm_index_size(ngx_array_t *vars);
+void ngx_http_cnt_shm_index_init(ngx_http_cnt_shm_index_t *index,
+    ngx_array_t *vars);
+ngx_int_t ngx_http_cnt_shm_index_lookup(ngx_http_cnt_shm_index_t *index,
+    u_char *name, size_t len);
+ngx_uint_t ngx_http_cnt_shm_block_same_layout(ngx_http_cnt_shm_block_t *block,
+    ngx_array_t *vars);
+void ngx_http_cnt_shm_block_remap(ngx_http_cnt_shm_block_t *block,
+    ngx_http_cnt_shm_block_t *oblock);
+void ngx_http_cnt_shm_block_load(ngx_http_cnt_shm_block_t *block,
+    ngx_http_cnt_shm_block_t *oblock);
+size_t ngx_http_cnt_shm_block_copy(u_char *dst,
+    ngx_http_cnt_shm_block_t *block, ngx_array_t *vars);
+ngx_int_t ngx_http_cnt_shm_index_check(ngx_http_cnt_shm_index_t *index,
+    size_t size);
+ngx_int_t ngx_http_cnt_shm_block_check(ngx_http_cnt_shm_block_t *block,
+    size_t size);
+ngx_atomic_int_t ngx_http_cnt_shm_block_epoch(ngx_http_cnt_shm_block_t *block);
+
+#endif /* NGX_HTTP_CUSTOM_COUNTERS_SHM_H */
+
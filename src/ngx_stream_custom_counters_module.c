@@ -0,0 +1,946 @@
+/*
+ * =============================================================================
+ *
+ *       Filename:  ngx_stream_custom_counters_module.c
+ *
+ *    Description:  nginx stream module for shared custom counters
+ *
+ *        Version:  4.0
+ *        Created:  18.10.2026 21:42:17
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Alexey Radkov (), 
+ *        Company:  
+ *
+ * =============================================================================
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_stream.h>
+
+#include "ngx_http_custom_counters_module.h"
+#include "ngx_http_custom_counters_histogram.h"
+#include "ngx_http_custom_counters_shm.h"
+
+
+/* the counter sets are of the same type as the sets of the http module and
+ * use the same shared memory zones functions, if the http block follows the
+ * stream block, the http module adopts the sets; the ranges are kept to set
+ * the tags of the bins of histograms */
+
+typedef struct {
+    ngx_array_t                 cnt_sets;
+    ngx_array_t                 ranges;
+} ngx_stream_cnt_main_conf_t;
+
+
+/* counter operations are shared with the http module, histograms are their
+ * indexes in the counter set */
+
+typedef struct {
+    ngx_uint_t                  cnt_set;
+    ngx_str_t                   cnt_set_id;
+    ngx_str_t                   unreachable_cnt_mark;
+    ngx_flag_t                  survive_reload;
+    ngx_array_t                 cnt_data;
+    ngx_array_t                 histograms;
+} ngx_stream_cnt_srv_conf_t;
+
+
+static ngx_int_t ngx_stream_cnt_add_vars(ngx_conf_t *cf);
+static ngx_int_t ngx_stream_cnt_init(ngx_conf_t *cf);
+static void *ngx_stream_cnt_create_main_conf(ngx_conf_t *cf);
+static void *ngx_stream_cnt_create_srv_conf(ngx_conf_t *cf);
+static char *ngx_stream_cnt_merge_srv_conf(ngx_conf_t *cf, void *parent,
+    void *child);
+static ngx_int_t ngx_stream_cnt_get_value(ngx_stream_session_t *s,
+    ngx_stream_variable_value_t *v, uintptr_t data);
+static ngx_int_t ngx_stream_cnt_collection(ngx_stream_session_t *s,
+    ngx_stream_variable_value_t *v, uintptr_t data);
+static ngx_int_t ngx_stream_cnt_get_range_index(ngx_stream_session_t *s,
+    ngx_stream_variable_value_t *v, uintptr_t data);
+static ngx_int_t ngx_stream_cnt_counter_set_init(ngx_conf_t *cf,
+    ngx_stream_cnt_main_conf_t *mcf, ngx_stream_cnt_srv_conf_t *scf);
+static ngx_int_t ngx_stream_cnt_declare_counter(ngx_conf_t *cf,
+    ngx_str_t *name, ngx_uint_t *point, ngx_uint_t scaled, ngx_int_t *v_idx);
+static ngx_int_t ngx_stream_cnt_var_data_init(ngx_conf_t *cf,
+    ngx_stream_cnt_srv_conf_t *scf, ngx_stream_variable_t *v, ngx_int_t idx);
+static char *ngx_stream_cnt_counter(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static char *ngx_stream_cnt_counter_set_id(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static char *ngx_stream_cnt_histogram(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static char *ngx_stream_cnt_map_to_range_index(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
+static ngx_int_t ngx_stream_cnt_log_phase_handler(ngx_stream_session_t *s);
+static void ngx_stream_cnt_session_vars(ngx_stream_session_t *s,
+    ngx_http_cnt_vars_t *vars);
+static ngx_stream_variable_value_t *ngx_stream_cnt_session_var_value(
+    void *data, ngx_uint_t index);
+static ngx_str_t *ngx_stream_cnt_session_var_name(void *data,
+    ngx_uint_t index);
+
+
+static ngx_command_t  ngx_stream_cnt_commands[] = {
+
+    { ngx_string("counter"),
+      NGX_STREAM_SRV_CONF|NGX_CONF_1MORE,
+      ngx_stream_cnt_counter,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      0,
+      NULL },
+    { ngx_string("counter_set_id"),
+      NGX_STREAM_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_stream_cnt_counter_set_id,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      0,
+      NULL },
+    { ngx_string("counters_survive_reload"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      offsetof(ngx_stream_cnt_srv_conf_t, survive_reload),
+      NULL },
+    { ngx_string("histogram"),
+      NGX_STREAM_SRV_CONF|NGX_CONF_2MORE,
+      ngx_stream_cnt_histogram,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      0,
+      NULL },
+    { ngx_string("map_to_range_index"),
+      NGX_STREAM_MAIN_CONF|NGX_CONF_2MORE,
+      ngx_stream_cnt_map_to_range_index,
+      NGX_STREAM_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+    { ngx_string("display_unreachable_counter_as"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_str_slot,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      offsetof(ngx_stream_cnt_srv_conf_t, unreachable_cnt_mark),
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_stream_variable_t  ngx_stream_cnt_vars[] =
+{
+    { ngx_string("cnt_collection"), NULL, ngx_stream_cnt_collection,
+      0, 0, 0 },
+
+    { ngx_null_string, NULL, NULL, 0, 0, 0 }
+};
+
+
+static ngx_stream_module_t  ngx_stream_cnt_module_ctx = {
+    ngx_stream_cnt_add_vars,                 /* preconfiguration */
+    ngx_stream_cnt_init,                     /* postconfiguration */
+
+    ngx_stream_cnt_create_main_conf,         /* create main configuration */
+    NULL,                                    /* init main configuration */
+
+    ngx_stream_cnt_create_srv_conf,          /* create server configuration */
+    ngx_stream_cnt_merge_srv_conf            /* merge server configuration */
+};
+
+
+ngx_module_t  ngx_stream_custom_counters_module = {
+    NGX_MODULE_V1,
+    &ngx_stream_cnt_module_ctx,              /* module context */
+    ngx_stream_cnt_commands,                 /* module directives */
+    NGX_STREAM_MODULE,                       /* module type */
+    NULL,                                    /* init master */
+    NULL,                                    /* init module */
+    NULL,                                    /* init process */
+    NULL,                                    /* init thread */
+    NULL,                                    /* exit thread */
+    NULL,                                    /* exit process */
+    NULL,                                    /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static ngx_int_t
+ngx_stream_cnt_add_vars(ngx_conf_t *cf)
+{
+    ngx_stream_variable_t  *var, *v;
+
+    for (v = ngx_stream_cnt_vars; v->name.len; v++) {
+        var = ngx_stream_add_variable(cf, &v->name, v->flags);
+        if (var == NULL) {
+            return NGX_ERROR;
+        }
+
+        var->get_handler = v->get_handler;
+        var->data = v->data;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_stream_cnt_init(ngx_conf_t *cf)
+{
+    ngx_uint_t                               i, j, k;
+    ngx_stream_core_main_conf_t             *cmcf;
+    ngx_stream_cnt_main_conf_t              *mcf;
+    ngx_http_cnt_set_t                      *cnt_sets;
+    ngx_http_cnt_set_histogram_data_t       *histograms;
+    ngx_http_cnt_map_to_range_index_data_t **ranges;
+    ngx_stream_handler_pt                   *h;
+
+    cmcf = ngx_stream_conf_get_module_main_conf(cf, ngx_stream_core_module);
+    mcf = ngx_stream_conf_get_module_main_conf(cf,
+                                            ngx_stream_custom_counters_module);
+
+    if (mcf->cnt_sets.nelts == 0) {
+        return NGX_OK;
+    }
+
+    h = ngx_array_push(&cmcf->phases[NGX_STREAM_LOG_PHASE].handlers);
+    if (h == NULL) {
+        return NGX_ERROR;
+    }
+
+    *h = ngx_stream_cnt_log_phase_handler;
+
+    /* the http module sets the same sizes again if it adopts the sets */
+
+    cnt_sets = mcf->cnt_sets.elts;
+
+    for (i = 0; i < mcf->cnt_sets.nelts; i++) {
+        cnt_sets[i].zone->shm.size =
+                ngx_http_cnt_shm_zone_size(&cnt_sets[i].vars);
+    }
+
+    /* histograms which observe the index of the bin in a range index get the
+     * bounds of the range as the tags of the bins */
+
+    ranges = mcf->ranges.elts;
+
+    for (i = 0; i < mcf->cnt_sets.nelts; i++) {
+        histograms = cnt_sets[i].histograms.elts;
+        for (j = 0; j < cnt_sets[i].histograms.nelts; j++) {
+            if (histograms[j].buckets.nelts > 0) {
+                continue;
+            }
+            for (k = 0; k < mcf->ranges.nelts; k++) {
+                if (ranges[k]->self == histograms[j].observe_idx) {
+                    ngx_http_cnt_histogram_range_tags(&histograms[j],
+                                                      ranges[k]);
+                    break;
+                }
+            }
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static void *
+ngx_stream_cnt_create_main_conf(ngx_conf_t *cf)
+{
+    ngx_stream_cnt_main_conf_t  *mcf;
+
+    mcf = ngx_pcalloc(cf->pool, sizeof(ngx_stream_cnt_main_conf_t));
+    if (mcf == NULL) {
+        return NULL;
+    }
+
+    if (ngx_array_init(&mcf->cnt_sets, cf->pool, 1,
+                       sizeof(ngx_http_cnt_set_t)) != NGX_OK
+        || ngx_array_init(&mcf->ranges, cf->pool, 1,
+                          sizeof(ngx_http_cnt_map_to_range_index_data_t *))
+           != NGX_OK)
+    {
+        return NULL;
+    }
+
+    return mcf;
+}
+
+
+static void *
+ngx_stream_cnt_create_srv_conf(ngx_conf_t *cf)
+{
+    ngx_stream_cnt_srv_conf_t  *scf;
+
+    scf = ngx_pcalloc(cf->pool, sizeof(ngx_stream_cnt_srv_conf_t));
+    if (scf == NULL) {
+        return NULL;
+    }
+
+    scf->cnt_set = NGX_CONF_UNSET_UINT;
+    scf->survive_reload = NGX_CONF_UNSET;
+
+    return scf;
+}
+
+
+static char *
+ngx_stream_cnt_merge_srv_conf(ngx_conf_t *cf, void *parent, void *child)
+{
+    ngx_stream_cnt_srv_conf_t   *prev = parent;
+    ngx_stream_cnt_srv_conf_t   *conf = child;
+
+    ngx_stream_cnt_main_conf_t  *mcf;
+    ngx_http_cnt_set_t          *cnt_sets;
+
+    ngx_conf_merge_str_value(conf->unreachable_cnt_mark,
+                             prev->unreachable_cnt_mark, "");
+    ngx_conf_merge_value(conf->survive_reload, prev->survive_reload, 0);
+
+    if (conf->survive_reload && conf->cnt_set != NGX_CONF_UNSET_UINT) {
+        mcf = ngx_stream_conf_get_module_main_conf(cf,
+                                            ngx_stream_custom_counters_module);
+        cnt_sets = mcf->cnt_sets.elts;
+        cnt_sets[conf->cnt_set].survive_reload = 1;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static ngx_int_t
+ngx_stream_cnt_get_value(ngx_stream_session_t *s,
+                         ngx_stream_variable_value_t *v, uintptr_t data)
+{
+    ngx_array_t                       *v_data = (ngx_array_t *) data;
+
+    ngx_uint_t                         i;
+    ngx_stream_cnt_main_conf_t        *mcf;
+    ngx_stream_cnt_srv_conf_t         *scf;
+    ngx_http_cnt_var_data_t           *var_data;
+    ngx_http_cnt_set_var_data_t       *vars;
+    volatile ngx_atomic_int_t         *shm_data;
+    ngx_http_cnt_set_t                *cnt_sets, *cnt_set;
+    ngx_int_t                          idx = NGX_ERROR;
+    u_char                            *buf, *last;
+
+    if (v_data == NULL) {
+        return NGX_ERROR;
+    }
+    var_data = v_data->elts;
+
+    scf = ngx_stream_get_module_srv_conf(s, ngx_stream_custom_counters_module);
+    if (scf->cnt_set == NGX_CONF_UNSET_UINT) {
+        goto unreachable_cnt;
+    }
+
+    for (i = 0; i < v_data->nelts; i++) {
+        if (var_data[i].cnt_set != scf->cnt_set) {
+            continue;
+        }
+
+        idx = var_data[i].self;
+        break;
+    }
+    if (idx == NGX_ERROR) {
+        goto unreachable_cnt;
+    }
+
+    mcf = ngx_stream_get_module_main_conf(s,
+                                          ngx_stream_custom_counters_module);
+    cnt_sets = mcf->cnt_sets.elts;
+    cnt_set = &cnt_sets[scf->cnt_set];
+
+    shm_data = ngx_http_cnt_shm_values(cnt_set->zone->data);
+    buf = ngx_pnalloc(s->connection->pool, NGX_ATOMIC_T_LEN);
+    if (buf == NULL) {
+        return NGX_ERROR;
+    }
+
+    vars = cnt_set->vars.elts;
+    last = ngx_http_cnt_sprintf_value(buf, shm_data[idx], vars[idx].point);
+
+    v->len          = last - buf;
+    v->data         = buf;
+    v->valid        = 1;
+    v->no_cacheable = 0;
+    v->not_found    = 0;
+
+    return NGX_OK;
+
+unreachable_cnt:
+
+    v->len          = scf->unreachable_cnt_mark.len;
+    v->data         = scf->unreachable_cnt_mark.data;
+    v->valid        = 1;
+    v->no_cacheable = 0;
+    v->not_found    = 0;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_stream_cnt_collection(ngx_stream_session_t *s,
+                          ngx_stream_variable_value_t *v, uintptr_t data)
+{
+    ngx_uint_t                         i;
+    ngx_http_cnt_main_conf_t          *hmcf;
+    ngx_stream_cnt_main_conf_t        *mcf;
+    ngx_http_cnt_set_t                *cnt_sets;
+    size_t                             len = 2;
+    u_char                            *buf, *last;
+
+    /* when the http module adopted the sets of stream servers, the collection
+     * is exactly the same as variable $cnt_collection in http servers */
+
+    hmcf = ngx_http_cycle_get_module_main_conf(ngx_cycle,
+                                            ngx_http_custom_counters_module);
+
+    if (hmcf != NULL && hmcf->cnt_sets.nelts > 0) {
+        buf = ngx_pnalloc(s->connection->pool, hmcf->collection_buf_len);
+        if (buf == NULL) {
+            return NGX_ERROR;
+        }
+
+        last = ngx_http_cnt_render_collection(hmcf, buf, 0);
+
+        goto collection;
+    }
+
+    mcf = ngx_stream_get_module_main_conf(s,
+                                          ngx_stream_custom_counters_module);
+    cnt_sets = mcf->cnt_sets.elts;
+
+    for (i = 0; i < mcf->cnt_sets.nelts; i++) {
+        len += ngx_http_cnt_set_buf_len(&cnt_sets[i]);
+    }
+
+    buf = ngx_pnalloc(s->connection->pool, len);
+    if (buf == NULL) {
+        return NGX_ERROR;
+    }
+
+    last = ngx_sprintf(buf, "{");
+
+    for (i = 0; i < mcf->cnt_sets.nelts; i++) {
+        if (i > 0) {
+            *last++ = ',';
+        }
+
+        last = ngx_http_cnt_render_set(&cnt_sets[i], last);
+    }
+
+    last = ngx_sprintf(last, "}");
+
+collection:
+
+    v->len          = last - buf;
+    v->data         = buf;
+    v->valid        = 1;
+    v->no_cacheable = 0;
+    v->not_found    = 0;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_stream_cnt_get_range_index(ngx_stream_session_t *s,
+                               ngx_stream_variable_value_t *v, uintptr_t data)
+{
+    ngx_http_cnt_vars_t                      vars;
+
+    ngx_stream_cnt_session_vars(s, &vars);
+
+    return ngx_http_cnt_map_to_range(&vars,
+                    (ngx_http_cnt_map_to_range_index_data_t *) data, v);
+}
+
+
+static ngx_int_t
+ngx_stream_cnt_counter_set_init(ngx_conf_t *cf,
+                                ngx_stream_cnt_main_conf_t *mcf,
+                                ngx_stream_cnt_srv_conf_t *scf)
+{
+    ngx_uint_t                     i;
+    ngx_int_t                      idx;
+    ngx_http_cnt_set_t            *cnt_sets;
+
+    if (scf->cnt_set != NGX_CONF_UNSET_UINT) {
+        return NGX_OK;
+    }
+
+    if (scf->cnt_set_id.len == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "custom counters in stream servers require "
+                           "directive \"counter_set_id\"");
+        return NGX_ERROR;
+    }
+
+    /* the http module adopts the sets at the end of the http block */
+
+    if (ngx_http_cycle_get_module_main_conf(cf->cycle,
+                                            ngx_http_custom_counters_module)
+        != NULL)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "custom counters in stream servers must be "
+                           "declared before the http block");
+        return NGX_ERROR;
+    }
+
+    cnt_sets = mcf->cnt_sets.elts;
+
+    for (i = 0; i < mcf->cnt_sets.nelts; i++) {
+        if (cnt_sets[i].name.len == scf->cnt_set_id.len
+            && ngx_strncmp(cnt_sets[i].name.data, scf->cnt_set_id.data,
+                           scf->cnt_set_id.len) == 0)
+        {
+            scf->cnt_set = i;
+            return NGX_OK;
+        }
+    }
+
+    idx = ngx_http_cnt_counter_set_create(cf, &mcf->cnt_sets,
+                                          &scf->cnt_set_id, NULL);
+    if (idx == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    scf->cnt_set = idx;
+
+    return NGX_OK;
+}
+
+
+/* the declaration hook of stream servers, counters are declared like the
+ * counters of http servers */
+
+static ngx_int_t
+ngx_stream_cnt_declare_counter(ngx_conf_t *cf, ngx_str_t *name,
+                               ngx_uint_t *point, ngx_uint_t scaled,
+                               ngx_int_t *v_idx)
+{
+    ngx_stream_cnt_main_conf_t    *mcf;
+    ngx_stream_cnt_srv_conf_t     *scf;
+    ngx_stream_variable_t         *v;
+    ngx_http_cnt_set_t            *cnt_sets;
+    ngx_int_t                      idx;
+
+    mcf = ngx_stream_conf_get_module_main_conf(cf,
+                                            ngx_stream_custom_counters_module);
+    scf = ngx_stream_conf_get_module_srv_conf(cf,
+                                            ngx_stream_custom_counters_module);
+
+    if (ngx_stream_cnt_counter_set_init(cf, mcf, scf) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    v = ngx_stream_add_variable(cf, name, NGX_STREAM_VAR_CHANGEABLE);
+    if (v == NULL) {
+        return NGX_ERROR;
+    }
+    *v_idx = ngx_stream_get_variable_index(cf, name);
+    if (*v_idx == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    cnt_sets = mcf->cnt_sets.elts;
+    idx = ngx_http_cnt_set_add_counter(cf, &cnt_sets[scf->cnt_set], name,
+                                       *v_idx, point, scaled);
+    if (idx == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+    if (v->get_handler != NULL && v->get_handler != ngx_stream_cnt_get_value) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "custom counter variable has a different setter");
+        return NGX_ERROR;
+    }
+    if (ngx_stream_cnt_var_data_init(cf, scf, v, idx) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    return idx;
+}
+
+
+static ngx_int_t
+ngx_stream_cnt_var_data_init(ngx_conf_t *cf, ngx_stream_cnt_srv_conf_t *scf,
+                             ngx_stream_variable_t *v, ngx_int_t idx)
+{
+    ngx_uint_t                     i;
+    ngx_array_t                   *v_data;
+    ngx_http_cnt_var_data_t       *var_data;
+
+    v_data = (ngx_array_t *) v->data;
+
+    if (v_data == NULL) {
+        v_data = ngx_array_create(cf->pool, 1,
+                                  sizeof(ngx_http_cnt_var_data_t));
+        if (v_data == NULL) {
+            return NGX_ERROR;
+        }
+
+        v->get_handler = ngx_stream_cnt_get_value;
+        v->data = (uintptr_t) v_data;
+    }
+
+    var_data = v_data->elts;
+
+    for (i = 0; i < v_data->nelts; i++) {
+        if (var_data[i].cnt_set == scf->cnt_set) {
+            return NGX_OK;
+        }
+    }
+
+    var_data = ngx_array_push(v_data);
+    if (var_data == NULL) {
+        return NGX_ERROR;
+    }
+
+    var_data->cnt_set = scf->cnt_set;
+    var_data->self = idx;
+    var_data->bin_idx = NGX_ERROR;
+
+    return NGX_OK;
+}
+
+
+static char *
+ngx_stream_cnt_counter(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_stream_cnt_srv_conf_t     *scf = conf;
+
+    ngx_http_cnt_data_t           *cnt_data;
+
+    if (scf->cnt_data.nalloc == 0
+        && ngx_array_init(&scf->cnt_data, cf->pool, 1,
+                          sizeof(ngx_http_cnt_data_t)) != NGX_OK)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    cnt_data = ngx_array_push(&scf->cnt_data);
+    if (cnt_data == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (ngx_http_cnt_parse_counter(cf, ngx_stream_cnt_declare_counter,
+                                   ngx_stream_get_variable_index, cnt_data)
+        != NGX_CONF_OK)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    /* there are no locations in stream servers, and therefore there is
+     * nothing to undo */
+
+    if (cnt_data->op == ngx_http_cnt_op_undo) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "counter operation \"undo\" is not supported in "
+                           "stream servers");
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_stream_cnt_counter_set_id(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_stream_cnt_srv_conf_t     *scf = conf;
+    ngx_str_t                     *value = cf->args->elts;
+
+    if (scf->cnt_set != NGX_CONF_UNSET_UINT) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "directive \"counter_set_id\" must precede "
+                           "all server's custom counters declarations");
+        return NGX_CONF_ERROR;
+    }
+    if (scf->cnt_set_id.len > 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "duplicate directive \"counter_set_id\"");
+        return NGX_CONF_ERROR;
+    }
+
+    scf->cnt_set_id = value[1];
+
+    return NGX_CONF_OK;
+}
+
+
+/* histograms observe values of a variable like in http servers, or the
+ * index of the bin, e.g. a range index of $session_time or $bytes_sent */
+
+static char *
+ngx_stream_cnt_histogram(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_stream_cnt_srv_conf_t          *scf = conf;
+
+    ngx_uint_t                          i;
+    ngx_int_t                           idx = NGX_ERROR, *histogram;
+    ngx_str_t                          *value;
+    ngx_stream_cnt_main_conf_t         *mcf;
+    ngx_http_cnt_set_t                 *cnt_sets, *cnt_set;
+    ngx_http_cnt_set_histogram_data_t  *histograms;
+
+    value = cf->args->elts;
+
+    if (value[1].len < 2 || value[1].data[0] != '$') {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid variable name \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+    value[1].len--;
+    value[1].data++;
+
+    mcf = ngx_stream_conf_get_module_main_conf(cf,
+                                            ngx_stream_custom_counters_module);
+
+    if (ngx_stream_cnt_counter_set_init(cf, mcf, scf) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    cnt_sets = mcf->cnt_sets.elts;
+    cnt_set = &cnt_sets[scf->cnt_set];
+
+    histograms = cnt_set->histograms.elts;
+    for (i = 0; i < cnt_set->histograms.nelts; i++) {
+        if (histograms[i].name.len == value[1].len
+            && ngx_strncmp(histograms[i].name.data, value[1].data,
+                           value[1].len) == 0)
+        {
+            idx = i;
+            break;
+        }
+    }
+
+    if (cf->args->nelts == 3
+        && value[2].len == 5 && ngx_strncmp(value[2].data, "reuse", 5) == 0)
+    {
+        if (idx == NGX_ERROR) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "histogram \"%V\" was "
+                               "not declared in this counter set", &value[1]);
+            return NGX_CONF_ERROR;
+        }
+    } else {
+        if (idx != NGX_ERROR) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "histogram \"%V\" was "
+                               "already declared in this counter set, use "
+                               "\"reuse\" to update it here", &value[1]);
+            return NGX_CONF_ERROR;
+        }
+
+        if (value[2].len == 7 && ngx_strncmp(value[2].data, "observe", 7) == 0)
+        {
+            idx = ngx_http_cnt_histogram_observe_declare(cf, cnt_set,
+                                                ngx_stream_cnt_declare_counter,
+                                                ngx_stream_get_variable_index);
+        } else {
+            idx = ngx_http_cnt_histogram_bins_declare(cf, cnt_set,
+                                                ngx_stream_cnt_declare_counter,
+                                                ngx_stream_get_variable_index);
+        }
+        if (idx == NGX_ERROR) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    if (scf->histograms.nalloc == 0
+        && ngx_array_init(&scf->histograms, cf->pool, 1, sizeof(ngx_int_t))
+           != NGX_OK)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    histogram = scf->histograms.elts;
+    for (i = 0; i < scf->histograms.nelts; i++) {
+        if (histogram[i] == idx) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "histogram \"%V\" "
+                               "was already declared in this server",
+                               &value[1]);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    histogram = ngx_array_push(&scf->histograms);
+    if (histogram == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    *histogram = idx;
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_stream_cnt_map_to_range_index(ngx_conf_t *cf, ngx_command_t *cmd,
+                                  void *conf)
+{
+    ngx_stream_cnt_main_conf_t               *mcf = conf;
+
+    ngx_str_t                                *value;
+    ngx_stream_variable_t                    *v;
+    ngx_http_cnt_map_to_range_index_data_t   *v_data, **range;
+
+    value = cf->args->elts;
+
+    if (value[2].len < 2 || value[2].data[0] != '$') {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid variable name \"%V\"", &value[2]);
+        return NGX_CONF_ERROR;
+    }
+    value[2].len--;
+    value[2].data++;
+
+    v = ngx_stream_add_variable(cf, &value[2], NGX_STREAM_VAR_CHANGEABLE);
+    if (v == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    v_data = ngx_pcalloc(cf->pool,
+                         sizeof(ngx_http_cnt_map_to_range_index_data_t));
+    if (v_data == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    v->get_handler = ngx_stream_cnt_get_range_index;
+    v->data = (uintptr_t) v_data;
+
+    v_data->self = ngx_stream_get_variable_index(cf, &value[2]);
+    if (v_data->self == NGX_ERROR) {
+        return NGX_CONF_ERROR;
+    }
+
+    range = ngx_array_push(&mcf->ranges);
+    if (range == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    *range = v_data;
+
+    return ngx_http_cnt_parse_range(cf, ngx_stream_get_variable_index, v_data);
+}
+
+
+static ngx_int_t
+ngx_stream_cnt_log_phase_handler(ngx_stream_session_t *s)
+{
+    ngx_uint_t                     i;
+    ngx_stream_cnt_main_conf_t    *mcf;
+    ngx_stream_cnt_srv_conf_t     *scf;
+    ngx_http_cnt_data_t           *cnt_data;
+    ngx_int_t                     *histograms;
+    ngx_http_cnt_vars_t            vars;
+    ngx_http_cnt_observation_t     obs;
+    ngx_http_cnt_set_t            *cnt_sets, *cnt_set;
+    ngx_http_cnt_shm_block_t      *block;
+    ngx_slab_pool_t               *shpool;
+    volatile ngx_atomic_int_t     *shm_data;
+    ngx_int_t                      value, rc;
+    ngx_uint_t                     changed = 0;
+
+    scf = ngx_stream_get_module_srv_conf(s, ngx_stream_custom_counters_module);
+    if (scf->cnt_set == NGX_CONF_UNSET_UINT) {
+        return NGX_OK;
+    }
+
+    mcf = ngx_stream_get_module_main_conf(s,
+                                          ngx_stream_custom_counters_module);
+    cnt_sets = mcf->cnt_sets.elts;
+    cnt_set = &cnt_sets[scf->cnt_set];
+
+    block = cnt_set->zone->data;
+    shm_data = ngx_http_cnt_shm_values(block);
+
+    ngx_stream_cnt_session_vars(s, &vars);
+
+    cnt_data = scf->cnt_data.elts;
+
+    for (i = 0; i < scf->cnt_data.nelts; i++) {
+        if (ngx_http_cnt_data_value(&vars, &cnt_data[i], NULL, &value)
+            != NGX_OK)
+        {
+            continue;
+        }
+        if (cnt_data[i].op == ngx_http_cnt_op_set) {
+            shpool = (ngx_slab_pool_t *) cnt_set->zone->shm.addr;
+            ngx_shmtx_lock(&shpool->mutex);
+            shm_data[cnt_data[i].idx] = value;
+            ngx_shmtx_unlock(&shpool->mutex);
+            changed = 1;
+        } else if (value != 0) {
+            (void) ngx_atomic_fetch_add(&shm_data[cnt_data[i].idx], value);
+            changed = 1;
+        }
+    }
+
+    histograms = scf->histograms.elts;
+
+    for (i = 0; i < scf->histograms.nelts; i++) {
+        obs.pos = NULL;
+        obs.done = 0;
+
+        for ( ;; ) {
+            rc = ngx_http_cnt_histogram_observe(&vars, cnt_set, histograms[i],
+                                                &obs);
+            if (rc == NGX_DONE) {
+                break;
+            }
+
+            (void) ngx_atomic_fetch_add(&shm_data[obs.bin], 1);
+
+            if (rc == NGX_OK) {
+                (void) ngx_atomic_fetch_add(&shm_data[obs.cnt], 1);
+                if (obs.sum != NGX_ERROR) {
+                    (void) ngx_atomic_fetch_add(&shm_data[obs.sum],
+                                                obs.value);
+                }
+            }
+
+            changed = 1;
+        }
+    }
+
+    if (changed) {
+        ngx_http_cnt_shm_block_touch(block);
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_stream_cnt_session_vars(ngx_stream_session_t *s,
+                            ngx_http_cnt_vars_t *vars)
+{
+    vars->data  = s;
+    vars->pool  = s->connection->pool;
+    vars->log   = s->connection->log;
+    vars->value = ngx_stream_cnt_session_var_value;
+    vars->name  = ngx_stream_cnt_session_var_name;
+}
+
+
+static ngx_stream_variable_value_t *
+ngx_stream_cnt_session_var_value(void *data, ngx_uint_t index)
+{
+    return ngx_stream_get_indexed_variable(data, index);
+}
+
+
+static ngx_str_t *
+ngx_stream_cnt_session_var_name(void *data, ngx_uint_t index)
+{
+    ngx_stream_core_main_conf_t   *cmcf;
+    ngx_stream_variable_t         *v;
+
+    cmcf = ngx_stream_get_module_main_conf((ngx_stream_session_t *) data,
+                                           ngx_stream_core_module);
+    v = cmcf->variables.elts;
+
+    return &v[index].name;
+}
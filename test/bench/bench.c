@@ -0,0 +1,555 @@
+/*
+ * =============================================================================
+ *
+ *       Filename:  bench.c
+ *
+ *    Description:  microbenchmarks of hot paths of custom counters
+ *
+ *        Version:  4.0
+ *        Created:  18.10.2026 21:05:12
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Alexey Radkov (), 
+ *        Company:  
+ *
+ * =============================================================================
+ */
+
+/* the sources of the module are included rather than linked to get access to
+ * its static functions, all other symbols come from a built Nginx object tree,
+ * see Makefile in this directory */
+
+#include "../../src/ngx_http_custom_counters_module.c"
+#include "../../src/ngx_http_custom_counters_histogram.c"
+#include "../../src/ngx_http_custom_counters_shm.c"
+#include "../../src/ngx_http_custom_counters_persistency.c"
+#include "../../src/ngx_http_custom_counters_journal.c"
+#include "../../src/ngx_http_custom_counters_mmap.c"
+#include "../../src/ngx_http_custom_counters_metrics.c"
+
+#include <stdio.h>
+#include <time.h>
+
+
+#define BENCH_BATCH             1000
+#define BENCH_NVARS             16
+#define BENCH_RT_VAR            0
+#define BENCH_BOUND_VAR         1
+
+
+typedef struct {
+    ngx_pool_t                             *pool;
+    ngx_http_cnt_main_conf_t               *mcf;
+    ngx_http_cnt_srv_conf_t                *scf;
+    ngx_http_cnt_loc_conf_t                *lcf;
+    ngx_http_request_t                     *r;
+    ngx_array_t                             var_data;
+    ngx_http_cnt_map_to_range_index_data_t  range;
+    ngx_http_variable_value_t               value;
+} bench_ctx_t;
+
+
+typedef ngx_int_t (*bench_op_pt)(bench_ctx_t *ctx);
+
+
+typedef struct {
+    const char                             *name;
+    bench_op_pt                             op;
+    ngx_uint_t                              nsets;
+    ngx_uint_t                              ncounters;
+    ngx_http_cnt_op_e                       cnt_op;
+    ngx_uint_t                              rt_var;
+    ngx_uint_t                              nbins;
+} bench_case_t;
+
+
+static ngx_int_t bench_update(bench_ctx_t *ctx);
+static ngx_int_t bench_get_value(bench_ctx_t *ctx);
+static ngx_int_t bench_get_range_index(bench_ctx_t *ctx);
+static ngx_int_t bench_build_collection(bench_ctx_t *ctx);
+
+
+static bench_case_t  bench_cases[] = {
+    { "update", bench_update, 1, 1, ngx_http_cnt_op_inc, 0, 0 },
+    { "update", bench_update, 1, 10, ngx_http_cnt_op_inc, 0, 0 },
+    { "update", bench_update, 1, 100, ngx_http_cnt_op_inc, 0, 0 },
+    { "update", bench_update, 1, 1000, ngx_http_cnt_op_inc, 0, 0 },
+    { "update_set", bench_update, 1, 1, ngx_http_cnt_op_set, 0, 0 },
+    { "update_set", bench_update, 1, 10, ngx_http_cnt_op_set, 0, 0 },
+    { "update_set", bench_update, 1, 100, ngx_http_cnt_op_set, 0, 0 },
+    { "update_rt_var", bench_update, 1, 1, ngx_http_cnt_op_inc, 1, 0 },
+    { "update_rt_var", bench_update, 1, 10, ngx_http_cnt_op_inc, 1, 0 },
+    { "update_rt_var", bench_update, 1, 100, ngx_http_cnt_op_inc, 1, 0 },
+    { "get_value", bench_get_value, 1, 1, ngx_http_cnt_op_inc, 0, 0 },
+    { "get_value", bench_get_value, 16, 1, ngx_http_cnt_op_inc, 0, 0 },
+    { "get_value", bench_get_value, 256, 1, ngx_http_cnt_op_inc, 0, 0 },
+    { "get_range_index", bench_get_range_index, 1, 1, ngx_http_cnt_op_inc,
+      0, 4 },
+    { "get_range_index", bench_get_range_index, 1, 1, ngx_http_cnt_op_inc,
+      0, 32 },
+    { "get_range_index", bench_get_range_index, 1, 1, ngx_http_cnt_op_inc,
+      0, 256 },
+    { "build_collection", bench_build_collection, 1, 10, ngx_http_cnt_op_inc,
+      0, 0 },
+    { "build_collection", bench_build_collection, 1, 100, ngx_http_cnt_op_inc,
+      0, 0 },
+    { "build_collection", bench_build_collection, 1, 1000,
+      ngx_http_cnt_op_inc, 0, 0 },
+    { "build_collection", bench_build_collection, 16, 100,
+      ngx_http_cnt_op_inc, 0, 0 },
+    { NULL, NULL, 0, 0, 0, 0, 0 }
+};
+
+
+/* the benchmark gets linked with --wrap for the allocation functions */
+
+void *__real_malloc(size_t size);
+int __real_posix_memalign(void **memptr, size_t alignment, size_t size);
+void *__real_memalign(size_t alignment, size_t size);
+
+static ngx_uint_t  bench_allocs;
+
+
+void *
+__wrap_malloc(size_t size)
+{
+    bench_allocs++;
+    return __real_malloc(size);
+}
+
+
+int
+__wrap_posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    bench_allocs++;
+    return __real_posix_memalign(memptr, alignment, size);
+}
+
+
+void *
+__wrap_memalign(size_t alignment, size_t size)
+{
+    bench_allocs++;
+    return __real_memalign(alignment, size);
+}
+
+
+static size_t
+bench_pool_used(ngx_pool_t *pool)
+{
+    ngx_pool_t  *p;
+    size_t       used = 0;
+
+    for (p = pool; p != NULL; p = p->d.next) {
+        used += p->d.last - (u_char *) p;
+    }
+
+    return used;
+}
+
+
+static ngx_int_t
+bench_update(bench_ctx_t *ctx)
+{
+    return ngx_http_cnt_update(ctx->r, 0);
+}
+
+
+static ngx_int_t
+bench_get_value(bench_ctx_t *ctx)
+{
+    return ngx_http_cnt_get_value(ctx->r, &ctx->value,
+                                  (uintptr_t) &ctx->var_data);
+}
+
+
+static ngx_int_t
+bench_get_range_index(bench_ctx_t *ctx)
+{
+    return ngx_http_cnt_get_range_index(ctx->r, &ctx->value,
+                                        (uintptr_t) &ctx->range);
+}
+
+
+static ngx_int_t
+bench_build_collection(bench_ctx_t *ctx)
+{
+    ngx_str_t  collection;
+
+    return ngx_http_cnt_build_collection(ctx->r, NULL, &collection, 0);
+}
+
+
+static ngx_int_t
+bench_init_set(bench_ctx_t *ctx, ngx_http_cnt_set_t *cnt_set, ngx_uint_t n,
+    ngx_uint_t k)
+{
+    ngx_uint_t                     i;
+    ngx_http_cnt_set_var_data_t   *var;
+    ngx_slab_pool_t               *shpool;
+    ngx_http_cnt_shm_block_t      *block;
+    size_t                         size;
+    u_char                        *name;
+
+    ngx_memzero(cnt_set, sizeof(ngx_http_cnt_set_t));
+
+    name = ngx_pnalloc(ctx->pool, NGX_INT_T_LEN + 4);
+    if (name == NULL) {
+        return NGX_ERROR;
+    }
+
+    cnt_set->name.data = name;
+    cnt_set->name.len = ngx_sprintf(name, "set_%ui", k) - name;
+
+    if (ngx_array_init(&cnt_set->vars, ctx->pool, n,
+                       sizeof(ngx_http_cnt_set_var_data_t)) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    for (i = 0; i < n; i++) {
+        var = ngx_array_push(&cnt_set->vars);
+        if (var == NULL) {
+            return NGX_ERROR;
+        }
+
+        name = ngx_pnalloc(ctx->pool, NGX_INT_T_LEN + 4);
+        if (name == NULL) {
+            return NGX_ERROR;
+        }
+
+        var->self = BENCH_NVARS + i;
+        var->idx = i;
+        var->name.data = name;
+        var->name.len = ngx_sprintf(name, "cnt_%ui", i) - name;
+    }
+
+    /* the zone is not a real shared memory zone, but update() needs a slab
+     * pool with a mutex for operation set */
+
+    cnt_set->zone = ngx_pcalloc(ctx->pool, sizeof(ngx_shm_zone_t));
+    shpool = ngx_pcalloc(ctx->pool, sizeof(ngx_slab_pool_t));
+    if (cnt_set->zone == NULL || shpool == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (ngx_shmtx_create(&shpool->mutex, &shpool->lock, NULL) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    size = ngx_http_cnt_shm_block_size(&cnt_set->vars);
+
+    block = ngx_pcalloc(ctx->pool, size);
+    if (block == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_http_cnt_shm_block_init(block, &cnt_set->vars, size);
+
+    cnt_set->zone->shm.addr = (u_char *) shpool;
+    cnt_set->zone->data = block;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+bench_init(bench_ctx_t *ctx, bench_case_t *bc, ngx_log_t *log)
+{
+    ngx_uint_t                           i;
+    ngx_http_request_t                  *r;
+    ngx_connection_t                    *c;
+    ngx_http_core_main_conf_t           *cmcf;
+    ngx_http_cnt_set_t                  *cnt_set;
+    ngx_http_cnt_data_t                 *cnt_data;
+    ngx_http_cnt_rt_var_data_t          *rt_var;
+    ngx_http_cnt_var_data_t             *var_data;
+    ngx_http_cnt_range_boundary_data_t  *bound;
+    void                               **confs;
+
+    ngx_memzero(ctx, sizeof(bench_ctx_t));
+
+    ctx->pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, log);
+    if (ctx->pool == NULL) {
+        return NGX_ERROR;
+    }
+
+    ctx->mcf = ngx_pcalloc(ctx->pool, sizeof(ngx_http_cnt_main_conf_t));
+    ctx->scf = ngx_pcalloc(ctx->pool, sizeof(ngx_http_cnt_srv_conf_t));
+    ctx->lcf = ngx_pcalloc(ctx->pool, sizeof(ngx_http_cnt_loc_conf_t));
+    cmcf = ngx_pcalloc(ctx->pool, sizeof(ngx_http_core_main_conf_t));
+    if (ctx->mcf == NULL || ctx->scf == NULL || ctx->lcf == NULL
+        || cmcf == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    if (ngx_array_init(&ctx->mcf->cnt_sets, ctx->pool, bc->nsets,
+                       sizeof(ngx_http_cnt_set_t)) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    for (i = 0; i < bc->nsets; i++) {
+        cnt_set = ngx_array_push(&ctx->mcf->cnt_sets);
+        if (cnt_set == NULL
+            || bench_init_set(ctx, cnt_set, bc->ncounters, i) != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    ngx_http_cnt_set_collection_buf_len(ctx->mcf);
+
+    /* the request's server uses the last set, this is the worst case for
+     * get_value() */
+
+    ctx->scf->cnt_set = bc->nsets - 1;
+
+    if (ngx_array_init(&ctx->lcf->cnt_data, ctx->pool, bc->ncounters,
+                       sizeof(ngx_http_cnt_data_t)) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    for (i = 0; i < bc->ncounters; i++) {
+        cnt_data = ngx_array_push(&ctx->lcf->cnt_data);
+        if (cnt_data == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_memzero(cnt_data, sizeof(ngx_http_cnt_data_t));
+
+        cnt_data->op = bc->cnt_op;
+        cnt_data->self = BENCH_NVARS + i;
+        cnt_data->idx = i;
+        cnt_data->value = bc->rt_var ? 0 : 1;
+
+        if (!bc->rt_var) {
+            continue;
+        }
+
+        if (ngx_array_init(&cnt_data->rt_vars, ctx->pool, 1,
+                           sizeof(ngx_http_cnt_rt_var_data_t)) != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        rt_var = ngx_array_push(&cnt_data->rt_vars);
+        if (rt_var == NULL) {
+            return NGX_ERROR;
+        }
+
+        rt_var->self = BENCH_RT_VAR;
+        rt_var->negative = 0;
+    }
+
+    if (ngx_array_init(&ctx->var_data, ctx->pool, bc->nsets,
+                       sizeof(ngx_http_cnt_var_data_t)) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    for (i = 0; i < bc->nsets; i++) {
+        var_data = ngx_array_push(&ctx->var_data);
+        if (var_data == NULL) {
+            return NGX_ERROR;
+        }
+
+        var_data->cnt_set = i;
+        var_data->self = 0;
+        var_data->bin_idx = NGX_ERROR;
+    }
+
+    ctx->range.idx = BENCH_BOUND_VAR;
+
+    if (bc->nbins > 0) {
+        ctx->range.range = ngx_array_create(ctx->pool, bc->nbins,
+                                sizeof(ngx_http_cnt_range_boundary_data_t));
+        if (ctx->range.range == NULL) {
+            return NGX_ERROR;
+        }
+
+        for (i = 0; i < bc->nbins; i++) {
+            bound = ngx_array_push(ctx->range.range);
+            if (bound == NULL) {
+                return NGX_ERROR;
+            }
+
+            bound->value = (double) (i + 1) / bc->nbins;
+            ngx_str_null(&bound->s_value);
+        }
+    }
+
+    /* variables get looked up by their indexes only, their values are
+     * cached in the request */
+
+    if (ngx_array_init(&cmcf->variables, ctx->pool, BENCH_NVARS,
+                       sizeof(ngx_http_variable_t)) != NGX_OK
+        || ngx_array_push_n(&cmcf->variables, BENCH_NVARS) == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(cmcf->variables.elts,
+                BENCH_NVARS * sizeof(ngx_http_variable_t));
+
+    c = ngx_pcalloc(ctx->pool, sizeof(ngx_connection_t));
+    r = ngx_pcalloc(ctx->pool, sizeof(ngx_http_request_t));
+    if (c == NULL || r == NULL) {
+        return NGX_ERROR;
+    }
+
+    c->log = log;
+
+    r->main = r;
+    r->connection = c;
+
+    r->variables = ngx_pcalloc(ctx->pool,
+                               BENCH_NVARS * sizeof(ngx_http_variable_value_t));
+    if (r->variables == NULL) {
+        return NGX_ERROR;
+    }
+
+    r->variables[BENCH_RT_VAR].len = 1;
+    r->variables[BENCH_RT_VAR].data = (u_char *) "3";
+    r->variables[BENCH_RT_VAR].valid = 1;
+
+    r->variables[BENCH_BOUND_VAR].len = 5;
+    r->variables[BENCH_BOUND_VAR].data = (u_char *) "0.618";
+    r->variables[BENCH_BOUND_VAR].valid = 1;
+
+    confs = ngx_pcalloc(ctx->pool, 6 * sizeof(void *));
+    if (confs == NULL) {
+        return NGX_ERROR;
+    }
+
+    r->main_conf = confs;
+    r->srv_conf = confs + 2;
+    r->loc_conf = confs + 4;
+
+    r->main_conf[ngx_http_core_module.ctx_index] = cmcf;
+    r->main_conf[ngx_http_custom_counters_module.ctx_index] = ctx->mcf;
+    r->srv_conf[ngx_http_custom_counters_module.ctx_index] = ctx->scf;
+    r->loc_conf[ngx_http_custom_counters_module.ctx_index] = ctx->lcf;
+
+    ctx->r = r;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+bench_run(bench_case_t *bc, ngx_uint_t iterations, ngx_log_t *log)
+{
+    ngx_uint_t                     i, n, allocs;
+    bench_ctx_t                    ctx;
+    struct timespec                start, end;
+    double                         ns;
+    size_t                         used;
+
+    if (bench_init(&ctx, bc, log) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    ns = 0;
+    used = 0;
+    allocs = 0;
+
+    for (n = 0; n < iterations; n += BENCH_BATCH) {
+
+        /* every batch runs in a new request pool, like a request does */
+
+        ctx.r->pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, log);
+        if (ctx.r->pool == NULL) {
+            return NGX_ERROR;
+        }
+
+        used -= bench_pool_used(ctx.r->pool);
+        bench_allocs = 0;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        for (i = 0; i < BENCH_BATCH; i++) {
+            (void) bc->op(&ctx);
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        allocs += bench_allocs;
+        used += bench_pool_used(ctx.r->pool);
+
+        ns += (end.tv_sec - start.tv_sec) * 1e9
+              + (end.tv_nsec - start.tv_nsec);
+
+        ngx_destroy_pool(ctx.r->pool);
+    }
+
+    printf("%-18s %6lu %6lu %6lu %12.1f %10.3f %12.1f\n", bc->name,
+           (unsigned long) bc->nsets, (unsigned long) bc->ncounters,
+           (unsigned long) bc->nbins, ns / n, (double) allocs / n,
+           (double) used / n);
+
+    ngx_destroy_pool(ctx.pool);
+
+    return NGX_OK;
+}
+
+
+int
+main(int argc, char *const *argv)
+{
+    ngx_uint_t                     iterations = 1000000, n;
+    bench_case_t                  *bc;
+    ngx_log_t                      log;
+    ngx_open_file_t                file;
+    ngx_cycle_t                    cycle;
+
+    if (argc > 1) {
+        iterations = strtoul(argv[1], NULL, 10);
+        if (iterations < BENCH_BATCH) {
+            fprintf(stderr, "usage: %s [iterations >= %d]\n", argv[0],
+                    BENCH_BATCH);
+            return 1;
+        }
+    }
+
+    ngx_pagesize = getpagesize();
+    ngx_cacheline_size = NGX_CPU_CACHE_LINE;
+
+    ngx_time_init();
+
+    ngx_memzero(&file, sizeof(ngx_open_file_t));
+    file.fd = ngx_stderr;
+
+    ngx_memzero(&log, sizeof(ngx_log_t));
+    log.file = &file;
+    log.log_level = NGX_LOG_WARN;
+
+    ngx_memzero(&cycle, sizeof(ngx_cycle_t));
+    cycle.log = &log;
+    ngx_cycle = &cycle;
+
+    ngx_http_core_module.ctx_index = 0;
+    ngx_http_custom_counters_module.ctx_index = 1;
+
+    printf("%-18s %6s %6s %6s %12s %10s %12s\n", "path", "sets", "cnts",
+           "bins", "ns/op", "allocs/op", "pool B/op");
+
+    for (bc = bench_cases; bc->name != NULL; bc++) {
+
+        /* heavy cases get proportionally fewer iterations */
+
+        n = iterations / (bc->ncounters * bc->nsets > 100 ?
+                          bc->ncounters * bc->nsets / 100 : 1);
+        n = ngx_max(n, BENCH_BATCH);
+
+        if (bench_run(bc, n, &log) != NGX_OK) {
+            fprintf(stderr, "failed to run \"%s\"\n", bc->name);
+            return 1;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,102 @@
+#!/usr/bin/perl
+
+# Generates an Nginx configuration with many servers, counters and locations
+# for measuring how long it takes to load the configuration, e.g.
+#
+#   $ perl gen-conf.pl -s 3000 -c 14 -l 4 > nginx.conf
+#   $ time nginx -t -p . -c nginx.conf
+#
+# and the same with a running Nginx and nginx -s reload.
+
+use strict;
+use warnings;
+
+use Getopt::Std;
+
+my %opts = (s => 1000, c => 10, l => 2, i => 0, p => 8010);
+
+getopts('s:c:l:i:p:uh', \%opts) or usage();
+usage() if $opts{h};
+
+my ($servers, $counters, $locations, $inherit, $port) = @opts{qw(s c l i p)};
+my $vars = $opts{u} ? $servers * $counters : $counters;
+my $hash_size = 1;
+
+$hash_size *= 2 while $hash_size < 4 * ($vars + 16);
+
+print <<END;
+worker_processes  1;
+error_log         logs/error.log  notice;
+pid               logs/nginx.pid;
+
+events {
+    worker_connections  1024;
+}
+
+http {
+    access_log  off;
+
+    variables_hash_max_size     $hash_size;
+    variables_hash_bucket_size  128;
+
+    counters_survive_reload on;
+
+END
+
+for my $s (0 .. $servers - 1) {
+    my $prefix = $opts{u} ? "cnt_${s}_" : 'cnt_';
+
+    print <<END;
+    server {
+        listen          $port;
+        server_name     server_$s;
+        counter_set_id  set_$s;
+
+END
+
+    for my $c (0 .. $counters - 1) {
+        print "        counter \$$prefix$c inc;\n";
+    }
+
+    for my $l (0 .. $locations - 1) {
+        my $c = $l % $counters;
+        print <<END;
+
+        location /loc_$l {
+            counter \$$prefix$c inc;
+            return 200;
+        }
+END
+    }
+
+    for my $l (0 .. $inherit - 1) {
+        print <<END;
+
+        location /inherit_$l {
+            return 200;
+        }
+END
+    }
+
+    print "    }\n\n";
+}
+
+print "}\n";
+
+
+sub usage {
+    print STDERR <<END;
+Usage: $0 [-s servers] [-c counters] [-l locations] [-i locations]
+       [-p port] [-u]
+
+  -s  number of servers, each server has its own counter set (default 1000)
+  -c  number of counters in a server (default 10)
+  -l  number of locations with own counters in a server (default 2)
+  -i  number of locations without own counters in a server (default 0)
+  -p  port to listen (default 8010)
+  -u  use unique counter names in all servers, by default counters in
+      different servers share names
+END
+    exit 1;
+}
+
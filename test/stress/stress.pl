@@ -0,0 +1,334 @@
+#!/usr/bin/perl
+
+# Runs Nginx with several worker processes and hammers shared counters from
+# many concurrent keepalive clients, e.g.
+#
+#   $ perl stress.pl -w 4 -c 32 -n 20000
+#
+# The load is run twice: against a location without counters to get the
+# baseline, and against a mix of locations with inc and set counters, a
+# histogram and the counters collection. Then the final values of the counters
+# are checked to be exactly as expected, and requests per second and the 99th
+# percentile of latencies are reported against the baseline. The exit status
+# is not zero if any counter was lost or the overhead exceeds option -f.
+
+use strict;
+use warnings;
+
+use Getopt::Std;
+use File::Temp qw(tempdir);
+use IO::Socket::INET;
+use POSIX qw(:sys_wait_h);
+use Time::HiRes qw(time sleep);
+
+my %opts = (w => 4, c => 16, n => 10000, p => 8020, b => 'nginx');
+
+getopts('w:c:n:p:b:f:kh', \%opts) or usage();
+usage() if $opts{h};
+
+my ($workers, $clients, $requests, $port, $nginx) = @opts{qw(w c n p b)};
+my $prefix = tempdir('nginx-custom-counters-stress-XXXX',
+                     TMPDIR => 1, CLEANUP => !$opts{k});
+my $failed = 0;
+
+$SIG{PIPE} = 'IGNORE';
+
+# each request of a client goes to a location selected by its sequence number:
+# 6 of 10 requests go to /inc, 2 to /hst, 1 to /set and 1 to /collection
+my @mix = (('inc') x 6, ('hst') x 2, 'set', 'collection');
+
+mkdir "$prefix/logs" or die "Could not create $prefix/logs: $!";
+write_conf("$prefix/nginx.conf");
+
+my $pid = start_nginx();
+
+my $base = run_load(sub { '/base' });
+my $mixed = run_load(\&mixed_uri);
+
+check_counters();
+report('baseline', $base);
+report('counters', $mixed);
+
+my $rps_loss = 100 * (1 - $mixed->{rps} / $base->{rps});
+my $p99_gain = 100 * ($mixed->{p99} / $base->{p99} - 1);
+
+printf "overhead: %.1f%% of rps, %.1f%% of p99\n", $rps_loss, $p99_gain;
+
+if (defined $opts{f} && ($rps_loss > $opts{f} || $p99_gain > $opts{f})) {
+    print "FAILED: overhead exceeds $opts{f}%\n";
+    $failed = 1;
+}
+
+stop_nginx($pid);
+print "logs were kept in $prefix\n" if $opts{k};
+exit $failed;
+
+
+sub write_conf {
+    my $file = shift;
+
+    open my $fh, '>', $file or die "Could not open $file: $!";
+    print $fh <<END;
+worker_processes  $workers;
+daemon            off;
+error_log         logs/error.log  warn;
+pid               logs/nginx.pid;
+
+events {
+    worker_connections  @{[ $clients * 2 + 64 ]};
+}
+
+http {
+    access_log  off;
+
+    server {
+        listen              $port;
+        server_name         stress;
+        keepalive_requests  @{[ $requests + 1 ]};
+
+        location /base {
+            return 200;
+        }
+
+        location /inc {
+            counter \$cnt_inc inc;
+            counter \$cnt_inc_arg inc \$arg_v;
+            return 200;
+        }
+
+        location /hst {
+            counter \$cnt_hst inc;
+            histogram \$hst_bin 4 \$arg_v;
+            return 200;
+        }
+
+        location /set {
+            counter \$cnt_set set \$arg_v;
+            return 200;
+        }
+
+        location /collection {
+            return 200 \$cnt_collection;
+        }
+
+        location /show {
+            return 200 "\$cnt_inc \$cnt_inc_arg \$cnt_hst \$cnt_set \$hst_bin_cnt \$hst_bin_err \$hst_bin_00 \$hst_bin_01 \$hst_bin_02 \$hst_bin_03";
+        }
+    }
+}
+END
+    close $fh;
+}
+
+
+sub start_nginx {
+    my $pid = fork // die "Could not fork: $!";
+
+    if ($pid == 0) {
+        exec $nginx, '-p', "$prefix/", '-c', "$prefix/nginx.conf";
+        die "Could not run $nginx: $!";
+    }
+
+    for (1 .. 100) {
+        return $pid if IO::Socket::INET->new(PeerAddr => "127.0.0.1:$port");
+        die "Nginx exited, see $prefix/logs/error.log\n"
+            if waitpid($pid, WNOHANG) == $pid;
+        sleep 0.05;
+    }
+
+    kill 'QUIT', $pid;
+    die "Nginx did not start listening on port $port\n";
+}
+
+
+sub stop_nginx {
+    my $pid = shift;
+
+    kill 'QUIT', $pid;
+    waitpid $pid, 0;
+}
+
+
+sub mixed_uri {
+    my ($client, $i) = @_;
+    my $loc = $mix[$i % @mix];
+
+    return "/$loc?v=" . ($loc eq 'hst' ? ($client + $i) % 4
+                                       : $client % 7 + 1);
+}
+
+
+sub run_load {
+    my $uri = shift;
+    my (@pids, @latencies);
+    my $start = time;
+
+    for my $client (0 .. $clients - 1) {
+        my $pid = fork // die "Could not fork: $!";
+
+        if ($pid == 0) {
+            open my $fh, '>', "$prefix/client.$client" or exit 1;
+            my $conn = Conn->new($port);
+
+            for my $i (0 .. $requests - 1) {
+                my $t = time;
+                my ($status) = $conn->get($uri->($client, $i));
+                exit 1 unless $status == 200;
+                printf $fh "%.0f\n", (time - $t) * 1e6;
+            }
+
+            close $fh;
+            exit 0;
+        }
+
+        push @pids, $pid;
+    }
+
+    for (@pids) {
+        waitpid $_, 0;
+        die "A client failed, see $prefix/logs/error.log\n" if $?;
+    }
+
+    my $elapsed = time - $start;
+
+    for my $client (0 .. $clients - 1) {
+        open my $fh, '<', "$prefix/client.$client" or die $!;
+        chomp(my @l = <$fh>);
+        push @latencies, @l;
+        close $fh;
+    }
+
+    @latencies = sort { $a <=> $b } @latencies;
+
+    return {rps => @latencies / $elapsed,
+            p50 => $latencies[int(@latencies * 0.50)],
+            p99 => $latencies[int(@latencies * 0.99)]};
+}
+
+
+sub check_counters {
+    my (%expected, %set_values);
+
+    $expected{$_} = 0 for qw(inc inc_arg hst cnt err 00 01 02 03);
+
+    for my $client (0 .. $clients - 1) {
+        for my $i (0 .. $requests - 1) {
+            my ($v) = mixed_uri($client, $i) =~ /v=(\d+)/;
+            my $loc = $mix[$i % @mix];
+
+            if ($loc eq 'inc') {
+                $expected{inc}++;
+                $expected{inc_arg} += $v;
+            } elsif ($loc eq 'hst') {
+                $expected{hst}++;
+                $expected{cnt}++;
+                $expected{sprintf '%02d', $v}++;
+            } elsif ($loc eq 'set') {
+                $set_values{$v} = 1;
+            }
+        }
+    }
+
+    # the value of a set counter is the value of the latest request to /set
+    # which is not known, but it must be one of the values sent
+    my (undef, $body) = Conn->new($port)->get('/show');
+    my %got;
+
+    @got{qw(inc inc_arg hst set cnt err 00 01 02 03)} = split ' ', $body;
+
+    for (qw(inc inc_arg hst cnt err 00 01 02 03)) {
+        if ($got{$_} == $expected{$_}) {
+            print "ok: $_ = $got{$_}\n";
+        } else {
+            print "FAILED: $_ = $got{$_}, expected $expected{$_}\n";
+            $failed = 1;
+        }
+    }
+
+    if ($set_values{$got{set}}) {
+        print "ok: set = $got{set}\n";
+    } else {
+        print "FAILED: set = $got{set} was never sent\n";
+        $failed = 1;
+    }
+}
+
+
+sub report {
+    my ($name, $r) = @_;
+
+    printf "%s: %d clients x %d requests, %.0f rps, p50 %d us, p99 %d us\n",
+        $name, $clients, $requests, $r->{rps}, $r->{p50}, $r->{p99};
+}
+
+
+sub usage {
+    print STDERR <<END;
+Usage: $0 [-w workers] [-c clients] [-n requests] [-p port]
+       [-b nginx] [-f percent] [-k]
+
+  -w  number of Nginx worker processes (default 4)
+  -c  number of concurrent keepalive clients (default 16)
+  -n  number of requests sent by each client in each run (default 10000)
+  -p  port to listen (default 8020)
+  -b  Nginx binary built with this module (default nginx from PATH)
+  -f  fail if the overhead in rps or p99 against the baseline exceeds
+      this percentage
+  -k  keep the Nginx prefix directory with the configuration and logs
+END
+    exit 1;
+}
+
+
+package Conn;
+
+# a minimal HTTP/1.1 keepalive client which reconnects when the server closes
+# the connection
+
+sub new {
+    my ($class, $port) = @_;
+
+    return bless {port => $port}, $class;
+}
+
+sub get {
+    my ($self, $uri) = @_;
+
+    $self->connect unless $self->{sock};
+
+    my $req = "GET $uri HTTP/1.1\r\nHost: stress\r\n\r\n";
+
+    syswrite $self->{sock}, $req or die "Could not send request: $!";
+
+    my $head = $self->read_until(sub { index($_[0], "\r\n\r\n") }, 4);
+    my ($status) = $head =~ m{^HTTP/1\.1 (\d+)};
+    my ($len) = $head =~ /^Content-Length: (\d+)/mi;
+
+    $len //= 0;
+    my $body = $self->read_until(sub { length $_[0] >= $len ? $len : -1 }, 0);
+
+    delete $self->{sock} if $head =~ /^Connection: close/mi;
+
+    return ($status // 0, $body);
+}
+
+sub connect {
+    my $self = shift;
+
+    $self->{sock} = IO::Socket::INET->new(PeerAddr => "127.0.0.1:$self->{port}")
+        or die "Could not connect: $!";
+    $self->{buf} = '';
+}
+
+sub read_until {
+    my ($self, $end, $skip) = @_;
+    my $pos;
+
+    while (($pos = $end->($self->{buf})) < 0) {
+        my $n = sysread $self->{sock}, $self->{buf}, 65536, length $self->{buf};
+        die "Connection closed unexpectedly\n" unless $n;
+    }
+
+    return substr $self->{buf}, 0, $pos + $skip, '';
+}
+
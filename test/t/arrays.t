@@ -0,0 +1,144 @@
+# vi:filetype=
+
+use Test::Nginx::Socket;
+
+repeat_each(1);
+plan tests => repeat_each() * (2 * blocks());
+
+no_shuffle();
+run_tests();
+
+__DATA__
+
+=== TEST 1: check 0
+--- http_config
+    server {
+        listen          8010;
+        counter_set_id  arr;
+
+        counter_array $cnt_dense 5 $arg_i;
+        counter_array $cnt_sparse $arg_k 404 200 500;
+
+        location / {
+            return 200;
+        }
+
+        location /undo {
+            counter_array $cnt_dense undo;
+            return 200;
+        }
+    }
+
+    server {
+        listen          8030;
+        counter_set_id  arr;
+
+        counter_array $cnt_dense reuse;
+
+        location / {
+            return 200;
+        }
+    }
+
+    server {
+        listen          8020;
+        counter_set_id  arr;
+
+        location / {
+            echo "dense = $cnt_dense | sparse = $cnt_sparse";
+            echo -n "2 = $cnt_dense_2 | 200 = $cnt_sparse_200";
+            echo    " | err = $cnt_dense_err $cnt_sparse_err";
+        }
+
+        location /all {
+            echo $cnt_collection;
+        }
+
+        location /reset {
+            counter_array $cnt_dense reset;
+            return 200;
+        }
+    }
+--- config
+        location ~ ^/8010/(.*) {
+            proxy_pass http://127.0.0.1:8010/$1$is_args$args;
+        }
+
+        location ~ ^/8020/(.*) {
+            proxy_pass http://127.0.0.1:8020/$1;
+        }
+
+        location ~ ^/8030/(.*) {
+            proxy_pass http://127.0.0.1:8030/$1$is_args$args;
+        }
+--- request
+GET /8020/
+--- response_body
+dense = {"0":0,"1":0,"2":0,"3":0,"4":0} | sparse = {"200":0,"404":0,"500":0}
+2 = 0 | 200 = 0 | err = 0 0
+--- error_code: 200
+
+=== TEST 2: indexes of both arrays
+--- request
+GET /8010/?i=2&k=200
+--- response_body
+--- error_code: 200
+
+=== TEST 3: last index of the dense array
+--- request
+GET /8010/?i=4&k=404
+--- response_body
+--- error_code: 200
+
+=== TEST 4: indexes out of the arrays
+--- request
+GET /8010/?i=5&k=201
+--- response_body
+--- error_code: 200
+
+=== TEST 5: indexes which are not non-negative integers
+--- request
+GET /8010/?i=-1&k=abc
+--- response_body
+--- error_code: 200
+
+=== TEST 6: undo the dense array
+--- request
+GET /8010/undo?i=0&k=500
+--- response_body
+--- error_code: 200
+
+=== TEST 7: reuse the dense array in another server
+--- request
+GET /8030/?i=0&k=500
+--- response_body
+--- error_code: 200
+
+=== TEST 8: check 1
+--- request
+GET /8020/
+--- response_body
+dense = {"0":1,"1":0,"2":1,"3":0,"4":1} | sparse = {"200":1,"404":1,"500":1}
+2 = 1 | 200 = 1 | err = 2 2
+--- error_code: 200
+
+=== TEST 9: check collection
+--- request
+GET /8020/all
+--- response_body
+{"arr":{"cnt_dense_err":2,"cnt_sparse_err":2,"cnt_dense":{"0":1,"1":0,"2":1,"3":0,"4":1},"cnt_sparse":{"200":1,"404":1,"500":1}}}
+--- error_code: 200
+
+=== TEST 10: reset the dense array
+--- request
+GET /8020/reset
+--- response_body
+--- error_code: 200
+
+=== TEST 11: check 2
+--- request
+GET /8020/
+--- response_body
+dense = {"0":0,"1":0,"2":0,"3":0,"4":0} | sparse = {"200":1,"404":1,"500":1}
+2 = 0 | 200 = 1 | err = 0 2
+--- error_code: 200
@@ -182,3 +182,371 @@ GET /8020/all
 sprintf('{"main":{"cnt_all_requests":5,"cnt_a_requests":9,"cnt_test1_requests":5,"cnt_test2_requests":5,"cnt_test3_requests":5,"cnt_test_requests":4,"cnt_test_a_requests":9,"cnt_test_b_requests":1,"ecnt_test_requests":1,"cnt_bytes_sent":%d},"other":{"cnt_test1_requests":0},"test.histogram":{"hst_request_time_00":0,"hst_request_time_01":0,"hst_request_time_02":0,"hst_request_time_03":0,"hst_request_time_04":0,"hst_request_time_05":0,"hst_request_time_06":0,"hst_request_time_07":0,"hst_request_time_08":0,"hst_request_time_09":0,"hst_request_time_10":0,"hst_request_time_cnt":0,"hst_request_time_err":0}}%s', $ENV{NGXVER} eq 'head' || version->parse('v'.$ENV{NGXVER}) >= version->parse('v1.30') ? 879 : 737, "\n")
 --- error_code: 200
 
+=== TEST 2: backup with fsync=none
+--- http_config
+    counters_persistent_storage html/counters-none.json 1s fsync=none;
+
+    server {
+        listen          8010;
+        counter_set_id  fsync;
+
+        counter $cnt_requests inc;
+
+        location / {
+            return 200;
+        }
+    }
+
+    server {
+        listen          8020;
+
+        location /sleep {
+            echo_sleep 2;
+            echo Ok;
+        }
+
+        location /backup {
+            default_type application/json;
+            alias html/counters-none.json~;
+        }
+
+        location /files/ {
+            alias html/;
+            autoindex on;
+            autoindex_format json;
+        }
+    }
+--- config
+        location ~ ^/8010/(.*) {
+            proxy_pass http://127.0.0.1:8010/$1$is_args$args;
+        }
+
+        location ~ ^/8020/(.*) {
+            proxy_pass http://127.0.0.1:8020/$1;
+        }
+--- request
+GET /8010/
+--- response_body
+--- error_code: 200
+
+=== TEST 3: wait for the backup with fsync=none
+--- request
+GET /8020/sleep
+--- response_body
+Ok
+--- error_code: 200
+
+=== TEST 4: check the backup with fsync=none
+--- request
+GET /8020/backup
+--- response_body chomp
+{"fsync":{"cnt_requests":1}}
+--- error_code: 200
+
+=== TEST 5: the backup with fsync=none replaced its temporary file
+--- request
+GET /8020/files/
+--- response_body_like
+^(?!.*counters-none\.json~\.\d).*"counters-none\.json~"
+--- error_code: 200
+
+=== TEST 6: backup with fsync=data
+--- http_config
+    counters_persistent_storage html/counters-data.json 1s fsync=data;
+
+    server {
+        listen          8010;
+        counter_set_id  fsync;
+
+        counter $cnt_requests inc;
+
+        location / {
+            return 200;
+        }
+    }
+
+    server {
+        listen          8020;
+
+        location /sleep {
+            echo_sleep 2;
+            echo Ok;
+        }
+
+        location /backup {
+            default_type application/json;
+            alias html/counters-data.json~;
+        }
+
+        location /files/ {
+            alias html/;
+            autoindex on;
+            autoindex_format json;
+        }
+    }
+--- config
+        location ~ ^/8010/(.*) {
+            proxy_pass http://127.0.0.1:8010/$1$is_args$args;
+        }
+
+        location ~ ^/8020/(.*) {
+            proxy_pass http://127.0.0.1:8020/$1;
+        }
+--- request
+GET /8010/
+--- response_body
+--- error_code: 200
+
+=== TEST 7: wait for the backup with fsync=data
+--- request
+GET /8020/sleep
+--- response_body
+Ok
+--- error_code: 200
+
+=== TEST 8: check the backup with fsync=data
+--- request
+GET /8020/backup
+--- response_body chomp
+{"fsync":{"cnt_requests":1}}
+--- error_code: 200
+
+=== TEST 9: the backup with fsync=data replaced its temporary file
+--- request
+GET /8020/files/
+--- response_body_like
+^(?!.*counters-data\.json~\.\d).*"counters-data\.json~"
+--- error_code: 200
+
+=== TEST 10: backup with fsync=dir
+--- http_config
+    counters_persistent_storage html/counters-dir.json 1s fsync=dir;
+
+    server {
+        listen          8010;
+        counter_set_id  fsync;
+
+        counter $cnt_requests inc;
+
+        location / {
+            return 200;
+        }
+    }
+
+    server {
+        listen          8020;
+
+        location /sleep {
+            echo_sleep 2;
+            echo Ok;
+        }
+
+        location /backup {
+            default_type application/json;
+            alias html/counters-dir.json~;
+        }
+
+        location /files/ {
+            alias html/;
+            autoindex on;
+            autoindex_format json;
+        }
+    }
+--- config
+        location ~ ^/8010/(.*) {
+            proxy_pass http://127.0.0.1:8010/$1$is_args$args;
+        }
+
+        location ~ ^/8020/(.*) {
+            proxy_pass http://127.0.0.1:8020/$1;
+        }
+--- request
+GET /8010/
+--- response_body
+--- error_code: 200
+
+=== TEST 11: wait for the backup with fsync=dir
+--- request
+GET /8020/sleep
+--- response_body
+Ok
+--- error_code: 200
+
+=== TEST 12: check the backup with fsync=dir
+--- request
+GET /8020/backup
+--- response_body chomp
+{"fsync":{"cnt_requests":1}}
+--- error_code: 200
+
+=== TEST 13: the backup with fsync=dir replaced its temporary file
+--- request
+GET /8020/files/
+--- response_body_like
+^(?!.*counters-dir\.json~\.\d).*"counters-dir\.json~"
+--- error_code: 200
+
+=== TEST 14: backup which is newer than the main storage gets loaded
+--- user_files
+>>> counters-newer.json 202001010000
+{"sel":{"cnt_requests":1}}
+>>> counters-newer.json~ 202101010000
+{"sel":{"cnt_requests":2}}
+--- http_config
+    counters_persistent_storage html/counters-newer.json 10s;
+
+    server {
+        listen          8010;
+        counter_set_id  sel;
+
+        counter $cnt_requests inc;
+
+        location / {
+            return 200;
+        }
+    }
+
+    server {
+        listen          8020;
+        counter_set_id  sel;
+
+        location / {
+            echo "requests = $cnt_requests";
+        }
+    }
+--- config
+        location ~ ^/8010/(.*) {
+            proxy_pass http://127.0.0.1:8010/$1$is_args$args;
+        }
+
+        location ~ ^/8020/(.*) {
+            proxy_pass http://127.0.0.1:8020/$1;
+        }
+--- request
+GET /8020/
+--- response_body
+requests = 2
+--- error_code: 200
+
+=== TEST 15: backup which is older than the main storage is ignored
+--- user_files
+>>> counters-older.json 202101010000
+{"sel":{"cnt_requests":1}}
+>>> counters-older.json~ 202001010000
+{"sel":{"cnt_requests":2}}
+--- http_config
+    counters_persistent_storage html/counters-older.json 10s;
+
+    server {
+        listen          8010;
+        counter_set_id  sel;
+
+        counter $cnt_requests inc;
+
+        location / {
+            return 200;
+        }
+    }
+
+    server {
+        listen          8020;
+        counter_set_id  sel;
+
+        location / {
+            echo "requests = $cnt_requests";
+        }
+    }
+--- config
+        location ~ ^/8010/(.*) {
+            proxy_pass http://127.0.0.1:8010/$1$is_args$args;
+        }
+
+        location ~ ^/8020/(.*) {
+            proxy_pass http://127.0.0.1:8020/$1;
+        }
+--- request
+GET /8020/
+--- response_body
+requests = 1
+--- error_code: 200
+
+=== TEST 16: empty backup is ignored
+--- user_files
+>>> counters-empty.json~ 202101010000
+>>> counters-empty.json 202001010000
+{"sel":{"cnt_requests":1}}
+--- http_config
+    counters_persistent_storage html/counters-empty.json 10s;
+
+    server {
+        listen          8010;
+        counter_set_id  sel;
+
+        counter $cnt_requests inc;
+
+        location / {
+            return 200;
+        }
+    }
+
+    server {
+        listen          8020;
+        counter_set_id  sel;
+
+        location / {
+            echo "requests = $cnt_requests";
+        }
+    }
+--- config
+        location ~ ^/8010/(.*) {
+            proxy_pass http://127.0.0.1:8010/$1$is_args$args;
+        }
+
+        location ~ ^/8020/(.*) {
+            proxy_pass http://127.0.0.1:8020/$1;
+        }
+--- request
+GET /8020/
+--- response_body
+requests = 1
+--- error_code: 200
+
+=== TEST 17: backup is loaded when there is no main storage
+--- user_files
+>>> counters-lost.json~ 202001010000
+{"sel":{"cnt_requests":3}}
+--- http_config
+    counters_persistent_storage html/counters-lost.json 10s;
+
+    server {
+        listen          8010;
+        counter_set_id  sel;
+
+        counter $cnt_requests inc;
+
+        location / {
+            return 200;
+        }
+    }
+
+    server {
+        listen          8020;
+        counter_set_id  sel;
+
+        location / {
+            echo "requests = $cnt_requests";
+        }
+    }
+--- config
+        location ~ ^/8010/(.*) {
+            proxy_pass http://127.0.0.1:8010/$1$is_args$args;
+        }
+
+        location ~ ^/8020/(.*) {
+            proxy_pass http://127.0.0.1:8020/$1;
+        }
+--- request
+GET /8020/
+--- response_body
+requests = 3
+--- error_code: 200
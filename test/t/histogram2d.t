@@ -0,0 +1,119 @@
+# vi:filetype=
+
+use Test::Nginx::Socket;
+
+repeat_each(1);
+plan tests => repeat_each() * (2 * blocks());
+
+no_shuffle();
+run_tests();
+
+__DATA__
+
+=== TEST 1: check 0
+--- http_config
+    server {
+        listen          8010;
+        counter_set_id  heatmap;
+
+        histogram2d $hst_heat $arg_row $arg_col 2 3;
+
+        location / {
+            return 200;
+        }
+    }
+
+    server {
+        listen          8020;
+        counter_set_id  heatmap;
+
+        location / {
+            echo "heat = $hst_heat | 1_2 = $hst_heat_1_2 | err = $hst_heat_err";
+        }
+
+        location /all {
+            echo $cnt_collection;
+        }
+    }
+--- config
+        location ~ ^/8010/(.*) {
+            proxy_pass http://127.0.0.1:8010/$1$is_args$args;
+        }
+
+        location ~ ^/8020/(.*) {
+            proxy_pass http://127.0.0.1:8020/$1;
+        }
+--- request
+GET /8020/
+--- response_body
+heat = [[0,0,0],[0,0,0]] | 1_2 = 0 | err = 0
+--- error_code: 200
+
+=== TEST 2: row 0 column 1
+--- request
+GET /8010/?row=0&col=1
+--- response_body
+--- error_code: 200
+
+=== TEST 3: row 1 column 2
+--- request
+GET /8010/?row=1&col=2
+--- response_body
+--- error_code: 200
+
+=== TEST 4: row 1 column 2 again
+--- request
+GET /8010/?row=1&col=2
+--- response_body
+--- error_code: 200
+
+=== TEST 5: check 1
+--- request
+GET /8020/
+--- response_body
+heat = [[0,1,0],[0,0,2]] | 1_2 = 2 | err = 0
+--- error_code: 200
+
+=== TEST 6: row out of range
+--- request
+GET /8010/?row=2&col=0
+--- response_body
+--- error_code: 200
+
+=== TEST 7: column out of range
+--- request
+GET /8010/?row=0&col=3
+--- response_body
+--- error_code: 200
+
+=== TEST 8: row that overflows the offset of a valid bin
+--- request
+GET /8010/?row=6148914691236517206&col=0
+--- response_body
+--- error_code: 200
+
+=== TEST 9: non-numeric row
+--- request
+GET /8010/?row=a&col=0
+--- response_body
+--- error_code: 200
+
+=== TEST 10: no column
+--- request
+GET /8010/?row=0
+--- response_body
+--- error_code: 200
+
+=== TEST 11: check 2
+--- request
+GET /8020/
+--- response_body
+heat = [[0,1,0],[0,0,2]] | 1_2 = 2 | err = 5
+--- error_code: 200
+
+=== TEST 12: check all
+--- request
+GET /8020/all
+--- response_body
+{"heatmap":{"hst_heat_err":5,"hst_heat":[[0,1,0],[0,0,2]]}}
+--- error_code: 200
@@ -0,0 +1,379 @@
+# vi:filetype=
+
+use Test::Nginx::Socket;
+use File::Basename;
+use File::Copy;
+
+my $counters_file = '../counters-journal.json';
+
+(my $servroot = server_root()) =~ s"([^/])$"$1/";
+
+# the storages are kept in the parent directory of the server root which may
+# not exist yet
+my $root = dirname(server_root()) . '/';
+
+for my $name ('journal', 'replay', 'torn', 'compact', 'compacted', 'pool',
+              'pool-replay')
+{
+    for my $file ("${root}counters-$name.json",
+                  "${root}counters-$name.json.journal")
+    {
+        if (-f $file) {
+            unlink $file if -e $file or die "Could not unlink $file: $!";
+        }
+    }
+}
+
+# the base storage from which the journal starts
+open my $fh, '>', "${root}counters-journal.json"
+    or die "Could not open $counters_file: $!";
+print $fh '{"jrn":{"cnt_requests":100}}';
+close $fh;
+
+# render the types of records in a journal
+sub journal_records {
+    my $file = "${root}counters-" . shift() . ".json.journal";
+    open my $in, '<:raw', $file or die "Could not open $file: $!";
+    local $/;
+    my $data = <$in>;
+    close $in;
+    my ($pos, $snapshots, $deltas) = (16, 0, 0);
+    while ($pos + 16 <= length $data) {
+        my ($type, $set, $len) = unpack 'L L Q', substr($data, $pos, 16);
+        $snapshots++ if $type == 1;
+        $deltas++ if $type == 2;
+        $pos += $len;
+    }
+    return "snapshots = $snapshots | deltas = " . ($deltas ? 'yes' : 'no');
+}
+
+# keep the journal of a running Nginx as if it has crashed, optionally
+# with an incomplete record at the end
+sub save_journal {
+    my ($from, $to, $torn) = @_;
+    my $journal = "${root}counters-$to.json.journal";
+    copy("${root}counters-$from.json.journal", $journal)
+        or die "Could not copy journal: $!";
+    if (-f "${root}counters-$from.json") {
+        copy("${root}counters-$from.json",
+             "${root}counters-$to.json")
+            or die "Could not copy storage: $!";
+    }
+    if ($torn) {
+        open my $out, '>>:raw', $journal or die "Could not open $journal: $!";
+        print $out pack 'L L Q', 2, 0, 1024;
+        close $out;
+    }
+}
+
+sub write_html {
+    my ($name, $content) = @_;
+    open my $out, '>', "${servroot}html/$name"
+        or die "Could not open $name: $!";
+    print $out "$content\n";
+    close $out;
+}
+
+add_block_preprocessor(sub {
+    my $block = shift;
+    if (defined $block->http_config) {
+        my $http_config = $block->http_config;
+        $http_config =~ s/;;PUT_COUNTERS_FILE_HERE;;/$counters_file/;
+        $block->set_value("http_config", $http_config);
+    }
+});
+
+repeat_each(1);
+plan tests => repeat_each() * (2 * blocks() + 1);
+
+no_shuffle();
+run_tests();
+
+__DATA__
+
+=== TEST 1: start with the base storage
+--- http_config
+    counters_persistent_storage ;;PUT_COUNTERS_FILE_HERE;; 10s journal=1s;
+
+    server {
+        listen          8010;
+        counter_set_id  jrn;
+
+        counter $cnt_requests inc;
+
+        location / {
+            return 200;
+        }
+    }
+
+    server {
+        listen          8020;
+        counter_set_id  jrn;
+
+        location / {
+            echo "requests = $cnt_requests";
+        }
+
+        location /sleep {
+            echo_sleep 1.5;
+            echo Ok;
+        }
+    }
+--- config
+        location ~ ^/8010/(.*) {
+            proxy_pass http://127.0.0.1:8010/$1$is_args$args;
+        }
+
+        location ~ ^/8020/(.*) {
+            proxy_pass http://127.0.0.1:8020/$1;
+        }
+--- request
+GET /8020/
+--- response_body
+requests = 100
+--- error_code: 200
+
+=== TEST 2: test 1
+--- request
+GET /8010/
+--- response_body
+--- error_code: 200
+
+=== TEST 3: test 2
+--- request
+GET /8010/
+--- response_body
+--- error_code: 200
+
+=== TEST 4: wait for the journal
+--- request
+GET /8020/sleep
+--- response_body
+Ok
+--- error_code: 200
+
+=== TEST 5: the journal has deltas after the snapshot
+--- init
+main::write_html('journal.txt', main::journal_records('journal'));
+main::save_journal('journal', 'replay');
+main::save_journal('journal', 'torn', 1);
+--- request
+GET /journal.txt
+--- response_body
+snapshots = 1 | deltas = yes
+--- error_code: 200
+
+=== TEST 6: replay the deltas over the base storage
+--- http_config
+    counters_persistent_storage ../counters-replay.json 10s journal=1s;
+
+    server {
+        listen          8020;
+        counter_set_id  jrn;
+
+        counter $cnt_requests inc;
+
+        location / {
+            echo "requests = $cnt_requests";
+        }
+    }
+--- config
+        location ~ ^/8020/(.*) {
+            proxy_pass http://127.0.0.1:8020/$1;
+        }
+--- request
+GET /8020/
+--- response_body
+requests = 102
+--- error_code: 200
+
+=== TEST 7: ignore an incomplete record at the end of the journal
+--- http_config
+    counters_persistent_storage ../counters-torn.json 10s journal=1s;
+
+    server {
+        listen          8020;
+        counter_set_id  jrn;
+
+        counter $cnt_requests inc;
+
+        location / {
+            echo "requests = $cnt_requests";
+        }
+    }
+--- config
+        location ~ ^/8020/(.*) {
+            proxy_pass http://127.0.0.1:8020/$1;
+        }
+--- request
+GET /8020/
+--- response_body
+requests = 102
+--- error_code: 200
+--- error_log
+ends with an incomplete record, ignoring it
+
+=== TEST 8: start with compaction
+--- http_config
+    counters_persistent_storage ../counters-compact.json 2s journal=1s;
+
+    server {
+        listen          8010;
+        counter_set_id  jrn;
+
+        counter $cnt_requests inc;
+
+        location / {
+            return 200;
+        }
+    }
+
+    server {
+        listen          8020;
+        counter_set_id  jrn;
+
+        location /sleep {
+            echo_sleep 4;
+            echo Ok;
+        }
+    }
+--- config
+        location ~ ^/8010/(.*) {
+            proxy_pass http://127.0.0.1:8010/$1$is_args$args;
+        }
+
+        location ~ ^/8020/(.*) {
+            proxy_pass http://127.0.0.1:8020/$1;
+        }
+--- request
+GET /8010/
+--- response_body
+--- error_code: 200
+
+=== TEST 9: wait for compaction
+--- request
+GET /8020/sleep
+--- response_body
+Ok
+--- error_code: 200
+
+=== TEST 10: the compacted journal has only the snapshot
+--- init
+main::write_html('journal.txt', main::journal_records('compact'));
+main::save_journal('compact', 'compacted');
+--- request
+GET /journal.txt
+--- response_body
+snapshots = 1 | deltas = no
+--- error_code: 200
+
+=== TEST 11: the snapshot has the counters
+--- http_config
+    counters_persistent_storage ../counters-compacted.json 10s journal=1s;
+
+    server {
+        listen          8020;
+        counter_set_id  jrn;
+
+        counter $cnt_requests inc;
+
+        location / {
+            echo "requests = $cnt_requests";
+        }
+    }
+--- config
+        location ~ ^/8020/(.*) {
+            proxy_pass http://127.0.0.1:8020/$1;
+        }
+--- request
+GET /8020/
+--- response_body
+requests = 1
+--- error_code: 200
+
+=== TEST 12: start with the journal written in a thread pool
+--- main_config
+    thread_pool counters threads=1;
+--- http_config
+    counters_persistent_storage ../counters-pool.json 10s journal=1s
+            thread_pool=counters;
+
+    server {
+        listen          8010;
+        counter_set_id  jrn;
+
+        counter $cnt_requests inc;
+
+        location / {
+            return 200;
+        }
+    }
+
+    server {
+        listen          8020;
+        counter_set_id  jrn;
+
+        location /sleep {
+            echo_sleep 1.5;
+            echo Ok;
+        }
+    }
+--- config
+        location ~ ^/8010/(.*) {
+            proxy_pass http://127.0.0.1:8010/$1$is_args$args;
+        }
+
+        location ~ ^/8020/(.*) {
+            proxy_pass http://127.0.0.1:8020/$1;
+        }
+--- request
+GET /8010/
+--- response_body
+--- error_code: 200
+
+=== TEST 13: test 1
+--- request
+GET /8010/
+--- response_body
+--- error_code: 200
+
+=== TEST 14: wait for the journal in the thread pool
+--- request
+GET /8020/sleep
+--- response_body
+Ok
+--- error_code: 200
+
+=== TEST 15: the journal written in the thread pool has deltas
+--- init
+main::write_html('journal.txt', main::journal_records('pool'));
+main::save_journal('pool', 'pool-replay');
+--- request
+GET /journal.txt
+--- response_body
+snapshots = 1 | deltas = yes
+--- error_code: 200
+
+=== TEST 16: replay the journal written in the thread pool
+--- http_config
+    counters_persistent_storage ../counters-pool-replay.json 10s journal=1s;
+
+    server {
+        listen          8020;
+        counter_set_id  jrn;
+
+        counter $cnt_requests inc;
+
+        location / {
+            echo "requests = $cnt_requests";
+        }
+    }
+--- config
+        location ~ ^/8020/(.*) {
+            proxy_pass http://127.0.0.1:8020/$1;
+        }
+--- request
+GET /8020/
+--- response_body
+requests = 2
+--- error_code: 200
@@ -0,0 +1,167 @@
+# vi:filetype=
+
+use Test::Nginx::Socket;
+
+repeat_each(1);
+plan tests => repeat_each() * (2 * blocks() + 2);
+
+no_shuffle();
+run_tests();
+
+__DATA__
+
+=== TEST 1: check 0
+--- http_config
+    server {
+        listen          8010;
+        counter_set_id  mlt;
+
+        counter $cnt_sum inc $http_x_values multi=sum scale=1000;
+        counter $cnt_last set $http_x_values multi=last scale=1000;
+        counter $cnt_plain inc $http_x_values scale=1000;
+
+        histogram $hst_sum observe $http_x_values buckets 0.01 0.1
+                scale=1000 multi=sum;
+        histogram $hst_last observe $http_x_values buckets 0.01 0.1
+                scale=1000 multi=last;
+        histogram $hst_each observe $http_x_values buckets 0.01 0.1
+                scale=1000 multi=each;
+
+        location / {
+            return 200;
+        }
+    }
+
+    server {
+        listen          8020;
+        counter_set_id  mlt;
+
+        location / {
+            echo -n "sum = $cnt_sum | last = $cnt_last";
+            echo    " | plain = $cnt_plain";
+            echo -n "sum: $hst_sum_00 $hst_sum_01 $hst_sum_02";
+            echo -n " | cnt = $hst_sum_cnt | err = $hst_sum_err";
+            echo    " | sum = $hst_sum_sum";
+            echo -n "last: $hst_last_00 $hst_last_01 $hst_last_02";
+            echo -n " | cnt = $hst_last_cnt | err = $hst_last_err";
+            echo    " | sum = $hst_last_sum";
+            echo -n "each: $hst_each_00 $hst_each_01 $hst_each_02";
+            echo -n " | cnt = $hst_each_cnt | err = $hst_each_err";
+            echo    " | sum = $hst_each_sum";
+        }
+    }
+--- config
+        location ~ ^/8010/(.*) {
+            proxy_pass http://127.0.0.1:8010/$1$is_args$args;
+        }
+
+        location ~ ^/8020/(.*) {
+            proxy_pass http://127.0.0.1:8020/$1;
+        }
+--- request
+GET /8020/
+--- response_body
+sum = 0.000 | last = 0.000 | plain = 0.000
+sum: 0 0 0 | cnt = 0 | err = 0 | sum = 0.000
+last: 0 0 0 | cnt = 0 | err = 0 | sum = 0.000
+each: 0 0 0 | cnt = 0 | err = 0 | sum = 0.000
+--- error_code: 200
+
+=== TEST 2: list of values from two upstreams
+--- request
+GET /8010/
+--- more_headers
+X-Values: 0.012, 0.500 : 0.003
+--- response_body
+--- error_code: 200
+--- error_log
+variable "http_x_values" has value "0.012, 0.500 : 0.003" which is not a number
+
+=== TEST 3: check 1
+--- request
+GET /8020/
+--- response_body
+sum = 0.515 | last = 0.003 | plain = 0.000
+sum: 0 0 1 | cnt = 1 | err = 0 | sum = 0.515
+last: 1 0 0 | cnt = 1 | err = 0 | sum = 0.003
+each: 1 1 1 | cnt = 3 | err = 0 | sum = 0.515
+--- error_code: 200
+
+=== TEST 4: list of missing values only
+--- request
+GET /8010/
+--- more_headers
+X-Values: - : -
+--- response_body
+--- error_code: 200
+
+=== TEST 5: single value
+--- request
+GET /8010/
+--- more_headers
+X-Values: 0.2
+--- response_body
+--- error_code: 200
+
+=== TEST 6: list with a missing value
+--- request
+GET /8010/
+--- more_headers
+X-Values: -, 0.05
+--- response_body
+--- error_code: 200
+--- error_log
+variable "http_x_values" has value "-, 0.05" which is not a number
+
+=== TEST 7: check 2
+--- request
+GET /8020/
+--- response_body
+sum = 0.765 | last = 0.050 | plain = 0.200
+sum: 0 1 2 | cnt = 3 | err = 0 | sum = 0.765
+last: 1 1 1 | cnt = 3 | err = 0 | sum = 0.253
+each: 1 2 2 | cnt = 5 | err = 0 | sum = 0.765
+--- error_code: 200
+
+=== TEST 8: list with a value which is not a number
+--- request
+GET /8010/
+--- more_headers
+X-Values: 0.1, abc
+--- response_body
+--- error_code: 200
+--- error_log
+variable "http_x_values" has value "0.1, abc" which is not a number
+
+=== TEST 9: no list
+--- request
+GET /8010/
+--- response_body
+--- error_code: 200
+
+=== TEST 10: check 3
+--- request
+GET /8020/
+--- response_body
+sum = 0.765 | last = 0.050 | plain = 0.200
+sum: 0 1 2 | cnt = 3 | err = 2 | sum = 0.765
+last: 1 1 1 | cnt = 3 | err = 2 | sum = 0.253
+each: 1 3 2 | cnt = 6 | err = 2 | sum = 0.865
+--- error_code: 200
+
+=== TEST 11: counters do not observe each value of a list
+--- http_config
+    server {
+        listen          8010;
+        counter_set_id  mlt;
+
+        counter $cnt_each inc $http_x_values multi=each;
+
+        location / {
+            return 200;
+        }
+    }
+--- config
+--- must_die
+--- error_log
+bad value of "multi=each", must be "sum", "last"
@@ -0,0 +1,153 @@
+# vi:filetype=
+
+use Test::Nginx::Socket;
+
+repeat_each(1);
+plan tests => repeat_each() * (2 * blocks());
+
+no_shuffle();
+run_tests();
+
+__DATA__
+
+=== TEST 1: check 0
+--- http_config
+    server {
+        listen          8010;
+        counter_set_id  obs;
+
+        location /time {
+            histogram $hst_time observe $arg_v buckets 0.1 0.5 1;
+            return 200;
+        }
+
+        location /size {
+            histogram $hst_size observe $arg_v buckets 10 100 scale=1000;
+            return 200;
+        }
+    }
+
+    server {
+        listen          8020;
+        counter_set_id  obs;
+
+        location / {
+            echo -n "time: $hst_time_00 $hst_time_01 $hst_time_02 $hst_time_03";
+            echo -n " | cnt = $hst_time_cnt | err = $hst_time_err";
+            echo    " | sum = $hst_time_sum";
+            echo -n "size: $hst_size_00 $hst_size_01 $hst_size_02";
+            echo -n " | cnt = $hst_size_cnt | err = $hst_size_err";
+            echo    " | sum = $hst_size_sum";
+        }
+
+        location /all {
+            echo $cnt_collection;
+        }
+    }
+--- config
+        location ~ ^/8010/(.*) {
+            proxy_pass http://127.0.0.1:8010/$1$is_args$args;
+        }
+
+        location ~ ^/8020/(.*) {
+            proxy_pass http://127.0.0.1:8020/$1;
+        }
+--- request
+GET /8020/
+--- response_body
+time: 0 0 0 0 | cnt = 0 | err = 0 | sum = 0.0
+size: 0 0 0 | cnt = 0 | err = 0 | sum = 0.000
+--- error_code: 200
+
+=== TEST 2: value equal to the first bound
+--- request
+GET /8010/time?v=0.1
+--- response_body
+--- error_code: 200
+
+=== TEST 3: value equal to an inner bound
+--- request
+GET /8010/time?v=0.5
+--- response_body
+--- error_code: 200
+
+=== TEST 4: value equal to the last bound
+--- request
+GET /8010/time?v=1
+--- response_body
+--- error_code: 200
+
+=== TEST 5: value above the last bound
+--- request
+GET /8010/time?v=1.5
+--- response_body
+--- error_code: 200
+
+=== TEST 6: zero value
+--- request
+GET /8010/time?v=0
+--- response_body
+--- error_code: 200
+
+=== TEST 7: value finer than the scale gets truncated to a bound
+--- request
+GET /8010/time?v=0.55
+--- response_body
+--- error_code: 200
+
+=== TEST 8: value which is not a number
+--- request
+GET /8010/time?v=abc
+--- response_body
+--- error_code: 200
+
+=== TEST 9: negative value
+--- request
+GET /8010/time?v=-1
+--- response_body
+--- error_code: 200
+
+=== TEST 10: no value
+--- request
+GET /8010/time
+--- response_body
+--- error_code: 200
+
+=== TEST 11: integer value equal to the first bound
+--- request
+GET /8010/size?v=10
+--- response_body
+--- error_code: 200
+
+=== TEST 12: integer value equal to the last bound
+--- request
+GET /8010/size?v=100
+--- response_body
+--- error_code: 200
+
+=== TEST 13: decimal value with explicit scale
+--- request
+GET /8010/size?v=2.5
+--- response_body
+--- error_code: 200
+
+=== TEST 14: value in exponential notation
+--- request
+GET /8010/size?v=1e3
+--- response_body
+--- error_code: 200
+
+=== TEST 15: check 1
+--- request
+GET /8020/
+--- response_body
+time: 2 2 1 1 | cnt = 6 | err = 3 | sum = 3.6
+size: 2 1 0 | cnt = 3 | err = 1 | sum = 112.500
+--- error_code: 200
+
+=== TEST 16: check collection
+--- request
+GET /8020/all
+--- response_body
+{"obs":{"hst_time_00":2,"hst_time_01":2,"hst_time_02":1,"hst_time_03":1,"hst_time_cnt":6,"hst_time_err":3,"hst_time_sum":3.6,"hst_size_00":2,"hst_size_01":1,"hst_size_02":0,"hst_size_cnt":3,"hst_size_err":1,"hst_size_sum":112.500}}
+--- error_code: 200
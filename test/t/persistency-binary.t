@@ -0,0 +1,273 @@
+# vi:filetype=
+
+use Test::Nginx::Socket;
+
+my $counters_file = '../counters-binary.dat';
+
+(my $servroot = server_root()) =~ s"([^/])$"$1/";
+for my $file ($servroot . $counters_file) {
+    if (-f $file) {
+        unlink $file if -e $file or die "Could not unlink $file: $!";
+    }
+}
+
+add_block_preprocessor(sub {
+    my $block = shift;
+    if (defined $block->http_config) {
+        my $http_config = $block->http_config;
+        $http_config =~ s/;;PUT_COUNTERS_FILE_HERE;;/$counters_file/g;
+        $block->set_value("http_config", $http_config);
+    }
+});
+
+repeat_each(1);
+plan tests => repeat_each() * (2 * blocks() - 2);
+
+no_shuffle();
+run_tests();
+
+__DATA__
+
+=== TEST 1: start with the binary format
+--- http_config
+    counters_persistent_storage ;;PUT_COUNTERS_FILE_HERE;; format=binary;
+
+    server {
+        listen          8010;
+        counter_set_id  bin;
+
+        counter $cnt_requests inc;
+
+        location / {
+            return 200;
+        }
+    }
+
+    server {
+        listen          8020;
+        counter_set_id  bin;
+
+        location / {
+            echo "requests = $cnt_requests";
+        }
+
+        location = /storage {
+            default_type application/octet-stream;
+            alias ;;PUT_COUNTERS_FILE_HERE;;;
+        }
+    }
+--- config
+        location ~ ^/8010/(.*) {
+            proxy_pass http://127.0.0.1:8010/$1$is_args$args;
+        }
+
+        location ~ ^/8020/(.*) {
+            proxy_pass http://127.0.0.1:8020/$1;
+        }
+--- request
+GET /8010/
+--- response_body
+--- error_code: 200
+
+=== TEST 2: test 2
+--- request
+GET /8010/
+--- response_body
+--- error_code: 200
+
+=== TEST 3: check 1
+--- request
+GET /8020/
+--- response_body
+requests = 2
+--- error_code: 200
+
+=== TEST 4: load the binary storage after restart
+--- http_config
+    counters_persistent_storage ;;PUT_COUNTERS_FILE_HERE;; format=binary;
+
+    server {
+        listen          8010;
+        counter_set_id  bin;
+
+        counter $cnt_requests inc;
+
+        location / {
+            return 200;
+        }
+    }
+
+    server {
+        listen          8020;
+        counter_set_id  bin;
+
+        location / {
+            echo "requests = $cnt_requests";
+        }
+
+        location = /storage {
+            default_type application/octet-stream;
+            alias ;;PUT_COUNTERS_FILE_HERE;;;
+        }
+    }
+--- config
+        location ~ ^/8010/(.*) {
+            proxy_pass http://127.0.0.1:8010/$1$is_args$args;
+        }
+
+        location ~ ^/8020/(.*) {
+            proxy_pass http://127.0.0.1:8020/$1;
+        }
+--- request
+GET /8020/
+--- response_body
+requests = 2
+--- error_code: 200
+
+=== TEST 5: check the format of the storage
+--- request
+GET /8020/storage
+--- response_body_like
+^NGXCNTB1
+--- error_code: 200
+
+=== TEST 6: switch to JSON
+--- http_config
+    counters_persistent_storage ;;PUT_COUNTERS_FILE_HERE;;;
+
+    server {
+        listen          8010;
+        counter_set_id  bin;
+
+        counter $cnt_requests inc;
+
+        location / {
+            return 200;
+        }
+    }
+
+    server {
+        listen          8020;
+        counter_set_id  bin;
+
+        location / {
+            echo "requests = $cnt_requests";
+        }
+
+        location = /storage {
+            default_type application/octet-stream;
+            alias ;;PUT_COUNTERS_FILE_HERE;;;
+        }
+    }
+--- config
+        location ~ ^/8010/(.*) {
+            proxy_pass http://127.0.0.1:8010/$1$is_args$args;
+        }
+
+        location ~ ^/8020/(.*) {
+            proxy_pass http://127.0.0.1:8020/$1;
+        }
+--- request
+GET /8010/
+--- response_body
+--- error_code: 200
+
+=== TEST 7: check 2
+--- request
+GET /8020/
+--- response_body
+requests = 3
+--- error_code: 200
+
+=== TEST 8: switch back to the binary format
+--- http_config
+    counters_persistent_storage ;;PUT_COUNTERS_FILE_HERE;; format=binary;
+
+    server {
+        listen          8010;
+        counter_set_id  bin;
+
+        counter $cnt_requests inc;
+
+        location / {
+            return 200;
+        }
+    }
+
+    server {
+        listen          8020;
+        counter_set_id  bin;
+
+        location / {
+            echo "requests = $cnt_requests";
+        }
+
+        location = /storage {
+            default_type application/octet-stream;
+            alias ;;PUT_COUNTERS_FILE_HERE;;;
+        }
+    }
+--- config
+        location ~ ^/8010/(.*) {
+            proxy_pass http://127.0.0.1:8010/$1$is_args$args;
+        }
+
+        location ~ ^/8020/(.*) {
+            proxy_pass http://127.0.0.1:8020/$1;
+        }
+--- request
+GET /8020/
+--- response_body
+requests = 3
+--- error_code: 200
+
+=== TEST 9: the storage was written in JSON
+--- request
+GET /8020/storage
+--- response_body chomp
+{"bin":{"cnt_requests":3}}
+--- error_code: 200
+
+=== TEST 10: corrupted binary storage
+--- user_files
+>>> counters-corrupted.dat
+NGXCNTB1xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx
+--- http_config
+    counters_persistent_storage html/counters-corrupted.dat format=binary;
+
+    server {
+        listen          8010;
+        counter_set_id  bin;
+
+        counter $cnt_requests inc;
+
+        location / {
+            return 200;
+        }
+    }
+--- config
+--- must_die
+--- error_log
+unexpected structure of binary data
+
+=== TEST 11: truncated binary storage
+--- user_files
+>>> counters-truncated.dat
+NGXCNTB1
+--- http_config
+    counters_persistent_storage html/counters-truncated.dat format=binary;
+
+    server {
+        listen          8010;
+        counter_set_id  bin;
+
+        counter $cnt_requests inc;
+
+        location / {
+            return 200;
+        }
+    }
+--- config
+--- must_die
+--- error_log
+unexpected structure of binary data
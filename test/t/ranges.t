@@ -0,0 +1,109 @@
+# vi:filetype=
+
+use Test::Nginx::Socket;
+
+repeat_each(1);
+plan tests => repeat_each() * (2 * blocks());
+
+no_shuffle();
+run_tests();
+
+__DATA__
+
+=== TEST 1: value below the ranges
+--- http_config
+    map_to_range_index $arg_v $lin_bin linear 1 2 4;
+    map_to_range_index $arg_v $lin_list_bin 1 3 5 7;
+
+    map_to_range_index $arg_v $exp_bin exponential 0.25 2 4;
+    map_to_range_index $arg_v $exp_list_bin 0.25 0.5 1 2;
+
+    map_to_range_index $arg_v $tiny_bin exponential 1e-10 10 3;
+
+    server {
+        listen          8010;
+        server_name     tiny;
+
+        histogram $hst_tiny 4 $tiny_bin;
+
+        location / {
+            return 200;
+        }
+    }
+--- config
+        location /range {
+            echo -n "linear: $lin_bin $lin_list_bin";
+            echo    " | exponential: $exp_bin $exp_list_bin";
+        }
+
+        location /histograms {
+            echo $cnt_histograms;
+        }
+--- request
+GET /range?v=0
+--- response_body
+linear: 0 0 | exponential: 0 0
+--- error_code: 200
+
+=== TEST 2: value equal to the first bounds
+--- request
+GET /range?v=0.25
+--- response_body
+linear: 0 0 | exponential: 0 0
+--- error_code: 200
+
+=== TEST 3: value between bounds
+--- request
+GET /range?v=0.3
+--- response_body
+linear: 0 0 | exponential: 1 1
+--- error_code: 200
+
+=== TEST 4: value equal to inner bounds
+--- request
+GET /range?v=1
+--- response_body
+linear: 0 0 | exponential: 2 2
+--- error_code: 200
+
+=== TEST 5: value between inner bounds
+--- request
+GET /range?v=1.5
+--- response_body
+linear: 1 1 | exponential: 3 3
+--- error_code: 200
+
+=== TEST 6: value equal to the last exponential bound
+--- request
+GET /range?v=2
+--- response_body
+linear: 1 1 | exponential: 3 3
+--- error_code: 200
+
+=== TEST 7: value equal to an inner linear bound
+--- request
+GET /range?v=5
+--- response_body
+linear: 2 2 | exponential: 4 4
+--- error_code: 200
+
+=== TEST 8: value equal to the last linear bound
+--- request
+GET /range?v=7
+--- response_body
+linear: 3 3 | exponential: 4 4
+--- error_code: 200
+
+=== TEST 9: value above the ranges
+--- request
+GET /range?v=1000
+--- response_body
+linear: 4 4 | exponential: 4 4
+--- error_code: 200
+
+=== TEST 10: tags of tiny generated bounds
+--- request
+GET /histograms
+--- response_body
+{"tiny":{"hst_tiny":{"range":{"hst_tiny_00":"1e-10","hst_tiny_01":"1e-09","hst_tiny_02":"1e-08","hst_tiny_03":"+Inf"},"cnt":["hst_tiny_cnt","cnt"],"err":["hst_tiny_err","err"]}}}
+--- error_code: 200
@@ -0,0 +1,180 @@
+# vi:filetype=
+
+use Test::Nginx::Socket;
+
+my $counters_file = '../counters-mmap.bin';
+
+(my $servroot = server_root()) =~ s"([^/])$"$1/";
+for my $file ($servroot . $counters_file) {
+    if (-f $file) {
+        unlink $file if -e $file or die "Could not unlink $file: $!";
+    }
+}
+
+add_block_preprocessor(sub {
+    my $block = shift;
+    if (defined $block->http_config) {
+        my $http_config = $block->http_config;
+        $http_config =~ s/;;PUT_COUNTERS_FILE_HERE;;/$counters_file/;
+        $block->set_value("http_config", $http_config);
+    }
+});
+
+use_hup();
+
+repeat_each(1);
+plan tests => repeat_each() * (2 * blocks() + 2);
+
+no_shuffle();
+run_tests();
+
+__DATA__
+
+=== TEST 1: start with the mapped storage
+--- http_config
+    counters_survive_reload on;
+
+    counters_persistent_storage ;;PUT_COUNTERS_FILE_HERE;; format=mmap;
+
+    server {
+        listen          8010;
+        counter_set_id  main;
+
+        counter $cnt_a inc;
+        counter $cnt_b inc;
+
+        location / {
+            return 200;
+        }
+    }
+
+    server {
+        listen          8020;
+        counter_set_id  main;
+
+        location / {
+            echo "a = $cnt_a | b = $cnt_b";
+        }
+    }
+--- config
+        location ~ ^/8010/(.*) {
+            proxy_pass http://127.0.0.1:8010/$1$is_args$args;
+        }
+
+        location ~ ^/8020/(.*) {
+            proxy_pass http://127.0.0.1:8020/$1;
+        }
+--- request
+GET /8010/
+--- response_body
+--- error_code: 200
+
+=== TEST 2: check 1
+--- request
+GET /8020/
+--- response_body
+a = 1 | b = 1
+--- error_code: 200
+
+=== TEST 3: reload with a new layout
+--- http_config
+    counters_survive_reload on;
+
+    counters_persistent_storage ;;PUT_COUNTERS_FILE_HERE;; format=mmap;
+
+    server {
+        listen          8010;
+        counter_set_id  main;
+
+        counter $cnt_c inc;
+        counter $cnt_b inc;
+        counter $cnt_a inc;
+
+        location / {
+            return 200;
+        }
+    }
+
+    server {
+        listen          8020;
+        counter_set_id  main;
+
+        location / {
+            echo "a = $cnt_a | b = $cnt_b | c = $cnt_c";
+        }
+    }
+--- config
+        location ~ ^/8010/(.*) {
+            proxy_pass http://127.0.0.1:8010/$1$is_args$args;
+        }
+
+        location ~ ^/8020/(.*) {
+            proxy_pass http://127.0.0.1:8020/$1;
+        }
+--- request
+GET /8020/
+--- response_body
+a = 1 | b = 1 | c = 0
+--- error_code: 200
+--- error_log
+custom counters set "main" was remapped by names on reload: 2 kept, 1 added, 0 dropped
+
+=== TEST 4: test 2
+--- request
+GET /8010/
+--- response_body
+--- error_code: 200
+
+=== TEST 5: check 2
+--- request
+GET /8020/
+--- response_body
+a = 2 | b = 2 | c = 1
+--- error_code: 200
+
+=== TEST 6: reload with the same layout reuses the replaced storage
+--- http_config
+    counters_survive_reload on;
+
+    counters_persistent_storage ;;PUT_COUNTERS_FILE_HERE;; format=mmap;
+
+    server {
+        listen          8010;
+        counter_set_id  main;
+
+        counter $cnt_c inc;
+        counter $cnt_b inc;
+        counter $cnt_a inc;
+
+        location / {
+            return 200;
+        }
+    }
+
+    server {
+        listen          8020;
+        counter_set_id  main;
+
+        location / {
+            echo "a = $cnt_a | b = $cnt_b | c = $cnt_c";
+        }
+
+        location /other {
+            return 204;
+        }
+    }
+--- config
+        location ~ ^/8010/(.*) {
+            proxy_pass http://127.0.0.1:8010/$1$is_args$args;
+        }
+
+        location ~ ^/8020/(.*) {
+            proxy_pass http://127.0.0.1:8020/$1;
+        }
+--- request
+GET /8020/
+--- response_body
+a = 2 | b = 2 | c = 1
+--- error_code: 200
+--- no_error_log
+was remapped by names on reload
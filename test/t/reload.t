@@ -0,0 +1,159 @@
+# vi:filetype=
+
+use Test::Nginx::Socket;
+
+use_hup();
+
+repeat_each(1);
+plan tests => repeat_each() * (2 * blocks() + 2);
+
+no_shuffle();
+run_tests();
+
+__DATA__
+
+=== TEST 1: test 1
+--- http_config
+    counters_survive_reload on;
+
+    server {
+        listen          8010;
+        counter_set_id  main;
+
+        counter $cnt_a inc;
+        counter $cnt_b inc;
+        counter $cnt_c inc;
+
+        location / {
+            return 200;
+        }
+    }
+
+    server {
+        listen          8020;
+        counter_set_id  main;
+
+        location / {
+            echo "a = $cnt_a | b = $cnt_b | c = $cnt_c";
+        }
+    }
+--- config
+        location ~ ^/8010/(.*) {
+            proxy_pass http://127.0.0.1:8010/$1$is_args$args;
+        }
+
+        location ~ ^/8020/(.*) {
+            proxy_pass http://127.0.0.1:8020/$1;
+        }
+--- request
+GET /8010/
+--- response_body
+--- error_code: 200
+
+=== TEST 2: test 2
+--- request
+GET /8010/
+--- response_body
+--- error_code: 200
+
+=== TEST 3: check 1
+--- request
+GET /8020/
+--- response_body
+a = 2 | b = 2 | c = 2
+--- error_code: 200
+
+=== TEST 4: reload with added, removed and reordered counters
+--- http_config
+    counters_survive_reload on;
+
+    server {
+        listen          8010;
+        counter_set_id  main;
+
+        counter $cnt_c inc;
+        counter $cnt_a inc;
+        counter $cnt_d inc;
+
+        location / {
+            return 200;
+        }
+    }
+
+    server {
+        listen          8020;
+        counter_set_id  main;
+
+        location / {
+            echo "a = $cnt_a | c = $cnt_c | d = $cnt_d";
+        }
+    }
+--- config
+        location ~ ^/8010/(.*) {
+            proxy_pass http://127.0.0.1:8010/$1$is_args$args;
+        }
+
+        location ~ ^/8020/(.*) {
+            proxy_pass http://127.0.0.1:8020/$1;
+        }
+--- request
+GET /8020/
+--- response_body
+a = 2 | c = 2 | d = 0
+--- error_code: 200
+--- error_log
+custom counters set "main" was remapped by names on reload: 2 kept, 1 added, 1 dropped
+
+=== TEST 5: test 3
+--- request
+GET /8010/
+--- response_body
+--- error_code: 200
+
+=== TEST 6: check 2
+--- request
+GET /8020/
+--- response_body
+a = 3 | c = 3 | d = 1
+--- error_code: 200
+
+=== TEST 7: reload with reordered counters
+--- http_config
+    counters_survive_reload on;
+
+    server {
+        listen          8010;
+        counter_set_id  main;
+
+        counter $cnt_d inc;
+        counter $cnt_c inc;
+        counter $cnt_a inc;
+
+        location / {
+            return 200;
+        }
+    }
+
+    server {
+        listen          8020;
+        counter_set_id  main;
+
+        location / {
+            echo "a = $cnt_a | c = $cnt_c | d = $cnt_d";
+        }
+    }
+--- config
+        location ~ ^/8010/(.*) {
+            proxy_pass http://127.0.0.1:8010/$1$is_args$args;
+        }
+
+        location ~ ^/8020/(.*) {
+            proxy_pass http://127.0.0.1:8020/$1;
+        }
+--- request
+GET /8020/
+--- response_body
+a = 3 | c = 3 | d = 1
+--- error_code: 200
+--- error_log
+custom counters set "main" was remapped by names on reload: 3 kept, 0 added, 0 dropped
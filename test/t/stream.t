@@ -0,0 +1,240 @@
+# vi:filetype=
+
+use Test::Nginx::Socket;
+
+my $counters_file = '../counters-stream.json';
+
+(my $servroot = server_root()) =~ s"([^/])$"$1/";
+for my $file ($servroot . $counters_file) {
+    if (-f $file) {
+        unlink $file if -e $file or die "Could not unlink $file: $!";
+    }
+}
+
+add_block_preprocessor(sub {
+    my $block = shift;
+    if (defined $block->http_config) {
+        my $http_config = $block->http_config;
+        $http_config =~ s/;;PUT_COUNTERS_FILE_HERE;;/$counters_file/;
+        $block->set_value("http_config", $http_config);
+    }
+});
+
+repeat_each(1);
+plan tests => repeat_each() * (2 * blocks() - 1);
+
+no_shuffle();
+run_tests();
+
+__DATA__
+
+=== TEST 1: check 0
+--- main_config
+    stream {
+        map_to_range_index $stream_value $stream_value_bin 1 5 10;
+
+        server {
+            listen          8030;
+            counter_set_id  tcp;
+
+            set $stream_value 3;
+
+            counter $cnt_sessions inc;
+            counter $cnt_values inc $stream_value;
+            counter $cnt_last_value set $stream_value;
+
+            histogram $hst_values 4 $stream_value_bin;
+
+            proxy_pass      127.0.0.1:8010;
+        }
+
+        server {
+            listen          8031;
+            counter_set_id  tcp;
+
+            set $stream_value 12;
+
+            counter $cnt_sessions inc;
+            counter $cnt_values inc $stream_value;
+            counter $cnt_last_value set $stream_value;
+
+            histogram $hst_values reuse;
+
+            proxy_pass      127.0.0.1:8010;
+        }
+
+        server {
+            listen          8032;
+            counter_set_id  tcp;
+
+            set $stream_value -4;
+
+            counter $cnt_sessions inc;
+            counter $cnt_values inc $stream_value;
+            counter $cnt_last_value set $stream_value;
+
+            histogram $hst_values reuse;
+
+            proxy_pass      127.0.0.1:8010;
+        }
+
+        server {
+            listen          8033;
+            counter_set_id  tcp;
+
+            set $stream_value none;
+
+            counter $cnt_sessions inc;
+            counter $cnt_values inc $stream_value;
+            counter $cnt_last_value set $stream_value;
+
+            histogram $hst_values reuse;
+
+            proxy_pass      127.0.0.1:8010;
+        }
+
+        server {
+            listen          8034;
+            counter_set_id  tcp_observe;
+
+            set $stream_time 0.25;
+            set $stream_list "1, 2, 3";
+
+            counter $cnt_time inc $stream_time scale=1000;
+            histogram $hst_time observe $stream_time buckets 0.1 1.0;
+
+            counter $cnt_list inc $stream_list multi=sum;
+            histogram $hst_list observe $stream_list buckets 1 2 multi=each;
+
+            proxy_pass      127.0.0.1:8010;
+        }
+    }
+--- http_config
+    counters_persistent_storage ;;PUT_COUNTERS_FILE_HERE;;;
+
+    server {
+        listen          8010;
+
+        location / {
+            return 200;
+        }
+    }
+
+    server {
+        listen          8020;
+
+        location /all {
+            echo $cnt_collection;
+        }
+    }
+--- config
+        location ~ ^/(80[23]\d)/(.*) {
+            proxy_pass http://127.0.0.1:$1/$2;
+        }
+--- request
+GET /8020/all
+--- response_body
+{"tcp":{"cnt_sessions":0,"cnt_values":0,"cnt_last_value":0,"hst_values_00":0,"hst_values_01":0,"hst_values_02":0,"hst_values_03":0,"hst_values_cnt":0,"hst_values_err":0},"tcp_observe":{"cnt_time":0.000,"hst_time_00":0,"hst_time_01":0,"hst_time_02":0,"hst_time_cnt":0,"hst_time_err":0,"hst_time_sum":0.0,"cnt_list":0,"hst_list_00":0,"hst_list_01":0,"hst_list_02":0,"hst_list_cnt":0,"hst_list_err":0,"hst_list_sum":0}}
+--- error_code: 200
+
+=== TEST 2: value in an inner range
+--- request
+GET /8030/
+--- response_body
+--- error_code: 200
+
+=== TEST 3: value above the ranges
+--- request
+GET /8031/
+--- response_body
+--- error_code: 200
+
+=== TEST 4: negative value
+--- request
+GET /8032/
+--- response_body
+--- error_code: 200
+
+=== TEST 5: value which is not a number
+--- request
+GET /8033/
+--- response_body
+--- error_code: 200
+
+=== TEST 6: scaled value and list of values
+--- request
+GET /8034/
+--- response_body
+--- error_code: 200
+
+=== TEST 7: check 1
+--- request
+GET /8020/all
+--- response_body
+{"tcp":{"cnt_sessions":4,"cnt_values":11,"cnt_last_value":-4,"hst_values_00":1,"hst_values_01":1,"hst_values_02":0,"hst_values_03":1,"hst_values_cnt":3,"hst_values_err":1},"tcp_observe":{"cnt_time":0.250,"hst_time_00":0,"hst_time_01":1,"hst_time_02":0,"hst_time_cnt":1,"hst_time_err":0,"hst_time_sum":0.2,"cnt_list":6,"hst_list_00":1,"hst_list_01":1,"hst_list_02":1,"hst_list_cnt":3,"hst_list_err":0,"hst_list_sum":6}}
+--- error_code: 200
+
+=== TEST 8: check persistency after restart
+--- main_config
+    stream {
+        server {
+            listen          8030;
+            counter_set_id  tcp;
+
+            counter $cnt_sessions inc;
+
+            proxy_pass      127.0.0.1:8010;
+        }
+    }
+--- http_config
+    counters_persistent_storage ;;PUT_COUNTERS_FILE_HERE;;;
+
+    server {
+        listen          8010;
+
+        location / {
+            return 200;
+        }
+    }
+
+    server {
+        listen          8020;
+
+        location /all {
+            echo $cnt_collection;
+        }
+    }
+--- config
+        location ~ ^/(80[23]\d)/(.*) {
+            proxy_pass http://127.0.0.1:$1/$2;
+        }
+--- request
+GET /8020/all
+--- response_body
+{"tcp":{"cnt_sessions":4}}
+--- error_code: 200
+
+=== TEST 9: stream block after the http block
+--- post_main_config
+    stream {
+        server {
+            listen          8030;
+            counter_set_id  tcp;
+
+            counter $cnt_sessions inc;
+
+            proxy_pass      127.0.0.1:8010;
+        }
+    }
+--- http_config
+    server {
+        listen          8010;
+
+        location / {
+            return 200;
+        }
+    }
+--- config
+--- must_die
+--- error_log
+custom counters in stream servers must be declared before the http block
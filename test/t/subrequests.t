@@ -0,0 +1,110 @@
+# vi:filetype=
+
+use Test::Nginx::Socket;
+
+repeat_each(1);
+plan tests => repeat_each() * (2 * blocks());
+
+no_shuffle();
+run_tests();
+
+__DATA__
+
+=== TEST 1: check 0
+--- http_config
+    server {
+        listen          8010;
+        counter_set_id  sub;
+
+        location /page.html {
+            ssi on;
+            counter $cnt_pages inc;
+        }
+
+        location /fragment {
+            counters_subrequests on;
+            log_subrequest on;
+            early_counter $cnt_fragments_early inc;
+            counter $cnt_fragments inc;
+            echo -n x;
+        }
+
+        location /plain {
+            log_subrequest on;
+            counter $cnt_plain inc;
+            echo -n y;
+        }
+
+        location /protected {
+            auth_request /auth;
+            try_files /nonexistent @protected;
+        }
+
+        location = /auth {
+            counters_subrequests on;
+            early_counter $cnt_auth inc;
+            return 204;
+        }
+
+        location @protected {
+            counter $cnt_protected inc;
+            return 200;
+        }
+    }
+
+    server {
+        listen          8020;
+        counter_set_id  sub;
+
+        location / {
+            echo -n "pages = $cnt_pages";
+            echo -n " | fragments = $cnt_fragments";
+            echo -n " | early = $cnt_fragments_early";
+            echo -n " | plain = $cnt_plain";
+            echo -n " | auth = $cnt_auth";
+            echo    " | protected = $cnt_protected";
+        }
+    }
+--- config
+        location ~ ^/8010/(.*) {
+            proxy_pass http://127.0.0.1:8010/$1$is_args$args;
+        }
+
+        location ~ ^/8020/(.*) {
+            proxy_pass http://127.0.0.1:8020/$1;
+        }
+--- request
+GET /8020/
+--- response_body
+pages = 0 | fragments = 0 | early = 0 | plain = 0 | auth = 0 | protected = 0
+--- error_code: 200
+
+=== TEST 2: page with SSI includes
+--- user_files
+>>> page.html
+a<!--# include virtual="/fragment" -->b<!--# include virtual="/fragment" -->c<!--# include virtual="/plain" -->d
+--- request
+GET /8010/page.html
+--- response_body
+axbxcyd
+--- error_code: 200
+
+=== TEST 3: check 1
+--- request
+GET /8020/
+--- response_body
+pages = 1 | fragments = 2 | early = 2 | plain = 0 | auth = 0 | protected = 0
+--- error_code: 200
+
+=== TEST 4: auth request and internal redirect of the main request
+--- request
+GET /8010/protected
+--- response_body
+--- error_code: 200
+
+=== TEST 5: check 2
+--- request
+GET /8020/
+--- response_body
+pages = 1 | fragments = 2 | early = 2 | plain = 0 | auth = 1 | protected = 1
+--- error_code: 200
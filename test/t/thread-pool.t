@@ -0,0 +1,185 @@
+# vi:filetype=
+
+use Test::Nginx::Socket;
+
+repeat_each(1);
+plan tests => repeat_each() * (2 * blocks() + 2);
+
+no_shuffle();
+run_tests();
+
+__DATA__
+
+=== TEST 1: backup in a thread pool
+--- main_config
+    thread_pool counters threads=1;
+--- http_config
+    counters_persistent_storage html/counters-pool.json 1s thread_pool=counters;
+
+    server {
+        listen          8010;
+        counter_set_id  tp;
+
+        counter $cnt_requests inc;
+
+        location / {
+            return 200;
+        }
+    }
+
+    server {
+        listen          8020;
+
+        location /sleep {
+            echo_sleep 2;
+            echo Ok;
+        }
+
+        location /backup {
+            default_type application/json;
+            alias html/counters-pool.json~;
+        }
+    }
+--- config
+        location ~ ^/8010/(.*) {
+            proxy_pass http://127.0.0.1:8010/$1$is_args$args;
+        }
+
+        location ~ ^/8020/(.*) {
+            proxy_pass http://127.0.0.1:8020/$1;
+        }
+--- request
+GET /8010/
+--- response_body
+--- error_code: 200
+
+=== TEST 2: wait for the backup in the thread pool
+--- request
+GET /8020/sleep
+--- response_body
+Ok
+--- error_code: 200
+
+=== TEST 3: check the backup written in the thread pool
+--- request
+GET /8020/backup
+--- response_body chomp
+{"tp":{"cnt_requests":1}}
+--- error_code: 200
+
+=== TEST 4: backup in a thread pool which was not declared
+--- http_config
+    counters_persistent_storage html/counters-nopool.json 1s thread_pool=missing;
+
+    server {
+        listen          8010;
+        counter_set_id  tp;
+
+        counter $cnt_requests inc;
+
+        location / {
+            return 200;
+        }
+    }
+
+    server {
+        listen          8020;
+
+        location /sleep {
+            echo_sleep 2;
+            echo Ok;
+        }
+
+        location /backup {
+            default_type application/json;
+            alias html/counters-nopool.json~;
+        }
+    }
+--- config
+        location ~ ^/8010/(.*) {
+            proxy_pass http://127.0.0.1:8010/$1$is_args$args;
+        }
+
+        location ~ ^/8020/(.*) {
+            proxy_pass http://127.0.0.1:8020/$1;
+        }
+--- request
+GET /8010/
+--- response_body
+--- error_code: 200
+--- error_log
+thread pool "missing" was not found, persistent counters will be written in the worker
+
+=== TEST 5: wait for the backup in the worker
+--- request
+GET /8020/sleep
+--- response_body
+Ok
+--- error_code: 200
+
+=== TEST 6: check the backup written in the worker
+--- request
+GET /8020/backup
+--- response_body chomp
+{"tp":{"cnt_requests":1}}
+--- error_code: 200
+
+=== TEST 7: mapped storage synced in a thread pool
+--- main_config
+    thread_pool counters threads=1;
+--- http_config
+    counters_persistent_storage html/counters-pool.bin 1s format=mmap
+            fsync=data thread_pool=counters;
+
+    server {
+        listen          8010;
+        counter_set_id  tp;
+
+        counter $cnt_requests inc;
+
+        location / {
+            return 200;
+        }
+    }
+
+    server {
+        listen          8020;
+        counter_set_id  tp;
+
+        location / {
+            echo "requests = $cnt_requests";
+        }
+
+        location /sleep {
+            echo_sleep 2;
+            echo Ok;
+        }
+    }
+--- config
+        location ~ ^/8010/(.*) {
+            proxy_pass http://127.0.0.1:8010/$1$is_args$args;
+        }
+
+        location ~ ^/8020/(.*) {
+            proxy_pass http://127.0.0.1:8020/$1;
+        }
+--- request
+GET /8010/
+--- response_body
+--- error_code: 200
+
+=== TEST 8: wait for the sync in the thread pool
+--- request
+GET /8020/sleep
+--- response_body
+Ok
+--- error_code: 200
+
+=== TEST 9: check the counters after the sync
+--- request
+GET /8020/
+--- response_body
+requests = 1
+--- error_code: 200
+--- no_error_log
+msync